@@ -0,0 +1,44 @@
+#!/usr/bin/env lua
+
+----------------------------------------------------------------------------
+-- Random kvfetch throughput for several page cache sizes, on a database
+-- larger than the default cache.
+--   lua bench/bench_cache.lua [nkeys] [iterations]
+----------------------------------------------------------------------------
+
+require"string"
+require"os"
+local driver = require"luanosql.unqlite"
+
+local nkeys = tonumber(arg and arg[1]) or 500000
+local iters = tonumber(arg and arg[2]) or 1000000
+local caches = {false, 1024, 4096, 16384, 65536}
+local value = string.rep("x", 100)
+
+local dbname = os.tmpname()
+os.remove(dbname)
+local env = assert(driver.unqlite())
+
+local conn = assert(env:connect(dbname))
+for k = 0, nkeys - 1 do
+	assert(conn:kvstore("bench" .. k, value))
+end
+assert(conn:close())
+
+print(string.format("%10s %12s", "cache", "fetch op/s"))
+for _, cache in ipairs(caches) do
+	conn = assert(env:connect(dbname, {cache = cache or nil}))
+	local seed = 12345
+	local t0 = os.clock()
+	for i = 1, iters do
+		seed = (seed * 1103515245 + 12345) % 2147483648
+		local _, v = conn:kvfetch("bench" .. (seed % nkeys))
+		assert(#v == 100)
+	end
+	local t = os.clock() - t0
+	print(string.format("%10s %12.0f", cache or "default", iters / t))
+	assert(conn:close())
+end
+
+env:close()
+os.remove(dbname)
@@ -0,0 +1,50 @@
+#!/usr/bin/env lua
+
+----------------------------------------------------------------------------
+-- Hot key rewrites (counters, sessions) with and without the write buffer.
+-- nhot keys are rewritten in turn, with a commit every batch writes.
+--   lua bench/bench_hotkeys.lua [writes] [nhot] [batch]
+----------------------------------------------------------------------------
+
+require"string"
+require"os"
+local driver = require"luanosql.unqlite"
+
+local writes = tonumber(arg and arg[1]) or 1000000
+local nhot = tonumber(arg and arg[2]) or 100
+local batch = tonumber(arg and arg[3]) or 10000
+local value = string.rep("s", 200)
+
+local env = assert(driver.unqlite())
+
+local function run(buffered)
+	local dbname = os.tmpname()
+	os.remove(dbname)
+	local conn = assert(env:connect(dbname))
+	if buffered then
+		assert(conn:write_buffer{})
+	end
+	local keys = {}
+	for k = 1, nhot do keys[k] = "hot" .. k end
+	local t0 = os.clock()
+	for i = 1, writes do
+		assert(conn:kvstore(keys[(i % nhot) + 1], value))
+		if i % batch == 0 then
+			assert(conn:commit())
+		end
+	end
+	assert(conn:commit())
+	local t = os.clock() - t0
+	local st = conn:write_buffer_stats()
+	assert(conn:close())
+	os.remove(dbname)
+	return t, st
+end
+
+local tplain = run(false)
+local tbuf, st = run(true)
+print(string.format("%-10s %12s %14s", "mode", "writes/s", "engine writes"))
+print(string.format("%-10s %12.0f %14d", "direct", writes / tplain, writes))
+print(string.format("%-10s %12.0f %14d", "buffered", writes / tbuf, st and st.flushed or 0))
+
+env:close()
@@ -0,0 +1,40 @@
+----------------------------------------------------------------------------
+-- Minimal JSON encoder shared by the benchmark scripts (numbers, strings,
+-- booleans, arrays and tables with string keys; object keys are sorted so
+-- that outputs can be diffed).
+----------------------------------------------------------------------------
+
+require"string"
+require"table"
+require"math"
+
+local function encode(v)
+	local t = type(v)
+	if t == "number" then
+		if v ~= v or v == math.huge or v == -math.huge then return "null" end
+		if v == math.floor(v) and math.abs(v) < 1e15 then return string.format("%d", v) end
+		return string.format("%.6g", v)
+	elseif t == "string" then
+		return '"' .. string.gsub(v, '[%c"\\]', function(c)
+			return string.format("\\u%04x", string.byte(c))
+		end) .. '"'
+	elseif t == "boolean" then
+		return tostring(v)
+	elseif t == "table" then
+		local parts = {}
+		if #v > 0 then
+			for _, item in ipairs(v) do parts[#parts + 1] = encode(item) end
+			return "[" .. table.concat(parts, ",\n") .. "]"
+		end
+		local names = {}
+		for name in pairs(v) do names[#names + 1] = name end
+		table.sort(names)
+		for _, name in ipairs(names) do
+			parts[#parts + 1] = encode(name) .. ":" .. encode(v[name])
+		end
+		return "{" .. table.concat(parts, ",") .. "}"
+	end
+	return "null"
+end
+
+return { encode = encode }
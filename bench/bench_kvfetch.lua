@@ -0,0 +1,63 @@
+#!/usr/bin/env lua
+
+----------------------------------------------------------------------------
+-- kvfetch / cursor_data throughput across value sizes (16 B .. 1 MB).
+-- Run it against two builds of the driver to compare them:
+--   lua bench/bench_kvfetch.lua [iterations]
+----------------------------------------------------------------------------
+
+require"string"
+require"os"
+local driver = require"luanosql.unqlite"
+
+local sizes = {16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576}
+-- total bytes read per size, iterations are derived from it
+local budget = tonumber(arg and arg[1]) or 64 * 1024 * 1024
+local nkeys = 64
+
+local dbname = os.tmpname()
+os.remove(dbname)
+local env = assert(driver.unqlite())
+local conn = assert(env:connect(dbname))
+
+local function measure(fn, iters)
+	local t0 = os.clock()
+	for i = 1, iters do
+		fn(i)
+	end
+	return os.clock() - t0
+end
+
+print(string.format("%10s %12s %12s %12s %12s", "size", "fetch op/s", "fetch MB/s", "cursor op/s", "cursor MB/s"))
+for _, size in ipairs(sizes) do
+	local value = string.rep("x", size)
+	for k = 1, nkeys do
+		assert(conn:kvstore("bench" .. k, value))
+	end
+	assert(conn:commit())
+
+	local iters = math.max(nkeys, math.floor(budget / size))
+	local keys = {}
+	for k = 1, nkeys do keys[k] = "bench" .. k end
+
+	local tf = measure(function(i)
+		local _, v = conn:kvfetch(keys[(i % nkeys) + 1])
+		assert(#v == size)
+	end, iters)
+
+	local cur = assert(conn:create_cursor())
+	assert(cur:seek("bench1"))
+	local tc = measure(function()
+		local v = cur:cursor_data()
+		assert(#v == size)
+	end, iters)
+	cur:release()
+
+	local mb = iters * size / (1024 * 1024)
+	print(string.format("%10d %12.0f %12.1f %12.0f %12.1f", size,
+		iters / tf, mb / tf, iters / tc, mb / tc))
+end
+
+conn:close()
+env:close()
+os.remove(dbname)
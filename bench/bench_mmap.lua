@@ -0,0 +1,56 @@
+#!/usr/bin/env lua
+
+----------------------------------------------------------------------------
+-- kvfetch throughput of a read-write connection against a read-only and a
+-- memory mapped (mmap) read-only connection on the same database.
+--   lua bench/bench_mmap.lua [nkeys] [iterations]
+----------------------------------------------------------------------------
+
+require"string"
+require"os"
+local driver = require"luanosql.unqlite"
+
+local nkeys = tonumber(arg and arg[1]) or 100000
+local iters = tonumber(arg and arg[2]) or 1000000
+local sizes = {16, 256, 4096}
+
+local dbname = os.tmpname()
+os.remove(dbname)
+local env = assert(driver.unqlite())
+
+local function measure(conn, size)
+	local t0 = os.clock()
+	local seed = 12345
+	for i = 1, iters do
+		seed = (seed * 1103515245 + 12345) % 2147483648
+		local _, v = conn:kvfetch("bench" .. (seed % nkeys))
+		assert(#v == size)
+	end
+	return os.clock() - t0
+end
+
+print(string.format("%8s %14s %14s %14s", "size", "rw op/s", "readonly op/s", "mmap op/s"))
+for _, size in ipairs(sizes) do
+	local value = string.rep("x", size)
+	local rw = assert(env:connect(dbname))
+	for k = 0, nkeys - 1 do
+		assert(rw:kvstore("bench" .. k, value))
+	end
+	assert(rw:commit())
+
+	local trw = measure(rw, size)
+	assert(rw:close())
+
+	local ro = assert(env:connect(dbname, {readonly = true}))
+	local tro = measure(ro, size)
+	assert(ro:close())
+
+	local mm = assert(env:connect(dbname, {mmap = true}))
+	local tmm = measure(mm, size)
+	assert(mm:close())
+
+	print(string.format("%8d %14.0f %14.0f %14.0f", size, iters / trw, iters / tro, iters / tmm))
+end
+
+env:close()
+os.remove(dbname)
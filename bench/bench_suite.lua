@@ -0,0 +1,260 @@
+#!/usr/bin/env lua
+
+----------------------------------------------------------------------------
+-- Benchmark suite of the key/value, cursor and JX9 paths.
+-- Every case runs against a fresh database in the temp directory and
+-- reports ops/sec and p50/p99 latency; the results are printed as JSON on
+-- stdout (progress goes to stderr) so that runs can be compared.
+--   lua bench/bench_suite.lua [--quick] [--only case,...] [--max-mb n]
+-- make bench builds the driver and runs it (BENCH_ARGS is passed along).
+--
+-- Latencies come from batches of consecutive operations timed with the
+-- wall clock of luasocket (socket.gettime), divided by the batch size, so
+-- I/O and fsync waits are counted. Without luasocket they fall back to
+-- os.clock, process CPU time that leaves those waits out; meta.clock in
+-- the output tells which one was used. cpu_seconds is always reported.
+----------------------------------------------------------------------------
+
+require"string"
+require"os"
+require"table"
+require"math"
+local driver = require"luanosql.unqlite"
+-- the helper modules live next to this script
+package.path = (string.match(arg and arg[0] or "", "^(.*)[/\\]") or ".") .. "/?.lua;" .. package.path
+local json = require"bench_json"
+
+local quick = false
+local only = nil
+local max_mb = 64           -- skip a case when keys * value size is above it
+local i = 1
+while arg and arg[i] do
+	if arg[i] == "--quick" then
+		quick = true
+	elseif arg[i] == "--only" then
+		i = i + 1
+		only = {}
+		for name in string.gmatch(arg[i] or "", "[^,]+") do only[name] = true end
+	elseif arg[i] == "--max-mb" then
+		i = i + 1
+		max_mb = assert(tonumber(arg[i]), "--max-mb expects a number")
+	else
+		error("unknown option " .. arg[i])
+	end
+	i = i + 1
+end
+
+local sizes = quick and {16, 1024} or {16, 256, 4096, 65536}
+local key_counts = quick and {1000} or {1000, 100000}
+local batch = 16            -- operations per latency sample
+local jx9_runs = quick and 200 or 2000
+
+local env = assert(driver.unqlite())
+
+----------------------------------------------------------------------------
+-- Helpers
+----------------------------------------------------------------------------
+
+local function log(...)
+	io.stderr:write(string.format(...), "\n")
+end
+
+-- wall clock in seconds when luasocket is installed, CPU time otherwise
+local clock, clock_name
+do
+	local ok, socket = pcall(require, "socket")
+	if ok and socket.gettime then
+		clock, clock_name = socket.gettime, "socket.gettime"
+	else
+		clock, clock_name = os.clock, "os.clock"
+		log("luasocket not found: timing with os.clock, I/O waits are not counted")
+	end
+end
+
+local function tempdb()
+	local name = os.tmpname()
+	os.remove(name)
+	return name
+end
+
+local function dropdb(name)
+	os.remove(name)
+	os.remove(name .. "_unqlite_journal")
+end
+
+-- keys in a fixed pseudo random order, the same for every run
+local function make_keys(n, prefix)
+	local keys = {}
+	for k = 1, n do keys[k] = string.format("%s%08d", prefix, k) end
+	math.randomseed(42)
+	for k = n, 2, -1 do
+		local j = math.random(k)
+		keys[k], keys[j] = keys[j], keys[k]
+	end
+	return keys
+end
+
+-- run fn(i) for i = 1..n, timing batches of consecutive calls
+local function measure(n, fn)
+	local samples = {}
+	local total = 0
+	local cpu0 = os.clock()
+	local i = 1
+	while i <= n do
+		local last = math.min(n, i + batch - 1)
+		local t0 = clock()
+		for j = i, last do fn(j) end
+		local dt = clock() - t0
+		total = total + dt
+		samples[#samples + 1] = dt / (last - i + 1)
+		i = last + 1
+	end
+	table.sort(samples)
+	local function quantile(q)
+		if #samples == 0 then return 0 end
+		return samples[math.max(1, math.ceil(q * #samples))] * 1e6
+	end
+	return {
+		ops = n,
+		seconds = total,
+		cpu_seconds = os.clock() - cpu0,
+		ops_per_sec = total > 0 and n / total or 0,
+		p50_us = quantile(0.50),
+		p99_us = quantile(0.99),
+	}
+end
+
+local results = {}
+
+local function record(case, size, nkeys, r)
+	r.case = case
+	r.value_size = size
+	r.keys = nkeys
+	results[#results + 1] = r
+	log("%-10s size=%-6d keys=%-7d %12.0f op/s  p50 %8.2f us  p99 %8.2f us",
+		case, size, nkeys, r.ops_per_sec, r.p50_us, r.p99_us)
+end
+
+local function wanted(case)
+	return only == nil or only[case]
+end
+
+----------------------------------------------------------------------------
+-- Key/value and cursor cases, for each value size and key count
+----------------------------------------------------------------------------
+
+local function kv_cases(size, nkeys)
+	local dbname = tempdb()
+	local conn = assert(env:connect(dbname))
+	local value = string.rep("v", size)
+	local keys = make_keys(nkeys, "key")
+	local missing = make_keys(nkeys, "miss")
+
+	-- store: every key once, then one commit (timed on its own)
+	local r = measure(nkeys, function(i) assert(conn:kvstore(keys[i], value)) end)
+	local t0 = clock()
+	assert(conn:commit())
+	r.commit_ms = (clock() - t0) * 1000
+	if wanted("store") then record("store", size, nkeys, r) end
+
+	if wanted("fetch_hit") then
+		record("fetch_hit", size, nkeys, measure(nkeys, function(i)
+			local res, data = conn:kvfetch(keys[i])
+			assert(data)
+		end))
+	end
+
+	if wanted("fetch_miss") then
+		record("fetch_miss", size, nkeys, measure(nkeys, function(i)
+			local res, data = conn:kvfetch(missing[i])
+			assert(res and data == nil)
+		end))
+	end
+
+	if wanted("scan") then
+		local cur = assert(conn:create_cursor())
+		local first = true
+		record("scan", size, nkeys, measure(nkeys, function(i)
+			if first then
+				assert(cur:first_entry())
+				first = false
+			else
+				assert(cur:next_entry())
+			end
+			assert(cur:cursor_key())
+			assert(cur:cursor_data())
+		end))
+		assert(cur:release())
+	end
+
+	if wanted("append") then
+		local tail = string.rep("a", math.min(size, 256))
+		record("append", size, nkeys, measure(nkeys, function(i)
+			assert(conn:kvappend(keys[i], tail))
+		end))
+		assert(conn:commit())
+	end
+
+	if wanted("delete") then
+		record("delete", size, nkeys, measure(nkeys, function(i)
+			assert(conn:kvdelete(keys[i]))
+		end))
+		assert(conn:commit())
+	end
+
+	assert(conn:close())
+	dropdb(dbname)
+end
+
+----------------------------------------------------------------------------
+-- JX9 compile + exec
+----------------------------------------------------------------------------
+
+local jx9_script = [[
+if (!db_exists('bench')) { db_create('bench'); }
+$rec = { name: 'bench', value: 42, tags: ['a', 'b'] };
+db_store('bench', $rec);
+$count = db_total_records('bench');
+]]
+
+local function jx9_case()
+	local dbname = tempdb()
+	local conn = assert(env:connect(dbname))
+	if not conn.compile then
+		log("jx9: not compiled in, skipped")
+	else
+		record("jx9", #jx9_script, 0, measure(jx9_runs, function()
+			local vm = assert(conn:compile(jx9_script))
+			assert(vm:vm_exec())
+			assert(vm:vm_release())
+		end))
+	end
+	assert(conn:close())
+	dropdb(dbname)
+end
+
+----------------------------------------------------------------------------
+
+for _, nkeys in ipairs(key_counts) do
+	for _, size in ipairs(sizes) do
+		if nkeys * size > max_mb * 1024 * 1024 then
+			log("size=%d keys=%d: above %d MB, skipped", size, nkeys, max_mb)
+		else
+			kv_cases(size, nkeys)
+		end
+	end
+end
+if wanted("jx9") then jx9_case() end
+assert(env:close())
+
+io.write(json.encode({
+	meta = {
+		date = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+		lua = _VERSION,
+		driver = driver._VERSION,
+		quick = quick,
+		batch = batch,
+		clock = clock_name,
+	},
+	results = results,
+}), "\n")
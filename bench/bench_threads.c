@@ -0,0 +1,201 @@
+/*
+** Read throughput of one database from several OS threads.
+** Every thread runs its own lua_State and reads random keys with kvfetch,
+** either through a shared handle (env:connect(path, {shared = true})) or
+** through a handle of its own; reads/sec are measured for 1 to 16
+** threads and printed as JSON on stdout (progress goes to stderr).
+**   bench_threads [--keys n] [--reads n] [--max-threads n] [--value-size n]
+** make bench_threads builds it and runs it against the library just
+** built (BENCH_ARGS is passed along).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+/* Loaded by every thread: returns the read loop, ready to be timed */
+static const char *const reader_chunk =
+    "local path, shared, nkeys, reads, seed = ...\n"
+    "local driver = require'luanosql.unqlite'\n"
+    "local env = assert(driver.unqlite())\n"
+    "local conn = assert(env:connect(path, {shared = shared, readonly = true}))\n"
+    "local keys = {}\n"
+    "for i = 1, nkeys do keys[i] = string.format('key%08d', i) end\n"
+    "math.randomseed(seed)\n"
+    "return function()\n"
+    "  local random, fetch = math.random, conn.kvfetch\n"
+    "  for i = 1, reads do\n"
+    "    local res, data = fetch(conn, keys[random(nkeys)])\n"
+    "    if not data then error('missing key') end\n"
+    "  end\n"
+    "  conn:close()\n"
+    "  env:close()\n"
+    "end\n";
+
+/* Fills the database */
+static const char *const loader_chunk =
+    "local path, nkeys, size = ...\n"
+    "local driver = require'luanosql.unqlite'\n"
+    "local env = assert(driver.unqlite())\n"
+    "local conn = assert(env:connect(path))\n"
+    "local value = string.rep('v', size)\n"
+    "for i = 1, nkeys do assert(conn:kvstore(string.format('key%08d', i), value)) end\n"
+    "assert(conn:close())\n"
+    "assert(env:close())\n";
+
+typedef struct
+{
+    const char        *path;
+    int               shared;
+    int               nkeys;
+    int               reads;
+    int               seed;
+    pthread_barrier_t *start;
+    double            seconds;      /**< time spent in the read loop */
+    char              error[256];
+} reader;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+** Thread body: set up a lua_State, wait for the others, run the loop.
+** The barrier is always reached, even when the setup fails.
+*/
+static void *reader_main(void *arg)
+{
+    reader *r = (reader *)arg;
+    lua_State *L = luaL_newstate();
+    int ok;
+    double t0;
+    luaL_openlibs(L);
+    ok = luaL_loadstring(L, reader_chunk) == 0;
+    if (ok) {
+        lua_pushstring(L, r->path);
+        lua_pushboolean(L, r->shared);
+        lua_pushinteger(L, r->nkeys);
+        lua_pushinteger(L, r->reads);
+        lua_pushinteger(L, r->seed);
+        ok = lua_pcall(L, 5, 1, 0) == 0;
+    }
+    pthread_barrier_wait(r->start);
+    t0 = now_sec();
+    if (ok)
+        ok = lua_pcall(L, 0, 0, 0) == 0;
+    r->seconds = now_sec() - t0;
+    if (!ok)
+        snprintf(r->error, sizeof(r->error), "%s", lua_tostring(L, -1));
+    lua_close(L);
+    return NULL;
+}
+
+/*
+** Run nthreads readers and return the aggregate reads/sec, or -1.
+*/
+static double run(const char *path, int shared, int nthreads, int nkeys, int reads)
+{
+    pthread_t threads[64];
+    reader readers[64];
+    pthread_barrier_t start;
+    double slowest = 0;
+    int i, failed = 0;
+    pthread_barrier_init(&start, NULL, (unsigned)nthreads);
+    for (i = 0; i < nthreads; i++) {
+        memset(&readers[i], 0, sizeof(reader));
+        readers[i].path = path;
+        readers[i].shared = shared;
+        readers[i].nkeys = nkeys;
+        readers[i].reads = reads;
+        readers[i].seed = 42 + i;
+        readers[i].start = &start;
+        pthread_create(&threads[i], NULL, reader_main, &readers[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (readers[i].error[0] != '\0') {
+            fprintf(stderr, "thread %d: %s\n", i, readers[i].error);
+            failed = 1;
+        }
+        if (readers[i].seconds > slowest)
+            slowest = readers[i].seconds;
+    }
+    pthread_barrier_destroy(&start);
+    if (failed || slowest <= 0)
+        return -1;
+    return (double)nthreads * reads / slowest;
+}
+
+static int load(const char *path, int nkeys, int size)
+{
+    lua_State *L = luaL_newstate();
+    int ok;
+    luaL_openlibs(L);
+    ok = luaL_loadstring(L, loader_chunk) == 0;
+    if (ok) {
+        lua_pushstring(L, path);
+        lua_pushinteger(L, nkeys);
+        lua_pushinteger(L, size);
+        ok = lua_pcall(L, 3, 0, 0) == 0;
+    }
+    if (!ok)
+        fprintf(stderr, "load: %s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const modes[] = {"separate", "shared"};
+    char path[64];
+    int nkeys = 100000, reads = 200000, max_threads = 16, size = 100;
+    int i, n, m, first = 1;
+    for (i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--keys") == 0)
+            nkeys = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--reads") == 0)
+            reads = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--max-threads") == 0)
+            max_threads = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--value-size") == 0)
+            size = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--keys n] [--reads n] [--max-threads n] [--value-size n]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (nkeys < 1 || reads < 1 || max_threads < 1 || max_threads > 64 || size < 0) {
+        fprintf(stderr, "bench_threads: bad arguments\n");
+        return 2;
+    }
+    snprintf(path, sizeof(path), "/tmp/lns-bench-threads-%ld.db", (long)time(NULL));
+    if (!load(path, nkeys, size))
+        return 1;
+
+    printf("{\"meta\":{\"keys\":%d,\"reads_per_thread\":%d,\"value_size\":%d},\"results\":[",
+           nkeys, reads, size);
+    for (n = 1; n <= max_threads; n *= 2) {
+        for (m = 0; m < 2; m++) {
+            double rate = run(path, m, n, nkeys, reads);
+            if (rate < 0)
+                break;
+            fprintf(stderr, "%-8s threads=%-3d %12.0f reads/s\n", modes[m], n, rate);
+            printf("%s{\"mode\":\"%s\",\"threads\":%d,\"reads_per_sec\":%.0f}",
+                   first ? "" : ",", modes[m], n, rate);
+            first = 0;
+        }
+    }
+    printf("]}\n");
+    remove(path);
+    return 0;
+}
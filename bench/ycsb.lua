@@ -0,0 +1,392 @@
+#!/usr/bin/env lua
+
+----------------------------------------------------------------------------
+-- YCSB style workload driver, built on the public driver API only.
+--   lua bench/ycsb.lua [options]
+--     --workload A..F        core workload (default A)
+--     --records n            records loaded (default 100000)
+--     --operations n         operations of the run phase, split among the
+--                            workers (default 100000)
+--     --distribution d       uniform, zipfian or latest (default: the one
+--                            of the workload)
+--     --value-size n         record size in bytes (default 1000)
+--     --procs n[,n...]       worker processes; a list runs once per count
+--                            to measure scaling (default 1)
+--     --commit-every n       writes per commit (default 100, 1 with more
+--                            than one process so locks are released)
+--     --db path              database file (default: a temp file, removed)
+--     --skip-load            run against an already loaded database
+--
+-- Workloads: A 50% read / 50% update, B 95% read / 5% update, C read only,
+-- D 95% read / 5% insert (latest), E 95% scan / 5% insert, F 50% read /
+-- 50% read-modify-write. Scans seek a key with a cursor and read up to 100
+-- records from there (in the engine order, UnQLite is a hash store).
+--
+-- Several processes share one database file: each worker is this script
+-- started through io.popen with --worker. Failed operations (mostly lock
+-- contention, UNQLITE_BUSY) are retried and counted as retries.
+-- Results are printed as JSON on stdout.
+----------------------------------------------------------------------------
+
+require"string"
+require"os"
+require"io"
+require"table"
+require"math"
+local driver = require"luanosql.unqlite"
+-- the helper modules live next to this script
+local script = arg and arg[0] or "ycsb.lua"
+package.path = (string.match(script, "^(.*)[/\\]") or ".") .. "/?.lua;" .. package.path
+local json = require"bench_json"
+
+local workloads = {
+	A = {read = 0.50, update = 0.50, distribution = "zipfian"},
+	B = {read = 0.95, update = 0.05, distribution = "zipfian"},
+	C = {read = 1.00, distribution = "zipfian"},
+	D = {read = 0.95, insert = 0.05, distribution = "latest"},
+	E = {scan = 0.95, insert = 0.05, distribution = "zipfian"},
+	F = {read = 0.50, rmw = 0.50, distribution = "zipfian"},
+}
+local op_names = {"read", "update", "insert", "scan", "rmw"}
+local max_scan = 100
+local max_retries = 1000
+
+----------------------------------------------------------------------------
+-- Options
+----------------------------------------------------------------------------
+
+local opts = {
+	workload = "A", records = 100000, operations = 100000, value_size = 1000,
+	procs = "1", commit_every = nil, db = nil, skip_load = false, worker = nil,
+	distribution = nil, seed = 42,
+}
+local numeric = {records = true, operations = true, value_size = true,
+	commit_every = true, worker = true, seed = true}
+do
+	local i = 1
+	while arg and arg[i] do
+		local name = string.match(arg[i], "^%-%-([%w%-]+)$")
+		name = name and string.gsub(name, "%-", "_")
+		if name == "skip_load" then
+			opts.skip_load = true
+		elseif name and opts[name] ~= nil or name == "commit_every" or name == "db"
+			or name == "worker" or name == "distribution" then
+			i = i + 1
+			local v = arg[i]
+			if numeric[name] then v = tonumber(v) end
+			opts[name] = assert(v, "--" .. name .. " expects a value")
+		else
+			error("unknown option " .. arg[i])
+		end
+		i = i + 1
+	end
+end
+local workload = assert(workloads[string.upper(opts.workload)], "unknown workload " .. opts.workload)
+local distribution = opts.distribution or workload.distribution
+
+local function log(...)
+	io.stderr:write(string.format(...), "\n")
+end
+
+-- wall clock in seconds: luasocket when installed, date(1) otherwise and
+-- os.time as a last resort
+local wallclock
+do
+	local ok, socket = pcall(require, "socket")
+	if ok and socket.gettime then
+		wallclock = socket.gettime
+	else
+		wallclock = function()
+			local ok, f = pcall(io.popen, "date +%s.%N")
+			local t = ok and f and tonumber(f:read("*l"))
+			if ok and f then f:close() end
+			return t or os.time()
+		end
+	end
+end
+
+local function key(n)
+	return string.format("user%012d", n)
+end
+
+----------------------------------------------------------------------------
+-- Key choosers
+----------------------------------------------------------------------------
+
+-- Zipfian ranks in [0, n) with theta 0.99 (Gray et al., as in YCSB)
+local function zipfian(n)
+	local theta = 0.99
+	local zetan, zeta2 = 0, 1 + 0.5 ^ theta
+	for i = 1, n do zetan = zetan + 1 / i ^ theta end
+	local alpha = 1 / (1 - theta)
+	local eta = (1 - (2 / n) ^ (1 - theta)) / (1 - zeta2 / zetan)
+	return function()
+		local u = math.random()
+		local uz = u * zetan
+		if uz < 1 then return 0 end
+		if uz < zeta2 then return 1 end
+		return math.floor(n * (eta * u - eta + 1) ^ alpha) % n
+	end
+end
+
+-- next key to read: uniform, zipfian (hot ranks scattered over the key
+-- space) or latest (zipfian over the most recent inserts)
+local function chooser(state)
+	local n = opts.records
+	if distribution == "uniform" then
+		return function() return math.random(0, state.count - 1) end
+	end
+	local rank = zipfian(n)
+	if distribution == "zipfian" then
+		return function() return (rank() * 40503 + 12345) % n end
+	end
+	assert(distribution == "latest", "unknown distribution " .. distribution)
+	return function()
+		local k = state.last - rank()
+		return k >= 0 and k or 0
+	end
+end
+
+----------------------------------------------------------------------------
+-- Load phase
+----------------------------------------------------------------------------
+
+local env = assert(driver.unqlite())
+
+local function load(dbname)
+	local conn = assert(env:connect(dbname))
+	local value = string.rep("v", opts.value_size)
+	local t0 = wallclock()
+	for n = 0, opts.records - 1 do
+		assert(conn:kvstore(key(n), value))
+		if n % 1000 == 999 then assert(conn:commit()) end
+	end
+	assert(conn:commit())
+	assert(conn:close())
+	return wallclock() - t0
+end
+
+----------------------------------------------------------------------------
+-- Run phase (one worker)
+----------------------------------------------------------------------------
+
+-- run an operation, retrying it while it fails (another process holds the lock)
+local function retry(counters, fn)
+	for attempt = 1, max_retries do
+		if fn() then return true end
+		counters.retries = counters.retries + 1
+	end
+	counters.errors = counters.errors + 1
+	return false
+end
+
+local function run_worker(dbname, id, nworkers, operations)
+	math.randomseed(opts.seed + id)
+	local conn = assert(env:connect(dbname))
+	local value = string.rep("u", opts.value_size)
+	local commit_every = opts.commit_every or (nworkers > 1 and 1 or 100)
+	-- inserts of worker id use the keys records + id + k * nworkers
+	local state = {count = opts.records, last = opts.records - 1, next_insert = opts.records + id}
+	local choose = chooser(state)
+	local c = {retries = 0, errors = 0, writes = 0}
+	for _, name in ipairs(op_names) do c[name] = 0 end
+
+	local function write_done()
+		c.writes = c.writes + 1
+		if c.writes % commit_every == 0 then
+			retry(c, function() return conn:commit() end)
+		end
+	end
+
+	local ops = {
+		read = function()
+			local k = key(choose())
+			retry(c, function() return conn:kvfetch(k) end)
+		end,
+		update = function()
+			local k = key(choose())
+			retry(c, function() return conn:kvstore(k, value) end)
+			write_done()
+		end,
+		insert = function()
+			local n = state.next_insert
+			state.next_insert = n + nworkers
+			retry(c, function() return conn:kvstore(key(n), value) end)
+			state.count = state.count + 1
+			if n > state.last then state.last = n end
+			write_done()
+		end,
+		scan = function()
+			local k = key(choose())
+			local len = math.random(1, max_scan)
+			retry(c, function()
+				local cur = conn:create_cursor()
+				if not cur then return false end
+				if cur:seek(k) then
+					for r = 1, len do
+						cur:cursor_key()
+						cur:cursor_data()
+						if not cur:next_entry() then break end
+					end
+				end
+				cur:release()
+				return true
+			end)
+		end,
+		rmw = function()
+			local k = key(choose())
+			retry(c, function()
+				local res, data = conn:kvfetch(k)
+				return res and conn:kvstore(k, value)
+			end)
+			write_done()
+		end,
+	}
+
+	-- cumulative mix, op chosen by a uniform draw
+	local mix = {}
+	local acc = 0
+	for _, name in ipairs(op_names) do
+		if workload[name] then
+			acc = acc + workload[name]
+			mix[#mix + 1] = {acc, name}
+		end
+	end
+
+	local t0 = wallclock()
+	for i = 1, operations do
+		local u = math.random()
+		local name = mix[#mix][2]
+		for _, m in ipairs(mix) do
+			if u < m[1] then
+				name = m[2]
+				break
+			end
+		end
+		ops[name]()
+		c[name] = c[name] + 1
+	end
+	retry(c, function() return conn:commit() end)
+	local elapsed = wallclock() - t0
+
+	local result = {worker = id, operations = operations, elapsed_s = elapsed,
+		ops_per_sec = elapsed > 0 and operations / elapsed or 0,
+		retries = c.retries, errors = c.errors}
+	for _, name in ipairs(op_names) do result[name] = c[name] end
+	-- latencies measured by the driver, when built with its statistics
+	if conn.stats then
+		local st = conn:stats()
+		for _, op in ipairs{"kvfetch", "kvstore", "cursor", "commit"} do
+			result[op .. "_p50_us"] = st[op].p50_ms * 1000
+			result[op .. "_p99_us"] = st[op].p99_ms * 1000
+		end
+	end
+	assert(conn:close())
+	return result
+end
+
+----------------------------------------------------------------------------
+-- Workers as processes
+----------------------------------------------------------------------------
+
+-- serialize a flat table of numbers as a Lua chunk, read back by the parent
+local function serialize(t)
+	local parts = {}
+	for k, v in pairs(t) do
+		parts[#parts + 1] = string.format("%s = %.17g", k, v)
+	end
+	return "return {" .. table.concat(parts, ", ") .. "}"
+end
+
+local function quote(s)
+	return "'" .. string.gsub(s, "'", "'\\''") .. "'"
+end
+
+local function run_processes(dbname, nworkers)
+	local interpreter = arg and arg[-1] or "lua"
+	local per_worker = math.floor(opts.operations / nworkers)
+	local pipes = {}
+	for id = 0, nworkers - 1 do
+		local cmd = string.format("%s %s --worker %d --procs %d --db %s --workload %s --records %d" ..
+			" --operations %d --value-size %d --distribution %s --seed %d",
+			quote(interpreter), quote(script), id, nworkers, quote(dbname), opts.workload,
+			opts.records, per_worker, opts.value_size, distribution, opts.seed)
+		if opts.commit_every then
+			cmd = cmd .. " --commit-every " .. opts.commit_every
+		end
+		pipes[#pipes + 1] = assert(io.popen(cmd, "r"))
+	end
+	local results = {}
+	for _, pipe in ipairs(pipes) do
+		local out = pipe:read("*a")
+		pipe:close()
+		local chunk = loadstring or load
+		local fn = chunk(out)
+		results[#results + 1] = assert(fn, "worker failed: " .. out)()
+	end
+	return results
+end
+
+----------------------------------------------------------------------------
+
+if opts.worker then
+	local nworkers = tonumber(opts.procs) or 1
+	io.write(serialize(run_worker(opts.db, opts.worker, nworkers, opts.operations)), "\n")
+	return
+end
+
+local dbname = opts.db
+local temporary = dbname == nil
+if temporary then
+	dbname = os.tmpname()
+	os.remove(dbname)
+end
+
+local load_s
+if not opts.skip_load then
+	log("loading %d records", opts.records)
+	load_s = load(dbname)
+end
+
+local runs = {}
+for count in string.gmatch(opts.procs, "%d+") do
+	local nworkers = tonumber(count)
+	local t0 = wallclock()
+	local workers
+	if nworkers == 1 then
+		workers = {run_worker(dbname, 0, 1, opts.operations)}
+	else
+		workers = run_processes(dbname, nworkers)
+	end
+	local elapsed = wallclock() - t0
+	local run = {procs = nworkers, elapsed_s = elapsed, operations = 0, retries = 0, errors = 0,
+		workers = workers}
+	for _, w in ipairs(workers) do
+		run.operations = run.operations + w.operations
+		run.retries = run.retries + w.retries
+		run.errors = run.errors + w.errors
+	end
+	run.ops_per_sec = elapsed > 0 and run.operations / elapsed or 0
+	log("workload %s, %d process(es): %.0f op/s, %d retries, %d errors",
+		string.upper(opts.workload), nworkers, run.ops_per_sec, run.retries, run.errors)
+	runs[#runs + 1] = run
+end
+assert(env:close())
+if temporary then
+	os.remove(dbname)
+	os.remove(dbname .. "_unqlite_journal")
+end
+
+io.write(json.encode({
+	meta = {
+		date = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+		lua = _VERSION,
+		driver = driver._VERSION,
+	},
+	workload = string.upper(opts.workload),
+	distribution = distribution,
+	records = opts.records,
+	value_size = opts.value_size,
+	load_s = load_s,
+	runs = runs,
+}), "\n")
@@ -10,10 +10,40 @@
 ** helped me to get into "lua/C binding world".
 */
 
+/*
+** Recursive mutexes and CLOCK_MONOTONIC are POSIX, not ISO C: ask for
+** them before any system header, so strict -std=c89 builds see them too.
+*/
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#elif !defined(LUANOSQL_OMIT_THREADS)
+#include <pthread.h>
+#endif
+
+/*
+** Asynchronous operations and the parallel export run on POSIX threads;
+** without them the export parts run one after the other.
+*/
+#if !defined(LUANOSQL_OMIT_THREADS) && !defined(_WIN32)
+#define LUANOSQL_PTHREADS
+#ifndef LUANOSQL_OMIT_ASYNC
+#define LUANOSQL_ASYNC
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+#endif
 
 #include "unqlite.h"
 
@@ -25,20 +55,364 @@
 
 
 
+/*
+** Keys starting with this prefix are kept by the binding itself (the
+** bloom filter sidecar), range and prefix scans skip them.
+*/
+#define LUANOSQL_RESERVED_PREFIX "\0lns:"
+#define LUANOSQL_RESERVED_LEN (sizeof(LUANOSQL_RESERVED_PREFIX) - 1)
+#define IS_RESERVED_KEY(k, n) \
+    ((n) >= LUANOSQL_RESERVED_LEN && memcmp((k), LUANOSQL_RESERVED_PREFIX, LUANOSQL_RESERVED_LEN) == 0)
+
+/* Sidecar record of the bloom filter */
+#define LUANOSQL_BLOOM_KEY LUANOSQL_RESERVED_PREFIX "bloom"
+#define LUANOSQL_BLOOM_KEYLEN ((int)sizeof(LUANOSQL_BLOOM_KEY) - 1)
+
+/* Prefix of the secondary index entries */
+#define LUANOSQL_INDEX_PREFIX LUANOSQL_RESERVED_PREFIX "ix:"
+#define LUANOSQL_INDEX_PREFIXLEN (sizeof(LUANOSQL_INDEX_PREFIX) - 1)
+
+/* Marker record of a database holding encoded values (see value compression) */
+#define LUANOSQL_CODEC_KEY LUANOSQL_RESERVED_PREFIX "codec"
+#define LUANOSQL_CODEC_KEYLEN ((int)sizeof(LUANOSQL_CODEC_KEY) - 1)
+
+/* Reserved records that describe this database only, dumps leave them out */
+#define IS_LOCAL_KEY(k, n) \
+    (IS_RESERVED_KEY(k, n) && !((n) == (size_t)LUANOSQL_CODEC_KEYLEN && \
+                                memcmp((k), LUANOSQL_CODEC_KEY, LUANOSQL_CODEC_KEYLEN) == 0))
+
+/* Result code of a failed index extractor, kv_errmsg gives its message */
+#define IX_EXTRACT_ERROR (-1000)
+
+/* Default budget of the value cache, in bytes */
+#ifndef LUANOSQL_VCACHE_BYTES
+#define LUANOSQL_VCACHE_BYTES (8*1024*1024)
+#endif
+
+/* Default size of the write buffer, in key and data bytes */
+#ifndef LUANOSQL_WBUF_BYTES
+#define LUANOSQL_WBUF_BYTES (4*1024*1024)
+#endif
+
+/* Scratch buffers bigger than this are released after each use */
+#ifndef LUANOSQL_SCRATCH_KEEP
+#define LUANOSQL_SCRATCH_KEEP (1024*1024)
+#endif
+
 #define LUANOSQL_ENVIRONMENT_UNQLITE "UnQLite environment"
 #define LUANOSQL_CONNECTION_UNQLITE "UnQLite connection"
 #define LUANOSQL_CURSOR_UNQLITE "UnQLite cursor"
+#define LUANOSQL_SHARED_CONNECTION_UNQLITE "UnQLite shared connection"
+#define LUANOSQL_SHARED_CURSOR_UNQLITE "UnQLite shared cursor"
+#define LUANOSQL_BLOB_UNQLITE "UnQLite blob"
+#define LUANOSQL_ASYNC_UNQLITE "UnQLite async"
 
 #ifndef LUANOSQL_OMIT_JX9_DOCSTORE
 #define LUANOSQL_JX9DOCSTORE_UNQLITE "UnQLite JX9VM"
 #endif /* End LUANOSQL_OMIT_JX9_DOCSTORE */
 
+/* Idle connections kept by the environment pool */
+#ifndef LUANOSQL_POOL_SIZE
+#define LUANOSQL_POOL_SIZE 0
+#endif
+#ifndef LUANOSQL_POOL_IDLE
+#define LUANOSQL_POOL_IDLE 60
+#endif
+
+#ifndef LUANOSQL_OMIT_STATS
+/* Operations timed by the statistics */
+#define ST_STORE  0
+#define ST_FETCH  1
+#define ST_APPEND 2
+#define ST_DELETE 3
+#define ST_CURSOR 4
+#define ST_COMMIT 5
+#define ST_VMEXEC 6
+#define STATS_OPS 7
+
+/* Latency histogram buckets: < 1 us, then < 2^i us, the last one is open */
+#define STATS_BUCKETS 24
+
+/* One operation out of this many (a power of two) is timed */
+#ifndef LUANOSQL_STATS_SAMPLE
+#define LUANOSQL_STATS_SAMPLE 8
+#endif
+#endif /* LUANOSQL_OMIT_STATS */
+
 /* Environment data structure */
 typedef struct
 {
     short   closed;             /**< env closed or not */
+    struct pool_entry *pool;    /**< idle database handles, oldest first */
+    int     pool_count;         /**< idle handles in the pool */
+    int     pool_size;          /**< max idle handles (0: no pooling) */
+    int     pool_idle;          /**< seconds an idle handle is kept (0: no limit) */
+    unsigned long pool_hits;    /**< connects served by the pool */
+    unsigned long pool_misses;  /**< connects that opened a new handle */
+    unsigned long pool_evictions; /**< idle handles closed by the pool */
+    struct async_pool *async;   /**< worker threads of the async operations or NULL */
 } env_data;
 
+/* Growable scratch buffer, reused across reads on a connection */
+typedef struct
+{
+    char    *data;                     /**< buffer storage (malloc'd) */
+    size_t  len;                       /**< bytes currently used */
+    size_t  size;                      /**< bytes allocated */
+} scratch_buf;
+
+/* A key held by the ordered key index */
+typedef struct
+{
+    char    *data;                     /**< key bytes (malloc'd) */
+    size_t  len;                       /**< key length */
+} ikey;
+
+/* A pending change to the ordered key index */
+typedef struct
+{
+    ikey    key;                       /**< key inserted or deleted */
+    size_t  seq;                       /**< arrival order, the last change wins */
+    int     del;                       /**< 1 for a delete, 0 for an insert */
+} ikey_op;
+
+/*
+** Ordered key index: the sorted keys of the database plus a log of the
+** changes made since it was last merged. The default UnQLite engine is a
+** hash so range and prefix scans use this index to visit matching keys only.
+*/
+typedef struct
+{
+    ikey    *keys;                     /**< sorted, unique keys */
+    size_t  nkeys;                     /**< number of keys */
+    size_t  capkeys;                   /**< allocated keys */
+    ikey_op *ops;                      /**< pending changes */
+    size_t  nops;                      /**< number of pending changes */
+    size_t  capops;                    /**< allocated changes */
+} key_index;
+
+/* Engine settings of a connection, as set by connect options or conn:config */
+typedef struct
+{
+    int          cache;                /**< max page cache, in pages (0: engine default) */
+    int          auto_commit;          /**< commit on close */
+    int          hash;                 /**< index in kv_hash_names */
+    int          cmp;                  /**< index in kv_cmp_names */
+} conn_config;
+
+/* Idle database handle in the environment pool */
+typedef struct pool_entry
+{
+    unqlite      *db;                  /**< the open handle */
+    char         *path;                /**< database path */
+    char         *engine;              /**< KV engine name or NULL */
+    int          flags;                /**< UNQLITE_OPEN_* flags */
+    conn_config  config;               /**< engine settings of the handle */
+    time_t       idle_since;           /**< when the handle was returned */
+} pool_entry;
+
+/* Write buffer entry: the latest pending operation on a key */
+typedef struct wb_entry
+{
+    struct wb_entry *next;             /**< next entry of the hash chain */
+    unsigned int hash;                 /**< key hash */
+    int          op;                   /**< WB_STORE, WB_APPEND or WB_DELETE */
+    size_t       klen;                 /**< key length */
+    size_t       dlen;                 /**< data length (stored or appended) */
+    size_t       dsize;                /**< data allocation size */
+    char         *data;                /**< data */
+    char         key[1];               /**< key, allocated with the entry */
+} wb_entry;
+
+/* Write buffer: writes coalesced per key until flushed to the engine */
+typedef struct
+{
+    wb_entry     **buckets;            /**< hash table */
+    size_t       nbuckets;             /**< number of buckets, a power of 2 */
+    size_t       count;                /**< buffered keys */
+    size_t       bytes;                /**< buffered key and data bytes */
+    size_t       max_bytes;            /**< flush when bytes reaches it */
+    double       max_ms;               /**< flush this many ms after the first buffered write (0: off) */
+    double       first_ms;             /**< time of the first buffered write */
+    unsigned long writes;              /**< writes buffered */
+    unsigned long coalesced;           /**< writes that replaced a buffered one */
+    unsigned long flushes;             /**< flushes done */
+    unsigned long flushed;             /**< records written by the flushes */
+} write_buffer;
+
+/* Value cache entry: a record value kept as a Lua string */
+typedef struct vc_entry
+{
+    struct vc_entry *next;             /**< next entry of the hash chain */
+    struct vc_entry *newer;            /**< LRU list, towards the most recently used */
+    struct vc_entry *older;            /**< LRU list, towards the least recently used */
+    unsigned int hash;                 /**< key hash */
+    int          ref;                  /**< registry reference to the value string */
+    size_t       klen;                 /**< key length */
+    size_t       vlen;                 /**< value length */
+    char         key[1];               /**< key, allocated with the entry */
+} vc_entry;
+
+/* Value cache: byte budgeted LRU of the values read by kvfetch */
+typedef struct
+{
+    vc_entry     **buckets;            /**< hash table */
+    size_t       nbuckets;             /**< number of buckets, a power of 2 */
+    size_t       count;                /**< cached values */
+    vc_entry     *newest;              /**< most recently used entry */
+    vc_entry     *oldest;              /**< least recently used entry */
+    size_t       bytes;                /**< bytes charged to the cache */
+    size_t       max_bytes;            /**< byte budget */
+    unsigned long hits;                /**< kvfetch served by the cache */
+    unsigned long misses;              /**< kvfetch that read the database */
+    unsigned long evictions;           /**< values dropped for the budget */
+    unsigned long invalidations;       /**< values dropped by a write */
+} value_cache;
+
+/* Bloom filter of the keys of a database */
+typedef struct
+{
+    unsigned char *data;               /**< sidecar header followed by the bits */
+    unsigned char *bits;               /**< the bit array, data + BLOOM_HEADER */
+    size_t       nbits;                /**< number of bits, a multiple of 8 */
+    unsigned int nhash;                /**< hash functions */
+    size_t       nkeys;                /**< keys added */
+    int          persist;              /**< saved in the sidecar record on close */
+    int          dirty;                /**< built here, not yet saved */
+    unsigned long negatives;           /**< lookups answered without the engine */
+    unsigned long positives;           /**< lookups passed to the engine */
+    unsigned long false_positives;     /**< positives the engine did not find */
+} bloom_filter;
+
+/* Value compression of a connection */
+typedef struct
+{
+    int           enabled;             /**< values are compressed (conn:compression) */
+    size_t        threshold;           /**< values shorter than this are not compressed */
+    unsigned long encoded;             /**< values given to the compressor */
+    unsigned long compressed;          /**< values stored compressed */
+    unsigned long decoded;             /**< values decompressed */
+    double        in_bytes;            /**< bytes given to the compressor */
+    double        out_bytes;           /**< bytes stored for them */
+    double        encode_ms;           /**< time spent compressing */
+    double        decode_ms;           /**< time spent decompressing */
+    scratch_buf   tmp;                 /**< compressor and decompressor output */
+} value_codec;
+
+/* Secondary index declared on a connection */
+typedef struct sec_index
+{
+    struct sec_index *next;
+    char          *name;               /**< index name */
+    char          *prefix;             /**< key prefix of its entries */
+    size_t        plen;                /**< prefix length */
+    char          *path;               /**< field path extractor or NULL */
+    int           fn;                  /**< reference to the extractor function or LUA_NOREF */
+} sec_index;
+
+/* Secondary indexes of a connection and their work buffers */
+typedef struct
+{
+    sec_index     *list;               /**< declared indexes */
+    key_index     *dir;                /**< sorted entry keys, for index_range, or NULL */
+    scratch_buf   old;                 /**< previous data of the record being written */
+    scratch_buf   vals;                /**< old and new value of each index for that record */
+    scratch_buf   key;                 /**< primary key of the record */
+    scratch_buf   ekey;                /**< entry key */
+    int           has_old;             /**< old holds a record (to put back if ix_apply fails) */
+    int           pending;             /**< vals hold changes for ix_apply */
+    int           busy;                /**< an extractor function is running */
+    char          errmsg[256];         /**< message of the last extractor error */
+} index_set;
+
+#ifndef LUANOSQL_OMIT_STATS
+/* Counters and latency histogram of an operation */
+typedef struct
+{
+    unsigned long count;               /**< operations */
+    unsigned long timed;               /**< operations timed */
+    unsigned long misses;              /**< not found (or end of cursor) */
+    unsigned long errors;              /**< other failures */
+    double       bytes;                /**< key and data bytes moved */
+    double       total_ms;             /**< time spent by the timed operations */
+    double       max_ms;               /**< slowest operation */
+    unsigned long hist[STATS_BUCKETS]; /**< latency histogram of the timed operations */
+} op_stats;
+#endif /* LUANOSQL_OMIT_STATS */
+
+
+typedef struct shared_handle shared_handle;
+
+#ifndef LUANOSQL_OMIT_THREADS
+/*
+** Shared handles. env:connect(path, {shared = true}) attaches to a process
+** wide registry of open databases, so lua_States running in different OS
+** threads use one unqlite handle (one file descriptor, one page cache, no
+** lock fights) instead of opening the file each. Each handle counts its
+** connections and is closed by the last one.
+** UnQLite does not serialize cursor calls and this binding makes several
+** engine calls per method, so every method of a shared connection or of
+** its cursors runs holding the (recursive) lock of the handle: the
+** metatables of shared objects wrap each method with shared_conn_call
+** or shared_cur_call.
+*/
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION lns_mutex;
+#define lns_mutex_init(m)    InitializeCriticalSection(m)
+#define lns_mutex_destroy(m) DeleteCriticalSection(m)
+#define lns_mutex_lock(m)    EnterCriticalSection(m)
+#define lns_mutex_unlock(m)  LeaveCriticalSection(m)
+#else
+typedef pthread_mutex_t lns_mutex;
+#define lns_mutex_destroy(m) pthread_mutex_destroy(m)
+#define lns_mutex_lock(m)    pthread_mutex_lock(m)
+#define lns_mutex_unlock(m)  pthread_mutex_unlock(m)
+
+/*
+** Initialize a recursive mutex: methods of a shared connection can be
+** re-entered from the Lua callbacks of cursor scans.
+** @return void
+*/
+static void lns_mutex_init(lns_mutex *m)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+#endif
+
+/* An open database shared by the connections of several lua_States */
+struct shared_handle
+{
+    unqlite      *db;
+    char         *path;
+    int          flags;                /**< UNQLITE_OPEN_* flags */
+    int          refs;                 /**< connections using it */
+    lns_mutex    lock;                 /**< held by the methods of its connections */
+    unsigned long writes;              /**< writes by all its connections */
+    short        sidecar_gone;         /**< bloom sidecar deleted in the shared transaction */
+    struct shared_handle *next;
+};
+#endif /* LUANOSQL_OMIT_THREADS */
+
+/* Group commit policy of a connection and its counters */
+typedef struct
+{
+    unsigned int max_ops;              /**< commit after this many writes (0: off) */
+    size_t       max_bytes;            /**< commit after this many bytes written (0: off) */
+    double       max_ms;               /**< commit this many ms after the first pending write (0: off) */
+    unsigned int ops;                  /**< writes since the last commit */
+    size_t       bytes;                /**< bytes written since the last commit */
+    double       first_ms;             /**< time of the first pending write */
+    unsigned long commits;             /**< commits done, by the policy or not */
+    unsigned long auto_commits;        /**< commits done by the policy */
+    double       total_ms;             /**< time spent committing */
+    double       worst_ms;             /**< longest commit */
+} commit_policy;
+
 /* Connection data structure */
 typedef struct
 {
@@ -51,9 +425,48 @@ typedef struct
     unqlite      *unqlite_conn;        /**< database connection unqlite */
     int 		 con_fetch_cb;         /**< reference to unqlite_kv_fetch_callback */
     int 		 con_fetch_cb_udata;   /**< reference to unqlite_kv_fetch_callback userdata*/
-    lua_State    *L;                   /**< reference to a lua_state, useful for callback implementation */
+    scratch_buf  fetch_buf;            /**< read buffer shared by kvfetch and cursor key/data */
+    scratch_buf  key_buf[2];           /**< encoded integer and tuple keys (argument, upper bound) */
+    short        typed_keys;           /**< integer and tuple keys are encoded (connect option) */
+    key_index    *kindex;              /**< ordered key index, built on first range/prefix scan */
+    int          open_flags;           /**< UNQLITE_OPEN_* flags the database was opened with */
+    conn_config  config;               /**< engine settings */
+    char         *path;                /**< database path, to return the handle to the pool */
+    char         *engine;              /**< KV engine name chosen at connect or NULL */
+    commit_policy commit;              /**< group commit policy */
+    write_buffer *wbuf;                /**< write-behind buffer or NULL */
+    value_cache  *vcache;              /**< kvfetch value cache or NULL */
+    bloom_filter *bloom;               /**< key bloom filter or NULL */
+    value_codec  *codec;               /**< value compression or NULL */
+    short        codec_seen;           /**< the database has the codec marker */
+    index_set    *indexes;             /**< secondary indexes or NULL */
+    short        sidecar_gone;         /**< bloom sidecar deleted in this transaction */
+#ifndef LUANOSQL_OMIT_STATS
+    op_stats     stats[STATS_OPS];     /**< operation statistics */
+#endif
+#ifndef LUANOSQL_OMIT_THREADS
+    shared_handle *shared;             /**< shared handle or NULL */
+    unsigned long kindex_writes;       /**< writes of the shared handle the key index has seen */
+#endif
 } conn_data;
 
+/*
+** The caches of a connection (value cache, bloom filter, write buffer)
+** would miss the writes of the other connections of a shared handle.
+*/
+#ifndef LUANOSQL_OMIT_THREADS
+#define IS_SHARED(conn) ((conn)->shared != NULL)
+#else
+#define IS_SHARED(conn) 0
+#endif
+
+/* Blob data structure: record data kept in a native buffer */
+typedef struct
+{
+    short       closed;             /**< blob freed or not */
+    scratch_buf buf;                /**< the data, filled straight by the engine */
+} blob_data;
+
 /* Cursor data structure */
 typedef struct
 {
@@ -78,6 +491,7 @@ typedef struct
     unqlite_vm *uvm;	            /**< reference to unqlite_kv_cursor struct */
 	int jx9_consumer_cb;            /**< reference to unqlite_vm_config - setting a callback */
     int jx9_consumer_cb_udata;      /**< reference to unqlite_vm_config UNQLITE_VM_CONFIG_OUTPUT callback userdata */
+    lua_State   *L;                 /**< state running vm_exec, for the output callback */
     
 } jx9_doc_data;
 #endif /* LUANOSQL_OMIT_JX9_DOCSTORE */
@@ -116,20 +530,23 @@ static void stackDump (lua_State *L) {
 }
 #endif  //End LUANOSQL_DEBUG
 /**
-** Create a metatable and leave it on top of the stack.
+** Extract the database error log.
 ** @param conn a connection to unqlite db
-** @param zBuf a string where the log error will be copied to.
+** @param pzBuf where the pointer to the log error will be copied to.
 ** @return void
 */
-static void unqlite_logerror(unqlite *conn, const char *zBuf) {
-    int iLen;
+static void unqlite_logerror(unqlite *conn, const char **pzBuf) {
+    int iLen = 0;
+    *pzBuf = NULL;
     /* Something goes wrong, extract database error log */
-    unqlite_config(conn, UNQLITE_CONFIG_ERR_LOG, &zBuf, &iLen);
-#ifdef LUANOSQL_DEBUG
-    if( iLen > 0 )
-    {
-        puts(zBuf);
+    if (conn != NULL)
+        unqlite_config(conn, UNQLITE_CONFIG_ERR_LOG, pzBuf, &iLen);
+    if (*pzBuf == NULL || iLen <= 0) {
+        *pzBuf = "unknown error";
+        return;
     }
+#ifdef LUANOSQL_DEBUG
+    puts(*pzBuf);
 #endif
 }
 
@@ -145,1216 +562,8300 @@ static env_data *getenvironment(lua_State *L) {
     return env;
 }
 
+#ifndef LUANOSQL_OMIT_THREADS
+/*
+** Check that the value at idx is a userdata of class tname or of its
+** shared counterpart.
+** @param L the lua state
+** @return void* the userdata (an error is raised otherwise)
+*/
+static void *checkobject(lua_State *L, int idx, const char *tname, const char *shared)
+{
+    void *p = lua_touserdata(L, idx);
+    if (p != NULL && lua_getmetatable(L, idx)) {
+        int ok;
+        luaL_getmetatable(L, tname);
+        ok = lua_rawequal(L, -1, -2);
+        if (!ok) {
+            luaL_getmetatable(L, shared);
+            ok = lua_rawequal(L, -1, -3);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+        if (ok)
+            return p;
+    }
+    return luaL_checkudata(L, idx, tname);  /* raises the usual error */
+}
+#define checkconnection(L, idx) \
+    ((conn_data *)checkobject(L, idx, LUANOSQL_CONNECTION_UNQLITE, LUANOSQL_SHARED_CONNECTION_UNQLITE))
+#define checkcursor(L, idx) \
+    ((cur_data *)checkobject(L, idx, LUANOSQL_CURSOR_UNQLITE, LUANOSQL_SHARED_CURSOR_UNQLITE))
+#else
+#define checkconnection(L, idx) ((conn_data *)luaL_checkudata(L, idx, LUANOSQL_CONNECTION_UNQLITE))
+#define checkcursor(L, idx) ((cur_data *)luaL_checkudata(L, idx, LUANOSQL_CURSOR_UNQLITE))
+#endif
+
+/* An index extractor function of the connection is running (see ix_extract) */
+#define IX_BUSY(conn) ((conn)->indexes != NULL && (conn)->indexes->busy)
+
+/*
+** Raise an error if an index extractor of the connection is running:
+** the write in progress holds its index buffers and fetch buffer.
+** @param L the lua state
+** @param conn the connection
+** @return void
+*/
+static void check_not_extracting(lua_State *L, conn_data *conn)
+{
+    if (IX_BUSY(conn))
+        luaL_error(L, LUANOSQL_PREFIX"connection is in use by an index extractor");
+}
+
 /*
 ** Check for valid connection.
 ** @param L the lua state
 ** @return conn_data a valid conn_data structure
 */
 static conn_data *getconnection(lua_State *L) {
-    conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUANOSQL_CONNECTION_UNQLITE);
+    conn_data *conn = checkconnection(L, 1);
     luaL_argcheck(L, conn != NULL, 1, LUANOSQL_PREFIX"connection expected");
     luaL_argcheck(L, !conn->closed, 1, LUANOSQL_PREFIX"connection is closed");
+    check_not_extracting(L, conn);
     return conn;
 }
 
 /*
-** Check for valid cursor.
-** @param L the lua state
-** @return cur_data a valid cur_data structure / cursor
+** Make room for at least need bytes in a scratch buffer.
+** The buffer grows geometrically so repeated reads settle on one allocation.
+** @param buf the scratch buffer
+** @param need the total number of bytes required
+** @return integer 0 if ok, -1 if memory cannot be allocated
 */
-static cur_data *getcursor(lua_State *L) {
-    cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUANOSQL_CURSOR_UNQLITE);
-    luaL_argcheck(L, cur != NULL, 1, LUANOSQL_PREFIX"cursor expected");
-    luaL_argcheck(L, !cur->closed, 1, LUANOSQL_PREFIX"cursor is closed");
-    return cur;
+static int scratch_reserve(scratch_buf *buf, size_t need)
+{
+    size_t nsize;
+    char *ndata;
+    if (need <= buf->size)
+        return 0;
+    nsize = buf->size ? buf->size : 256;
+    while (nsize < need) {
+        if (nsize > ((size_t)-1) / 2) {
+            nsize = need;
+            break;
+        }
+        nsize *= 2;
+    }
+    ndata = (char *)realloc(buf->data, nsize);
+    if (ndata == NULL)
+        return -1;
+    buf->data = ndata;
+    buf->size = nsize;
+    return 0;
 }
 
-
-#ifndef LUANOSQL_OMIT_JX9_DOCSTORE
-
-/**
-** Create a metatable and leave it on top of the stack.
-** @param conn a connection to unqlite db
-** @param zBuf a string where the log error will be copied to.
+/*
+** Release the scratch buffer memory if it grew beyond LUANOSQL_SCRATCH_KEEP,
+** so that a single huge record does not stay pinned to the connection.
+** @param buf the scratch buffer
 ** @return void
 */
-static void unqlite_jx9_logerror(unqlite *conn, const char *zBuf) {
-    int iLen;
-    /* Something goes wrong, extract database error log */
-    unqlite_config(conn, UNQLITE_CONFIG_JX9_ERR_LOG, &zBuf, &iLen);
-#ifdef LUANOSQL_DEBUG
-    if( iLen > 0 )
-    {
-        puts(zBuf);
+static void scratch_trim(scratch_buf *buf)
+{
+    buf->len = 0;
+    if (buf->size > LUANOSQL_SCRATCH_KEEP) {
+        free(buf->data);
+        buf->data = NULL;
+        buf->size = 0;
     }
-#endif
 }
 
+/*
+** Free all the scratch buffer memory.
+** @param buf the scratch buffer
+** @return void
+*/
+static void scratch_free(scratch_buf *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+}
 
 /*
-** Check for valid jx9_doc_data structure.
+** Push the scratch buffer content as a Lua string and reset the buffer.
 ** @param L the lua state
-** @return jx9_doc_data a valid jx9_doc_data structure / jx9 VM
+** @param buf the scratch buffer
+** @return void
 */
-static jx9_doc_data *getjx9doc(lua_State *L) {
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata (L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"JX9 docstore VM expected");
-    luaL_argcheck(L, !jx9data->closed, 1, LUANOSQL_PREFIX"JX9 docstore VM is closed");
-    return jx9data;
+static void scratch_push(lua_State *L, scratch_buf *buf)
+{
+    lua_pushlstring(L, buf->len ? buf->data : "", buf->len);
+    scratch_trim(buf);
 }
 
+/*
+** UnQLite data consumer appending each chunk to a scratch buffer.
+** Used with unqlite_kv_fetch_callback and the cursor callbacks, so a
+** record is looked up once, without probing its length first.
+** @param pData chunk provided by the engine
+** @param iDataLen chunk length
+** @param pUserData passed is a scratch_buf
+** @return integer UNQLITE_OK or UNQLITE_ABORT when out of memory
+*/
+static int scratch_consumer(const void *pData, unsigned int iDataLen, void *pUserData)
+{
+    scratch_buf *buf = (scratch_buf *)pUserData;
+    if (buf->len + iDataLen < buf->len || scratch_reserve(buf, buf->len + iDataLen) != 0)
+        return UNQLITE_ABORT;
+    memcpy(buf->data + buf->len, pData, iDataLen);
+    buf->len += iDataLen;
+    return UNQLITE_OK;
+}
 
 
-/* Wrapped functions for JX9 VM data */
+/*
+** Ordered key index. It is built by a full cursor scan the first time a
+** range or prefix scan runs on the connection, then kept up to date by the
+** write primitives below. Changes are logged and merged lazily so that
+** writes stay O(1). If memory runs out the index is dropped and rebuilt
+** on the next scan.
+*/
+
+/* Merge pending changes once their number reaches this */
+#ifndef LUANOSQL_KINDEX_MERGE
+#define LUANOSQL_KINDEX_MERGE 4096
+#endif
 
 /*
-** Jx9Doc object collector function
-** @param L the lua state
-** @return integer 0 , nil and err in case of
+** Compare two keys, bytewise then by length.
+** @return integer <0, 0, >0
 */
-static int jx9_ds_gc(lua_State *L)
+static int ikey_cmp(const char *a, size_t alen, const char *b, size_t blen)
 {
-    int res;
-    const char *errmsg;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    if (jx9data != NULL && !(jx9data->closed))
-    {
-        res = unqlite_vm_release(jx9data->uvm);
-        if (res != UNQLITE_OK) {
-            unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
-            return luanosql_faildirect(L, errmsg);
-        }
-		
-		conn_data *conn;
-		
-		/* destroy structure fields. */
-		jx9data->closed = 1;
-		jx9data->uvm = NULL;
-		lua_rawgeti (L, LUA_REGISTRYINDEX, jx9data->conn);
-		conn = lua_touserdata (L, -1);
-		conn->vm_counter--;
-		luaL_unref(L, LUA_REGISTRYINDEX, jx9data->conn);
-		//luaL_unref(L, LUA_REGISTRYINDEX, jx9data->uvm);
-		
-    }
-    return 0;
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0)
+        return c;
+    return alen < blen ? -1 : (alen > blen ? 1 : 0);
 }
 
+/* qsort callback for sorted keys */
+static int ikey_qcmp(const void *a, const void *b)
+{
+    const ikey *ka = (const ikey *)a, *kb = (const ikey *)b;
+    return ikey_cmp(ka->data, ka->len, kb->data, kb->len);
+}
 
+/* qsort callback for pending changes, in arrival order for equal keys */
+static int ikey_op_qcmp(const void *a, const void *b)
+{
+    const ikey_op *oa = (const ikey_op *)a, *ob = (const ikey_op *)b;
+    int c = ikey_cmp(oa->key.data, oa->key.len, ob->key.data, ob->key.len);
+    if (c != 0)
+        return c;
+    return oa->seq < ob->seq ? -1 : 1;
+}
 
 /*
-** Release the vm
-** Release a cursor object (deallocation) 
-** It wraps unqlite_kv_cursor_release.
-** int unqlite_kv_cursor_release(unqlite *pDb,unqlite_kv_cursor *pCur);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
-** 
+** Free a sorted key array and its pending changes.
+** @param idx the key index or NULL
+** @return void
 */
-static int jx9_ds_vm_release(lua_State *L)
+static void ikeys_free(key_index *idx)
 {
-    int res;
-    const char *errmsg;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-    if (jx9data->closed) {
-        lua_pushboolean(L, 0);
-        return 1;
-    }
-    res = unqlite_vm_release(jx9data->uvm);
-    if (res != UNQLITE_OK) {
-        unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
-    }
-	
-	/*FIXME: Refactor, cretaing a destroy_vm as for cursor */
-	conn_data *conn;
-	/* destroy structure fields. */
-	jx9data->closed = 1;
-	jx9data->uvm = NULL;
-	lua_rawgeti (L, LUA_REGISTRYINDEX, jx9data->conn);
-	conn = lua_touserdata (L, -1);
-	conn->vm_counter--;
-	luaL_unref(L, LUA_REGISTRYINDEX, jx9data->conn);
-	//luaL_unref(L, LUA_REGISTRYINDEX, jx9data->uvm);
-	
-	lua_pushboolean(L, 1);
-    return 1;
+    size_t i;
+    if (idx == NULL)
+        return;
+    for (i = 0; i < idx->nkeys; i++)
+        free(idx->keys[i].data);
+    for (i = 0; i < idx->nops; i++)
+        free(idx->ops[i].key.data);
+    free(idx->keys);
+    free(idx->ops);
+    free(idx);
 }
 
+/*
+** Free the ordered key index of a connection.
+** @param conn the connection
+** @return void
+*/
+static void kindex_drop(conn_data *conn)
+{
+    ikeys_free(conn->kindex);
+    conn->kindex = NULL;
+}
 
+/*
+** Append a key to the sorted array (no ordering check).
+** @return integer 0 if ok, -1 if out of memory
+*/
+static int kindex_push(key_index *idx, char *data, size_t len)
+{
+    if (idx->nkeys == idx->capkeys) {
+        size_t ncap = idx->capkeys ? idx->capkeys * 2 : 1024;
+        ikey *nkeys = (ikey *)realloc(idx->keys, ncap * sizeof(ikey));
+        if (nkeys == NULL)
+            return -1;
+        idx->keys = nkeys;
+        idx->capkeys = ncap;
+    }
+    idx->keys[idx->nkeys].data = data;
+    idx->keys[idx->nkeys].len = len;
+    idx->nkeys++;
+    return 0;
+}
 
 /*
-** Compile a jx9 program passed as jx9script.
-** It wraps unqlite_compile.
-** int  unqlite_compile(nqlite *pDb, const char *zJx9, int nLen, unqlite_vm **ppOutVm);
-** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** Merge the pending changes into the sorted keys.
+** @param idx the key index
+** @return integer 0 if ok, -1 if out of memory (the index must be freed)
 */
-static int jx9_ds_compile(lua_State *L)
+static int ikeys_merge(key_index *idx)
 {
-    conn_data *conn = getconnection(L);
-    int res;
-    const char *errmsg;
-    unqlite_vm *vm;
-	const char *jx9script;
-	size_t iLen;
-	/* get jx9 script to be compiled */
+    ikey *old;
+    size_t nold, i = 0, j = 0, k;
+    if (idx->nops == 0)
+        return 0;
+    qsort(idx->ops, idx->nops, sizeof(ikey_op), ikey_op_qcmp);
+    old = idx->keys;
+    nold = idx->nkeys;
+    idx->keys = NULL;
+    idx->nkeys = idx->capkeys = 0;
+    while (i < nold || j < idx->nops) {
+        int c;
+        if (j == idx->nops)
+            c = -1;
+        else if (i == nold)
+            c = 1;
+        else
+            c = ikey_cmp(old[i].data, old[i].len, idx->ops[j].key.data, idx->ops[j].key.len);
+        if (c < 0) {
+            if (kindex_push(idx, old[i].data, old[i].len) != 0)
+                goto nomem;
+            old[i++].data = NULL;
+            continue;
+        }
+        /* skip to the last change of this key */
+        while (j + 1 < idx->nops && ikey_cmp(idx->ops[j].key.data, idx->ops[j].key.len,
+                idx->ops[j + 1].key.data, idx->ops[j + 1].key.len) == 0) {
+            free(idx->ops[j].key.data);
+            idx->ops[j++].key.data = NULL;
+        }
+        if (c == 0) {
+            free(old[i].data);
+            old[i++].data = NULL;
+        }
+        if (!idx->ops[j].del) {
+            if (kindex_push(idx, idx->ops[j].key.data, idx->ops[j].key.len) != 0)
+                goto nomem;
+        }
+        else
+            free(idx->ops[j].key.data);
+        idx->ops[j++].key.data = NULL;
+    }
+    free(old);
+    idx->nops = 0;
+    return 0;
+nomem:
+    for (k = i; k < nold; k++)
+        free(old[k].data);
+    free(old);
+    for (k = j; k < idx->nops; k++)
+        free(idx->ops[k].key.data);
+    idx->nops = 0;
+    return -1;
+}
+
+/*
+** Merge the pending changes of the ordered key index of a connection.
+** @param conn the connection
+** @return integer 0 if ok, -1 if out of memory (the index is dropped)
+*/
+static int kindex_merge(conn_data *conn)
+{
+    if (conn->kindex == NULL || ikeys_merge(conn->kindex) == 0)
+        return 0;
+    kindex_drop(conn);
+    return -1;
+}
+
+#ifndef LUANOSQL_OMIT_THREADS
+/*
+** Count a write on the shared handle of a connection: the key indexes of
+** its other connections are out of date from now on, its own is kept up
+** to date by kindex_note.
+** @param conn the connection
+** @return void
+*/
+static void kindex_shared_write(conn_data *conn)
+{
+    if (conn->shared == NULL)
+        return;
+    if (conn->kindex_writes == conn->shared->writes)
+        conn->kindex_writes++;
+    conn->shared->writes++;
+}
+#else
+#define kindex_shared_write(conn)
+#endif
+
+/*
+** Log a change to a sorted key array, merged once enough are pending.
+** @param idx the key index
+** @param key the key
+** @param klen the key length
+** @param del 1 for a delete, 0 for an insert
+** @return integer 0 if ok, -1 if out of memory (the index must be freed)
+*/
+static int ikeys_note(key_index *idx, const char *key, size_t klen, int del)
+{
+    char *copy;
+    if (idx->nops == idx->capops) {
+        size_t ncap = idx->capops ? idx->capops * 2 : 64;
+        ikey_op *nops = (ikey_op *)realloc(idx->ops, ncap * sizeof(ikey_op));
+        if (nops == NULL)
+            return -1;
+        idx->ops = nops;
+        idx->capops = ncap;
+    }
+    copy = (char *)malloc(klen ? klen : 1);
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, key, klen);
+    idx->ops[idx->nops].key.data = copy;
+    idx->ops[idx->nops].key.len = klen;
+    idx->ops[idx->nops].seq = idx->nops;
+    idx->ops[idx->nops].del = del;
+    idx->nops++;
+    if (idx->nops >= LUANOSQL_KINDEX_MERGE && idx->nops >= idx->nkeys / 4)
+        return ikeys_merge(idx);
+    return 0;
+}
+
+/*
+** Log a change to the index, if the connection has one.
+** @param conn the connection
+** @param key the key
+** @param klen the key length
+** @param del 1 for a delete, 0 for an insert
+** @return void
+*/
+static void kindex_note(conn_data *conn, const char *key, size_t klen, int del)
+{
+    kindex_shared_write(conn);
+    if (conn->kindex != NULL && ikeys_note(conn->kindex, key, klen, del) != 0)
+        kindex_drop(conn);
+}
+
+/*
+** Make sure the connection has an up to date ordered key index,
+** building it with a full cursor scan when needed.
+** @param conn the connection
+** @return integer UnQLite result code (UNQLITE_NOMEM if out of memory)
+*/
+static int kindex_ensure(conn_data *conn)
+{
+    int res;
+    key_index *idx;
+    unqlite_kv_cursor *cursor;
+    scratch_buf *buf = &conn->fetch_buf;
+#ifndef LUANOSQL_OMIT_THREADS
+    /* another connection of the shared handle wrote, start over */
+    if (conn->shared != NULL && conn->kindex_writes != conn->shared->writes) {
+        kindex_drop(conn);
+        conn->kindex_writes = conn->shared->writes;
+    }
+#endif
+    if (conn->kindex != NULL)
+        return kindex_merge(conn) == 0 ? UNQLITE_OK : UNQLITE_NOMEM;
+    idx = (key_index *)calloc(1, sizeof(key_index));
+    if (idx == NULL)
+        return UNQLITE_NOMEM;
+    conn->kindex = idx;
+    res = unqlite_kv_cursor_init(conn->unqlite_conn, &cursor);
+    if (res != UNQLITE_OK) {
+        kindex_drop(conn);
+        return res;
+    }
+    res = unqlite_kv_cursor_first_entry(cursor);
+    if (res == UNQLITE_DONE || res == UNQLITE_EOF)
+        res = UNQLITE_OK;
+    while (res == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor)) {
+        char *copy;
+        buf->len = 0;
+        res = unqlite_kv_cursor_key_callback(cursor, scratch_consumer, buf);
+        if (res != UNQLITE_OK)
+            break;
+        if (IS_RESERVED_KEY(buf->data, buf->len)) {
+            if (unqlite_kv_cursor_next_entry(cursor) != UNQLITE_OK)
+                break;
+            continue;
+        }
+        copy = (char *)malloc(buf->len ? buf->len : 1);
+        if (copy == NULL || kindex_push(idx, copy, buf->len) != 0) {
+            free(copy);
+            res = UNQLITE_NOMEM;
+            break;
+        }
+        memcpy(copy, buf->data, buf->len);
+        if (unqlite_kv_cursor_next_entry(cursor) != UNQLITE_OK)
+            break;
+    }
+    unqlite_kv_cursor_release(conn->unqlite_conn, cursor);
+    scratch_trim(buf);
+    if (res != UNQLITE_OK) {
+        kindex_drop(conn);
+        return res;
+    }
+    qsort(idx->keys, idx->nkeys, sizeof(ikey), ikey_qcmp);
+    return UNQLITE_OK;
+}
+
+/*
+** Position of the first indexed key not less than key.
+** @return size_t position in [0, nkeys]
+*/
+static size_t kindex_lower(key_index *idx, const char *key, size_t klen)
+{
+    size_t lo = 0, hi = idx->nkeys;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ikey_cmp(idx->keys[mid].data, idx->keys[mid].len, key, klen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+** Position of the first indexed key, from start, not beginning with prefix.
+** @return size_t position in [start, nkeys]
+*/
+static size_t kindex_prefix_end(key_index *idx, size_t start, const char *prefix, size_t plen)
+{
+    size_t lo = start, hi = idx->nkeys;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        ikey *k = &idx->keys[mid];
+        if (k->len >= plen && memcmp(k->data, prefix, plen) == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+/*
+** Write buffer. When enabled, kvstore, kvappend and kvdelete only record
+** the operation in a hash table keyed by record key, so repeated writes to
+** a hot key reach the engine once. kvfetch (and the reads built on the key
+** value primitives) look at the buffer first; cursors, commits and the
+** other reads flush it. A rollback discards it.
+*/
+
+#define WB_STORE  0
+#define WB_APPEND 1
+#define WB_DELETE 2
+
+/*
+** Get a monotonic time in milliseconds.
+** @return double milliseconds
+*/
+static double now_ms(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+#endif
+}
+
+/*
+** FNV-1a key hash.
+** @return unsigned int hash
+*/
+static unsigned int kv_hash_fnv1a(const void *pKey, unsigned int nLen)
+{
+    const unsigned char *p = (const unsigned char *)pKey;
+    unsigned int h = 2166136261U;
+    while (nLen-- > 0) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+** DJB2 key hash.
+** @return unsigned int hash
+*/
+static unsigned int kv_hash_djb2(const void *pKey, unsigned int nLen)
+{
+    const unsigned char *p = (const unsigned char *)pKey;
+    unsigned int h = 5381;
+    while (nLen-- > 0)
+        h = (h << 5) + h + *p++;
+    return h;
+}
+
+/*
+** Find the buffered entry of a key.
+** @return wb_entry* the entry or NULL
+*/
+static wb_entry *wb_find(write_buffer *wb, const char *key, size_t klen, unsigned int hash)
+{
+    wb_entry *e = wb->buckets[hash & (wb->nbuckets - 1)];
+    for (; e != NULL; e = e->next)
+        if (e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0)
+            return e;
+    return NULL;
+}
+
+/*
+** Free a buffered entry.
+** @return void
+*/
+static void wb_free_entry(write_buffer *wb, wb_entry *e)
+{
+    wb->count--;
+    wb->bytes -= e->klen + e->dlen;
+    free(e->data);
+    free(e);
+}
+
+/*
+** Drop all the buffered writes.
+** @return void
+*/
+static void wb_clear(write_buffer *wb)
+{
+    size_t i;
+    for (i = 0; i < wb->nbuckets; i++) {
+        wb_entry *e = wb->buckets[i];
+        while (e != NULL) {
+            wb_entry *next = e->next;
+            wb_free_entry(wb, e);
+            e = next;
+        }
+        wb->buckets[i] = NULL;
+    }
+}
+
+/*
+** Write the buffered operations to the engine. Written entries leave the
+** buffer, on error the remaining ones stay buffered.
+** @param conn the connection
+** @return integer UnQLite result code
+*/
+static int wb_flush(conn_data *conn)
+{
+    write_buffer *wb = conn->wbuf;
+    unqlite *db = conn->unqlite_conn;
+    size_t i;
+    int res = UNQLITE_OK;
+    if (wb == NULL || wb->count == 0)
+        return UNQLITE_OK;
+    wb->flushes++;
+    for (i = 0; i < wb->nbuckets && res == UNQLITE_OK; i++) {
+        while (wb->buckets[i] != NULL) {
+            wb_entry *e = wb->buckets[i];
+            if (e->op == WB_STORE)
+                res = unqlite_kv_store(db, e->key, (int)e->klen, e->data, (unqlite_int64)e->dlen);
+            else if (e->op == WB_APPEND)
+                res = unqlite_kv_append(db, e->key, (int)e->klen, e->data, (unqlite_int64)e->dlen);
+            else if ((res = unqlite_kv_delete(db, e->key, (int)e->klen)) == UNQLITE_NOTFOUND)
+                res = UNQLITE_OK;
+            if (res != UNQLITE_OK)
+                break;
+            wb->buckets[i] = e->next;
+            wb->flushed++;
+            wb_free_entry(wb, e);
+        }
+    }
+    return res;
+}
+
+/*
+** Double the number of buckets.
+** @return void (the table is left as is if out of memory)
+*/
+static void wb_grow(write_buffer *wb)
+{
+    size_t i, n = wb->nbuckets * 2;
+    wb_entry **buckets = (wb_entry **)calloc(n, sizeof(wb_entry *));
+    if (buckets == NULL)
+        return;
+    for (i = 0; i < wb->nbuckets; i++) {
+        wb_entry *e = wb->buckets[i];
+        while (e != NULL) {
+            wb_entry *next = e->next;
+            e->next = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(wb->buckets);
+    wb->buckets = buckets;
+    wb->nbuckets = n;
+}
+
+/*
+** Buffer a write, coalescing it with the pending one on the same key:
+** a store or a delete replaces it, an append extends it.
+** @param conn the connection
+** @param op WB_STORE, WB_APPEND or WB_DELETE
+** @return integer UnQLite result code (UNQLITE_OK or UNQLITE_NOMEM)
+*/
+static int wb_put(conn_data *conn, int op, const char *key, size_t klen,
+                  const char *data, size_t dlen)
+{
+    write_buffer *wb = conn->wbuf;
+    unsigned int hash = kv_hash_fnv1a(key, (unsigned int)klen);
+    wb_entry *e = wb_find(wb, key, klen, hash);
+    int fresh = e == NULL, extend = 0;
+    size_t keep = 0;    /* bytes of the buffered data kept before data */
+
+    /* allocate first, a failed write leaves the buffer as it was */
+    if (fresh) {
+        e = (wb_entry *)malloc(sizeof(wb_entry) + klen);
+        if (e == NULL)
+            return UNQLITE_NOMEM;
+        memcpy(e->key, key, klen);
+        e->klen = klen;
+        e->hash = hash;
+        e->op = op;
+        e->data = NULL;
+        e->dlen = e->dsize = 0;
+    }
+    else if (op == WB_APPEND && e->op != WB_DELETE) {
+        extend = 1;             /* store + append = store, append + append = append */
+        keep = e->dlen;
+    }
+    if (keep + dlen > e->dsize) {
+        size_t size = keep + dlen < 2 * e->dsize ? 2 * e->dsize : keep + dlen;
+        char *p = (char *)realloc(e->data, size);
+        if (p == NULL) {
+            if (fresh)
+                free(e);
+            return UNQLITE_NOMEM;
+        }
+        e->data = p;
+        e->dsize = size;
+    }
+
+    if (fresh) {
+        e->next = wb->buckets[hash & (wb->nbuckets - 1)];
+        wb->buckets[hash & (wb->nbuckets - 1)] = e;
+        if (wb->count++ == 0 && wb->max_ms > 0)
+            wb->first_ms = now_ms();
+        wb->bytes += klen;
+        if (wb->count > wb->nbuckets * 2)
+            wb_grow(wb);
+    }
+    else {
+        wb->coalesced++;
+        if (!extend)
+            e->op = op == WB_APPEND ? WB_STORE : op;    /* delete + append = store */
+    }
+    wb->writes++;
+    if (dlen > 0)
+        memcpy(e->data + keep, data, dlen);
+    wb->bytes += keep + dlen - e->dlen;
+    e->dlen = keep + dlen;
+    return UNQLITE_OK;
+}
+
+/*
+** Flush the write buffer if it reached its size or time limit.
+** @return integer UnQLite result code
+*/
+static int wb_check(conn_data *conn)
+{
+    write_buffer *wb = conn->wbuf;
+    if (wb != NULL && (wb->bytes >= wb->max_bytes ||
+        (wb->max_ms > 0 && now_ms() - wb->first_ms >= wb->max_ms)))
+        return wb_flush(conn);
+    return UNQLITE_OK;
+}
+
+/*
+** Free the write buffer of a connection, dropping what it holds.
+** @return void
+*/
+static void wb_drop(conn_data *conn)
+{
+    if (conn->wbuf != NULL) {
+        wb_clear(conn->wbuf);
+        free(conn->wbuf->buckets);
+        free(conn->wbuf);
+        conn->wbuf = NULL;
+    }
+}
+
+/*
+** Value cache. When enabled, kvfetch keeps the strings it returns in an
+** LRU list bounded by a byte budget, so hot keys are served without
+** entering the engine nor copying the data again. Every write through the
+** connection drops the cached value of its key, a rollback drops them all.
+*/
+
+/* Bytes charged to the cache for an entry */
+#define VC_COST(e) (sizeof(vc_entry) + (e)->klen + (e)->vlen)
+
+/*
+** Find the cached entry of a key.
+** @return vc_entry* the entry or NULL
+*/
+static vc_entry *vc_find(value_cache *vc, const char *key, size_t klen, unsigned int hash)
+{
+    vc_entry *e = vc->buckets[hash & (vc->nbuckets - 1)];
+    for (; e != NULL; e = e->next)
+        if (e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0)
+            return e;
+    return NULL;
+}
+
+/*
+** Unlink an entry from the LRU list.
+** @return void
+*/
+static void vc_unlink(value_cache *vc, vc_entry *e)
+{
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        vc->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        vc->oldest = e->newer;
+}
+
+/*
+** Link an entry as the most recently used.
+** @return void
+*/
+static void vc_link(value_cache *vc, vc_entry *e)
+{
+    e->newer = NULL;
+    e->older = vc->newest;
+    if (vc->newest != NULL)
+        vc->newest->newer = e;
+    else
+        vc->oldest = e;
+    vc->newest = e;
+}
+
+/*
+** Remove an entry from the cache and free it.
+** @return void
+*/
+static void vc_remove(lua_State *L, value_cache *vc, vc_entry *e)
+{
+    vc_entry **pp = &vc->buckets[e->hash & (vc->nbuckets - 1)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    vc_unlink(vc, e);
+    vc->count--;
+    vc->bytes -= VC_COST(e);
+    luaL_unref(L, LUA_REGISTRYINDEX, e->ref);
+    free(e);
+}
+
+/*
+** Drop the least recently used entries until the cache fits in size bytes.
+** @return void
+*/
+static void vc_trim(lua_State *L, value_cache *vc, size_t size)
+{
+    while (vc->oldest != NULL && vc->bytes > size) {
+        vc_remove(L, vc, vc->oldest);
+        vc->evictions++;
+    }
+}
+
+/*
+** Drop all the cached values.
+** @return void
+*/
+static void vc_clear(lua_State *L, value_cache *vc)
+{
+    while (vc->oldest != NULL)
+        vc_remove(L, vc, vc->oldest);
+}
+
+/*
+** Drop the cached value of a key, if any.
+** @return void
+*/
+static void vc_forget(lua_State *L, conn_data *conn, const char *key, size_t klen)
+{
+    value_cache *vc = conn->vcache;
+    vc_entry *e;
+    if (vc == NULL || vc->count == 0)
+        return;
+    e = vc_find(vc, key, klen, kv_hash_fnv1a(key, (unsigned int)klen));
+    if (e != NULL) {
+        vc_remove(L, vc, e);
+        vc->invalidations++;
+    }
+}
+
+/*
+** Push the cached value of a key.
+** @return integer 1 if found (value pushed), 0 otherwise
+*/
+static int vc_get(lua_State *L, value_cache *vc, const char *key, size_t klen)
+{
+    vc_entry *e = vc_find(vc, key, klen, kv_hash_fnv1a(key, (unsigned int)klen));
+    if (e == NULL) {
+        vc->misses++;
+        return 0;
+    }
+    vc->hits++;
+    if (e != vc->newest) {
+        vc_unlink(vc, e);
+        vc_link(vc, e);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, e->ref);
+    return 1;
+}
+
+/*
+** Cache the value string on top of the stack (left there). Values over
+** a quarter of the budget are not cached, nor anything out of memory.
+** @return void
+*/
+static void vc_put(lua_State *L, value_cache *vc, const char *key, size_t klen)
+{
+    size_t vlen;
+    unsigned int hash = kv_hash_fnv1a(key, (unsigned int)klen);
+    vc_entry *e;
+    lua_tolstring(L, -1, &vlen);
+    if (sizeof(vc_entry) + klen + vlen > vc->max_bytes / 4)
+        return;
+    e = (vc_entry *)malloc(sizeof(vc_entry) + klen);
+    if (e == NULL)
+        return;
+    memcpy(e->key, key, klen);
+    e->klen = klen;
+    e->vlen = vlen;
+    e->hash = hash;
+    lua_pushvalue(L, -1);
+    e->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    e->next = vc->buckets[hash & (vc->nbuckets - 1)];
+    vc->buckets[hash & (vc->nbuckets - 1)] = e;
+    vc_link(vc, e);
+    vc->count++;
+    vc->bytes += VC_COST(e);
+    vc_trim(L, vc, vc->max_bytes);
+    if (vc->count > vc->nbuckets * 2) {
+        size_t i, n = vc->nbuckets * 2;
+        vc_entry **buckets = (vc_entry **)calloc(n, sizeof(vc_entry *));
+        if (buckets == NULL)
+            return;
+        for (i = 0; i < vc->nbuckets; i++) {
+            while ((e = vc->buckets[i]) != NULL) {
+                vc->buckets[i] = e->next;
+                e->next = buckets[e->hash & (n - 1)];
+                buckets[e->hash & (n - 1)] = e;
+            }
+        }
+        free(vc->buckets);
+        vc->buckets = buckets;
+        vc->nbuckets = n;
+    }
+}
+
+/*
+** Free the value cache of a connection.
+** @return void
+*/
+static void vc_drop(lua_State *L, conn_data *conn)
+{
+    if (conn->vcache != NULL) {
+        vc_clear(L, conn->vcache);
+        free(conn->vcache->buckets);
+        free(conn->vcache);
+        conn->vcache = NULL;
+    }
+}
+
+
+/*
+** Bloom filter. An optional per connection set of key hashes: a key it
+** does not hold is not in the database, so lookups of missing keys are
+** answered without entering the engine. Keys are added by the store
+** paths; deleted keys are left in (they only cost false positives). The
+** filter can be saved in a sidecar record on close and loaded back. Any
+** write through a connection first deletes the sidecar in the same
+** transaction, so a sidecar that survives is never behind the data.
+*/
+
+/* Sidecar header: "LBF1", hash count (4), bit count (8), key count (8) */
+#define BLOOM_HEADER 24
+
+/*
+** Store an unsigned integer in n little endian bytes.
+** @return void
+*/
+static void put_le(unsigned char *p, size_t v, int n)
+{
+    int i;
+    for (i = 0; i < n; i++, v >>= 8)
+        p[i] = (unsigned char)(v & 0xff);
+}
+
+/*
+** Read an unsigned integer of n little endian bytes.
+** @return size_t value
+*/
+static size_t get_le(const unsigned char *p, int n)
+{
+    size_t v = 0;
+    while (n-- > 0) {
+        if (n < (int)sizeof(size_t))
+            v = (v << 8) | p[n];
+    }
+    return v;
+}
+
+/*
+** Allocate an empty filter.
+** @return bloom_filter* the filter or NULL if out of memory
+*/
+static bloom_filter *bloom_new(size_t nbits, unsigned int nhash)
+{
+    bloom_filter *bf = (bloom_filter *)calloc(1, sizeof(bloom_filter));
+    nbits = (nbits + 7) & ~(size_t)7;
+    if (bf == NULL || (bf->data = (unsigned char *)calloc(1, BLOOM_HEADER + nbits / 8)) == NULL) {
+        free(bf);
+        return NULL;
+    }
+    bf->bits = bf->data + BLOOM_HEADER;
+    bf->nbits = nbits;
+    bf->nhash = nhash;
+    return bf;
+}
+
+/*
+** Size a filter for capacity keys at the false positive rate fpr: one hash
+** per halving of the rate and 1.44 bits per key and hash.
+** @return bloom_filter* the filter or NULL if out of memory
+*/
+static bloom_filter *bloom_sized(size_t capacity, double fpr)
+{
+    unsigned int nhash = 0;
+    double q = 1.0;
+    while (q > fpr && nhash < 30) {
+        q /= 2;
+        nhash++;
+    }
+    if (nhash == 0)
+        nhash = 1;
+    if (capacity < 64)
+        capacity = 64;
+    return bloom_new((size_t)(capacity * 1.44 * nhash), nhash);
+}
+
+/*
+** Free a filter.
+** @return void
+*/
+static void bloom_free(bloom_filter *bf)
+{
+    free(bf->data);
+    free(bf);
+}
+
+/*
+** Set or test the bits of a key, double hashing over FNV-1a and DJB2.
+** @param set 1 to add the key, 0 to test it
+** @return integer 1 if all the bits were set (before adding)
+*/
+static int bloom_bits(bloom_filter *bf, const char *key, size_t klen, int set)
+{
+    size_t h1 = kv_hash_fnv1a(key, (unsigned int)klen);
+    size_t h2 = kv_hash_djb2(key, (unsigned int)klen) | 1;
+    unsigned int i;
+    int all = 1;
+    for (i = 0; i < bf->nhash; i++) {
+        size_t bit = (h1 + i * h2) % bf->nbits;
+        unsigned char mask = (unsigned char)(1 << (bit & 7));
+        if (!(bf->bits[bit >> 3] & mask)) {
+            if (!set)
+                return 0;
+            all = 0;
+            bf->bits[bit >> 3] |= mask;
+        }
+    }
+    return all;
+}
+
+/*
+** Flag telling that the sidecar was deleted in the current transaction.
+** The connections of a shared handle share the transaction, so the flag
+** is the one of the handle.
+** @return short* the flag
+*/
+static short *sidecar_flag(conn_data *conn)
+{
+#ifndef LUANOSQL_OMIT_THREADS
+    if (conn->shared != NULL)
+        return &conn->shared->sidecar_gone;
+#endif
+    return &conn->sidecar_gone;
+}
+
+/*
+** Delete the sidecar record, once per transaction. The flag stays clear
+** if the delete fails, so the next write tries again.
+** @return void
+*/
+static void sidecar_delete(unqlite *db, short *gone)
+{
+    int res;
+    if (!*gone) {
+        res = unqlite_kv_delete(db, LUANOSQL_BLOOM_KEY, LUANOSQL_BLOOM_KEYLEN);
+        *gone = res == UNQLITE_OK || res == UNQLITE_NOTFOUND;
+    }
+}
+
+/*
+** Note a write through the connection: add the key to the filter and
+** delete the sidecar record once per transaction.
+** @param add 1 for stores and appends, 0 for deletes
+** @return void
+*/
+static void bloom_note(conn_data *conn, const char *key, size_t klen, int add)
+{
+    if (add && conn->bloom != NULL && !bloom_bits(conn->bloom, key, klen, 1))
+        conn->bloom->nkeys++;
+    sidecar_delete(conn->unqlite_conn, sidecar_flag(conn));
+}
+
+/*
+** Check a key against the filter, counting the answer.
+** @return integer 0 if the key is surely missing, 1 if it may exist
+*/
+static int bloom_maybe(conn_data *conn, const char *key, size_t klen)
+{
+    bloom_filter *bf = conn->bloom;
+    if (bf == NULL)
+        return 1;
+    if (!bloom_bits(bf, key, klen, 0)) {
+        bf->negatives++;
+        return 0;
+    }
+    bf->positives++;
+    return 1;
+}
+
+/*
+** Load the filter from the sidecar record.
+** @return bloom_filter* the filter, NULL if there is no valid sidecar
+*/
+static bloom_filter *bloom_load(conn_data *conn)
+{
+    scratch_buf *buf = &conn->fetch_buf;
+    const unsigned char *p;
+    bloom_filter *bf = NULL;
+    size_t nbits;
+    buf->len = 0;
+    if (unqlite_kv_fetch_callback(conn->unqlite_conn, LUANOSQL_BLOOM_KEY, LUANOSQL_BLOOM_KEYLEN,
+                                  scratch_consumer, buf) == UNQLITE_OK &&
+        buf->len > BLOOM_HEADER && memcmp(buf->data, "LBF1", 4) == 0) {
+        p = (const unsigned char *)buf->data;
+        nbits = get_le(p + 8, 8);
+        if (nbits % 8 == 0 && buf->len == BLOOM_HEADER + nbits / 8 && get_le(p + 4, 4) > 0 &&
+            (bf = bloom_new(nbits, (unsigned int)get_le(p + 4, 4))) != NULL) {
+            memcpy(bf->data, buf->data, buf->len);
+            bf->nkeys = get_le(p + 16, 8);
+        }
+    }
+    scratch_trim(buf);
+    return bf;
+}
+
+/*
+** Save the filter in the sidecar record.
+** @return integer UnQLite result code
+*/
+static int bloom_save(conn_data *conn)
+{
+    bloom_filter *bf = conn->bloom;
+    int res;
+    memcpy(bf->data, "LBF1", 4);
+    put_le(bf->data + 4, bf->nhash, 4);
+    put_le(bf->data + 8, bf->nbits, 8);
+    put_le(bf->data + 16, bf->nkeys, 8);
+    res = unqlite_kv_store(conn->unqlite_conn, LUANOSQL_BLOOM_KEY, LUANOSQL_BLOOM_KEYLEN,
+                           bf->data, (unqlite_int64)(BLOOM_HEADER + bf->nbits / 8));
+    if (res == UNQLITE_OK) {
+        *sidecar_flag(conn) = 0;
+        bf->dirty = 0;
+    }
+    return res;
+}
+
+/*
+** Build a filter from the keys of the database with one cursor scan. The
+** keys are collected first, so the filter is sized for the larger of
+** capacity and twice the keys found.
+** @param res receives the UnQLite result code
+** @return bloom_filter* the filter or NULL on error
+*/
+static bloom_filter *bloom_build(conn_data *conn, size_t capacity, double fpr, int *res)
+{
+    unqlite_kv_cursor *cursor;
+    scratch_buf *buf = &conn->fetch_buf;
+    scratch_buf keys = {NULL, 0, 0};    /* the scanned keys, length prefixed */
+    bloom_filter *bf = NULL;
+    size_t nkeys = 0, off, klen;
+    *res = unqlite_kv_cursor_init(conn->unqlite_conn, &cursor);
+    if (*res != UNQLITE_OK)
+        return NULL;
+    *res = unqlite_kv_cursor_first_entry(cursor);
+    if (*res == UNQLITE_DONE || *res == UNQLITE_EOF)
+        *res = UNQLITE_OK;
+    while (*res == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor)) {
+        buf->len = 0;
+        *res = unqlite_kv_cursor_key_callback(cursor, scratch_consumer, buf);
+        if (*res != UNQLITE_OK)
+            break;
+        if (!IS_RESERVED_KEY(buf->data, buf->len)) {
+            if (scratch_reserve(&keys, keys.len + sizeof(size_t) + buf->len) != 0) {
+                *res = UNQLITE_NOMEM;
+                break;
+            }
+            memcpy(keys.data + keys.len, &buf->len, sizeof(size_t));
+            memcpy(keys.data + keys.len + sizeof(size_t), buf->data, buf->len);
+            keys.len += sizeof(size_t) + buf->len;
+            nkeys++;
+        }
+        if (unqlite_kv_cursor_next_entry(cursor) != UNQLITE_OK)
+            break;
+    }
+    unqlite_kv_cursor_release(conn->unqlite_conn, cursor);
+    scratch_trim(buf);
+    if (*res == UNQLITE_OK) {
+        bf = bloom_sized(capacity > 2 * nkeys ? capacity : 2 * nkeys, fpr);
+        if (bf == NULL)
+            *res = UNQLITE_NOMEM;
+    }
+    for (off = 0; bf != NULL && off < keys.len; off += sizeof(size_t) + klen) {
+        memcpy(&klen, keys.data + off, sizeof(size_t));
+        bloom_bits(bf, keys.data + off + sizeof(size_t), klen, 1);
+    }
+    if (bf != NULL) {
+        bf->nkeys = nkeys;
+        bf->dirty = 1;
+    }
+    scratch_free(&keys);
+    return bf;
+}
+
+/*
+** Free the bloom filter of a connection, saving it first if persistent.
+** @return void
+*/
+static void bloom_drop(conn_data *conn, int save)
+{
+    if (conn->bloom != NULL) {
+        if (save && conn->bloom->persist && (conn->bloom->dirty || *sidecar_flag(conn)))
+            bloom_save(conn);
+        bloom_free(conn->bloom);
+        conn->bloom = NULL;
+    }
+}
+
+
+#ifndef LUANOSQL_OMIT_STATS
+/*
+** Operation statistics. Key/value primitives, cursor moves, commits and
+** JX9 program runs are counted; one in LUANOSQL_STATS_SAMPLE of them (all
+** the commits and program runs) is timed with the monotonic clock and
+** counted in a histogram of power of two microsecond buckets, reading the
+** clock costs as much as a cached fetch. Build with LUANOSQL_OMIT_STATS
+** to compile all of it out.
+*/
+
+static const char *const stats_names[] = {
+    "kvstore", "kvfetch", "kvappend", "kvdelete", "cursor", "commit", "vm_exec"
+};
+
+/*
+** Account an operation started at t0 (now_ms, 0 if not timed) with result
+** res. Not found and end of cursor results count as misses.
+** @return void
+*/
+static void stats_note(conn_data *conn, int op, double t0, int res, size_t bytes)
+{
+    op_stats *st = &conn->stats[op];
+    st->count++;
+    st->bytes += bytes;
+    if (t0 != 0) {
+        double dt = now_ms() - t0;
+        unsigned long us = (unsigned long)(dt * 1000.0);
+        int b = 0;
+        while (us != 0 && b < STATS_BUCKETS - 1) {
+            us >>= 1;
+            b++;
+        }
+        st->hist[b]++;
+        st->timed++;
+        st->total_ms += dt;
+        if (dt > st->max_ms)
+            st->max_ms = dt;
+    }
+    if (res == UNQLITE_NOTFOUND || res == UNQLITE_DONE || res == UNQLITE_EOF)
+        st->misses++;
+    else if (res != UNQLITE_OK)
+        st->errors++;
+}
+
+#define STATS_START(conn, op) \
+    (((conn)->stats[op].count & (LUANOSQL_STATS_SAMPLE - 1)) ? 0.0 : now_ms())
+#define STATS_CALL(conn, op, res, call, bytes) \
+    do { double stats_t0 = STATS_START(conn, op); (res) = (call); stats_note((conn), (op), stats_t0, (res), (bytes)); } while (0)
+#define STATS_TIMED(conn, op, res, call, bytes) \
+    do { double stats_t0 = now_ms(); (res) = (call); stats_note((conn), (op), stats_t0, (res), (bytes)); } while (0)
+#define STATS_NOTE(conn, op, t0, res, bytes) stats_note((conn), (op), (t0), (res), (bytes))
+#else
+#define STATS_CALL(conn, op, res, call, bytes) ((res) = (call))
+#define STATS_TIMED(conn, op, res, call, bytes) ((res) = (call))
+#define STATS_NOTE(conn, op, t0, res, bytes) ((void)0)
+#endif /* LUANOSQL_OMIT_STATS */
+
+
+/*
+** Check for valid cursor, flushing the write buffer of its connection.
+** @param L the lua state
+** @return cur_data a valid cur_data structure / cursor
+*/
+static cur_data *getcursor(lua_State *L) {
+    cur_data *cur = checkcursor(L, 1);
+    luaL_argcheck(L, cur != NULL, 1, LUANOSQL_PREFIX"cursor expected");
+    luaL_argcheck(L, !cur->closed, 1, LUANOSQL_PREFIX"cursor is closed");
+    check_not_extracting(L, cur->conn_data);
+    /* cursors read the engine, hand it the buffered writes first */
+    if (cur->conn_data->wbuf != NULL && wb_flush(cur->conn_data) != UNQLITE_OK)
+        luaL_error(L, LUANOSQL_PREFIX"cannot flush the write buffer");
+    return cur;
+}
+
+/*
+** Value compression. An optional per connection codec: values of at least
+** threshold bytes are compressed with a small LZ77 coder (LZ4 block
+** layout) when that makes them smaller. A stored value starting with the
+** tag byte CODEC_TAG (never the first byte of UTF-8 text) is followed by
+** a method byte: CODEC_LZ, the original length (varint) and the
+** compressed data, or CODEC_RAW and the value itself, for raw values
+** that happen to start with the tag. Other values are stored as they
+** are, so data written before the codec was enabled stays readable
+** unless it starts with the tag and one of the method bytes.
+** The first encoded value stores the marker record LUANOSQL_CODEC_KEY.
+** From then on every connection of the database decodes tagged values
+** and escapes raw values starting with the tag, compression enabled or
+** not, so that its connections can mix them; a database without the
+** marker keeps its values as they are. The marker is looked up when a
+** tagged value is met, and kept once found. Bytes appended raw to a
+** compressed value follow its compressed data and are decoded as they are.
+*/
+
+#define CODEC_TAG 0xf5
+#define CODEC_RAW 0
+#define CODEC_LZ  1
+
+/* Default threshold of conn:compression, in bytes */
+#ifndef LUANOSQL_CODEC_THRESHOLD
+#define LUANOSQL_CODEC_THRESHOLD 64
+#endif
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5
+
+#define IS_ENCODED(d, n) ((n) >= 2 && ((const unsigned char *)(d))[0] == CODEC_TAG)
+#define CODEC_ON(conn) ((conn)->codec != NULL && (conn)->codec->enabled)
+
+/*
+** Worst case size of the LZ coder output.
+** @return size_t bytes
+*/
+static size_t lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static unsigned int lz_read32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) |
+           ((unsigned int)p[3] << 24);
+}
+
+/* Write a length beyond its 4 bit token field */
+static unsigned char *lz_put_length(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*
+** Compress n bytes of src to dst (lz_bound(n) bytes).
+** @return size_t compressed length
+*/
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst)
+{
+    size_t table[1 << LZ_HASH_BITS];
+    size_t i = 0, anchor = 0, cand, lit, mlen;
+    size_t limit = n > LZ_LAST_LITERALS + LZ_MIN_MATCH ? n - LZ_LAST_LITERALS - LZ_MIN_MATCH : 0;
+    unsigned char *op = dst, *token;
+    unsigned int seq, h;
+    memset(table, 0, sizeof(table));
+    while (i < limit) {
+        seq = lz_read32(src + i);
+        h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        cand = table[h];
+        table[h] = i;
+        if (cand >= i || i - cand > LZ_MAX_OFFSET || lz_read32(src + cand) != seq) {
+            i++;
+            continue;
+        }
+        mlen = LZ_MIN_MATCH;
+        while (i + mlen < n - LZ_LAST_LITERALS && src[cand + mlen] == src[i + mlen])
+            mlen++;
+        lit = i - anchor;
+        token = op++;
+        *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15)
+            op = lz_put_length(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (unsigned char)((i - cand) & 0xff);
+        *op++ = (unsigned char)((i - cand) >> 8);
+        *token |= (unsigned char)(mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15);
+        if (mlen - LZ_MIN_MATCH >= 15)
+            op = lz_put_length(op, mlen - LZ_MIN_MATCH - 15);
+        i += mlen;
+        anchor = i;
+    }
+    lit = n - anchor;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = lz_put_length(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    return (size_t)(op + lit - dst);
+}
+
+/*
+** Decompress src into exactly dn bytes of dst. The compressed data ends
+** with the literals that complete the dn bytes, bytes after them were
+** appended raw to the stored value.
+** @param used set to the length of the compressed data
+** @return integer 0 if ok, -1 if the input is corrupt
+*/
+static int lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t dn,
+                         size_t *used)
+{
+    size_t ip = 0, op = 0, lit, mlen, off;
+    unsigned char b;
+    while (ip < n) {
+        b = src[ip++];
+        lit = b >> 4;
+        mlen = b & 15;
+        if (lit == 15) {
+            do {
+                if (ip >= n)
+                    return -1;
+                lit += src[ip];
+            } while (src[ip++] == 255);
+        }
+        if (lit > n - ip || lit > dn - op)
+            return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (op == dn)
+            break;      /* the last sequence has no match */
+        if (n - ip < 2)
+            return -1;
+        off = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (mlen == 15) {
+            do {
+                if (ip >= n)
+                    return -1;
+                mlen += src[ip];
+            } while (src[ip++] == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > op || mlen > dn - op)
+            return -1;
+        if (off >= mlen)
+            memcpy(dst + op, dst + op - off, mlen);
+        else {
+            for (; mlen > 0; mlen--, op++)
+                dst[op] = dst[op - off];
+            continue;
+        }
+        op += mlen;
+    }
+    *used = ip;
+    return op == dn ? 0 : -1;
+}
+
+/*
+** Encode a value for storage.
+** @param conn the connection, with a codec
+** @param data the value
+** @param dlen its length
+** @param olen set to the length of the bytes to store
+** @return the bytes to store (data itself or the codec buffer), NULL if
+** out of memory
+*/
+static const char *codec_encode(conn_data *conn, const char *data, size_t dlen, size_t *olen)
+{
+    value_codec *vc = conn->codec;
+    scratch_buf *out = &vc->tmp;
+    unsigned char *p;
+    size_t n, len;
+    double t0;
+    *olen = dlen;
+    if (!vc->enabled || dlen < vc->threshold) {
+        if (dlen == 0 || (unsigned char)data[0] != CODEC_TAG)
+            return data;
+    }
+    else {
+        t0 = now_ms();
+        if (scratch_reserve(out, lz_bound(dlen) + 12) != 0)
+            return NULL;
+        p = (unsigned char *)out->data;
+        p[0] = CODEC_TAG;
+        p[1] = CODEC_LZ;
+        n = 2;
+        for (len = dlen; len >= 0x80; len >>= 7)
+            p[n++] = (unsigned char)(len | 0x80);
+        p[n++] = (unsigned char)len;
+        n += lz_compress((const unsigned char *)data, dlen, p + n);
+        vc->encoded++;
+        vc->in_bytes += (double)dlen;
+        vc->encode_ms += now_ms() - t0;
+        if (n < dlen) {
+            vc->compressed++;
+            vc->out_bytes += (double)n;
+            *olen = n;
+            return out->data;
+        }
+        vc->out_bytes += (double)dlen;
+        if ((unsigned char)data[0] != CODEC_TAG)
+            return data;
+    }
+    /* a raw value starting with the tag is escaped */
+    if (scratch_reserve(out, dlen + 2) != 0)
+        return NULL;
+    out->data[0] = (char)CODEC_TAG;
+    out->data[1] = CODEC_RAW;
+    memcpy(out->data + 2, data, dlen);
+    *olen = dlen + 2;
+    return out->data;
+}
+
+/*
+** Decode a stored value in place.
+** @param vc the codec, for its buffer and counters
+** @param buf the stored value, replaced by the value
+** @return integer UNQLITE_OK, UNQLITE_ABORT if out of memory or
+** UNQLITE_CORRUPT if the value cannot be decoded
+*/
+static int value_decode(value_codec *vc, scratch_buf *buf)
+{
+    const unsigned char *p = (const unsigned char *)buf->data;
+    size_t n = 2, len = 0, used = 0;
+    scratch_buf swap;
+    double t0;
+    int shift;
+    if (!IS_ENCODED(buf->data, buf->len))
+        return UNQLITE_OK;
+    if (p[1] == CODEC_RAW) {
+        memmove(buf->data, buf->data + 2, buf->len - 2);
+        buf->len -= 2;
+        return UNQLITE_OK;
+    }
+    if (p[1] != CODEC_LZ)
+        return UNQLITE_OK;      /* a raw value written without the codec */
+    t0 = now_ms();
+    for (shift = 0; n < buf->len && shift < (int)sizeof(size_t) * 8; shift += 7) {
+        len |= (size_t)(p[n] & 0x7f) << shift;
+        if (!(p[n++] & 0x80))
+            break;
+    }
+    /* a compressed byte expands to 255 bytes at most */
+    if ((n >= buf->len && len > 0) || len / 255 > buf->len - n)
+        return UNQLITE_CORRUPT;
+    if (scratch_reserve(&vc->tmp, len + (buf->len - n)) != 0)
+        return UNQLITE_ABORT;
+    if (lz_decompress(p + n, buf->len - n, (unsigned char *)vc->tmp.data, len, &used) != 0)
+        return UNQLITE_CORRUPT;
+    /* then the bytes appended raw */
+    memcpy(vc->tmp.data + len, p + n + used, buf->len - n - used);
+    vc->tmp.len = len + (buf->len - n - used);
+    swap = *buf;
+    *buf = vc->tmp;
+    vc->tmp = swap;
+    vc->tmp.len = 0;
+    vc->decoded++;
+    vc->decode_ms += now_ms() - t0;
+    return UNQLITE_OK;
+}
+
+/*
+** Get the codec of a connection, created on first use: it decodes values
+** whether compression is enabled or not.
+** @return value_codec* the codec, NULL if out of memory
+*/
+static value_codec *codec_get(conn_data *conn)
+{
+    if (conn->codec == NULL)
+        conn->codec = (value_codec *)calloc(1, sizeof(value_codec));
+    return conn->codec;
+}
+
+/*
+** Tell whether a database has the codec marker.
+** @return integer 1 if it has, 0 otherwise
+*/
+static int codec_marked(unqlite *db)
+{
+    unqlite_int64 n = 0;
+    return unqlite_kv_fetch(db, LUANOSQL_CODEC_KEY, LUANOSQL_CODEC_KEYLEN, NULL, &n) == UNQLITE_OK;
+}
+
+/*
+** Tell whether the values of the connection's database are encoded.
+** @return integer 1 if they are, 0 otherwise
+*/
+static int codec_active(conn_data *conn)
+{
+    if (!conn->codec_seen)
+        conn->codec_seen = (short)codec_marked(conn->unqlite_conn);
+    return conn->codec_seen;
+}
+
+/*
+** Store the codec marker before the first encoded value of a database.
+** @return integer UnQLite result code
+*/
+static int codec_mark(conn_data *conn)
+{
+    int res;
+    if (codec_active(conn))
+        return UNQLITE_OK;
+    res = unqlite_kv_store(conn->unqlite_conn, LUANOSQL_CODEC_KEY, LUANOSQL_CODEC_KEYLEN, "\1", 1);
+    conn->codec_seen = res == UNQLITE_OK;
+    return res;
+}
+
+/*
+** Decode a stored value in place with the codec of the connection.
+** @return integer UnQLite result code, as value_decode
+*/
+static int codec_decode(conn_data *conn, scratch_buf *buf)
+{
+    if (!IS_ENCODED(buf->data, buf->len) || !codec_active(conn))
+        return UNQLITE_OK;
+    if (codec_get(conn) == NULL)
+        return UNQLITE_ABORT;
+    return value_decode(conn->codec, buf);
+}
+
+/* Consumer wrapper decoding a value before handing it to a consumer */
+typedef struct
+{
+    conn_data    *conn;
+    int          (*xConsumer)(const void *, unsigned int, void *);
+    void         *ud;
+    int          collect;              /**< the value is encoded, gathered in buf */
+    int          started;              /**< first non empty chunk seen */
+    scratch_buf  buf;
+} codec_stream;
+
+/*
+** UnQLite data consumer: raw values are passed through as they come,
+** encoded ones are gathered and decoded by codec_stream_finish.
+** @return integer consumer result code
+*/
+static int codec_stream_consumer(const void *pData, unsigned int iDataLen, void *pUserData)
+{
+    codec_stream *cs = (codec_stream *)pUserData;
+    if (!cs->started && iDataLen > 0) {
+        cs->started = 1;
+        cs->collect = ((const unsigned char *)pData)[0] == CODEC_TAG;
+    }
+    if (cs->collect)
+        return scratch_consumer(pData, iDataLen, &cs->buf);
+    return cs->xConsumer(pData, iDataLen, cs->ud);
+}
+
+/*
+** Hand a gathered value, decoded, to the consumer and free the buffer.
+** @param res result code of the engine call
+** @return integer UnQLite result code
+*/
+static int codec_stream_finish(codec_stream *cs, int res)
+{
+    if (res == UNQLITE_OK && cs->collect) {
+        res = codec_decode(cs->conn, &cs->buf);
+        if (res == UNQLITE_OK && cs->xConsumer != NULL &&
+            cs->xConsumer(cs->buf.data, (unsigned int)cs->buf.len, cs->ud) != UNQLITE_OK)
+            res = UNQLITE_ABORT;
+    }
+    scratch_free(&cs->buf);
+    return res;
+}
+
+/*
+** Free the codec of a connection.
+** @return void
+*/
+static void codec_drop(conn_data *conn)
+{
+    if (conn->codec != NULL) {
+        scratch_free(&conn->codec->tmp);
+        free(conn->codec);
+        conn->codec = NULL;
+    }
+}
+
+/*
+** Typed keys. An integer key or a tuple key (an array of integers and
+** strings, such as {tenant, ts, id}) is encoded into bytes that sort like
+** the values: each element is a tag byte followed by
+**   integer: 8 bytes big-endian with the sign bit flipped
+**   string:  the bytes with 0x00 escaped as 0x00 0xff, then 0x00
+** Elements are self-delimiting, so a shorter tuple is a prefix of the
+** longer ones and sorts before them. An integer key n and the tuple {n}
+** are the same key. String keys are stored as they are.
+*/
+
+#define TKEY_STR 0x02
+#define TKEY_INT 0x15
+
+/* Key buffers of a connection: the key argument and the upper range bound */
+#define KEY_ARG 0
+#define KEY_HI  1
+
+/*
+** Get the value at idx as a 64 bit integer.
+** @return integer 1 if it is an integral number in range, 0 otherwise
+*/
+static int tkey_int(lua_State *L, int idx, unqlite_int64 *v)
+{
+    lua_Number d;
+    if (lua_type(L, idx) != LUA_TNUMBER)
+        return 0;
+    d = lua_tonumber(L, idx);
+    if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0) || (lua_Number)(unqlite_int64)d != d)
+        return 0;
+    *v = (unqlite_int64)d;
+    return 1;
+}
+
+/*
+** Append a string tuple element to buf.
+** @return integer 0 if ok, -2 if out of memory
+*/
+static int tkey_put_str(scratch_buf *buf, const char *s, size_t n)
+{
+    unsigned char *p;
+    size_t i;
+    if (scratch_reserve(buf, buf->len + 2 * n + 2) != 0)
+        return -2;
+    p = (unsigned char *)buf->data + buf->len;
+    *p++ = TKEY_STR;
+    for (i = 0; i < n; i++) {
+        *p++ = (unsigned char)s[i];
+        if (s[i] == '\0')
+            *p++ = 0xff;
+    }
+    *p++ = 0;
+    buf->len = (char *)p - buf->data;
+    return 0;
+}
+
+/*
+** Append one tuple element (the value at idx) to buf.
+** @return integer 0 if ok, -1 for an invalid element, -2 if out of memory
+*/
+static int tkey_put(lua_State *L, int idx, scratch_buf *buf)
+{
+    unqlite_int64 v;
+    size_t i, n;
+    const char *s;
+    unsigned char *p;
+    if (tkey_int(L, idx, &v)) {
+        unsigned long long u = (unsigned long long)v ^ 0x8000000000000000ULL;
+        if (scratch_reserve(buf, buf->len + 9) != 0)
+            return -2;
+        p = (unsigned char *)buf->data + buf->len;
+        p[0] = TKEY_INT;
+        for (i = 8; i > 0; i--, u >>= 8)
+            p[i] = (unsigned char)(u & 0xff);
+        buf->len += 9;
+        return 0;
+    }
+    if (lua_type(L, idx) != LUA_TSTRING)
+        return -1;
+    s = lua_tolstring(L, idx, &n);
+    return tkey_put_str(buf, s, n);
+}
+
+/*
+** Get the key at idx as bytes. A string is used as it is. With the
+** typed_keys connect option an integer or a tuple is encoded into
+** conn->key_buf[slot] and the result stays valid until the next key
+** encoded in that slot; otherwise a number is converted in place to its
+** string form, as lua_tolstring does.
+** @param L the lua state
+** @param idx stack index of the key
+** @param conn the connection
+** @param slot KEY_ARG or KEY_HI
+** @param len receives the key length
+** @param errmsg receives the error message on failure
+** @return const char* the key, or NULL on failure
+*/
+static const char *key_get(lua_State *L, int idx, conn_data *conn, int slot, size_t *len,
+                           const char **errmsg)
+{
+    scratch_buf *buf = &conn->key_buf[slot];
+    int res = 0, i, n;
+    if (lua_type(L, idx) == LUA_TSTRING || (!conn->typed_keys && lua_isstring(L, idx)))
+        return lua_tolstring(L, idx, len);
+    if (!conn->typed_keys) {
+        *errmsg = "key must be a string";
+        return NULL;
+    }
+    buf->len = 0;
+    if (lua_istable(L, idx)) {
+        n = (int)lua_objlen(L, idx);
+        if (n == 0)
+            res = -1;
+        for (i = 1; i <= n && res == 0; i++) {
+            lua_rawgeti(L, idx, i);
+            res = tkey_put(L, -1, buf);
+            lua_pop(L, 1);
+        }
+    }
+    else
+        res = tkey_put(L, idx, buf);
+    if (res != 0) {
+        *errmsg = res == -2 ? "Cannot allocate buffer" : "key must be a string, an integer or a tuple";
+        return NULL;
+    }
+    *len = buf->len;
+    return buf->data;
+}
+
+/*
+** Get the key argument at idx as bytes, as key_get. Raises an error
+** for an invalid key.
+** @return const char* the key
+*/
+static const char *key_check(lua_State *L, int idx, conn_data *conn, int slot, size_t *len)
+{
+    const char *errmsg;
+    const char *key = key_get(L, idx, conn, slot, len, &errmsg);
+    if (key == NULL)
+        luaL_argerror(L, idx, errmsg);
+    return key;
+}
+
+/*
+** Skip one encoded tuple element.
+** @return const unsigned char* the next element, or NULL if invalid
+*/
+static const unsigned char *tkey_next(const unsigned char *p, const unsigned char *end)
+{
+    if (*p == TKEY_INT)
+        return end - p >= 9 ? p + 9 : NULL;
+    if (*p != TKEY_STR)
+        return NULL;
+    for (p++; p < end; p++) {
+        if (*p == 0) {
+            if (p + 1 == end || p[1] != 0xff)
+                return p + 1;
+            p++;
+        }
+    }
+    return NULL;
+}
+
+/*
+** Push one encoded tuple element, already checked by tkey_next.
+** @return const unsigned char* the next element
+*/
+static const unsigned char *tkey_push(lua_State *L, const unsigned char *p, const unsigned char *end)
+{
+    unsigned long long u = 0;
+    luaL_Buffer b;
+    int i;
+    if (*p++ == TKEY_INT) {
+        for (i = 0; i < 8; i++)
+            u = (u << 8) | *p++;
+        lua_pushnumber(L, (lua_Number)(unqlite_int64)(u ^ 0x8000000000000000ULL));
+        return p;
+    }
+    luaL_buffinit(L, &b);
+    for (; p[0] != 0 || (p + 1 < end && p[1] == 0xff); p++) {
+        luaL_addchar(&b, (char)*p);
+        if (*p == 0)
+            p++;
+    }
+    luaL_pushresult(&b);
+    return p + 1;
+}
+
+/*
+** Push a key decoded back into a Lua value: the integer for an integer
+** key, the tuple table for any other typed key, the key bytes as a string
+** when they are not a typed key. Integers beyond 2^53 lose precision as
+** Lua numbers.
+** @param L the lua state
+** @param key the key bytes
+** @param len the key length
+** @return void
+*/
+static void key_push(lua_State *L, const char *key, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)key, *end = p + len;
+    int i, n = 0;
+    while (p != NULL && p < end) {
+        p = tkey_next(p, end);
+        n++;
+    }
+    if (p == NULL || n == 0) {
+        lua_pushlstring(L, key, len);
+        return;
+    }
+    p = (const unsigned char *)key;
+    if (n == 1 && *p == TKEY_INT) {
+        tkey_push(L, p, end);
+        return;
+    }
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; i++) {
+        p = tkey_push(L, p, end);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+/*
+** Table serialization. conn:put_table and conn:get_table store Lua values
+** as MessagePack (nil, booleans, numbers, strings and nested tables), so
+** the records can be read by any MessagePack implementation. A table
+** whose keys are exactly 1..n is written as an array, any other as a map.
+** Encoding writes into the connection buffer handed to the store path,
+** decoding builds the tables straight from the fetch buffer.
+*/
+
+/* Nesting limit of serialized tables (cycles end here too) */
+#ifndef LUANOSQL_MP_DEPTH
+#define LUANOSQL_MP_DEPTH 100
+#endif
+
+/*
+** Append a type byte followed by v on n big endian bytes.
+** @return integer 0 if ok, -1 if out of memory
+*/
+static int mp_put(scratch_buf *buf, int type, unqlite_int64 v, int n)
+{
+    unsigned char p[9];
+    int i;
+    p[0] = (unsigned char)type;
+    for (i = n; i > 0; i--, v >>= 8)
+        p[i] = (unsigned char)(v & 0xff);
+    return scratch_consumer(p, (unsigned int)n + 1, buf) == UNQLITE_OK ? 0 : -1;
+}
+
+/*
+** Append a length prefixed header: fix form below fixmax, then 8, 16 or
+** 32 bit forms (t8 is 0 when the type has no 8 bit form).
+** @return integer 0 if ok, -1 if out of memory
+*/
+static int mp_put_len(scratch_buf *buf, size_t n, int fix, size_t fixmax, int t8, int t16, int t32)
+{
+    if (n < fixmax)
+        return mp_put(buf, fix | (int)n, 0, 0);
+    if (t8 && n <= 0xff)
+        return mp_put(buf, t8, (unqlite_int64)n, 1);
+    if (n <= 0xffff)
+        return mp_put(buf, t16, (unqlite_int64)n, 2);
+    return mp_put(buf, t32, (unqlite_int64)n, 4);
+}
+
+/*
+** Append the MessagePack form of a number.
+** @return integer 0 if ok, -1 if out of memory
+*/
+static int mp_put_number(scratch_buf *buf, lua_Number d)
+{
+    unqlite_int64 i;
+    union { double d; unqlite_int64 i; } u;
+    if (d >= -9223372036854775808.0 && d < 9223372036854775808.0 && (lua_Number)(i = (unqlite_int64)d) == d) {
+        if (i >= 0) {
+            if (i < 128) return mp_put(buf, (int)i, 0, 0);
+            if (i <= 0xff) return mp_put(buf, 0xcc, i, 1);
+            if (i <= 0xffff) return mp_put(buf, 0xcd, i, 2);
+            if (i <= 0xffffffffLL) return mp_put(buf, 0xce, i, 4);
+            return mp_put(buf, 0xcf, i, 8);
+        }
+        if (i >= -32) return mp_put(buf, (int)(i & 0xff), 0, 0);
+        if (i >= -128) return mp_put(buf, 0xd0, i, 1);
+        if (i >= -32768) return mp_put(buf, 0xd1, i, 2);
+        if (i >= -2147483647LL - 1) return mp_put(buf, 0xd2, i, 4);
+        return mp_put(buf, 0xd3, i, 8);
+    }
+    u.d = (double)d;
+    return mp_put(buf, 0xcb, u.i, 8);
+}
+
+/*
+** Length of a table when its keys are exactly 1..n, -1 otherwise.
+** @return integer n or -1
+*/
+static int mp_array_len(lua_State *L, int idx)
+{
+    size_t n = lua_objlen(L, idx), count = 0;
+    lua_Number k;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pop(L, 1);
+        k = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : 0;
+        if (k < 1 || k > (lua_Number)n || (lua_Number)(size_t)k != k || ++count > n) {
+            lua_pop(L, 1);
+            return -1;
+        }
+    }
+    return (int)n;
+}
+
+/*
+** Append the MessagePack form of the value at idx (a Lua error for the
+** types that cannot be serialized).
+** @return integer 0 if ok, -1 if out of memory
+*/
+static int mp_encode(lua_State *L, int idx, scratch_buf *buf, int depth)
+{
+    const char *s;
+    size_t len;
+    int n, i;
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            return mp_put(buf, 0xc0, 0, 0);
+        case LUA_TBOOLEAN:
+            return mp_put(buf, lua_toboolean(L, idx) ? 0xc3 : 0xc2, 0, 0);
+        case LUA_TNUMBER:
+            return mp_put_number(buf, lua_tonumber(L, idx));
+        case LUA_TSTRING:
+            s = lua_tolstring(L, idx, &len);
+            if (mp_put_len(buf, len, 0xa0, 32, 0xd9, 0xda, 0xdb) != 0)
+                return -1;
+            return scratch_consumer(s, (unsigned int)len, buf) == UNQLITE_OK ? 0 : -1;
+        case LUA_TTABLE:
+            if (depth >= LUANOSQL_MP_DEPTH)
+                luaL_error(L, LUANOSQL_PREFIX"table nested too deep (or a cycle)");
+            luaL_checkstack(L, 3, "table nested too deep");
+            if (idx < 0)
+                idx = lua_gettop(L) + idx + 1;
+            n = mp_array_len(L, idx);
+            if (n >= 0) {
+                if (mp_put_len(buf, (size_t)n, 0x90, 16, 0, 0xdc, 0xdd) != 0)
+                    return -1;
+                for (i = 1; i <= n; i++) {
+                    lua_rawgeti(L, idx, i);
+                    if (mp_encode(L, -1, buf, depth + 1) != 0)
+                        return -1;
+                    lua_pop(L, 1);
+                }
+                return 0;
+            }
+            for (n = 0, lua_pushnil(L); lua_next(L, idx) != 0; n++)
+                lua_pop(L, 1);
+            if (mp_put_len(buf, (size_t)n, 0x80, 16, 0, 0xde, 0xdf) != 0)
+                return -1;
+            lua_pushnil(L);
+            while (lua_next(L, idx) != 0) {
+                if (mp_encode(L, -2, buf, depth + 1) != 0 || mp_encode(L, -1, buf, depth + 1) != 0)
+                    return -1;
+                lua_pop(L, 1);
+            }
+            return 0;
+        default:
+            return luaL_error(L, LUANOSQL_PREFIX"cannot serialize a %s value", luaL_typename(L, idx));
+    }
+}
+
+/*
+** Read n big endian bytes at *p, advancing it.
+** @return unqlite_int64 the value, as unsigned bits
+*/
+static unqlite_int64 mp_get(const unsigned char **p, int n)
+{
+    unqlite_int64 v = 0;
+    while (n-- > 0)
+        v = (v << 8) | *(*p)++;
+    return v;
+}
+
+/*
+** Decode one MessagePack value and push it.
+** @param p start of the value, advanced past it
+** @param end end of the data
+** @return integer 0 if ok, -1 if the data is invalid
+*/
+static int mp_decode(lua_State *L, const unsigned char **p, const unsigned char *end, int depth)
+{
+    static const signed char sizes[] = {
+        /* 0xc0 .. 0xdf: payload bytes after the type byte (-1: invalid) */
+        0, -1, 0, 0, 1, 2, 4, 1, 2, 4, 4, 8, 1, 2, 4, 8,
+        1, 2, 4, 8, 2, 3, 5, 9, 17, 1, 2, 4, 2, 4, 2, 4
+    };
+    union { float f; unsigned int i; } f;
+    union { double d; unqlite_int64 i; } d;
+    size_t n, i;
+    int t, map;
+    if (*p >= end)
+        return -1;
+    t = *(*p)++;
+    if (t < 0x80) {
+        lua_pushnumber(L, t);
+        return 0;
+    }
+    if (t >= 0xe0) {
+        lua_pushnumber(L, t - 256);
+        return 0;
+    }
+    if (t < 0xc0) {
+        n = (size_t)(t & (t < 0xa0 ? 0x0f : 0x1f));
+        map = t < 0x90;
+        if (t >= 0xa0)
+            goto string;
+        goto table;
+    }
+    if (sizes[t - 0xc0] < 0 || end - *p < sizes[t - 0xc0])
+        return -1;
+    switch (t) {
+        case 0xc0: lua_pushnil(L); return 0;
+        case 0xc2: lua_pushboolean(L, 0); return 0;
+        case 0xc3: lua_pushboolean(L, 1); return 0;
+        case 0xc4: case 0xd9: n = (size_t)mp_get(p, 1); goto string;
+        case 0xc5: case 0xda: n = (size_t)mp_get(p, 2); goto string;
+        case 0xc6: case 0xdb: n = (size_t)mp_get(p, 4); goto string;
+        case 0xca:
+            f.i = (unsigned int)mp_get(p, 4);
+            lua_pushnumber(L, (lua_Number)f.f);
+            return 0;
+        case 0xcb:
+            d.i = mp_get(p, 8);
+            lua_pushnumber(L, (lua_Number)d.d);
+            return 0;
+        case 0xcc: lua_pushnumber(L, (lua_Number)mp_get(p, 1)); return 0;
+        case 0xcd: lua_pushnumber(L, (lua_Number)mp_get(p, 2)); return 0;
+        case 0xce: lua_pushnumber(L, (lua_Number)mp_get(p, 4)); return 0;
+        case 0xcf: lua_pushnumber(L, (lua_Number)(unsigned long long)mp_get(p, 8)); return 0;
+        case 0xd0: lua_pushnumber(L, (lua_Number)(signed char)mp_get(p, 1)); return 0;
+        case 0xd1: lua_pushnumber(L, (lua_Number)(short)mp_get(p, 2)); return 0;
+        case 0xd2: lua_pushnumber(L, (lua_Number)(int)mp_get(p, 4)); return 0;
+        case 0xd3: lua_pushnumber(L, (lua_Number)mp_get(p, 8)); return 0;
+        case 0xdc: n = (size_t)mp_get(p, 2); map = 0; goto table;
+        case 0xdd: n = (size_t)mp_get(p, 4); map = 0; goto table;
+        case 0xde: n = (size_t)mp_get(p, 2); map = 1; goto table;
+        case 0xdf: n = (size_t)mp_get(p, 4); map = 1; goto table;
+        default: return -1;     /* extension types */
+    }
+string:
+    if ((size_t)(end - *p) < n)
+        return -1;
+    lua_pushlstring(L, (const char *)*p, n);
+    *p += n;
+    return 0;
+table:
+    /* every element takes a byte at least */
+    if (depth >= LUANOSQL_MP_DEPTH || (size_t)(end - *p) < n || !lua_checkstack(L, 4))
+        return -1;
+    lua_createtable(L, map ? 0 : (int)n, map ? (int)n : 0);
+    for (i = 1; i <= n; i++) {
+        if (map) {
+            if (mp_decode(L, p, end, depth + 1) != 0 || mp_decode(L, p, end, depth + 1) != 0)
+                return -1;
+            if (lua_isnil(L, -2) || (lua_isnumber(L, -2) && lua_tonumber(L, -2) != lua_tonumber(L, -2)))
+                return -1;
+            lua_rawset(L, -3);
+        }
+        else {
+            if (mp_decode(L, p, end, depth + 1) != 0)
+                return -1;
+            lua_rawseti(L, -2, (int)i);
+        }
+    }
+    return 0;
+}
+
+/*
+** Decode a whole record from buf and push it, or push nothing.
+** @return integer 0 if ok, -1 if the data is not one MessagePack value
+*/
+static int mp_decode_record(lua_State *L, scratch_buf *buf)
+{
+    const unsigned char *p = (const unsigned char *)buf->data;
+    const unsigned char *end = p + buf->len;
+    int top = lua_gettop(L);
+    if (mp_decode(L, &p, end, 0) != 0 || p != end) {
+        lua_settop(L, top);
+        scratch_trim(buf);
+        return -1;
+    }
+    scratch_trim(buf);
+    return 0;
+}
+
+/*
+** Key/value primitives shared by the single key and the batch methods.
+** They return an UnQLite result code, kv_errmsg turns it into a message.
+*/
+
+/*
+** Get the error message for a failed key/value primitive.
+** @param db the database handle
+** @param res the UnQLite result code
+** @return const char* error message
+*/
+static const char *engine_errmsg(unqlite *db, int res)
+{
+    const char *errmsg;
+    if (res == UNQLITE_ABORT)
+        return "Cannot allocate buffer";
+    if (res == UNQLITE_READ_ONLY)
+        return "Database is read-only";
+    if (res == UNQLITE_CORRUPT)
+        return "Corrupt compressed value";
+    unqlite_logerror(db, &errmsg);
+    return errmsg;
+}
+
+/*
+** Get the error message for a failed key/value primitive of a connection.
+** @param conn the connection
+** @param res the UnQLite result code
+** @return const char* error message
+*/
+static const char *kv_errmsg(conn_data *conn, int res)
+{
+    if (res == IX_EXTRACT_ERROR && conn->indexes != NULL)
+        return conn->indexes->errmsg;
+    return engine_errmsg(conn->unqlite_conn, res);
+}
+
+/*
+** Fetch a record into buf (a single engine lookup, none when the record
+** is in the write buffer). buf is reset first.
+** @return integer UnQLite result code (UNQLITE_NOTFOUND for a missing key)
+*/
+static int kv_fetch_data(conn_data *conn, const char *key, size_t klen,
+                         scratch_buf *buf)
+{
+    int res;
+    wb_entry *e = NULL;
+    buf->len = 0;
+    if (!bloom_maybe(conn, key, klen))
+        return UNQLITE_NOTFOUND;
+    if (conn->wbuf != NULL)
+        e = wb_find(conn->wbuf, key, klen, kv_hash_fnv1a(key, (unsigned int)klen));
+    if (e == NULL) {
+        res = unqlite_kv_fetch_callback(conn->unqlite_conn, key, (int)klen, scratch_consumer, buf);
+        if (res == UNQLITE_NOTFOUND && conn->bloom != NULL)
+            conn->bloom->false_positives++;
+        return res;
+    }
+    if (e->op == WB_DELETE)
+        return UNQLITE_NOTFOUND;
+    if (e->op == WB_APPEND) {
+        res = unqlite_kv_fetch_callback(conn->unqlite_conn, key, (int)klen, scratch_consumer, buf);
+        if (res != UNQLITE_OK && res != UNQLITE_NOTFOUND)
+            return res;
+    }
+    if (scratch_reserve(buf, buf->len + e->dlen) != 0)
+        return UNQLITE_ABORT;
+    if (e->dlen > 0)
+        memcpy(buf->data + buf->len, e->data, e->dlen);
+    buf->len += e->dlen;
+    return UNQLITE_OK;
+}
+
+/*
+** Secondary indexes. conn:create_index declares an index whose value is
+** taken from each record by a field path (MessagePack records) or by a
+** Lua function. Its entries live under LUANOSQL_INDEX_PREFIX, one empty
+** record per indexed record: the key is the prefix, then the index name,
+** the value and the primary key encoded as typed key elements, so entries
+** sort by value and then by primary key, and a write touches only the
+** entries of its own record. kv_store, kv_delete and the cursor delete
+** run ix_prepare before the write and ix_apply after it, so the entries
+** change in the same transaction as the record; when ix_apply fails the
+** record is put back as it was. Queries find the entries of a value in
+** the sorted entry keys (set->dir) and read each record to check it still
+** has that value, writers that do not maintain the index (another
+** connection or process) leave entries behind.
+*/
+
+/*
+** Free an index declaration.
+** @return void
+*/
+static void ix_free(lua_State *L, sec_index *ix)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, ix->fn);
+    free(ix->name);
+    free(ix->prefix);
+    free(ix->path);
+    free(ix);
+}
+
+/*
+** Drop the sorted entry keys, they are read again by the next index_range.
+** @return void
+*/
+static void ix_dir_drop(conn_data *conn)
+{
+    if (conn->indexes != NULL) {
+        ikeys_free(conn->indexes->dir);
+        conn->indexes->dir = NULL;
+    }
+}
+
+/*
+** Free the secondary indexes of a connection (the entries stay).
+** @return void
+*/
+static void ix_drop(lua_State *L, conn_data *conn)
+{
+    index_set *set = conn->indexes;
+    sec_index *ix;
+    if (set == NULL)
+        return;
+    while ((ix = set->list) != NULL) {
+        set->list = ix->next;
+        ix_free(L, ix);
+    }
+    ix_dir_drop(conn);
+    scratch_free(&set->old);
+    scratch_free(&set->vals);
+    scratch_free(&set->key);
+    scratch_free(&set->ekey);
+    free(set);
+    conn->indexes = NULL;
+}
+
+/*
+** Log an entry created or deleted to the sorted entry keys, if read.
+** @return void
+*/
+static void ix_dir_note(conn_data *conn, const char *key, size_t klen, int del)
+{
+    index_set *set = conn->indexes;
+    if (set->dir != NULL && ikeys_note(set->dir, key, klen, del) != 0)
+        ix_dir_drop(conn);
+}
+
+/*
+** Make sure the sorted entry keys are read, with a full cursor scan
+** when needed.
+** @return integer UnQLite result code (UNQLITE_NOMEM if out of memory)
+*/
+static int ix_dir_ensure(conn_data *conn)
+{
+    index_set *set = conn->indexes;
+    scratch_buf *buf = &set->ekey;
+    unqlite_kv_cursor *cursor;
+    key_index *dir;
+    int res;
+    if (set->dir != NULL) {
+        if (ikeys_merge(set->dir) == 0)
+            return UNQLITE_OK;
+        ix_dir_drop(conn);
+        return UNQLITE_NOMEM;
+    }
+    dir = (key_index *)calloc(1, sizeof(key_index));
+    if (dir == NULL)
+        return UNQLITE_NOMEM;
+    res = unqlite_kv_cursor_init(conn->unqlite_conn, &cursor);
+    if (res != UNQLITE_OK) {
+        free(dir);
+        return res;
+    }
+    res = unqlite_kv_cursor_first_entry(cursor);
+    if (res == UNQLITE_DONE || res == UNQLITE_EOF)
+        res = UNQLITE_OK;
+    while (res == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor)) {
+        buf->len = 0;
+        res = unqlite_kv_cursor_key_callback(cursor, scratch_consumer, buf);
+        if (res != UNQLITE_OK)
+            break;
+        if (buf->len > LUANOSQL_INDEX_PREFIXLEN &&
+            memcmp(buf->data, LUANOSQL_INDEX_PREFIX, LUANOSQL_INDEX_PREFIXLEN) == 0) {
+            char *copy = (char *)malloc(buf->len);
+            if (copy == NULL || kindex_push(dir, copy, buf->len) != 0) {
+                free(copy);
+                res = UNQLITE_NOMEM;
+                break;
+            }
+            memcpy(copy, buf->data, buf->len);
+        }
+        if (unqlite_kv_cursor_next_entry(cursor) != UNQLITE_OK)
+            break;
+    }
+    unqlite_kv_cursor_release(conn->unqlite_conn, cursor);
+    scratch_trim(buf);
+    if (res != UNQLITE_OK) {
+        ikeys_free(dir);
+        return res;
+    }
+    qsort(dir->keys, dir->nkeys, sizeof(ikey), ikey_qcmp);
+    set->dir = dir;
+    return UNQLITE_OK;
+}
+
+/*
+** Append the value of index ix for a record to out, encoded as a typed key
+** element, or a 0 byte when the record has none. Values other than strings
+** and integers are not indexed. The extractor function runs with the
+** connection marked busy, its methods raise an error until it returns.
+** @return integer UnQLite result code (IX_EXTRACT_ERROR if the extractor
+** function failed)
+*/
+static int ix_extract(lua_State *L, conn_data *conn, sec_index *ix, const char *key, size_t klen,
+                      const char *data, size_t dlen, scratch_buf *out)
+{
+    int top = lua_gettop(L), res = -1, failed;
+    if (ix->path != NULL) {
+        const unsigned char *p = (const unsigned char *)data;
+        const char *field = ix->path, *dot;
+        size_t n;
+        if (mp_decode(L, &p, p + dlen, 0) != 0 || p != (const unsigned char *)data + dlen)
+            lua_settop(L, top);
+        while (lua_gettop(L) > top && field != NULL) {
+            if (!lua_istable(L, -1)) {
+                lua_settop(L, top);
+                break;
+            }
+            dot = strchr(field, '.');
+            n = dot != NULL ? (size_t)(dot - field) : strlen(field);
+            lua_pushlstring(L, field, n);
+            lua_rawget(L, -2);
+            /* a numeric part also selects an array item */
+            if (lua_isnil(L, -1) && n > 0 && strspn(field, "0123456789") >= n) {
+                lua_pop(L, 1);
+                lua_rawgeti(L, -1, atoi(field));
+            }
+            lua_replace(L, -2);
+            field = dot != NULL ? dot + 1 : NULL;
+        }
+    }
+    else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ix->fn);
+        if (conn->typed_keys)
+            key_push(L, key, klen);
+        else
+            lua_pushlstring(L, key, klen);
+        lua_pushlstring(L, data, dlen);
+        conn->indexes->busy = 1;
+        failed = lua_pcall(L, 2, 1, 0) != 0;
+        conn->indexes->busy = 0;
+        if (failed) {
+            snprintf(conn->indexes->errmsg, sizeof(conn->indexes->errmsg), "index %s: %s", ix->name,
+                     lua_isstring(L, -1) ? lua_tostring(L, -1) : "extractor failed");
+            lua_settop(L, top);
+            return IX_EXTRACT_ERROR;
+        }
+    }
+    if (lua_gettop(L) > top)
+        res = tkey_put(L, -1, out);
+    lua_settop(L, top);
+    if (res == -1)
+        res = scratch_consumer("", 1, out) == UNQLITE_OK ? 0 : -2;
+    return res == 0 ? UNQLITE_OK : UNQLITE_ABORT;
+}
+
+/*
+** Build into set->ekey the key of the entry of ix for a value and the
+** primary key in set->key. When pk is 0 it stops at the tag of the
+** primary key: the prefix of the entries of exactly that value (the
+** encoding of "ab" alone is also the start of "ab\0c").
+** @return integer 0 if ok, -1 if out of memory
+*/
+static int ix_entry_key(index_set *set, sec_index *ix, const char *val, size_t vlen, int pk)
+{
+    set->ekey.len = 0;
+    if (scratch_reserve(&set->ekey, ix->plen + vlen + 1) != 0)
+        return -1;
+    memcpy(set->ekey.data, ix->prefix, ix->plen);
+    memcpy(set->ekey.data + ix->plen, val, vlen);
+    set->ekey.len = ix->plen + vlen;
+    if (pk)
+        return tkey_put_str(&set->ekey, set->key.data, set->key.len) != 0 ? -1 : 0;
+    if (vlen > 0)
+        set->ekey.data[set->ekey.len++] = TKEY_STR;
+    return 0;
+}
+
+/*
+** Create the entry of ix for a value and the primary key in set->key.
+** @return integer UnQLite result code
+*/
+static int ix_entry_add(conn_data *conn, sec_index *ix, const char *val, size_t vlen)
+{
+    index_set *set = conn->indexes;
+    int res;
+    if (ix_entry_key(set, ix, val, vlen, 1) != 0)
+        return UNQLITE_ABORT;
+    res = unqlite_kv_store(conn->unqlite_conn, set->ekey.data, (int)set->ekey.len, "", 0);
+    if (res == UNQLITE_OK)
+        ix_dir_note(conn, set->ekey.data, set->ekey.len, 0);
+    return res;
+}
+
+/*
+** Delete the entry of ix for a value and the primary key in set->key.
+** @return integer UnQLite result code
+*/
+static int ix_entry_remove(conn_data *conn, sec_index *ix, const char *val, size_t vlen)
+{
+    index_set *set = conn->indexes;
+    int res;
+    if (ix_entry_key(set, ix, val, vlen, 1) != 0)
+        return UNQLITE_ABORT;
+    res = unqlite_kv_delete(conn->unqlite_conn, set->ekey.data, (int)set->ekey.len);
+    if (res == UNQLITE_OK)
+        ix_dir_note(conn, set->ekey.data, set->ekey.len, 1);
+    return res == UNQLITE_NOTFOUND ? UNQLITE_OK : res;
+}
+
+/*
+** Compute the old and new index values of a record about to be written
+** (data, or deleted when has_new is 0). Nothing is written yet, so an
+** extractor error leaves the database as it was.
+** @return integer UnQLite result code
+*/
+static int ix_prepare(lua_State *L, conn_data *conn, const char *key, size_t klen,
+                      const char *data, size_t dlen, int has_new)
+{
+    index_set *set = conn->indexes;
+    sec_index *ix;
+    int res, has_old;
+    if (set == NULL || IS_RESERVED_KEY(key, klen))
+        return UNQLITE_OK;
+    set->pending = 0;
+    set->key.len = set->vals.len = 0;
+    if (scratch_consumer(key, (unsigned int)klen, &set->key) != UNQLITE_OK)
+        return UNQLITE_ABORT;
+    res = kv_fetch_data(conn, key, klen, &set->old);
+    if (res == UNQLITE_OK)
+        res = codec_decode(conn, &set->old);
+    has_old = set->has_old = res == UNQLITE_OK;
+    if (res == UNQLITE_NOTFOUND)
+        res = UNQLITE_OK;
+    for (ix = set->list; ix != NULL && res == UNQLITE_OK; ix = ix->next) {
+        if (has_old)
+            res = ix_extract(L, conn, ix, set->key.data, klen, set->old.data, set->old.len, &set->vals);
+        else
+            res = scratch_consumer("", 1, &set->vals);
+        if (res != UNQLITE_OK)
+            break;
+        if (has_new)
+            res = ix_extract(L, conn, ix, set->key.data, klen, data, dlen, &set->vals);
+        else
+            res = scratch_consumer("", 1, &set->vals);
+    }
+    /* the old data stays until ix_apply, to put the record back */
+    if (res != UNQLITE_OK)
+        scratch_trim(&set->old);
+    set->pending = res == UNQLITE_OK;
+    return res;
+}
+
+/*
+** Update the entries with the values computed by ix_prepare, once the
+** record is written. If an entry cannot be written, the entries already
+** changed are set back to the old values (entry writes can be repeated)
+** and the caller puts the record back with ix_restore.
+** @return integer UnQLite result code
+*/
+static int ix_apply(conn_data *conn)
+{
+    index_set *set = conn->indexes;
+    const unsigned char *p, *end, *o, *n;
+    sec_index *ix, *failed = NULL;
+    int res = UNQLITE_OK;
+    if (set == NULL || !set->pending)
+        return UNQLITE_OK;
+    set->pending = 0;
+    end = (const unsigned char *)set->vals.data + set->vals.len;
+    p = (const unsigned char *)set->vals.data;
+    for (ix = set->list; ix != NULL && failed == NULL; ix = ix->next) {
+        o = p;
+        p = *p != 0 ? tkey_next(p, end) : p + 1;
+        n = p;
+        p = *p != 0 ? tkey_next(p, end) : p + 1;
+        if (n - o == p - n && memcmp(o, n, n - o) == 0)
+            continue;
+        if (*o != 0)
+            res = ix_entry_remove(conn, ix, (const char *)o, n - o);
+        if (res == UNQLITE_OK && *n != 0)
+            res = ix_entry_add(conn, ix, (const char *)n, p - n);
+        if (res != UNQLITE_OK)
+            failed = ix;
+    }
+    if (failed == NULL) {
+        scratch_trim(&set->old);
+        return UNQLITE_OK;
+    }
+    p = (const unsigned char *)set->vals.data;
+    for (ix = set->list; ix != failed->next; ix = ix->next) {
+        o = p;
+        p = *p != 0 ? tkey_next(p, end) : p + 1;
+        n = p;
+        p = *p != 0 ? tkey_next(p, end) : p + 1;
+        if (n - o == p - n && memcmp(o, n, n - o) == 0)
+            continue;
+        if (*n != 0)
+            ix_entry_remove(conn, ix, (const char *)n, p - n);
+        if (*o != 0)
+            ix_entry_add(conn, ix, (const char *)o, n - o);
+    }
+    return res;
+}
+
+/*
+** Delete the entries of an index.
+** @return integer UnQLite result code
+*/
+static int ix_clear(conn_data *conn, sec_index *ix)
+{
+    index_set *set = conn->indexes;
+    size_t i, start, end;
+    int res = ix_dir_ensure(conn);
+    if (res != UNQLITE_OK)
+        return res;
+    start = kindex_lower(set->dir, ix->prefix, ix->plen);
+    end = kindex_prefix_end(set->dir, start, ix->prefix, ix->plen);
+    for (i = start; i < end; i++) {
+        res = unqlite_kv_delete(conn->unqlite_conn, set->dir->keys[i].data, (int)set->dir->keys[i].len);
+        if (res != UNQLITE_OK && res != UNQLITE_NOTFOUND) {
+            ix_dir_drop(conn);
+            return res;
+        }
+        free(set->dir->keys[i].data);
+    }
+    memmove(set->dir->keys + start, set->dir->keys + end, (set->dir->nkeys - end) * sizeof(ikey));
+    set->dir->nkeys -= end - start;
+    return UNQLITE_OK;
+}
+
+/*
+** Build the entries of an index from the records of the database,
+** replacing the ones already there.
+** @return integer UnQLite result code
+*/
+static int ix_build(lua_State *L, conn_data *conn, sec_index *ix)
+{
+    index_set *set = conn->indexes;
+    size_t i;
+    int res = wb_flush(conn);
+    if (res == UNQLITE_OK)
+        res = ix_clear(conn, ix);
+    if (res == UNQLITE_OK)
+        res = kindex_ensure(conn);
+    /* the key index is read again at each step, the extractor may not keep it */
+    for (i = 0; res == UNQLITE_OK && conn->kindex != NULL && i < conn->kindex->nkeys; i++) {
+        ikey *k = &conn->kindex->keys[i];
+        set->key.len = set->vals.len = 0;
+        if (scratch_consumer(k->data, (unsigned int)k->len, &set->key) != UNQLITE_OK) {
+            res = UNQLITE_ABORT;
+            break;
+        }
+        res = kv_fetch_data(conn, set->key.data, set->key.len, &set->old);
+        if (res == UNQLITE_OK)
+            res = codec_decode(conn, &set->old);
+        if (res == UNQLITE_OK)
+            res = ix_extract(L, conn, ix, set->key.data, set->key.len, set->old.data, set->old.len, &set->vals);
+        if (res == UNQLITE_OK && set->vals.data[0] != 0)
+            res = ix_entry_add(conn, ix, set->vals.data, set->vals.len);
+        if (res == UNQLITE_NOTFOUND)
+            res = UNQLITE_OK;
+    }
+    scratch_trim(&set->old);
+    return res;
+}
+
+/*
+** Build again every index of a connection, after records were written
+** around ix_prepare (bulk_load of part files, restore).
+** @return integer UnQLite result code
+*/
+static int ix_rebuild(lua_State *L, conn_data *conn)
+{
+    sec_index *ix;
+    int res = UNQLITE_OK;
+    if (conn->indexes == NULL)
+        return UNQLITE_OK;
+    ix_dir_drop(conn);
+    for (ix = conn->indexes->list; ix != NULL && res == UNQLITE_OK; ix = ix->next)
+        res = ix_build(L, conn, ix);
+    return res;
+}
+
+/*
+** Store a record as given, without the codec.
+** @return integer UnQLite result code
+*/
+static int kv_store_raw(lua_State *L, conn_data *conn, const char *key, size_t klen,
+                        const char *data, size_t dlen)
+{
+    int res;
+    STATS_CALL(conn, ST_STORE, res, conn->wbuf != NULL ? wb_put(conn, WB_STORE, key, klen, data, dlen) :
+               unqlite_kv_store(conn->unqlite_conn, key, (int)klen, data, (unqlite_int64)dlen), klen + dlen);
+    vc_forget(L, conn, key, klen);
+    if (res == UNQLITE_OK) {
+        kindex_note(conn, key, klen, 0);
+        bloom_note(conn, key, klen, 1);
+        res = wb_check(conn);
+    }
+    return res;
+}
+
+/*
+** Delete a record as kv_delete, without the secondary indexes.
+** @return integer UnQLite result code
+*/
+static int kv_delete_raw(lua_State *L, conn_data *conn, const char *key, size_t klen)
+{
+    int res;
+    STATS_CALL(conn, ST_DELETE, res, conn->wbuf != NULL ? wb_put(conn, WB_DELETE, key, klen, NULL, 0) :
+               unqlite_kv_delete(conn->unqlite_conn, key, (int)klen), klen);
+    vc_forget(L, conn, key, klen);
+    if (res == UNQLITE_OK) {
+        kindex_note(conn, key, klen, 1);
+        bloom_note(conn, key, klen, 0);
+        res = wb_check(conn);
+    }
+    return res;
+}
+
+/*
+** Encode a value for storage if the connection compresses values, or if
+** it starts with the codec tag in a database holding encoded values (it
+** is escaped then).
+** @param data the value, replaced by the bytes to store
+** @param dlen its length, replaced by theirs
+** @return integer UnQLite result code
+*/
+static int kv_encode(conn_data *conn, const char **data, size_t *dlen)
+{
+    int res;
+    if (!CODEC_ON(conn) && !(*dlen > 0 && (unsigned char)(*data)[0] == CODEC_TAG && codec_active(conn)))
+        return UNQLITE_OK;
+    if (codec_get(conn) == NULL || (*data = codec_encode(conn, *data, *dlen, dlen)) == NULL)
+        return UNQLITE_ABORT;
+    if (!IS_ENCODED(*data, *dlen) || (res = codec_mark(conn)) == UNQLITE_OK)
+        return UNQLITE_OK;
+    return res;
+}
+
+/*
+** Put back the record ix_prepare read, after ix_apply failed: its old
+** data, or no record if it was new. Best effort, the ix_apply error is
+** the one reported.
+** @return void
+*/
+static void ix_restore(lua_State *L, conn_data *conn, const char *key, size_t klen)
+{
+    index_set *set = conn->indexes;
+    const char *data = set->old.data;
+    size_t dlen = set->old.len;
+    if (!set->has_old)
+        kv_delete_raw(L, conn, key, klen);
+    else if (kv_encode(conn, &data, &dlen) == UNQLITE_OK)
+        kv_store_raw(L, conn, key, klen, data, dlen);
+    scratch_trim(&set->old);
+}
+
+/*
+** Store a record, compressed if the connection enabled compression, and
+** update the secondary indexes.
+** @return integer UnQLite result code
+*/
+static int kv_store(lua_State *L, conn_data *conn, const char *key, size_t klen,
+                    const char *data, size_t dlen)
+{
+    int res = ix_prepare(L, conn, key, klen, data, dlen, 1);
+    if (res != UNQLITE_OK)
+        return res;
+    /* a raw value starting with the tag is escaped, compression enabled or not */
+    res = kv_encode(conn, &data, &dlen);
+    if (res != UNQLITE_OK)
+        return res;
+    res = kv_store_raw(L, conn, key, klen, data, dlen);
+    if (res == UNQLITE_OK && (res = ix_apply(conn)) != UNQLITE_OK)
+        ix_restore(L, conn, key, klen);
+    return res;
+}
+
+/*
+** Append data to a record, creating it if needed. With compression, an
+** empty or encoded record is read, decoded and stored again with the
+** data; so is a missing or empty one when the data starts with the tag,
+** to escape it. With secondary indexes every record is, to extract the
+** new values. Otherwise the data is appended raw, also to an encoded
+** record (see value_decode).
+** @return integer UnQLite result code
+*/
+static int kv_append(lua_State *L, conn_data *conn, const char *key, size_t klen,
+                     const char *data, size_t dlen)
+{
+    scratch_buf *buf = &conn->fetch_buf;
+    int res, rewrite = conn->indexes != NULL && !IS_RESERVED_KEY(key, klen);
+    if (CODEC_ON(conn) || rewrite || (dlen > 0 && (unsigned char)data[0] == CODEC_TAG && codec_active(conn))) {
+        res = kv_fetch_data(conn, key, klen, buf);
+        if (res == UNQLITE_NOTFOUND ||
+            (res == UNQLITE_OK && (rewrite || buf->len == 0 || IS_ENCODED(buf->data, buf->len)))) {
+            if (res == UNQLITE_OK && (res = codec_decode(conn, buf)) == UNQLITE_OK &&
+                scratch_consumer(data, (unsigned int)dlen, buf) != UNQLITE_OK)
+                res = UNQLITE_ABORT;
+            if (res == UNQLITE_NOTFOUND)
+                res = kv_store(L, conn, key, klen, data, dlen);
+            else if (res == UNQLITE_OK)
+                res = kv_store(L, conn, key, klen, buf->data, buf->len);
+            scratch_trim(buf);
+            return res;
+        }
+        scratch_trim(buf);
+        if (res != UNQLITE_OK)
+            return res;
+    }
+    STATS_CALL(conn, ST_APPEND, res, conn->wbuf != NULL ? wb_put(conn, WB_APPEND, key, klen, data, dlen) :
+               unqlite_kv_append(conn->unqlite_conn, key, (int)klen, data, (unqlite_int64)dlen), klen + dlen);
+    vc_forget(L, conn, key, klen);
+    if (res == UNQLITE_OK) {
+        kindex_note(conn, key, klen, 0);
+        bloom_note(conn, key, klen, 1);
+        res = wb_check(conn);
+    }
+    return res;
+}
+
+/*
+** Delete a record, UNQLITE_NOTFOUND is returned for a missing key (not
+** known when the delete is buffered).
+** @return integer UnQLite result code
+*/
+static int kv_delete(lua_State *L, conn_data *conn, const char *key, size_t klen)
+{
+    int res = ix_prepare(L, conn, key, klen, NULL, 0, 0);
+    if (res != UNQLITE_OK)
+        return res;
+    res = kv_delete_raw(L, conn, key, klen);
+    if (res == UNQLITE_OK && (res = ix_apply(conn)) != UNQLITE_OK)
+        ix_restore(L, conn, key, klen);
+    return res;
+}
+
+/*
+** Fetch a record handing its data, possibly in several chunks, to xConsumer.
+** @return integer UnQLite result code (UNQLITE_NOTFOUND for a missing key,
+** UNQLITE_ABORT if the consumer stopped)
+*/
+static int kv_fetch_cb(conn_data *conn, const char *key, size_t klen,
+                       int (*xConsumer)(const void *, unsigned int, void *), void *ud)
+{
+    write_buffer *wb = conn->wbuf;
+    int res;
+    if (!bloom_maybe(conn, key, klen)) {
+        STATS_NOTE(conn, ST_FETCH, 0, UNQLITE_NOTFOUND, klen);
+        return UNQLITE_NOTFOUND;
+    }
+    if (wb != NULL && wb_find(wb, key, klen, kv_hash_fnv1a(key, (unsigned int)klen)) != NULL) {
+        res = wb_flush(conn);
+        if (res != UNQLITE_OK)
+            return res;
+    }
+    STATS_CALL(conn, ST_FETCH, res, unqlite_kv_fetch_callback(conn->unqlite_conn, key, (int)klen, xConsumer, ud), klen);
+    if (res == UNQLITE_NOTFOUND && conn->bloom != NULL)
+        conn->bloom->false_positives++;
+    return res;
+}
+
+/*
+** Stream a record to a consumer as kv_fetch_cb, the value decoded if it
+** was stored compressed.
+** @return integer UnQLite result code
+*/
+static int kv_fetch_value_cb(conn_data *conn, const char *key, size_t klen,
+                             int (*xConsumer)(const void *, unsigned int, void *), void *ud)
+{
+    codec_stream cs;
+    memset(&cs, 0, sizeof(cs));
+    cs.conn = conn;
+    cs.xConsumer = xConsumer;
+    cs.ud = ud;
+    return codec_stream_finish(&cs, kv_fetch_cb(conn, key, klen, codec_stream_consumer, &cs));
+}
+
+/*
+** Fetch a record into buf, timed by the statistics.
+** @return integer UnQLite result code (UNQLITE_NOTFOUND for a missing key)
+*/
+static int kv_fetch(conn_data *conn, const char *key, size_t klen,
+                    scratch_buf *buf)
+{
+    int res;
+    STATS_CALL(conn, ST_FETCH, res, kv_fetch_data(conn, key, klen, buf), klen + buf->len);
+    if (res == UNQLITE_OK)
+        res = codec_decode(conn, buf);
+    return res;
+}
+
+
+#ifndef LUANOSQL_OMIT_JX9_DOCSTORE
+
+/**
+** Create a metatable and leave it on top of the stack.
+** @param conn a connection to unqlite db
+** @param zBuf a string where the log error will be copied to.
+** @return void
+*/
+static void unqlite_jx9_logerror(unqlite *conn, const char *zBuf) {
+    int iLen;
+    /* Something goes wrong, extract database error log */
+    unqlite_config(conn, UNQLITE_CONFIG_JX9_ERR_LOG, &zBuf, &iLen);
+#ifdef LUANOSQL_DEBUG
+    if( iLen > 0 )
+    {
+        puts(zBuf);
+    }
+#endif
+}
+
+
+/*
+** Check for valid jx9_doc_data structure.
+** @param L the lua state
+** @return jx9_doc_data a valid jx9_doc_data structure / jx9 VM
+*/
+static jx9_doc_data *getjx9doc(lua_State *L) {
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata (L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"JX9 docstore VM expected");
+    luaL_argcheck(L, !jx9data->closed, 1, LUANOSQL_PREFIX"JX9 docstore VM is closed");
+    return jx9data;
+}
+
+
+
+/* Wrapped functions for JX9 VM data */
+
+/*
+** Jx9Doc object collector function
+** @param L the lua state
+** @return integer 0 , nil and err in case of
+*/
+static int jx9_ds_gc(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    if (jx9data != NULL && !(jx9data->closed))
+    {
+        res = unqlite_vm_release(jx9data->uvm);
+        if (res != UNQLITE_OK) {
+            unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
+            return luanosql_faildirect(L, errmsg);
+        }
+		
+		conn_data *conn;
+		
+		/* destroy structure fields. */
+		jx9data->closed = 1;
+		jx9data->uvm = NULL;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, jx9data->conn);
+		conn = lua_touserdata (L, -1);
+		conn->vm_counter--;
+		luaL_unref(L, LUA_REGISTRYINDEX, jx9data->conn);
+		//luaL_unref(L, LUA_REGISTRYINDEX, jx9data->uvm);
+		
+    }
+    return 0;
+}
+
+
+
+/*
+** Release the vm
+** Release a cursor object (deallocation) 
+** It wraps unqlite_kv_cursor_release.
+** int unqlite_kv_cursor_release(unqlite *pDb,unqlite_kv_cursor *pCur);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+** 
+*/
+static int jx9_ds_vm_release(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+    if (jx9data->closed) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    res = unqlite_vm_release(jx9data->uvm);
+    if (res != UNQLITE_OK) {
+        unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+	
+	/*FIXME: Refactor, cretaing a destroy_vm as for cursor */
+	conn_data *conn;
+	/* destroy structure fields. */
+	jx9data->closed = 1;
+	jx9data->uvm = NULL;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, jx9data->conn);
+	conn = lua_touserdata (L, -1);
+	conn->vm_counter--;
+	luaL_unref(L, LUA_REGISTRYINDEX, jx9data->conn);
+	//luaL_unref(L, LUA_REGISTRYINDEX, jx9data->uvm);
+	
+	lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+
+/*
+** Compile a jx9 program passed as jx9script.
+** It wraps unqlite_compile.
+** int  unqlite_compile(nqlite *pDb, const char *zJx9, int nLen, unqlite_vm **ppOutVm);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_compile(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int res;
+    const char *errmsg;
+    unqlite_vm *vm;
+	const char *jx9script;
+	size_t iLen;
+	/* get jx9 script to be compiled */
 	jx9script = luaL_checklstring(L,2,&iLen);
+	/* the vm runs outside the lock of a shared handle */
+	if (IS_SHARED(conn))
+	    return luanosql_faildirect(L, "a shared connection cannot compile JX9 programs");
+	
+    /* compile a jx9 program passed as jx9script */
+    res = unqlite_compile(conn->unqlite_conn,jx9script, iLen, &vm);
+    if (res != UNQLITE_OK) {  /* mostly  UNQLITE_COMPILE_ERR */
+        unqlite_jx9_logerror(conn->unqlite_conn, errmsg);
+		/* need to set a value, UnQLite seems to return NULL 
+		as errmsg on UNQLITE_COMPILE_ERR */
+		if (errmsg==NULL) errmsg = "Compilation Error";
+        return luanosql_faildirect(L, errmsg);
+	}
+    /* Create our own jx9 vm internal structure */
+    jx9_doc_data *jx9_data = (jx9_doc_data*)lua_newuserdata(L, sizeof(jx9_doc_data));
+    luanosql_setmeta (L, LUANOSQL_JX9DOCSTORE_UNQLITE);
+
+    /* increment vm count for this connection */
+    conn->vm_counter++;
+    /* fill in cur structure */
+    jx9_data->uvm = vm;
+    jx9_data->closed = 0;
+    jx9_data->conn = LUA_NOREF;
+    jx9_data->conn_data = conn;
+    jx9_data->L = L;
+    lua_pushvalue(L, 1);
+    jx9_data->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+
+/*
+** Compile a jx9 program passed as a file.
+** It wraps unqlite_compile_file.
+** int  unqlite_compile_file(nqlite *pDb, const char *zFile, int nLen, unqlite_vm **ppOutVm);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_compile_file(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int res;
+    const char *errmsg;
+    unqlite_vm *vm;
+	const char *zFile;
+	size_t iLen;
+	/* get the file to be compiled */
+	zFile = luaL_checklstring(L,2,&iLen);
+	/* the vm runs outside the lock of a shared handle */
+	if (IS_SHARED(conn))
+	    return luanosql_faildirect(L, "a shared connection cannot compile JX9 programs");
+	
+    /* init a cursor for this connection */
+    res = unqlite_compile_file(conn->unqlite_conn,zFile, &vm);
+    if (res != UNQLITE_OK) {  /* mostly  UNQLITE_COMPILE_ERR */
+        unqlite_jx9_logerror(conn->unqlite_conn, errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    /* Create our own jx9 vm internal structure */
+    jx9_doc_data *jx9_data = (jx9_doc_data*)lua_newuserdata(L, sizeof(jx9_doc_data));
+    luanosql_setmeta (L, LUANOSQL_JX9DOCSTORE_UNQLITE);
+
+    /* increment vm count for this connection */
+    conn->vm_counter++;
+    /* fill in cur structure */
+    jx9_data->uvm = vm;
+    jx9_data->closed = 0;
+    jx9_data->conn = LUA_NOREF;
+    jx9_data->conn_data = conn;
+    jx9_data->L = L;
+    lua_pushvalue(L, 1);
+    jx9_data->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+
+
+/*
+** Exec a successfully compile jx9 program.
+** It wraps unqlite_vm_exec.
+** int   unqlite_vm_exec(unqlite_vm *pVm);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vmexec(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+   
+    /* the program may read the records, hand the buffered writes first */
+    res = wb_flush(jx9data->conn_data);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(jx9data->conn_data, res));
+    /* and it may change them: cached values cannot be trusted anymore */
+    if (jx9data->conn_data->vcache != NULL)
+        vc_clear(L, jx9data->conn_data->vcache);
+    jx9data->L = L;
+    STATS_TIMED(jx9data->conn_data, ST_VMEXEC, res, unqlite_vm_exec(jx9data->uvm), 0);
+    if (res != UNQLITE_OK) {
+        unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+
+/*
+** unqlite_vm_config(jx9data->uvm, UNQLITE_VM_CONFIG_OUTPUT, consumer_callback, jx9data);
+** Params: database, callback function, userdata
+**
+*** consumer_callback:
+** Params: pData,iDataLen, pUserData 
+** @param pData void* output provided 
+** @param iDataLen output length integer  
+** @param pUserData passed is a jx9_doc_data
+** @return integer 0
+*/
+static int consumer_callback(const void *pData, unsigned int iDataLen, void *pUserData /* jx9_doc_data for us */) {
+    jx9_doc_data *jx9data = (jx9_doc_data*)pUserData;
+    int res = 0;
+    lua_State *L = jx9data->L;
+    int top = lua_gettop(L);
+    /* setup lua callback */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb);    /* get the callback function */
+    /* pData push  param */
+    lua_pushlstring(L, pData, (size_t)iDataLen);
+    /* iDataLen push  param */
+    lua_pushinteger(L, iDataLen);
+    /* get callback user data */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb_udata);
+    /* call lua function */
+    res = lua_pcall(L, 3, 1, 0);
+    lua_settop(L, top);
+    return 0;
+}
+
+
+/**
+** Expecting a Lua function looking like this:
+** vm_consumer_callback(mycallback, udata or nil)
+** mycallback(pout, udata)
+** (pUserData passed is a jx9_doc_data struct)
+** It wraps unqlite_vm_config
+** int unqlite_vm_config(unqlite_vm *pVm,
+**    int (*xConsumer)(const void *pOut,unsigned int iDataLen,void *pUserData),
+**    void *pUserData);
+** @param L the lua state 
+** @return integer 0
+*/
+static int jx9_ds_consumer_callback(lua_State *L) {
+    
+	jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+	
+    if (lua_gettop(L) < 2 || lua_isnil(L, 2)) {
+        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb);
+        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb_udata);
+
+        jx9data->jx9_consumer_cb = LUA_NOREF;
+        jx9data->jx9_consumer_cb_udata = LUA_NOREF;
+
+        /* clear con_fetch_cb handler */
+        unqlite_vm_config(jx9data->uvm, UNQLITE_VM_CONFIG_OUTPUT, NULL, NULL);
+	}
+    else {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        /* always userdata field (even if nil) */
+        lua_settop(L, 3);
+
+        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb);
+        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb_udata);
+        jx9data->jx9_consumer_cb_udata = luaL_ref(L, LUA_REGISTRYINDEX);
+        jx9data->jx9_consumer_cb = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        /* set kv_fetch_callback handler */
+        unqlite_vm_config(jx9data->uvm, UNQLITE_VM_CONFIG_OUTPUT, consumer_callback, jx9data);
+    }
+    return 0;
+}
+
+/*
+** Reset jx9 vm.
+** It wraps unqlite_vm_reset.
+** int   unqlite_vm_reset(unqlite_vm *pVm);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vmreset(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+   
+    /* init a cursor for this connection */
+    res = unqlite_vm_reset(jx9data->uvm);
+    if (res != UNQLITE_OK) {
+        unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+
+
+
+/*
+** Extract a variable from jx9 vm.
+** It wraps unqlite_vm_extract_variable.
+** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const char *zVar);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vm_extract_var(lua_State *L)
+{
+    int res;
+    const char *errmsg, *zVar;
+	unqlite_value *uValue;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+	size_t iLen;
+	/* get var name to be extracted */
+	zVar = luaL_checklstring(L,2,&iLen);
+   
+   
+    /* init a cursor for this connection */
+    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
+    
+	
+    return 1;
+}
+
+
+
+/*
+** Extract a variable of integer type from jx9 vm.
+** It wraps:
+** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
+** int   unqlite_value_to_int(unqlite_value *uValue);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vm_extract_int(lua_State *L)
+{
+    int res;
+    const char *errmsg, *zVar;
+	unqlite_value *uValue;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+	size_t iLen;
+	/* get var name to be extracted */
+	zVar = luaL_checklstring(L,2,&iLen);
+  
+    /* init a cursor for this connection */
+    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
+	
+	res =  unqlite_value_to_int(uValue);
+	lua_pushinteger(L,res);
+    return 1;
+}
+
+/*
+** Extract a variable of boolean type from jx9 vm.
+** It wraps :
+** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
+** int   unqlite_value_to_bool(unqlite_value *uValue);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vm_extract_bool(lua_State *L)
+{
+    int res;
+    const char *errmsg, *zVar;
+	unqlite_value *uValue;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+	size_t iLen;
+	/* get var name to be extracted */
+	zVar = luaL_checklstring(L,2,&iLen);
+  
+    /* init a cursor for this connection */
+    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
+	
+	res =  unqlite_value_to_bool(uValue);
+	lua_pushboolean(L,res);
+    return 1;
+}
+
+/*
+** Extract a variable of int64 type from jx9 vm.
+** It wraps :
+** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
+** int   unqlite_value_to_bool(unqlite_value *uValue);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vm_extract_int64(lua_State *L)
+{
+    unqlite_int64 iVal;
+    const char *errmsg, *zVar;
+	unqlite_value *uValue;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+	size_t iLen;
+	/* get var name to be extracted */
+	zVar = luaL_checklstring(L,2,&iLen);
+  
+    /* init a cursor for this connection */
+    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
+	
+	iVal =  unqlite_value_to_int64(uValue);
+	/* FIXME: Check this for lua 5.1 this could be a problem. A macro is needed maybe */
+	lua_pushinteger(L,(int)iVal);
+    return 1;
+}
+
+
+/*
+** Extract a variable of boolean type from jx9 vm.
+** It wraps unqlite_vm_reset.
+** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
+** double   unqlite_value_to_double(unqlite_value *uValue);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int jx9_ds_vm_extract_double(lua_State *L)
+{
+    double dVal;
+    const char *errmsg, *zVar;
+	unqlite_value *uValue;
+    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
+	size_t iLen;
+	/* get var name to be extracted */
+	zVar = luaL_checklstring(L,2,&iLen);
+  
+    /* init a cursor for this connection */
+    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
+	
+	dVal =  unqlite_value_to_double(uValue);
+	lua_pushnumber(L,dVal);
+    return 1;
+}
+
+
+
+#endif  /* LUANOSQL_OMIT_JX9_DOCSTORE */
+
+
+
+
+/*
+** Get the FILE of an io file handle, or NULL if idx is not one.
+** @param L the lua state
+** @param idx stack index
+** @return FILE* or NULL
+*/
+static FILE *tofile(lua_State *L, int idx)
+{
+    void *ud = lua_touserdata(L, idx);
+    int isfile;
+    if (ud == NULL || !lua_getmetatable(L, idx))
+        return NULL;
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    isfile = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    /* FILE** in Lua 5.1, luaL_Stream (FILE* first) in later versions */
+    return isfile ? *(FILE **)ud : NULL;
+}
+
+
+/*
+** Blob objects. kvfetch(key, true) and cursor_data(true) return the record
+** data in a blob instead of a Lua string: the engine copies it once into a
+** native buffer owned by the blob, it is not hashed nor interned, and Lua
+** strings are only made for the parts asked for.
+*/
+
+/*
+** Check for valid blob.
+** @param L the lua state
+** @return blob_data a valid blob_data structure
+*/
+static blob_data *getblob(lua_State *L)
+{
+    blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUANOSQL_BLOB_UNQLITE);
+    luaL_argcheck(L, blob != NULL, 1, LUANOSQL_PREFIX"blob expected");
+    luaL_argcheck(L, !blob->closed, 1, LUANOSQL_PREFIX"blob is freed");
+    return blob;
+}
+
+/*
+** Create a new empty blob and push it on top of the stack.
+** @param L the lua state
+** @return blob_data the new blob
+*/
+static blob_data *create_blob(lua_State *L)
+{
+    blob_data *blob = (blob_data *)lua_newuserdata(L, sizeof(blob_data));
+    blob->closed = 0;
+    blob->buf.data = NULL;
+    blob->buf.len = blob->buf.size = 0;
+    luanosql_setmeta(L, LUANOSQL_BLOB_UNQLITE);
+    return blob;
+}
+
+/*
+** Blob object collector function, also blob:free().
+** @param L the lua state
+** @return integer 0
+*/
+static int blob_gc(lua_State *L)
+{
+    blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUANOSQL_BLOB_UNQLITE);
+    if (blob != NULL && !blob->closed) {
+        blob->closed = 1;
+        scratch_free(&blob->buf);
+    }
+    return 0;
+}
+
+/*
+** Translate a Lua string position (negative counts from the end).
+** @return lua_Integer position
+*/
+static lua_Integer blob_pos(lua_Integer pos, size_t len)
+{
+    if (pos < 0)
+        pos += (lua_Integer)len + 1;
+    return pos >= 0 ? pos : 0;
+}
+
+/*
+** Get the blob length, also the # operator.
+** @param L the lua state
+** @return integer 1
+*/
+static int blob_len(lua_State *L)
+{
+    blob_data *blob = getblob(L);
+    lua_pushnumber(L, (lua_Number)blob->buf.len);
+    return 1;
+}
+
+/*
+** Get a part of the blob as a string, as string.sub.
+** blob:sub(i [, j])
+** @param L the lua state
+** @return integer 1
+*/
+static int blob_sub(lua_State *L)
+{
+    blob_data *blob = getblob(L);
+    size_t len = blob->buf.len;
+    lua_Integer i = blob_pos(luaL_checkinteger(L, 2), len);
+    lua_Integer j = blob_pos(luaL_optinteger(L, 3, -1), len);
+    if (i < 1)
+        i = 1;
+    if (j > (lua_Integer)len)
+        j = (lua_Integer)len;
+    if (i <= j)
+        lua_pushlstring(L, blob->buf.data + i - 1, (size_t)(j - i + 1));
+    else
+        lua_pushliteral(L, "");
+    return 1;
+}
+
+/*
+** Get the byte values of the blob, as string.byte.
+** blob:byte([i [, j]])
+** @param L the lua state
+** @return integer number of bytes pushed
+*/
+static int blob_byte(lua_State *L)
+{
+    blob_data *blob = getblob(L);
+    size_t len = blob->buf.len;
+    lua_Integer i = blob_pos(luaL_optinteger(L, 2, 1), len);
+    lua_Integer j = blob_pos(luaL_optinteger(L, 3, i), len);
+    int n, k;
+    if (i < 1)
+        i = 1;
+    if (j > (lua_Integer)len)
+        j = (lua_Integer)len;
+    if (i > j)
+        return 0;
+    n = (int)(j - i + 1);
+    luaL_checkstack(L, n, LUANOSQL_PREFIX"blob slice too long");
+    for (k = 0; k < n; k++)
+        lua_pushinteger(L, (unsigned char)blob->buf.data[i + k - 1]);
+    return n;
+}
+
+/*
+** Copy the whole blob into a Lua string.
+** @param L the lua state
+** @return integer 1
+*/
+static int blob_tostring(lua_State *L)
+{
+    blob_data *blob = getblob(L);
+    lua_pushlstring(L, blob->buf.len ? blob->buf.data : "", blob->buf.len);
+    return 1;
+}
+
+/*
+** Write the blob to an io file handle.
+** blob:write(file)
+** @param L the lua state
+** @return integer 1 (true) or nil and err
+*/
+static int blob_write(lua_State *L)
+{
+    blob_data *blob = getblob(L);
+    FILE *fp = tofile(L, 2);
+    luaL_argcheck(L, fp != NULL, 2, LUANOSQL_PREFIX"file handle expected");
+    if (fwrite(blob->buf.data, 1, blob->buf.len, fp) != blob->buf.len)
+        return luanosql_faildirect(L, "cannot write to file");
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Free the blob memory before it is collected.
+** @param L the lua state
+** @return integer 1 (true, false if already freed)
+*/
+static int blob_free(lua_State *L)
+{
+    blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUANOSQL_BLOB_UNQLITE);
+    lua_pushboolean(L, !blob->closed);
+    blob_gc(L);
+    return 1;
+}
+
+
+/*
+** Closes the cursor and reset all structure fields.
+** @param L the lua state
+** @param cur_data curor to be detroyed
+** @return void
+*/
+static void cur_destroy(lua_State *L, cur_data *cur)
+{
+    conn_data *conn;
+
+    /* Nullify structure fields. */
+    cur->closed = 1;
+    cur->cursor = NULL;
+    lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
+    conn = lua_touserdata (L, -1);
+    conn->cur_counter--;
+    luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
+    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_key_cb);
+    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_key_cb_udata);
+    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_data_cb);
+    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_data_cb_udata);
+}
+
+/*
+** Copy a string with malloc.
+** @return char* the copy, NULL if s is NULL or out of memory
+*/
+static char *str_dup(const char *s)
+{
+    char *d;
+    if (s == NULL || (d = (char *)malloc(strlen(s) + 1)) == NULL)
+        return NULL;
+    return strcpy(d, s);
+}
+
+/*
+** Create a new Connection object and push it on top of the stack.
+** @param L the lua state
+** @param env the integer reference to the env
+** @param unqlite_conn unqlite connection object
+** @param flags UNQLITE_OPEN_* flags the handle was opened with
+** @param config engine settings of the handle
+** @param path database path
+** @param engine KV engine name or NULL
+** @param shared the shared handle unqlite_conn belongs to or NULL
+** @param typed_keys encode integer and tuple keys (see key_get)
+** @return conn_data a valid conn_data structure
+*/
+static int create_connection(lua_State *L, int env, unqlite *unqlite_conn, int flags,
+                             const conn_config *config, const char *path, const char *engine,
+                             shared_handle *shared, int typed_keys)
+{
+    conn_data *conn = (conn_data*)lua_newuserdata(L, sizeof(conn_data));
+#ifndef LUANOSQL_OMIT_THREADS
+    conn->shared = shared;
+    conn->kindex_writes = 0;
+    luanosql_setmeta(L, shared != NULL ? LUANOSQL_SHARED_CONNECTION_UNQLITE : LUANOSQL_CONNECTION_UNQLITE);
+#else
+    luanosql_setmeta(L, LUANOSQL_CONNECTION_UNQLITE);
+#endif
+
+    /* Initialize data structure */
+    conn->closed = 0;
+    conn->env = LUA_NOREF;
+    conn->unqlite_conn = unqlite_conn;
+    conn->cur_counter = 0;
+#ifndef LUANOSQL_OMIT_JX9_DOCSTORE
+    conn->vm_counter = 0;
+#endif
+    conn->con_fetch_cb =
+        conn->con_fetch_cb_udata = LUA_NOREF;
+    conn->fetch_buf.data = NULL;
+    conn->fetch_buf.len = conn->fetch_buf.size = 0;
+    memset(conn->key_buf, 0, sizeof(conn->key_buf));
+    conn->typed_keys = (short)typed_keys;
+    conn->kindex = NULL;
+    conn->open_flags = flags;
+    conn->config = *config;
+    conn->path = str_dup(path);
+    conn->engine = str_dup(engine);
+    memset(&conn->commit, 0, sizeof(conn->commit));
+    conn->wbuf = NULL;
+    conn->vcache = NULL;
+    conn->bloom = NULL;
+    conn->codec = NULL;
+    conn->codec_seen = 0;
+    conn->indexes = NULL;
+    conn->sidecar_gone = 0;
+#ifndef LUANOSQL_OMIT_STATS
+    memset(conn->stats, 0, sizeof(conn->stats));
+#endif
+    lua_pushvalue (L, env);
+    conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
+
+    return 1;
+}
+
+
+/**
+**  These are cursor function
+*/
+
+/*
+** Create a new Cursor object and push it on top of the stack.
+** It wraps unqlite_kv_cursor_init.
+** int unqlite_kv_cursor_init(unqlite *pDb,unqlite_kv_cursor **ppOut);
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect with err msg
+*/
+static int conn_create_cursor(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int res;
+    const char *errmsg;
+    unqlite_kv_cursor *ucursor;
+    /* cursors read the engine, hand it the buffered writes first */
+    res = wb_flush(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    /* init a cursor for this connection */
+    res = unqlite_kv_cursor_init(conn->unqlite_conn,&ucursor);
+    if (res != UNQLITE_OK) {
+        unqlite_logerror(conn->unqlite_conn, &errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    /* Create our own cursor internal structure */
+    cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
+#ifndef LUANOSQL_OMIT_THREADS
+    luanosql_setmeta (L, conn->shared != NULL ? LUANOSQL_SHARED_CURSOR_UNQLITE : LUANOSQL_CURSOR_UNQLITE);
+#else
+    luanosql_setmeta (L, LUANOSQL_CURSOR_UNQLITE);
+#endif
+
+    /* increment cursor count this connection */
+    conn->cur_counter++;
+    /* fill in cur structure */
+    cur->cursor = ucursor;
+    cur->closed = 0;
+    cur->conn = LUA_NOREF;
+    cur->cur_key_cb =
+    cur->cur_key_cb_udata =
+    cur->cur_data_cb =
+    cur->cur_data_cb_udata = LUA_NOREF;
+    cur->conn_data = conn;
+    lua_pushvalue(L, 1);
+    cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+/*
+** Cursor object collector function
+** @param L the lua state
+** @return integer 1
+*/
+static int cur_gc(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = checkcursor(L, 1);
+    if (cur != NULL && !(cur->closed))
+    {
+        res = unqlite_kv_cursor_release(cur->conn_data->unqlite_conn, cur->cursor);
+        if (res != UNQLITE_OK) {
+            unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+            return luanosql_faildirect(L, errmsg);
+        }
+        cur_destroy(L, cur);
+    }
+    return 0;
+}
+
+/*
+** Release the cursor on top of the stack.
+** Release a cursor object (deallocation) 
+** It wraps unqlite_kv_cursor_release.
+** int unqlite_kv_cursor_release(unqlite *pDb,unqlite_kv_cursor *pCur);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+** 
+*/
+static int cur_release(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = checkcursor(L, 1);
+    luaL_argcheck(L, cur != NULL, 1, LUANOSQL_PREFIX"cursor expected");
+    if (cur->closed) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    res = unqlite_kv_cursor_release(cur->conn_data->unqlite_conn, cur->cursor);
+    if (res != UNQLITE_OK) {
+        unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    cur_destroy(L, cur);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Move a cursor to seek a record
+** It wraps unqlite_kv_cursor_first_entry.
+** int unqlite_kv_cursor_seek(unqlite_kv_cursor *pCursor,const void *pKey,int nKeyLen,int iPos);
+** iPos param can one among: UNQLITE_CURSOR_MATCH_EXACT or 0 (default), UNQLITE_CURSOR_MATCH_LE or
+** UNQLITE_CURSOR_MATCH_GE (see unqlite documentation).
+** @see luanosql_faildirect
+** Seek with the cursor
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_seek(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    size_t iLen;
+    cur_data *cur = getcursor(L);
+    const char *key = key_check(L, 2, cur->conn_data, KEY_ARG, &iLen);
+    // fallback in default
+    if (lua_gettop(L) < 3 || lua_isnil(L, 3) || luaL_checkint(L,3) > 2 /* possible values 0,1,2 */)
+    {
+        STATS_CALL(cur->conn_data, ST_CURSOR, res,
+                   unqlite_kv_cursor_seek(cur->cursor, key, iLen, UNQLITE_CURSOR_MATCH_EXACT), iLen);
+        if (res == UNQLITE_NOTFOUND) {
+            lua_pushboolean(L, 0); /* not ok, but it means not found -> we manage this case */
+            return 1;
+        }
+        if (res != UNQLITE_OK) {
+            unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+            return luanosql_faildirect(L, errmsg);
+        }
+    } else
+    {
+        STATS_CALL(cur->conn_data, ST_CURSOR, res,
+                   unqlite_kv_cursor_seek(cur->cursor, (const char *)key, iLen, luaL_checkint(L,3)), iLen);
+        if (res != UNQLITE_OK) {
+            unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+            return luanosql_faildirect(L, errmsg);
+        }
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Move the cursor to the first entry
+** It wraps unqlite_kv_cursor_first_entry.
+** int unqlite_kv_cursor_first_entry(unqlite_kv_cursor *pCursor);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_first_entry(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = getcursor(L);
 	
-    /* compile a jx9 program passed as jx9script */
-    res = unqlite_compile(conn->unqlite_conn,jx9script, iLen, &vm);
-    if (res != UNQLITE_OK) {  /* mostly  UNQLITE_COMPILE_ERR */
-        unqlite_jx9_logerror(conn->unqlite_conn, errmsg);
-		/* need to set a value, UnQLite seems to return NULL 
-		as errmsg on UNQLITE_COMPILE_ERR */
-		if (errmsg==NULL) errmsg = "Compilation Error";
+    STATS_CALL(cur->conn_data, ST_CURSOR, res, unqlite_kv_cursor_first_entry(cur->cursor), 0);
+    /* check result */
+	if (res != UNQLITE_OK) {
+        unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
         return luanosql_faildirect(L, errmsg);
-	}
-    /* Create our own jx9 vm internal structure */
-    jx9_doc_data *jx9_data = (jx9_doc_data*)lua_newuserdata(L, sizeof(jx9_doc_data));
-    luanosql_setmeta (L, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Move the cursor to the last entry
+** It wraps unqlite_kv_cursor_last_entry.
+** int unqlite_kv_cursor_last_entry(unqlite_kv_cursor *pCursor);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_last_entry(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = getcursor(L);
+    STATS_CALL(cur->conn_data, ST_CURSOR, res, unqlite_kv_cursor_last_entry(cur->cursor), 0);
+    if (res != UNQLITE_OK) {
+        unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/*
+** Check cursor validity
+** It wraps unqlite_kv_cursor_valid_entry.
+** int unqlite_kv_cursor_valid_entry(unqlite_kv_cursor *pCursor);
+** @param L the lua state 
+** @return integer 1 (true or false pushed on lua stack)
+*/
+static int cur_is_valid_entry(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = getcursor(L);
+    res = unqlite_kv_cursor_valid_entry(cur->cursor);
+    lua_pushboolean(L, res);
+    return 1;
+}
+
+/*
+** Set cursor pointing to previous entry
+** It wraps unqlite_kv_cursor_prev_entry.
+** int unqlite_kv_cursor_prev_entry(unqlite_kv_cursor *pCursor);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_prev_entry(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = getcursor(L);
+    STATS_CALL(cur->conn_data, ST_CURSOR, res, unqlite_kv_cursor_prev_entry(cur->cursor), 0);
+	if (res != UNQLITE_OK) {
+        unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Set cursor pointing to next entry
+** It wraps unqlite_kv_cursor_next_entry.
+** int unqlite_kv_cursor_next_entry(unqlite_kv_cursor *pCursor);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_next_entry(lua_State *L)
+{
+    int res;
+    const char *errmsg;
+    cur_data *cur = getcursor(L);
+    STATS_CALL(cur->conn_data, ST_CURSOR, res, unqlite_kv_cursor_next_entry(cur->cursor), 0);
+	if (res != UNQLITE_OK) {
+        unqlite_logerror(cur->conn_data->unqlite_conn, &errmsg);
+        return luanosql_faildirect(L, errmsg);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Delete an entry using cursor
+** It wraps unqlite_kv_cursor_delete_entry.
+** int unqlite_kv_cursor_delete_entry(unqlite_kv_cursor *pCursor);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_delete_entry(lua_State *L)
+{
+    int res;
+    cur_data *cur = getcursor(L);
+    conn_data *conn = cur->conn_data;
+    scratch_buf *buf = &conn->fetch_buf;
+    buf->len = 0;
+    /* the key is needed to keep the ordered key index, value cache and indexes up to date */
+    if (conn->kindex != NULL || conn->vcache != NULL || conn->indexes != NULL) {
+        res = unqlite_kv_cursor_key_callback(cur->cursor, scratch_consumer, buf);
+        if (res == UNQLITE_OK)
+            res = ix_prepare(L, conn, buf->data, buf->len, NULL, 0, 0);
+        if (res != UNQLITE_OK && conn->indexes != NULL) {
+            scratch_trim(buf);
+            return luanosql_faildirect(L, kv_errmsg(conn, res));
+        }
+        if (res != UNQLITE_OK) {
+            kindex_drop(conn);
+            if (conn->vcache != NULL)
+                vc_clear(L, conn->vcache);
+        }
+    }
+    res = unqlite_kv_cursor_delete_entry(cur->cursor);
+    if (res == UNQLITE_OK && (res = ix_apply(conn)) != UNQLITE_OK)
+        ix_restore(L, conn, buf->data, buf->len);
+    if (res != UNQLITE_OK) {
+        scratch_trim(buf);
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    }
+    kindex_note(conn, buf->data, buf->len, 1);
+    vc_forget(L, conn, buf->data, buf->len);
+    bloom_note(conn, buf->data, buf->len, 0);
+    scratch_trim(buf);
+	lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Use a cusor to get a key
+** It wraps unqlite_kv_cursor_key_callback.
+** int unqlite_kv_cursor_key_callback(unqlite_kv_cursor *pCursor,
+**    int (*xConsumer)(const void *pData,unsigned int iDataLen,void *pUserData),
+**    void *pUserData);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_get_key(lua_State *L)
+{
+    int res;
+    cur_data *cur = getcursor(L);
+    scratch_buf *buf = &cur->conn_data->fetch_buf;
+
+    /* One call, the key is copied straight into the connection buffer */
+    buf->len = 0;
+    res = unqlite_kv_cursor_key_callback(cur->cursor, scratch_consumer, buf);
+    if (res == UNQLITE_ABORT) {
+        scratch_trim(buf);
+        return luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
+    }
+    if (res != UNQLITE_OK) {
+        scratch_trim(buf);
+        return luanosql_faildirect(L, kv_errmsg(cur->conn_data, res));
+    }
+    scratch_push(L, buf);
+    return 1;
+}
+
+/*
+** Use a cursor to get a key decoded into a Lua value: an integer key
+** gives the integer, a tuple key the tuple table and any other key the
+** string, as cur:cursor_key.
+** @param L the lua state
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_get_typed_key(lua_State *L)
+{
+    int res;
+    cur_data *cur = getcursor(L);
+    scratch_buf *buf = &cur->conn_data->fetch_buf;
+
+    buf->len = 0;
+    res = unqlite_kv_cursor_key_callback(cur->cursor, scratch_consumer, buf);
+    if (res != UNQLITE_OK) {
+        scratch_trim(buf);
+        return luanosql_faildirect(L, kv_errmsg(cur->conn_data, res));
+    }
+    key_push(L, buf->data, buf->len);
+    scratch_trim(buf);
+    return 1;
+}
+
+/*
+** Use a cursor to get a data. Data is streamed by the engine into the
+** connection read buffer (a single lookup, no length probe), then pushed.
+** cur:cursor_data([asblob]) - with asblob true data is returned in a blob.
+** It wraps unqlite_kv_cursor_data_callback.
+** int unqlite_kv_cursor_data_callback(unqlite_kv_cursor *pCursor,
+**    int (*xConsumer)(const void *pData,unsigned int iDataLen,void *pUserData),
+**    void *pUserData);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int cur_get_data(lua_State *L)
+{
+    int res;
+    cur_data *cur = getcursor(L);
+    scratch_buf *buf = &cur->conn_data->fetch_buf;
+
+    if (lua_toboolean(L, 2))
+        buf = &create_blob(L)->buf;
+    buf->len = 0;
+    res = unqlite_kv_cursor_data_callback(cur->cursor, scratch_consumer, buf);
+    if (res == UNQLITE_OK)
+        res = codec_decode(cur->conn_data, buf);
+    /* records not fitting in a size_t (32 bit builds) abort here too */
+    if (res == UNQLITE_ABORT) {
+        scratch_trim(buf);
+        return luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
+    }
+    if (res != UNQLITE_OK) {
+        scratch_trim(buf);
+        return luanosql_faildirect(L, kv_errmsg(cur->conn_data, res));
+    }
+    if (buf != &cur->conn_data->fetch_buf)
+        return 1;   /* the blob */
+    scratch_push(L, buf);
+    return 1;
+}
+
+/*
+** Read up to n records starting at the current cursor entry and advance the
+** cursor past them. Keys are stored at tkeys[1..count] and, unless tvals is
+** 0, data at tvals[1..count]. Stale entries after count are left untouched.
+** @param L the lua state
+** @param cur the cursor
+** @param n maximum number of records
+** @param tkeys stack index of the keys table
+** @param tvals stack index of the values table or 0 to skip data
+** @param count where the number of records read is stored
+** @return integer UnQLite result code
+*/
+static int cur_fill(lua_State *L, cur_data *cur, int n, int tkeys, int tvals, int *count)
+{
+    int res = UNQLITE_OK;
+    scratch_buf *buf = &cur->conn_data->fetch_buf;
+    *count = 0;
+    while (*count < n && unqlite_kv_cursor_valid_entry(cur->cursor)) {
+        buf->len = 0;
+        res = unqlite_kv_cursor_key_callback(cur->cursor, scratch_consumer, buf);
+        if (res != UNQLITE_OK)
+            break;
+        scratch_push(L, buf);
+        lua_rawseti(L, tkeys, *count + 1);
+        if (tvals) {
+            res = unqlite_kv_cursor_data_callback(cur->cursor, scratch_consumer, buf);
+            if (res == UNQLITE_OK)
+                res = codec_decode(cur->conn_data, buf);
+            if (res != UNQLITE_OK)
+                break;
+            scratch_push(L, buf);
+            lua_rawseti(L, tvals, *count + 1);
+        }
+        (*count)++;
+        STATS_CALL(cur->conn_data, ST_CURSOR, res, unqlite_kv_cursor_next_entry(cur->cursor), 0);
+        if (res != UNQLITE_OK) {
+            /* running past the last entry is not an error */
+            if (!unqlite_kv_cursor_valid_entry(cur->cursor))
+                res = UNQLITE_OK;
+            break;
+        }
+    }
+    if (res != UNQLITE_OK)
+        scratch_trim(buf);
+    return res;
+}
+
+/*
+** Read a batch of records from the current entry in one call.
+** cur:scan(n [, keys_only])
+** The cursor is left on the entry following the last one returned, so
+** repeated calls walk the whole keyspace. Use first_entry or seek first.
+** @param L the lua state 
+** @return integer 2: an array of keys and an array of data (nil when
+** keys_only is true), both empty at the end; or luanosql_faildirect
+*/
+static int cur_scan(lua_State *L)
+{
+    int res, count;
+    cur_data *cur = getcursor(L);
+    int n = luaL_checkint(L, 2);
+    int keys_only = lua_toboolean(L, 3);
+    luaL_argcheck(L, n > 0, 2, LUANOSQL_PREFIX"batch size must be positive");
+    lua_settop(L, 1);
+    lua_createtable(L, n, 0);
+    if (keys_only)
+        lua_pushnil(L);
+    else
+        lua_createtable(L, n, 0);
+    res = cur_fill(L, cur, n, 2, keys_only ? 0 : 3, &count);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(cur->conn_data, res));
+    return 2;
+}
+
+/*
+** Iterator function returned by cur:records().
+** Upvalues: cursor, keys table, values table (or nil), batch size,
+** position in the batch, records in the batch.
+*/
+static int cur_records_iter(lua_State *L)
+{
+    int res, count;
+    cur_data *cur = (cur_data *)lua_touserdata(L, lua_upvalueindex(1));
+    int keys_only = lua_isnil(L, lua_upvalueindex(3));
+    int pos = (int)lua_tointeger(L, lua_upvalueindex(5));
+    count = (int)lua_tointeger(L, lua_upvalueindex(6));
+
+    if (pos >= count) {
+        /* batch consumed, refill it */
+        if (cur->closed)
+            return luaL_error(L, LUANOSQL_PREFIX"cursor is closed");
+        res = cur_fill(L, cur, (int)lua_tointeger(L, lua_upvalueindex(4)),
+                       lua_upvalueindex(2), keys_only ? 0 : lua_upvalueindex(3), &count);
+        if (res != UNQLITE_OK)
+            return luaL_error(L, LUANOSQL_PREFIX"%s", kv_errmsg(cur->conn_data, res));
+        lua_pushinteger(L, count);
+        lua_replace(L, lua_upvalueindex(6));
+        pos = 0;
+        if (count == 0)
+            return 0;
+    }
+    pos++;
+    lua_pushinteger(L, pos);
+    lua_replace(L, lua_upvalueindex(5));
+    lua_rawgeti(L, lua_upvalueindex(2), pos);
+    if (keys_only)
+        return 1;
+    lua_rawgeti(L, lua_upvalueindex(3), pos);
+    return 2;
+}
+
+#ifndef LUANOSQL_OMIT_THREADS
+static int shared_run(lua_State *L, conn_data *conn);
+
+/*
+** Iterator of the cursors of shared connections: it runs the plain
+** iterator in upvalue 1 holding the lock of the handle, like the cursor
+** methods. Upvalue 2 is the cursor.
+*/
+static int shared_records_iter(lua_State *L)
+{
+    cur_data *cur = (cur_data *)lua_touserdata(L, lua_upvalueindex(2));
+    return shared_run(L, cur->closed ? NULL : cur->conn_data);
+}
+#endif
+
+/*
+** Return a generic-for iterator over the records, fetched from the engine
+** in batches of n. It starts at the current entry, or at the first one when
+** the cursor does not point to a valid entry.
+** for key, data in cur:records([n [, keys_only]]) do ... end
+** @param L the lua state 
+** @return integer 1 (the iterator) or luanosql_faildirect
+*/
+static int cur_records(lua_State *L)
+{
+    int res;
+    cur_data *cur = getcursor(L);
+    int n = luaL_optint(L, 2, 256);
+    int keys_only = lua_toboolean(L, 3);
+    luaL_argcheck(L, n > 0, 2, LUANOSQL_PREFIX"batch size must be positive");
+    if (!unqlite_kv_cursor_valid_entry(cur->cursor)) {
+        STATS_CALL(cur->conn_data, ST_CURSOR, res, unqlite_kv_cursor_first_entry(cur->cursor), 0);
+        if (res != UNQLITE_OK && res != UNQLITE_DONE && res != UNQLITE_EOF)
+            return luanosql_faildirect(L, kv_errmsg(cur->conn_data, res));
+    }
+    lua_settop(L, 1);
+    lua_createtable(L, n, 0);
+    if (keys_only)
+        lua_pushnil(L);
+    else
+        lua_createtable(L, n, 0);
+    lua_pushinteger(L, n);
+    lua_pushinteger(L, 0);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, cur_records_iter, 6);
+#ifndef LUANOSQL_OMIT_THREADS
+    if (cur->conn_data->shared != NULL) {
+        lua_pushlightuserdata(L, cur);  /* kept alive by the plain iterator */
+        lua_pushcclosure(L, shared_records_iter, 2);
+    }
+#endif
+    return 1;
+}
+
+/*
+** Streaming reads: a record is delivered to a Lua sink in chunks of a fixed
+** size, so reading a huge record never needs more than one chunk of memory.
+** The sink is either a function, called as sink(chunk), or an io file
+** handle written to directly.
+*/
+
+/* Default chunk size for streaming reads */
+#ifndef LUANOSQL_STREAM_CHUNK
+#define LUANOSQL_STREAM_CHUNK (64*1024)
+#endif
+
+/* Streaming read state, lives on the C stack for one call */
+typedef struct
+{
+    lua_State     *L;                  /**< calling lua state */
+    int           sink;                /**< stack index of the sink function */
+    FILE          *fp;                 /**< sink file, when an io file handle is given */
+    char          *buf;                /**< chunk buffer */
+    size_t        size;                /**< chunk size */
+    size_t        len;                 /**< bytes waiting in buf */
+    unqlite_int64 total;               /**< bytes delivered */
+    int           failed;              /**< 1 if the sink failed, message on stack top */
+} stream_ctx;
+
+
+/*
+** Hand the buffered bytes to the sink.
+** @return integer 0 if ok, -1 on failure (message pushed on the stack)
+*/
+static int stream_flush(stream_ctx *ctx)
+{
+    if (ctx->len == 0)
+        return 0;
+    if (ctx->fp != NULL) {
+        if (fwrite(ctx->buf, 1, ctx->len, ctx->fp) != ctx->len) {
+            lua_pushstring(ctx->L, "cannot write to file");
+            return -1;
+        }
+    }
+    else {
+        lua_pushvalue(ctx->L, ctx->sink);
+        lua_pushlstring(ctx->L, ctx->buf, ctx->len);
+        if (lua_pcall(ctx->L, 1, 0, 0) != 0)
+            return -1;
+    }
+    ctx->total += ctx->len;
+    ctx->len = 0;
+    return 0;
+}
+
+/*
+** UnQLite data consumer filling the chunk buffer and flushing it when full.
+** @param pUserData passed is a stream_ctx
+** @return integer UNQLITE_OK or UNQLITE_ABORT if the sink failed
+*/
+static int stream_consumer(const void *pData, unsigned int iDataLen, void *pUserData)
+{
+    stream_ctx *ctx = (stream_ctx *)pUserData;
+    const char *p = (const char *)pData;
+    while (iDataLen > 0) {
+        size_t n = ctx->size - ctx->len;
+        if (n > iDataLen)
+            n = iDataLen;
+        memcpy(ctx->buf + ctx->len, p, n);
+        ctx->len += n;
+        p += n;
+        iDataLen -= (unsigned int)n;
+        if (ctx->len == ctx->size && stream_flush(ctx) != 0) {
+            ctx->failed = 1;
+            return UNQLITE_ABORT;
+        }
+    }
+    return UNQLITE_OK;
+}
+
+/*
+** Set up a streaming read for the sink at index sink and the optional
+** chunk size at index sink + 1.
+** @param L the lua state
+** @param ctx the streaming read state to initialize
+** @param sink stack index of the sink
+** @return void (raises a Lua error on bad arguments or out of memory)
+*/
+static void stream_init(lua_State *L, stream_ctx *ctx, int sink)
+{
+    lua_Integer size = luaL_optinteger(L, sink + 1, LUANOSQL_STREAM_CHUNK);
+    luaL_argcheck(L, size > 0, sink + 1, LUANOSQL_PREFIX"chunk size must be positive");
+    ctx->L = L;
+    ctx->sink = sink;
+    ctx->fp = tofile(L, sink);
+    if (ctx->fp == NULL)
+        luaL_checktype(L, sink, LUA_TFUNCTION);
+    ctx->size = (size_t)size;
+    ctx->len = 0;
+    ctx->total = 0;
+    ctx->failed = 0;
+    ctx->buf = (char *)malloc(ctx->size);
+    if (ctx->buf == NULL)
+        luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
+}
+
+/*
+** Finish a streaming read and push its results.
+** @param L the lua state
+** @param ctx the streaming read state
+** @param conn the connection
+** @param res result of the engine call
+** @return integer 2: true and the number of bytes (nil if the record does
+** not exist), or nil and err
+*/
+static int stream_finish(lua_State *L, stream_ctx *ctx, conn_data *conn, int res)
+{
+    if (res == UNQLITE_OK && stream_flush(ctx) != 0) {
+        ctx->failed = 1;
+        res = UNQLITE_ABORT;
+    }
+    free(ctx->buf);
+    ctx->buf = NULL;
+    if (ctx->failed)
+        return luanosql_faildirect(L, lua_tostring(L, -1));
+    if (ctx->fp != NULL)
+        fflush(ctx->fp);
+    lua_pushboolean(L, 1);
+    if (res == UNQLITE_NOTFOUND) {
+        lua_pushnil(L);
+        return 2;
+    }
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushnumber(L, (lua_Number)ctx->total);
+    return 2;
+}
+
+/*
+** Stream the data of the current cursor entry to a sink.
+** cur:cursor_data_stream(sink [, chunk_size])
+** It wraps unqlite_kv_cursor_data_callback.
+** @param L the lua state 
+** @return integer 2: true and the number of bytes, or luanosql_faildirect
+*/
+static int cur_data_stream(lua_State *L)
+{
+    int res;
+    stream_ctx ctx;
+    cur_data *cur = getcursor(L);
+    codec_stream cs;
+    stream_init(L, &ctx, 2);
+    memset(&cs, 0, sizeof(cs));
+    cs.conn = cur->conn_data;
+    cs.xConsumer = stream_consumer;
+    cs.ud = &ctx;
+    res = unqlite_kv_cursor_data_callback(cur->cursor, codec_stream_consumer, &cs);
+    res = codec_stream_finish(&cs, res);
+    return stream_finish(L, &ctx, cur->conn_data, res);
+}
+
+/*
+** Group commit: writes are counted and committed together once the
+** policy limits are reached, instead of one commit per write.
+*/
+
+/*
+** Flush the write buffer and commit the current transaction, timing it.
+** Pending writes are reset on success.
+** @param conn the connection
+** @return integer UnQLite result code
+*/
+static int commit_now(conn_data *conn)
+{
+    commit_policy *cp = &conn->commit;
+    double t0 = now_ms(), dt;
+    int res = wb_flush(conn);
+    if (res == UNQLITE_OK)
+        res = unqlite_commit(conn->unqlite_conn);
+    STATS_NOTE(conn, ST_COMMIT, t0, res, 0);
+    dt = now_ms() - t0;
+    cp->commits++;
+    cp->total_ms += dt;
+    if (dt > cp->worst_ms)
+        cp->worst_ms = dt;
+    if (res == UNQLITE_OK) {
+        cp->ops = 0;
+        cp->bytes = 0;
+        *sidecar_flag(conn) = 0;    /* the next write deletes it again */
+    }
+    return res;
+}
+
+/*
+** Account a write done through the connection and commit when one of the
+** policy limits is reached. The time limit is checked on writes only.
+** @param conn the connection
+** @param bytes bytes written (key and data)
+** @return integer UnQLite result code of the commit, UNQLITE_OK if none
+*/
+static int commit_note(conn_data *conn, size_t bytes)
+{
+    commit_policy *cp = &conn->commit;
+    int res;
+    if (cp->max_ops == 0 && cp->max_bytes == 0 && cp->max_ms <= 0)
+        return UNQLITE_OK;
+    if (cp->ops++ == 0 && cp->max_ms > 0)
+        cp->first_ms = now_ms();
+    cp->bytes += bytes;
+    if ((cp->max_ops > 0 && cp->ops >= cp->max_ops) ||
+        (cp->max_bytes > 0 && cp->bytes >= cp->max_bytes) ||
+        (cp->max_ms > 0 && now_ms() - cp->first_ms >= cp->max_ms)) {
+        res = commit_now(conn);
+        if (res == UNQLITE_OK)
+            cp->auto_commits++;
+        return res;
+    }
+    return UNQLITE_OK;
+}
+
+
+/*
+** Environment connection pool. Closed connections hand their handle back
+** to the environment, a later connect to the same path with the same open
+** flags and engine settings reuses it instead of opening the file again.
+*/
+
+/*
+** Close the idle handle at position i and remove it from the pool.
+** @param env the environment
+** @param i position in the pool
+** @return void
+*/
+static void pool_evict(env_data *env, int i)
+{
+    pool_entry *e = &env->pool[i];
+    unqlite_close(e->db);
+    free(e->path);
+    free(e->engine);
+    env->pool_count--;
+    memmove(e, e + 1, sizeof(pool_entry) * (env->pool_count - i));
+    env->pool_evictions++;
+}
+
+/*
+** Close the handles idle for longer than the pool timeout, or all of them
+** that do not fit in size.
+** @param env the environment
+** @param size handles to keep at most
+** @return void
+*/
+static void pool_trim(env_data *env, int size)
+{
+    time_t now = time(NULL);
+    while (env->pool_count > 0 && (env->pool_count > size ||
+           (env->pool_idle > 0 && difftime(now, env->pool[0].idle_since) >= env->pool_idle)))
+        pool_evict(env, 0);
+}
+
+/*
+** Take an idle handle out of the pool.
+** @param env the environment
+** @param path database path
+** @param engine KV engine name or NULL
+** @param flags UNQLITE_OPEN_* flags
+** @param config wanted engine settings
+** @param old receives the settings of the handle taken
+** @return unqlite* the handle, NULL if none matches
+*/
+static unqlite *pool_take(env_data *env, const char *path, const char *engine, int flags,
+                          const conn_config *config, conn_config *old)
+{
+    int i;
+    unqlite *db;
+    pool_trim(env, env->pool_size);
+    for (i = env->pool_count - 1; i >= 0; i--) {
+        pool_entry *e = &env->pool[i];
+        if (e->flags == flags && e->config.auto_commit == config->auto_commit &&
+            e->config.hash == config->hash && e->config.cmp == config->cmp &&
+            strcmp(e->path, path) == 0 &&
+            (e->engine == NULL ? engine == NULL : engine != NULL && strcmp(e->engine, engine) == 0))
+            break;
+    }
+    if (i < 0) {
+        env->pool_misses++;
+        return NULL;
+    }
+    db = env->pool[i].db;
+    *old = env->pool[i].config;
+    free(env->pool[i].path);
+    free(env->pool[i].engine);
+    env->pool_count--;
+    memmove(&env->pool[i], &env->pool[i + 1], sizeof(pool_entry) * (env->pool_count - i));
+    env->pool_hits++;
+    return db;
+}
+
+/*
+** Hand the handle of a connection being closed back to the pool. The
+** transaction is ended as unqlite_close would: committed, or rolled back
+** when auto commit is off. In-memory databases are never pooled.
+** @param env the environment
+** @param conn the connection
+** @return integer 1 if the pool took the handle, 0 if it must be closed
+*/
+static int pool_put(env_data *env, conn_data *conn)
+{
+    pool_entry *e;
+    int res;
+    if (env->closed || env->pool_size <= 0 || conn->path == NULL ||
+        (conn->open_flags & UNQLITE_OPEN_IN_MEMORY) || strcmp(conn->path, ":mem:") == 0)
+        return 0;
+#ifndef LUANOSQL_OMIT_JX9_DOCSTORE
+    if (conn->vm_counter > 0)
+        return 0;
+#endif
+    if (env->pool == NULL) {
+        env->pool = (pool_entry *)malloc(sizeof(pool_entry) * env->pool_size);
+        if (env->pool == NULL)
+            return 0;
+    }
+    if (conn->config.auto_commit)
+        res = unqlite_commit(conn->unqlite_conn);
+    else
+        res = unqlite_rollback(conn->unqlite_conn);
+    if (res != UNQLITE_OK)
+        return 0;
+    pool_trim(env, env->pool_size - 1);
+    e = &env->pool[env->pool_count++];
+    e->db = conn->unqlite_conn;
+    e->path = conn->path;
+    e->engine = conn->engine;
+    e->flags = conn->open_flags;
+    e->config = conn->config;
+    e->idle_since = time(NULL);
+    conn->path = conn->engine = NULL;
+    return 1;
+}
+
+
+#ifndef LUANOSQL_OMIT_THREADS
+/* Registry of the shared handles, guarded by shared_list_lock */
+static shared_handle *shared_list = NULL;
+
+#ifdef _WIN32
+static CRITICAL_SECTION shared_list_lock;
+static volatile LONG shared_list_init = 0;
+
+/*
+** Lock the registry, initializing its lock on first use.
+** @return void
+*/
+static void registry_lock(void)
+{
+    if (InterlockedCompareExchange(&shared_list_init, 1, 0) == 0) {
+        InitializeCriticalSection(&shared_list_lock);
+        InterlockedExchange(&shared_list_init, 2);
+    }
+    while (shared_list_init != 2)
+        Sleep(0);
+    EnterCriticalSection(&shared_list_lock);
+}
+#define registry_unlock() LeaveCriticalSection(&shared_list_lock)
+#else
+static pthread_mutex_t shared_list_lock = PTHREAD_MUTEX_INITIALIZER;
+#define registry_lock()   pthread_mutex_lock(&shared_list_lock)
+#define registry_unlock() pthread_mutex_unlock(&shared_list_lock)
+#endif
+
+/*
+** Attach to the shared handle of a database, opening it if needed.
+** Called with the registry lock held, which the caller keeps while it
+** applies the engine settings of a handle it opened.
+** @param fresh set to 1 when the database was opened by this call
+** @param res receives the UnQLite result code
+** @return shared_handle* the handle (one more reference) or NULL
+*/
+static shared_handle *shared_attach(const char *path, int flags, int *fresh, int *res)
+{
+    shared_handle *sh;
+    *fresh = 0;
+    *res = UNQLITE_OK;
+    for (sh = shared_list; sh != NULL; sh = sh->next) {
+        if (sh->flags == flags && strcmp(sh->path, path) == 0) {
+            sh->refs++;
+            return sh;
+        }
+    }
+    sh = (shared_handle *)calloc(1, sizeof(shared_handle));
+    if (sh == NULL || (sh->path = str_dup(path)) == NULL) {
+        free(sh);
+        *res = UNQLITE_NOMEM;
+        return NULL;
+    }
+    *res = unqlite_open(&sh->db, path, flags);
+    if (*res != UNQLITE_OK) {
+        unqlite_close(sh->db);
+        free(sh->path);
+        free(sh);
+        return NULL;
+    }
+    lns_mutex_init(&sh->lock);
+    sh->flags = flags;
+    sh->refs = 1;
+    sh->next = shared_list;
+    shared_list = sh;
+    *fresh = 1;
+    return sh;
+}
+
+/*
+** Close a shared handle unlinked from the registry.
+** @return void
+*/
+static void shared_free(shared_handle *sh)
+{
+    unqlite_close(sh->db);
+    lns_mutex_destroy(&sh->lock);
+    free(sh->path);
+    free(sh);
+}
+
+/*
+** Drop a reference to a shared handle, the last one closes the database
+** (which commits, as unqlite_close does).
+** @return void
+*/
+static void shared_release(shared_handle *sh)
+{
+    shared_handle **p;
+    registry_lock();
+    if (--sh->refs > 0) {
+        registry_unlock();
+        return;
+    }
+    for (p = &shared_list; *p != NULL; p = &(*p)->next) {
+        if (*p == sh) {
+            *p = sh->next;
+            break;
+        }
+    }
+    registry_unlock();
+    shared_free(sh);
+}
+
+/*
+** Run the method in upvalue 1 holding the lock of the shared handle of
+** conn. A connection closed by the method keeps its reference to the
+** handle (and so the lock) until the lock is released, see conn_gc.
+** Errors are raised again once the lock is released.
+** @param conn the connection, NULL when the object is closed
+** @return integer the results of the method
+*/
+static int shared_run(lua_State *L, conn_data *conn)
+{
+    int status, n = lua_gettop(L);
+    lua_CFunction method;
+    shared_handle *sh = conn != NULL ? conn->shared : NULL;
+    if (sh == NULL) {   /* closed, the method reports it */
+        method = lua_tocfunction(L, lua_upvalueindex(1));
+        return method(L);
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lns_mutex_lock(&sh->lock);
+    status = lua_pcall(L, n, LUA_MULTRET, 0);
+    lns_mutex_unlock(&sh->lock);
+    if (conn->closed) {
+        conn->shared = NULL;
+        shared_release(sh);
+    }
+    if (status != 0)
+        return lua_error(L);
+    return lua_gettop(L);
+}
+
+/*
+** Method wrapper of shared connections.
+** @param L the lua state
+** @return integer the results of the method
+*/
+static int shared_conn_call(lua_State *L)
+{
+    conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUANOSQL_SHARED_CONNECTION_UNQLITE);
+    return shared_run(L, conn->closed ? NULL : conn);
+}
+
+/*
+** Method wrapper of the cursors of shared connections.
+** @param L the lua state
+** @return integer the results of the method
+*/
+static int shared_cur_call(lua_State *L)
+{
+    cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUANOSQL_SHARED_CURSOR_UNQLITE);
+    return shared_run(L, cur->closed ? NULL : cur->conn_data);
+}
+
+/*
+** Create the metatable of shared objects: the methods of the plain one,
+** each wrapped by call.
+** @return void
+*/
+static void shared_createmeta(lua_State *L, const char *name, const luaL_Reg *methods,
+                              lua_CFunction call)
+{
+    luanosql_createmeta(L, name, methods);
+    for (; methods->name != NULL; methods++) {
+        lua_pushcfunction(L, methods->func);
+        lua_pushcclosure(L, call, 1);
+        lua_setfield(L, -2, methods->name);
+    }
+}
+#endif /* LUANOSQL_OMIT_THREADS */
+
+#ifdef LUANOSQL_ASYNC
+/*
+** Asynchronous operations. conn:kvfetch_async and the other *_async
+** methods queue the operation for the worker threads of the environment
+** and return at once an async object: async:ready() polls it, async:wait()
+** blocks until it is done and async:result() gives what the synchronous
+** method would have returned. Each completion is also signalled on a
+** descriptor an event loop can watch (env:async_fd, an eventfd on Linux,
+** a pipe elsewhere); env:async_poll clears it.
+** Workers run the engine calls holding the lock of a shared handle, so
+** the operations are available on shared connections only. The
+** operations of one handle run in the order they were queued.
+*/
+
+/* Worker threads of an environment, started by its first async operation */
+#ifndef LUANOSQL_ASYNC_THREADS
+#define LUANOSQL_ASYNC_THREADS 2
+#endif
+
+/* Async operations */
+#define AS_FETCH  0
+#define AS_STORE  1
+#define AS_APPEND 2
+#define AS_DELETE 3
+#define AS_COMMIT 4
+
+/* Async job states */
+#define AS_QUEUED  0
+#define AS_RUNNING 1
+#define AS_DONE    2
+
+typedef struct async_pool async_pool;
+
+/* An operation for the workers */
+typedef struct async_job
+{
+    int          op;                  /**< AS_* operation */
+    short        state;               /**< AS_QUEUED, AS_RUNNING or AS_DONE */
+    short        orphan;              /**< its async object was collected while running */
+    shared_handle *sh;                /**< handle it runs on (one reference) */
+    async_pool   *pool;
+    char         *key;                /**< key then data, one allocation */
+    size_t       klen;
+    size_t       dlen;
+    scratch_buf  out;                 /**< fetched record */
+    int          res;                 /**< UnQLite result code */
+    char         *errmsg;             /**< error message or NULL */
+    struct async_job *next;           /**< next queued job */
+} async_job;
+
+/* A worker thread */
+typedef struct
+{
+    pthread_t       thread;
+    shared_handle   *running;         /**< handle of the job it runs or NULL */
+    struct async_pool *pool;
+} async_worker;
+
+/* Worker threads and queue of an environment */
+struct async_pool
+{
+    pthread_mutex_t lock;             /**< guards everything below and the job states */
+    pthread_cond_t  work;             /**< signalled when a job can run or on stop */
+    pthread_cond_t  done;             /**< broadcast on each completion */
+    async_job       *head, *tail;     /**< queued jobs, oldest first */
+    async_worker    *workers;
+    int             nthreads;         /**< workers started */
+    int             stop;             /**< set when the environment is closed */
+    int             refs;             /**< the environment and the live jobs */
+    int             fd[2];            /**< completion descriptor: read end, write end */
+    unsigned long   completed;        /**< completions not yet seen by env:async_poll */
+};
+
+/* Async object */
+typedef struct
+{
+    async_job   *job;                 /**< NULL once collected */
+} async_data;
+
+/*
+** Take one more reference to a shared handle.
+** @return void
+*/
+static void shared_retain(shared_handle *sh)
+{
+    registry_lock();
+    sh->refs++;
+    registry_unlock();
+}
+
+/*
+** Free an async job. The pool lock must not be held.
+** @return void
+*/
+static void async_free_job(async_job *job)
+{
+    shared_release(job->sh);
+    scratch_free(&job->out);
+    free(job->errmsg);
+    free(job->key);
+    free(job);
+}
+
+/*
+** Free the pool once the environment and all the jobs are gone.
+** @return void
+*/
+static void async_pool_free(async_pool *pool)
+{
+    close(pool->fd[0]);
+    if (pool->fd[1] != pool->fd[0])
+        close(pool->fd[1]);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+** Drop a reference to the pool.
+** @return void
+*/
+static void async_pool_unref(async_pool *pool)
+{
+    int last;
+    pthread_mutex_lock(&pool->lock);
+    last = --pool->refs == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (last)
+        async_pool_free(pool);
+}
+
+/*
+** Take the oldest queued job whose handle is not in use by another worker.
+** Called with the pool lock held.
+** @param w the calling worker
+** @return async_job* the job or NULL
+*/
+static async_job *async_next(async_pool *pool, async_worker *w)
+{
+    async_job *job, *prev = NULL;
+    int i;
+    for (job = pool->head; job != NULL; prev = job, job = job->next) {
+        for (i = 0; i < pool->nthreads; i++)
+            if (pool->workers[i].running == job->sh)
+                break;
+        if (i < pool->nthreads)
+            continue;
+        if (prev == NULL)
+            pool->head = job->next;
+        else
+            prev->next = job->next;
+        if (pool->tail == job)
+            pool->tail = prev;
+        job->next = NULL;
+        job->state = AS_RUNNING;
+        w->running = job->sh;
+        return job;
+    }
+    return NULL;
+}
+
+/*
+** Run a job holding the lock of its handle.
+** @return void
+*/
+static void async_exec(async_job *job)
+{
+    shared_handle *sh = job->sh;
+    value_codec vc;
+    const char *errmsg;
+    lns_mutex_lock(&sh->lock);
+    switch (job->op) {
+    case AS_FETCH:
+        job->res = unqlite_kv_fetch_callback(sh->db, job->key, (int)job->klen,
+                                             scratch_consumer, &job->out);
+        if (job->res == UNQLITE_OK && IS_ENCODED(job->out.data, job->out.len) && codec_marked(sh->db)) {
+            memset(&vc, 0, sizeof(vc));
+            job->res = value_decode(&vc, &job->out);
+            scratch_free(&vc.tmp);
+        }
+        break;
+    case AS_STORE:
+        job->res = unqlite_kv_store(sh->db, job->key, (int)job->klen,
+                                    job->key + job->klen, (unqlite_int64)job->dlen);
+        break;
+    case AS_APPEND:
+        job->res = unqlite_kv_append(sh->db, job->key, (int)job->klen,
+                                     job->key + job->klen, (unqlite_int64)job->dlen);
+        break;
+    case AS_DELETE:
+        job->res = unqlite_kv_delete(sh->db, job->key, (int)job->klen);
+        break;
+    default:
+        job->res = unqlite_commit(sh->db);
+        if (job->res == UNQLITE_OK)
+            sh->sidecar_gone = 0;
+        break;
+    }
+    if (job->op != AS_FETCH && job->op != AS_COMMIT && job->res == UNQLITE_OK) {
+        sh->writes++;   /* the key indexes of its connections are out of date */
+        sidecar_delete(sh->db, &sh->sidecar_gone);
+    }
+    if (job->res != UNQLITE_OK && job->res != UNQLITE_NOTFOUND) {
+        errmsg = engine_errmsg(sh->db, job->res);
+        job->errmsg = str_dup(errmsg);
+    }
+    lns_mutex_unlock(&sh->lock);
+}
+
+/*
+** Signal a completion on the descriptor of the pool.
+** @return void
+*/
+static void async_notify(async_pool *pool)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = write(pool->fd[1], &one, sizeof(one));
+#else
+    ssize_t n = write(pool->fd[1], "", 1);     /* a full pipe is readable anyway */
+#endif
+    (void)n;
+}
+
+/*
+** Worker thread: run queued jobs until the pool is stopped and empty.
+** @param arg the async_worker
+** @return void* NULL
+*/
+static void *async_worker_main(void *arg)
+{
+    async_worker *w = (async_worker *)arg;
+    async_pool *pool = w->pool;
+    async_job *job;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        job = async_next(pool, w);
+        if (job == NULL) {
+            if (pool->stop && pool->head == NULL)
+                break;
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        async_exec(job);
+        pthread_mutex_lock(&pool->lock);
+        w->running = NULL;
+        if (pool->head != NULL)
+            pthread_cond_broadcast(&pool->work);  /* jobs of this handle can run */
+        if (job->orphan) {
+            pool->refs--;
+            pthread_mutex_unlock(&pool->lock);
+            async_free_job(job);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+        job->state = AS_DONE;
+        pool->completed++;
+        async_notify(pool);
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+** Stop the worker pool of an environment: the queued operations are run
+** first. The pool itself lives on while async objects use it.
+** @param env the environment
+** @return void
+*/
+static void async_pool_stop(env_data *env)
+{
+    async_pool *pool = env->async;
+    int i;
+    if (pool == NULL)
+        return;
+    env->async = NULL;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    async_pool_unref(pool);
+}
+
+/*
+** Get the worker pool of an environment, starting it if needed.
+** @param env the environment
+** @return async_pool* the pool or NULL if it cannot be started
+*/
+static async_pool *async_pool_get(env_data *env)
+{
+    async_pool *pool = env->async;
+    int i, flags;
+    if (pool != NULL)
+        return pool;
+    pool = (async_pool *)calloc(1, sizeof(async_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = (async_worker *)calloc(LUANOSQL_ASYNC_THREADS, sizeof(async_worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+#ifdef __linux__
+    pool->fd[0] = pool->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->fd[0] < 0) {
+#else
+    if (pipe(pool->fd) != 0) {
+#endif
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+#ifndef __linux__
+    for (i = 0; i < 2; i++) {
+        flags = fcntl(pool->fd[i], F_GETFL);
+        fcntl(pool->fd[i], F_SETFL, flags | O_NONBLOCK);
+        fcntl(pool->fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->refs = 1;
+    for (i = 0; i < LUANOSQL_ASYNC_THREADS; i++) {
+        pool->workers[i].pool = pool;
+        if (pthread_create(&pool->workers[i].thread, NULL, async_worker_main, &pool->workers[i]) != 0)
+            break;
+        pool->nthreads++;
+    }
+    (void)flags;
+    env->async = pool;
+    if (pool->nthreads == 0) {
+        async_pool_stop(env);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+** Queue an operation of a shared connection and push its async object.
+** @param L the lua state
+** @param op AS_* operation
+** @return integer 1 or luanosql_faildirect
+*/
+static int async_submit(lua_State *L, int op)
+{
+    size_t klen = 0, dlen = 0, escape;
+    const char *key = NULL, *data = NULL;
+    conn_data *conn = getconnection(L);
+    env_data *env;
+    async_pool *pool;
+    async_job *job;
+    async_data *ad;
+    if (op != AS_COMMIT)
+        key = key_check(L, 2, conn, KEY_ARG, &klen);
+    if (op == AS_STORE || op == AS_APPEND)
+        data = luaL_checklstring(L, 3, &dlen);
+    if (!IS_SHARED(conn))
+        return luanosql_faildirect(L, "asynchronous operations need a shared connection");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, conn->env);
+    env = (env_data *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (env == NULL || env->closed)
+        return luanosql_faildirect(L, "environment is closed");
+    if ((pool = async_pool_get(env)) == NULL)
+        return luanosql_faildirect(L, "Cannot start the async workers");
+
+    /* a raw value starting with the tag is escaped, as kv_store does */
+    escape = op == AS_STORE && dlen > 0 && (unsigned char)data[0] == CODEC_TAG && codec_active(conn) ? 2 : 0;
+    job = (async_job *)calloc(1, sizeof(async_job));
+    if (job == NULL || (job->key = (char *)malloc(klen + escape + dlen + 1)) == NULL) {
+        free(job);
+        return luanosql_faildirect(L, "Cannot allocate async operation");
+    }
+    if (klen)
+        memcpy(job->key, key, klen);
+    if (escape) {
+        job->key[klen] = (char)CODEC_TAG;
+        job->key[klen + 1] = CODEC_RAW;
+    }
+    if (dlen)
+        memcpy(job->key + klen + escape, data, dlen);
+    dlen += escape;
+    job->op = op;
+    job->klen = klen;
+    job->dlen = dlen;
+    job->pool = pool;
+    job->sh = conn->shared;
+    shared_retain(job->sh);
+
+    ad = (async_data *)lua_newuserdata(L, sizeof(async_data));
+    ad->job = job;
+    luanosql_setmeta(L, LUANOSQL_ASYNC_UNQLITE);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->refs++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+/*
+** Fetch a record on the worker threads.
+** conn:kvfetch_async(key) - async:result() gives true, data (nil data
+** when the key is missing) or nil, errmsg.
+** @param L the lua state
+** @return integer 1 (the async object) or luanosql_faildirect
+*/
+static int conn_kv_fetch_async(lua_State *L)
+{
+    return async_submit(L, AS_FETCH);
+}
+
+/*
+** Store a record on the worker threads.
+** conn:kvstore_async(key, data) - async:result() gives true or nil, errmsg.
+** @param L the lua state
+** @return integer 1 (the async object) or luanosql_faildirect
+*/
+static int conn_kv_store_async(lua_State *L)
+{
+    return async_submit(L, AS_STORE);
+}
+
+/*
+** Append to a record on the worker threads.
+** conn:kvappend_async(key, data) - async:result() gives true or nil, errmsg.
+** @param L the lua state
+** @return integer 1 (the async object) or luanosql_faildirect
+*/
+static int conn_kv_append_async(lua_State *L)
+{
+    return async_submit(L, AS_APPEND);
+}
+
+/*
+** Delete a record on the worker threads.
+** conn:kvdelete_async(key) - async:result() gives true (missing keys
+** included) or nil, errmsg.
+** @param L the lua state
+** @return integer 1 (the async object) or luanosql_faildirect
+*/
+static int conn_kv_delete_async(lua_State *L)
+{
+    return async_submit(L, AS_DELETE);
+}
+
+/*
+** Commit on the worker threads (the commit policy counters are left alone).
+** conn:commit_async() - async:result() gives true or nil, errmsg.
+** @param L the lua state
+** @return integer 1 (the async object) or luanosql_faildirect
+*/
+static int conn_commit_async(lua_State *L)
+{
+    return async_submit(L, AS_COMMIT);
+}
+
+/*
+** Check for a valid async object.
+** @param L the lua state
+** @return async_job* its job
+*/
+static async_job *getasync(lua_State *L)
+{
+    async_data *ad = (async_data *)luaL_checkudata(L, 1, LUANOSQL_ASYNC_UNQLITE);
+    luaL_argcheck(L, ad->job != NULL, 1, LUANOSQL_PREFIX"async object is closed");
+    return ad->job;
+}
+
+/*
+** Tell whether the operation is done.
+** @param L the lua state
+** @return integer 1 (boolean)
+*/
+static int async_ready(lua_State *L)
+{
+    async_job *job = getasync(L);
+    int done;
+    pthread_mutex_lock(&job->pool->lock);
+    done = job->state == AS_DONE;
+    pthread_mutex_unlock(&job->pool->lock);
+    lua_pushboolean(L, done);
+    return 1;
+}
+
+/*
+** Get the results of the operation, as the synchronous method returns them.
+** @param L the lua state
+** @return integer the results, or nil and a message while still running
+*/
+static int async_result(lua_State *L)
+{
+    async_job *job = getasync(L);
+    int done;
+    pthread_mutex_lock(&job->pool->lock);
+    done = job->state == AS_DONE;
+    pthread_mutex_unlock(&job->pool->lock);
+    if (!done)
+        return luanosql_faildirect(L, "operation in progress");
+    if (job->errmsg != NULL)
+        return luanosql_faildirect(L, job->errmsg);
+    if (job->res != UNQLITE_OK && !(job->res == UNQLITE_NOTFOUND &&
+                                    (job->op == AS_FETCH || job->op == AS_DELETE)))
+        return luanosql_faildirect(L, "unknown error");
+    lua_pushboolean(L, 1);
+    if (job->op != AS_FETCH)
+        return 1;
+    if (job->res == UNQLITE_NOTFOUND)
+        lua_pushnil(L);
+    else
+        lua_pushlstring(L, job->out.len ? job->out.data : "", job->out.len);
+    return 2;
+}
+
+/*
+** Wait for the operation to be done.
+** @param L the lua state
+** @return integer the results, as async:result()
+*/
+static int async_wait(lua_State *L)
+{
+    async_job *job = getasync(L);
+    pthread_mutex_lock(&job->pool->lock);
+    while (job->state != AS_DONE)
+        pthread_cond_wait(&job->pool->done, &job->pool->lock);
+    pthread_mutex_unlock(&job->pool->lock);
+    return async_result(L);
+}
+
+/*
+** Async object collector function: an operation still queued is dropped,
+** one running is left to its worker.
+** @param L the lua state
+** @return integer 0
+*/
+static int async_gc(lua_State *L)
+{
+    async_data *ad = (async_data *)luaL_checkudata(L, 1, LUANOSQL_ASYNC_UNQLITE);
+    async_job *job = ad->job, *p;
+    async_pool *pool;
+    if (job == NULL)
+        return 0;
+    ad->job = NULL;
+    pool = job->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == AS_RUNNING) {
+        job->orphan = 1;
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    if (job->state == AS_QUEUED) {
+        if (pool->head == job)
+            pool->head = job->next;
+        else {
+            for (p = pool->head; p->next != job; p = p->next)
+                ;
+            p->next = job->next;
+            if (pool->tail == job)
+                pool->tail = p;
+        }
+        if (pool->head == NULL)
+            pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    async_free_job(job);
+    async_pool_unref(pool);
+    return 0;
+}
+
+/*
+** Get the completion descriptor of the environment, starting its workers.
+** It becomes readable when an async operation is done, env:async_poll()
+** clears it.
+** @param L the lua state
+** @return integer 1 (the descriptor) or luanosql_faildirect
+*/
+static int env_async_fd(lua_State *L)
+{
+    env_data *env = getenvironment(L);
+    async_pool *pool = async_pool_get(env);
+    if (pool == NULL)
+        return luanosql_faildirect(L, "Cannot start the async workers");
+    lua_pushinteger(L, pool->fd[0]);
+    return 1;
+}
+
+/*
+** Clear the completion descriptor.
+** @param L the lua state
+** @return integer 1: the number of operations done since the last call
+*/
+static int env_async_poll(lua_State *L)
+{
+    env_data *env = getenvironment(L);
+    async_pool *pool = env->async;
+    unsigned long completed;
+    char buf[64];
+    if (pool == NULL) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (read(pool->fd[0], buf, sizeof(buf)) > 0)
+        ;
+    completed = pool->completed;
+    pool->completed = 0;
+    pthread_mutex_unlock(&pool->lock);
+    lua_pushnumber(L, (lua_Number)completed);
+    return 1;
+}
+#endif /* LUANOSQL_ASYNC */
+
+
+/**
+**  These are connection function
+*/
+
+/*
+** Connection object collector function
+** This is garbarge collection function  for data related to  a
+** connection object.
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int conn_gc(lua_State *L)
+{
+    conn_data *conn = checkconnection(L, 1);
+    if (conn != NULL && !(conn->closed))
+    {
+        if (conn->cur_counter > 0)
+            return luaL_error (L, LUANOSQL_PREFIX"there are open cursors");
+
+        /* Nullify structure fields. */
+        conn->closed = 1;
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
+        scratch_free(&conn->fetch_buf);
+        scratch_free(&conn->key_buf[0]);
+        scratch_free(&conn->key_buf[1]);
+        kindex_drop(conn);
+        wb_flush(conn);     /* on error the buffered writes are lost */
+        wb_drop(conn);
+        vc_drop(L, conn);
+        bloom_drop(conn, !(conn->open_flags & UNQLITE_OPEN_IN_MEMORY));
+        codec_drop(conn);
+        ix_drop(L, conn);
+#ifndef LUANOSQL_OMIT_THREADS
+        if (conn->shared == NULL)   /* shared_run releases the shared handle */
+#endif
+        {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, conn->env);
+            if (!pool_put((env_data *)lua_touserdata(L, -1), conn))
+                unqlite_close(conn->unqlite_conn);
+            lua_pop(L, 1);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+        free(conn->path);
+        free(conn->engine);
+        conn->path = conn->engine = NULL;
+    }
+    return 0;
+}
+
+
+/*
+** Close a Connection object.
+** @param L the lua state 
+** @return integer 1
+*/
+static int conn_close(lua_State *L)
+{
+    conn_data *conn = checkconnection(L, 1);
+    luaL_argcheck (L, conn != NULL, 1, LUANOSQL_PREFIX"connection expected");
+    if (conn->closed)
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    check_not_extracting(L, conn);
+    /* Clean up */
+    conn_gc(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+
+/*
+** Commit the current transaction.
+** This is normally not needed as closing connection allows unqlite
+** automatically commit all operations such as kvfetch,kvdelete, kvappend.
+** It wraps unqlite_commit.
+** int unqlite_commit(unqlite *pDb);
+** @param L the lua state 
+** @return integer 1 or luanosql_faildirect
+*/
+static int conn_commit(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int res;
+
+    res = commit_now(conn);
+
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/*
+** Rollback the current transaction.
+** It wraps unqlite_commit.
+** int unqlite_commit(unqlite *pDb);
+** @param L the lua state 
+** @return integer 1
+*/
+static int conn_rollback(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int res;
+
+    res = unqlite_rollback(conn->unqlite_conn);
+    /* the ordered key index may hold rolled back keys, rebuild it lazily */
+    kindex_drop(conn);
+    ix_dir_drop(conn);
+    kindex_shared_write(conn);
+    if (conn->wbuf != NULL)
+        wb_clear(conn->wbuf);
+    if (conn->vcache != NULL)
+        vc_clear(L, conn->vcache);
+    conn->commit.ops = 0;
+    conn->commit.bytes = 0;
+    /* the sidecar delete was rolled back too, rolled back keys stay in the filter */
+    *sidecar_flag(conn) = 0;
+    /* and so may have been the codec marker */
+    conn->codec_seen = 0;
+    if( res!= UNQLITE_OK)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, LUANOSQL_PREFIX);
+        lua_concat(L, 2);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Set the group commit policy: kvstore, kvappend and kvdelete commit
+** once any of the limits is reached.
+** conn:commit_policy{ops = n, bytes = n, ms = n} - a missing or 0 limit
+** is off, an empty table turns group commit off.
+** @param L the lua state
+** @return integer 1 (true)
+*/
+static int conn_commit_policy(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    commit_policy *cp = &conn->commit;
+    lua_Number ops, bytes, ms;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "ops");
+    lua_getfield(L, 2, "bytes");
+    lua_getfield(L, 2, "ms");
+    ops = lua_tonumber(L, -3);
+    bytes = lua_tonumber(L, -2);
+    ms = lua_tonumber(L, -1);
+    luaL_argcheck(L, ops >= 0 && bytes >= 0 && ms >= 0, 2,
+                  LUANOSQL_PREFIX"commit policy limits must be non negative");
+    lua_pop(L, 3);
+    cp->max_ops = (unsigned int)ops;
+    cp->max_bytes = (size_t)bytes;
+    cp->max_ms = (double)ms;
+    if (cp->ops > 0)
+        cp->first_ms = now_ms();
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Get the commit counters.
+** @param L the lua state
+** @return integer 1: a table {commits, auto_commits, pending_ops,
+** pending_bytes, total_ms, avg_ms, max_ms}
+*/
+static int conn_commit_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    commit_policy *cp = &conn->commit;
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, (lua_Number)cp->commits);
+    lua_setfield(L, -2, "commits");
+    lua_pushnumber(L, (lua_Number)cp->auto_commits);
+    lua_setfield(L, -2, "auto_commits");
+    lua_pushnumber(L, (lua_Number)cp->ops);
+    lua_setfield(L, -2, "pending_ops");
+    lua_pushnumber(L, (lua_Number)cp->bytes);
+    lua_setfield(L, -2, "pending_bytes");
+    lua_pushnumber(L, cp->total_ms);
+    lua_setfield(L, -2, "total_ms");
+    lua_pushnumber(L, cp->commits > 0 ? cp->total_ms / cp->commits : 0);
+    lua_setfield(L, -2, "avg_ms");
+    lua_pushnumber(L, cp->worst_ms);
+    lua_setfield(L, -2, "max_ms");
+    return 1;
+}
+
+/*
+** Enable, reconfigure or disable the write buffer.
+** conn:write_buffer{bytes = n, ms = n} - writes are buffered until bytes
+** key and data bytes are pending (4 MB by default) or ms milliseconds
+** passed since the first pending write (checked when writing, 0: off).
+** conn:write_buffer(false) flushes and disables it.
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
+*/
+static int conn_write_buffer(lua_State *L)
+{
+    int res;
+    lua_Number bytes, ms;
+    conn_data *conn = getconnection(L);
+    write_buffer *wb = conn->wbuf;
+    if (!lua_toboolean(L, 2)) {
+        res = wb_flush(conn);
+        if (res != UNQLITE_OK)
+            return luanosql_faildirect(L, kv_errmsg(conn, res));
+        wb_drop(conn);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (IS_SHARED(conn))
+        return luanosql_faildirect(L, "a shared connection cannot buffer writes");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "bytes");
+    lua_getfield(L, 2, "ms");
+    bytes = lua_isnil(L, -2) ? LUANOSQL_WBUF_BYTES : lua_tonumber(L, -2);
+    ms = lua_tonumber(L, -1);
+    luaL_argcheck(L, bytes > 0 && ms >= 0, 2,
+                  LUANOSQL_PREFIX"write buffer bytes must be positive and ms non negative");
+    lua_pop(L, 2);
+    if (wb == NULL) {
+        wb = (write_buffer *)calloc(1, sizeof(write_buffer));
+        if (wb == NULL || (wb->buckets = (wb_entry **)calloc(256, sizeof(wb_entry *))) == NULL) {
+            free(wb);
+            return luanosql_faildirect(L, "Cannot allocate write buffer");
+        }
+        wb->nbuckets = 256;
+        conn->wbuf = wb;
+    }
+    wb->max_bytes = (size_t)bytes;
+    wb->max_ms = (double)ms;
+    if (wb->count > 0)
+        wb->first_ms = now_ms();
+    res = wb_check(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Write the buffered writes to the engine (without committing them).
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
+*/
+static int conn_flush(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int res = wb_flush(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Get the write buffer counters.
+** @param L the lua state
+** @return integer 1: a table {writes, coalesced, flushes, flushed,
+** pending, pending_bytes}, or nil when the buffer is disabled
+*/
+static int conn_write_buffer_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    write_buffer *wb = conn->wbuf;
+    if (wb == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, (lua_Number)wb->writes);
+    lua_setfield(L, -2, "writes");
+    lua_pushnumber(L, (lua_Number)wb->coalesced);
+    lua_setfield(L, -2, "coalesced");
+    lua_pushnumber(L, (lua_Number)wb->flushes);
+    lua_setfield(L, -2, "flushes");
+    lua_pushnumber(L, (lua_Number)wb->flushed);
+    lua_setfield(L, -2, "flushed");
+    lua_pushnumber(L, (lua_Number)wb->count);
+    lua_setfield(L, -2, "pending");
+    lua_pushnumber(L, (lua_Number)wb->bytes);
+    lua_setfield(L, -2, "pending_bytes");
+    return 1;
+}
+
+/*
+** Enable, resize or disable the value cache.
+** conn:value_cache{bytes = n} - bytes is the budget (8 MB by default).
+** conn:value_cache(false) drops and disables it.
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
+*/
+static int conn_value_cache(lua_State *L)
+{
+    lua_Number bytes;
+    conn_data *conn = getconnection(L);
+    value_cache *vc = conn->vcache;
+    if (!lua_toboolean(L, 2)) {
+        vc_drop(L, conn);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (IS_SHARED(conn))
+        return luanosql_faildirect(L, "a shared connection cannot cache values");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "bytes");
+    bytes = lua_isnil(L, -1) ? LUANOSQL_VCACHE_BYTES : lua_tonumber(L, -1);
+    luaL_argcheck(L, bytes > 0, 2, LUANOSQL_PREFIX"value cache bytes must be positive");
+    lua_pop(L, 1);
+    if (vc == NULL) {
+        vc = (value_cache *)calloc(1, sizeof(value_cache));
+        if (vc == NULL || (vc->buckets = (vc_entry **)calloc(256, sizeof(vc_entry *))) == NULL) {
+            free(vc);
+            return luanosql_faildirect(L, "Cannot allocate value cache");
+        }
+        vc->nbuckets = 256;
+        conn->vcache = vc;
+    }
+    vc->max_bytes = (size_t)bytes;
+    vc_trim(L, vc, vc->max_bytes);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Get the value cache counters.
+** @param L the lua state
+** @return integer 1: a table {hits, misses, evictions, invalidations,
+** entries, bytes, max_bytes}, or nil when the cache is disabled
+*/
+static int conn_value_cache_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    value_cache *vc = conn->vcache;
+    if (vc == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, (lua_Number)vc->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, (lua_Number)vc->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, (lua_Number)vc->evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushnumber(L, (lua_Number)vc->invalidations);
+    lua_setfield(L, -2, "invalidations");
+    lua_pushnumber(L, (lua_Number)vc->count);
+    lua_setfield(L, -2, "entries");
+    lua_pushnumber(L, (lua_Number)vc->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, (lua_Number)vc->max_bytes);
+    lua_setfield(L, -2, "max_bytes");
+    return 1;
+}
 
-    /* increment vm count for this connection */
-    conn->vm_counter++;
-    /* fill in cur structure */
-    jx9_data->uvm = vm;
-    jx9_data->closed = 0;
-    jx9_data->conn = LUA_NOREF;
-    jx9_data->conn_data = conn;
-    lua_pushvalue(L, 1);
-    jx9_data->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+/*
+** Enable or disable the key bloom filter. The filter is loaded from the
+** sidecar record when one is present, built with a scan of the keys
+** otherwise.
+** conn:bloom{fpr = 0.01, capacity = n, persist = true, rebuild = false}
+** conn:bloom(false) drops and disables it.
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
+*/
+static int conn_bloom(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    bloom_filter *bf = NULL;
+    lua_Number fpr, capacity;
+    int persist, rebuild, res = UNQLITE_OK;
+    if (!lua_toboolean(L, 2)) {
+        bloom_drop(conn, 0);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (IS_SHARED(conn))
+        return luanosql_faildirect(L, "a shared connection cannot keep a bloom filter");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "fpr");
+    lua_getfield(L, 2, "capacity");
+    lua_getfield(L, 2, "persist");
+    lua_getfield(L, 2, "rebuild");
+    fpr = lua_isnil(L, -4) ? 0.01 : lua_tonumber(L, -4);
+    capacity = lua_tonumber(L, -3);
+    persist = lua_isnil(L, -2) ? 1 : lua_toboolean(L, -2);
+    rebuild = lua_toboolean(L, -1);
+    lua_pop(L, 4);
+    luaL_argcheck(L, fpr > 0 && fpr < 1, 2, LUANOSQL_PREFIX"bloom fpr must be between 0 and 1");
+    luaL_argcheck(L, capacity >= 0, 2, LUANOSQL_PREFIX"bloom capacity must be non negative");
+    if (conn->wbuf != NULL && (res = wb_flush(conn)) != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    bloom_drop(conn, 0);
+    if (!rebuild && !*sidecar_flag(conn))
+        bf = bloom_load(conn);
+    if (bf == NULL)
+        bf = bloom_build(conn, (size_t)capacity, fpr, &res);
+    if (bf == NULL)
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate bloom filter" :
+                                   kv_errmsg(conn, res));
+    bf->persist = persist;
+    conn->bloom = bf;
+    lua_pushboolean(L, 1);
     return 1;
 }
 
+/*
+** Get the bloom filter counters.
+** @param L the lua state
+** @return integer 1: a table {bits, hashes, keys, fpr, negatives,
+** positives, false_positives}, or nil when the filter is disabled
+*/
+static int conn_bloom_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    bloom_filter *bf = conn->bloom;
+    size_t i, set = 0;
+    double fill, fpr = 1.0;
+    unsigned int k;
+    if (bf == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    for (i = 0; i < bf->nbits / 8; i++) {
+        unsigned char b = bf->bits[i];
+        for (; b; b &= (unsigned char)(b - 1))
+            set++;
+    }
+    /* estimated false positive rate: the chance all the bits of a key are set */
+    fill = (double)set / (double)bf->nbits;
+    for (k = 0; k < bf->nhash; k++)
+        fpr *= fill;
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, (lua_Number)bf->nbits);
+    lua_setfield(L, -2, "bits");
+    lua_pushnumber(L, (lua_Number)bf->nhash);
+    lua_setfield(L, -2, "hashes");
+    lua_pushnumber(L, (lua_Number)bf->nkeys);
+    lua_setfield(L, -2, "keys");
+    lua_pushnumber(L, (lua_Number)fpr);
+    lua_setfield(L, -2, "fpr");
+    lua_pushnumber(L, (lua_Number)bf->negatives);
+    lua_setfield(L, -2, "negatives");
+    lua_pushnumber(L, (lua_Number)bf->positives);
+    lua_setfield(L, -2, "positives");
+    lua_pushnumber(L, (lua_Number)bf->false_positives);
+    lua_setfield(L, -2, "false_positives");
+    return 1;
+}
 
 /*
-** Compile a jx9 program passed as a file.
-** It wraps unqlite_compile_file.
-** int  unqlite_compile_file(nqlite *pDb, const char *zFile, int nLen, unqlite_vm **ppOutVm);
+** Enable, change or disable value compression.
+** conn:compression{threshold = n} compresses the values of n bytes and
+** more stored from now on; conn:compression(false) stops compressing,
+** compressed values are still decoded.
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @return integer 1: true, or luanosql_faildirect
 */
-static int jx9_ds_compile_file(lua_State *L)
+static int conn_compression(lua_State *L)
 {
+    lua_Number threshold;
     conn_data *conn = getconnection(L);
-    int res;
-    const char *errmsg;
-    unqlite_vm *vm;
-	const char *zFile;
-	size_t iLen;
-	/* get the file to be compiled */
-	zFile = luaL_checklstring(L,2,&iLen);
-	
-    /* init a cursor for this connection */
-    res = unqlite_compile_file(conn->unqlite_conn,zFile, &vm);
-    if (res != UNQLITE_OK) {  /* mostly  UNQLITE_COMPILE_ERR */
-        unqlite_jx9_logerror(conn->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    if (!lua_toboolean(L, 2)) {
+        if (conn->codec != NULL)
+            conn->codec->enabled = 0;
+        lua_pushboolean(L, 1);
+        return 1;
     }
-    /* Create our own jx9 vm internal structure */
-    jx9_doc_data *jx9_data = (jx9_doc_data*)lua_newuserdata(L, sizeof(jx9_doc_data));
-    luanosql_setmeta (L, LUANOSQL_JX9DOCSTORE_UNQLITE);
+    if (IS_SHARED(conn))
+        return luanosql_faildirect(L, "a shared connection cannot compress values");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "threshold");
+    threshold = lua_isnil(L, -1) ? LUANOSQL_CODEC_THRESHOLD : lua_tonumber(L, -1);
+    luaL_argcheck(L, threshold >= 0, 2, LUANOSQL_PREFIX"compression threshold must not be negative");
+    lua_pop(L, 1);
+    if (codec_get(conn) == NULL)
+        return luanosql_faildirect(L, "Cannot allocate codec");
+    conn->codec->enabled = 1;
+    conn->codec->threshold = (size_t)threshold;
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    /* increment vm count for this connection */
-    conn->vm_counter++;
-    /* fill in cur structure */
-    jx9_data->uvm = vm;
-    jx9_data->closed = 0;
-    jx9_data->conn = LUA_NOREF;
-    jx9_data->conn_data = conn;
-    lua_pushvalue(L, 1);
-    jx9_data->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+/*
+** Get the value compression counters.
+** @param L the lua state
+** @return integer 1: {threshold, encoded, compressed, decoded, in_bytes,
+** out_bytes, ratio, encode_seconds, decode_seconds} or nil if disabled
+*/
+static int conn_compression_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    value_codec *vc = conn->codec;
+    if (vc == NULL || !vc->enabled) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 9);
+    lua_pushnumber(L, (lua_Number)vc->threshold);
+    lua_setfield(L, -2, "threshold");
+    lua_pushnumber(L, (lua_Number)vc->encoded);
+    lua_setfield(L, -2, "encoded");
+    lua_pushnumber(L, (lua_Number)vc->compressed);
+    lua_setfield(L, -2, "compressed");
+    lua_pushnumber(L, (lua_Number)vc->decoded);
+    lua_setfield(L, -2, "decoded");
+    lua_pushnumber(L, vc->in_bytes);
+    lua_setfield(L, -2, "in_bytes");
+    lua_pushnumber(L, vc->out_bytes);
+    lua_setfield(L, -2, "out_bytes");
+    lua_pushnumber(L, vc->out_bytes > 0 ? vc->in_bytes / vc->out_bytes : 1);
+    lua_setfield(L, -2, "ratio");
+    lua_pushnumber(L, vc->encode_ms / 1000.0);
+    lua_setfield(L, -2, "encode_seconds");
+    lua_pushnumber(L, vc->decode_ms / 1000.0);
+    lua_setfield(L, -2, "decode_seconds");
     return 1;
 }
 
+/*
+** unqlite_kv_fetch_callback consumer of conn_exists: the record is
+** there, stop before any data is copied.
+** @return integer UNQLITE_ABORT
+*/
+static int exists_consumer(const void *pData, unsigned int iDataLen, void *pUserData)
+{
+    (void)pData; (void)iDataLen; (void)pUserData;
+    return UNQLITE_ABORT;
+}
+
+/*
+** Check whether a key exists without fetching its data. The value cache,
+** write buffer and bloom filter are consulted before the engine.
+** conn:exists(key)
+** @param L the lua state
+** @return integer 1: true or false, or luanosql_faildirect
+*/
+static int conn_exists(lua_State *L)
+{
+    int res;
+    size_t iLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iLen);
+    unsigned int hash = kv_hash_fnv1a(key, (unsigned int)iLen);
+    wb_entry *e;
+    if (conn->vcache != NULL && vc_find(conn->vcache, key, iLen, hash) != NULL) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (conn->wbuf != NULL && (e = wb_find(conn->wbuf, key, iLen, hash)) != NULL) {
+        lua_pushboolean(L, e->op != WB_DELETE);
+        return 1;
+    }
+    res = kv_fetch_cb(conn, key, iLen, exists_consumer, NULL);
+    if (res == UNQLITE_OK || res == UNQLITE_ABORT) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (res == UNQLITE_NOTFOUND) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    return luanosql_faildirect(L, kv_errmsg(conn, res));
+}
+
+#ifndef LUANOSQL_OMIT_STATS
+/*
+** Push the latency under which a fraction of the operations ran: the upper
+** bound of the histogram bucket holding that rank, capped by the slowest.
+** @return void
+*/
+static void stats_push_quantile(lua_State *L, const op_stats *st, double q)
+{
+    unsigned long rank = (unsigned long)(q * (double)st->timed), seen = 0;
+    double bound = 0.001;   /* 1 us */
+    int b;
+    for (b = 0; b < STATS_BUCKETS - 1; b++, bound *= 2) {
+        seen += st->hist[b];
+        if (seen > rank)
+            break;
+    }
+    lua_pushnumber(L, (lua_Number)(bound < st->max_ms ? bound : st->max_ms));
+}
 
+/*
+** Get the operation statistics.
+** @param L the lua state
+** @return integer 1: a table with a field for each operation (kvstore,
+** kvfetch, kvappend, kvdelete, cursor, commit, vm_exec) holding {count,
+** timed, misses, errors, bytes, total_ms, max_ms, mean_ms, p50_ms, p90_ms,
+** p99_ms, histogram}, and the bytes_read and bytes_written totals. The times
+** come from the timed operations, total_ms is scaled up to count.
+*/
+static int conn_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int op, b;
+    lua_createtable(L, 0, STATS_OPS + 2);
+    for (op = 0; op < STATS_OPS; op++) {
+        const op_stats *st = &conn->stats[op];
+        double mean = st->timed ? st->total_ms / st->timed : 0;
+        lua_createtable(L, 0, 12);
+        lua_pushnumber(L, (lua_Number)st->count);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, (lua_Number)st->timed);
+        lua_setfield(L, -2, "timed");
+        lua_pushnumber(L, (lua_Number)st->misses);
+        lua_setfield(L, -2, "misses");
+        lua_pushnumber(L, (lua_Number)st->errors);
+        lua_setfield(L, -2, "errors");
+        lua_pushnumber(L, (lua_Number)st->bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, (lua_Number)(mean * st->count));
+        lua_setfield(L, -2, "total_ms");
+        lua_pushnumber(L, (lua_Number)st->max_ms);
+        lua_setfield(L, -2, "max_ms");
+        lua_pushnumber(L, (lua_Number)mean);
+        lua_setfield(L, -2, "mean_ms");
+        stats_push_quantile(L, st, 0.50);
+        lua_setfield(L, -2, "p50_ms");
+        stats_push_quantile(L, st, 0.90);
+        lua_setfield(L, -2, "p90_ms");
+        stats_push_quantile(L, st, 0.99);
+        lua_setfield(L, -2, "p99_ms");
+        lua_createtable(L, STATS_BUCKETS, 0);
+        for (b = 0; b < STATS_BUCKETS; b++) {
+            lua_pushnumber(L, (lua_Number)st->hist[b]);
+            lua_rawseti(L, -2, b + 1);
+        }
+        lua_setfield(L, -2, "histogram");
+        lua_setfield(L, -2, stats_names[op]);
+    }
+    lua_pushnumber(L, (lua_Number)conn->stats[ST_FETCH].bytes);
+    lua_setfield(L, -2, "bytes_read");
+    lua_pushnumber(L, (lua_Number)(conn->stats[ST_STORE].bytes + conn->stats[ST_APPEND].bytes +
+                                   conn->stats[ST_DELETE].bytes));
+    lua_setfield(L, -2, "bytes_written");
+    return 1;
+}
 
 /*
-** Exec a successfully compile jx9 program.
-** It wraps unqlite_vm_exec.
-** int   unqlite_vm_exec(unqlite_vm *pVm);
+** Clear the operation statistics.
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @return integer 1 (true)
+*/
+static int conn_reset_stats(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    memset(conn->stats, 0, sizeof(conn->stats));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+#endif /* LUANOSQL_OMIT_STATS */
+
+
+
+
+
+/* Userdata of fetch_callback */
+typedef struct
+{
+    lua_State *L;                   /**< state calling kvfetch_callback */
+    conn_data *conn;
+} fetch_ctx;
+
+/*
+** unqlite_kv_fetch_callback callback:
+** Params: database, callback function, userdata
+**
+*** fetch_callback:
+** Params: pData,iDataLen, pUserData 
+** @param pData void* output provided 
+** @param iDataLen output length integer  
+** @param pUserData passed is a fetch_ctx
+** @return integer 0
+*/
+static int fetch_callback(const void *pData, unsigned int iDataLen, void *pUserData /* fetch_ctx for us */) {
+    fetch_ctx *ctx = (fetch_ctx*)pUserData;
+    conn_data *conn = ctx->conn;
+    int res = 0;
+    lua_State *L = ctx->L;
+    int top = lua_gettop(L);
+    /* setup lua callback */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);    /* get the callback function */
+    /* pData push  param */
+    lua_pushlstring(L, pData, (size_t)iDataLen);
+    /* iDataLen push  param */
+    lua_pushinteger(L, iDataLen);
+    /* get callback user data */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
+    /* call lua function */
+    res = lua_pcall(L, 3, 1, 0);
+    lua_settop(L, top);
+    return 0;
+}
+
+
+/**
+** Expecting a Lua function looking like this:
+** kvfetch_callback(key, mycallback, udata or nil)
+** mycallback(pout, udata)
+** (pUserData passed is a fetch_ctx struct)
+** It unqlite_kv_fetch_callback.
+** int unqlite_kv_fetch_callback(unqlite *pDb, const void *pKey,int nKeyLen,
+**    int (*xConsumer)(const void *pData,unsigned int iDataLen,void *pUserData),
+**    void *pUserData);
+** @param L the lua state 
+** @return integer 0
+*/
+static int conn_kv_fetch_callback(lua_State *L) {
+    size_t iLen;
+    fetch_ctx ctx;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iLen);
+
+    if (lua_gettop(L) < 3 || lua_isnil(L, 3)) {
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
+
+        conn->con_fetch_cb = LUA_NOREF;
+        conn->con_fetch_cb_udata = LUA_NOREF;
+
+        /* clear con_fetch_cb handler */
+        unqlite_kv_fetch_callback(conn->unqlite_conn, key, iLen, NULL,NULL);
+    }
+    else {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+        /* always userdata field (even if nil) */
+        lua_settop(L, 4);
+
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);
+        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
+        conn->con_fetch_cb_udata = luaL_ref(L, LUA_REGISTRYINDEX);
+        conn->con_fetch_cb = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        /* set kv_fetch_callback handler */
+        ctx.L = L;
+        ctx.conn = conn;
+        kv_fetch_value_cb(conn, key, iLen, fetch_callback, &ctx);
+    }
+    return 0;
+}
+
+
+/*
+** Store key and data
+** wraps unqlite_kv_store to a data source.
+** int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
+** @param L the lua state 
+** @return integer 0 or 2 with luanosql_faildirect
+*/
+static int conn_kv_store(lua_State *L)
+{
+    int res;
+    size_t iKeyLen, iDataLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iKeyLen);
+    const char *data = luaL_checklstring(L, 3, &iDataLen);
+
+    res = kv_store(L, conn, key, iKeyLen, data, iDataLen);
+    if (res == UNQLITE_OK)
+        res = commit_note(conn, iKeyLen + iDataLen);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/*
+** Append key / data to an existing record. If record does not exist it is created.
+** wraps unqlite_kv_append to a data source.
+** int unqlite_kv_append(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
+** @param L the lua state 
+** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
+*/
+static int conn_kv_append(lua_State *L)
+{
+    int res;
+    size_t iKeyLen,iDataLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iKeyLen);
+    const char *data = luaL_checklstring(L,3, &iDataLen);
+
+    res = kv_append(L, conn, key, iKeyLen, data, iDataLen);
+    if (res == UNQLITE_OK)
+        res = commit_note(conn, iKeyLen + iDataLen);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+
+
+/*
+** Fetch data for a given key
+** The record is looked up once: the engine hands its data to a consumer
+** that copies it into the connection read buffer, which is then pushed.
+** The data is still copied twice, into the buffer and into the Lua
+** string: the Lua 5.1 API cannot build a string in place. A blob is
+** filled by the engine directly and saves the second copy.
+** conn:kvfetch(key [, asblob]) - with asblob true data is returned in a blob.
+** wraps unqlite_kv_fetch_callback to a data source.
+** int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,int nKeyLen,
+**    int (*xConsumer)(const void *pData,unsigned int iDataLen,void *pUserData),
+**    void *pUserData);
+** @param L the lua state 
+** @return integer 2 (true and data) or 2 for luanosql_faildirect(L, errmsg);
 */
-static int jx9_ds_vmexec(lua_State *L)
+static int conn_kv_fetch(lua_State *L)
 {
     int res;
-    const char *errmsg;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-   
-    /* init a cursor for this connection */
-    res = unqlite_vm_exec(jx9data->uvm);
+    size_t iLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iLen);
+    scratch_buf *buf = &conn->fetch_buf;
+
+    if (lua_toboolean(L, 3))
+        buf = &create_blob(L)->buf;
+    else if (conn->vcache != NULL && vc_get(L, conn->vcache, key, iLen)) {
+        lua_pushboolean(L, 1);
+        lua_insert(L, -2);  /* true, data */
+        return 2;
+    }
+    res = kv_fetch(conn, key, iLen, buf);
+    if (res == UNQLITE_NOTFOUND) {
+        lua_pushboolean(L, 1);
+        lua_pushnil(L);
+        return 2;
+    }
+    if (res == UNQLITE_ABORT) {
+        scratch_trim(buf);
+        return luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
+    }
     if (res != UNQLITE_OK) {
-        unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+        scratch_trim(buf);
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
     }
-    lua_pushboolean(L,1);
-    return 1;
+    lua_pushboolean(L, 1);
+    if (buf != &conn->fetch_buf) {
+        lua_insert(L, -2);  /* true, blob */
+        return 2;
+    }
+    scratch_push(L, buf);
+    if (conn->vcache != NULL)
+        vc_put(L, conn->vcache, key, iLen);
+    return 2;
 }
 
 
 /*
-** unqlite_vm_config(jx9data->uvm, UNQLITE_VM_CONFIG_OUTPUT, consumer_callback, jx9data);
-** Params: database, callback function, userdata
-**
-*** consumer_callback:
-** Params: pData,iDataLen, pUserData 
-** @param pData void* output provided 
-** @param iDataLen output length integer  
-** @param pUserData passed is a jx9_doc_data
-** @return integer 0
+** Stream the data of a record to a sink, in chunks of bounded size.
+** conn:kvfetch_stream(key, sink [, chunk_size])
+** sink is a function called as sink(chunk) or an io file handle.
+** @param L the lua state 
+** @return integer 2: true and the number of bytes (true and nil if key is
+** not found), or luanosql_faildirect
 */
-static int consumer_callback(const void *pData, unsigned int iDataLen, void *pUserData /* jx9_doc_data for us */) {
-    jx9_doc_data *jx9data = (jx9_doc_data*)pUserData;
-    int res = 0;
-    lua_State *L = jx9data->conn_data->L;
-    int top = lua_gettop(L);
-    /* setup lua callback */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb);    /* get the callback function */
-    /* pData push  param */
-    lua_pushlstring(L, pData, (size_t)iDataLen);
-    /* iDataLen push  param */
-    lua_pushinteger(L, iDataLen);
-    /* get callback user data */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb_udata);
-    /* call lua function */
-    res = lua_pcall(L, 3, 1, 0);
-    lua_settop(L, top);
-    return 0;
+static int conn_kv_fetch_stream(lua_State *L)
+{
+    int res;
+    size_t iLen;
+    stream_ctx ctx;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iLen);
+    stream_init(L, &ctx, 3);
+    res = kv_fetch_value_cb(conn, key, iLen, stream_consumer, &ctx);
+    return stream_finish(L, &ctx, conn, res);
 }
 
 
-/**
-** Expecting a Lua function looking like this:
-** vm_consumer_callback(mycallback, udata or nil)
-** mycallback(pout, udata)
-** (pUserData passed is a jx9_doc_data struct)
-** It wraps unqlite_vm_config
-** int unqlite_vm_config(unqlite_vm *pVm,
-**    int (*xConsumer)(const void *pOut,unsigned int iDataLen,void *pUserData),
-**    void *pUserData);
-** @param L the lua state 
-** @return integer 0
+/*
+** Store a Lua table (or any value put_table can serialize) as MessagePack.
+** conn:put_table(key, tbl)
+** @param L the lua state
+** @return integer 1: true, or luanosql_faildirect
 */
-static int jx9_ds_consumer_callback(lua_State *L) {
-    
-	jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-	
-    if (lua_gettop(L) < 2 || lua_isnil(L, 2)) {
-        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb);
-        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb_udata);
-
-        jx9data->jx9_consumer_cb = LUA_NOREF;
-        jx9data->jx9_consumer_cb_udata = LUA_NOREF;
-
-        /* clear con_fetch_cb handler */
-        unqlite_vm_config(jx9data->uvm, UNQLITE_VM_CONFIG_OUTPUT, NULL, NULL);
-	}
-    else {
-        luaL_checktype(L, 2, LUA_TFUNCTION);
-        /* always userdata field (even if nil) */
-        lua_settop(L, 3);
-
-        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb);
-        luaL_unref(L, LUA_REGISTRYINDEX, jx9data->jx9_consumer_cb_udata);
-        jx9data->jx9_consumer_cb_udata = luaL_ref(L, LUA_REGISTRYINDEX);
-        jx9data->jx9_consumer_cb = luaL_ref(L, LUA_REGISTRYINDEX);
+static int conn_put_table(lua_State *L)
+{
+    int res;
+    size_t iKeyLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iKeyLen);
+    scratch_buf *buf = &conn->fetch_buf;
+    luaL_checkany(L, 3);
+    lua_settop(L, 3);
+    buf->len = 0;
+    if (mp_encode(L, 3, buf, 0) != 0) {
+        scratch_trim(buf);
+        return luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
+    }
+    res = kv_store(L, conn, key, iKeyLen, buf->data, buf->len);
+    if (res == UNQLITE_OK)
+        res = commit_note(conn, iKeyLen + buf->len);
+    scratch_trim(buf);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-        /* set kv_fetch_callback handler */
-        unqlite_vm_config(jx9data->uvm, UNQLITE_VM_CONFIG_OUTPUT, consumer_callback, jx9data);
+/*
+** Fetch a record stored by put_table and rebuild the table.
+** conn:get_table(key)
+** @param L the lua state
+** @return integer 2: true and the value (nil if the key is not found),
+** or luanosql_faildirect
+*/
+static int conn_get_table(lua_State *L)
+{
+    int res;
+    size_t iLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iLen);
+    res = kv_fetch(conn, key, iLen, &conn->fetch_buf);
+    if (res != UNQLITE_OK) {
+        scratch_trim(&conn->fetch_buf);
+        if (res != UNQLITE_NOTFOUND)
+            return luanosql_faildirect(L, kv_errmsg(conn, res));
     }
-    return 0;
+    lua_pushboolean(L, 1);
+    if (res == UNQLITE_NOTFOUND)
+        lua_pushnil(L);
+    else if (mp_decode_record(L, &conn->fetch_buf) != 0)
+        return luanosql_faildirect(L, "invalid MessagePack data");
+    return 2;
 }
 
 /*
-** Reset jx9 vm.
-** It wraps unqlite_vm_reset.
-** int   unqlite_vm_reset(unqlite_vm *pVm);
+** Rebuild the table stored in the current cursor entry.
+** cur:cursor_table()
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @return integer 1: the value, or luanosql_faildirect
 */
-static int jx9_ds_vmreset(lua_State *L)
+static int cur_get_table(lua_State *L)
 {
     int res;
-    const char *errmsg;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-   
-    /* init a cursor for this connection */
-    res = unqlite_vm_reset(jx9data->uvm);
+    cur_data *cur = getcursor(L);
+    scratch_buf *buf = &cur->conn_data->fetch_buf;
+    buf->len = 0;
+    res = unqlite_kv_cursor_data_callback(cur->cursor, scratch_consumer, buf);
+    if (res == UNQLITE_OK)
+        res = codec_decode(cur->conn_data, buf);
     if (res != UNQLITE_OK) {
-        unqlite_jx9_logerror(jx9data->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+        scratch_trim(buf);
+        return luanosql_faildirect(L, kv_errmsg(cur->conn_data, res));
     }
-    lua_pushboolean(L,1);
+    if (mp_decode_record(L, buf) != 0)
+        return luanosql_faildirect(L, "invalid MessagePack data");
     return 1;
 }
 
 
-
-
 /*
-** Extract a variable from jx9 vm.
-** It wraps unqlite_vm_extract_variable.
-** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const char *zVar);
-** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** Delete a record passing the key. if the record is not found it returns
+** true anyway as deleting a non existent record does not have any side-effect.
+** wraps unqlite_kv_delete to a data source.
+** int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen);
+** @param L the lua state 
+** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
 */
-static int jx9_ds_vm_extract_var(lua_State *L)
+static int conn_kv_delete(lua_State *L)
 {
     int res;
-    const char *errmsg, *zVar;
-	unqlite_value *uValue;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-	size_t iLen;
-	/* get var name to be extracted */
-	zVar = luaL_checklstring(L,2,&iLen);
-   
-   
-    /* init a cursor for this connection */
-    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
-    
-	
+    size_t iLen;
+    conn_data *conn = getconnection(L);
+    const char *key = key_check(L, 2, conn, KEY_ARG, &iLen);
+
+    res = kv_delete(L, conn, key, iLen);
+    if (res == UNQLITE_OK)
+        res = commit_note(conn, iLen);
+    if (res != UNQLITE_OK && res != UNQLITE_NOTFOUND)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 
+/*
+** Batch methods: a whole table of keys is processed in one C call.
+** Errors do not stop the batch, they are collected per key.
+*/
 
 /*
-** Extract a variable of integer type from jx9 vm.
-** It wraps:
-** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
-** int   unqlite_value_to_int(unqlite_value *uValue);
+** Record a per-key error into the errors table at index errs
+** (created on first use, errs must hold nil or a table).
+** The key is expected on top of the stack.
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @param errs stack index of the errors table slot
+** @param msg error message
+** @return void
 */
-static int jx9_ds_vm_extract_int(lua_State *L)
+static void batch_seterror(lua_State *L, int errs, const char *msg)
 {
-    int res;
-    const char *errmsg, *zVar;
-	unqlite_value *uValue;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-	size_t iLen;
-	/* get var name to be extracted */
-	zVar = luaL_checklstring(L,2,&iLen);
-  
-    /* init a cursor for this connection */
-    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
-	
-	res =  unqlite_value_to_int(uValue);
-	lua_pushinteger(L,res);
-    return 1;
+    if (lua_isnil(L, errs)) {
+        lua_newtable(L);
+        lua_replace(L, errs);
+    }
+    lua_pushvalue(L, -1);
+    lua_pushstring(L, msg);
+    lua_rawset(L, errs);
 }
 
 /*
-** Extract a variable of boolean type from jx9 vm.
-** It wraps :
-** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
-** int   unqlite_value_to_bool(unqlite_value *uValue);
+** Call fn for each key of the table at index 2. If the table is a
+** sequence its values are the keys, otherwise its keys are used.
+** fn finds the key on top of the stack and must leave the stack balanced.
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @param conn the connection
+** @param fn per key function
+** @return void
 */
-static int jx9_ds_vm_extract_bool(lua_State *L)
+static void batch_foreach_key(lua_State *L, conn_data *conn,
+                              void (*fn)(lua_State *L, conn_data *conn))
+{
+    size_t i, n = lua_objlen(L, 2);
+    if (n > 0) {
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, 2, (int)i);
+            fn(L, conn);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        lua_pop(L, 1);
+        /* work on a copy, converting a number key would confuse lua_next */
+        lua_pushvalue(L, -1);
+        fn(L, conn);
+        lua_pop(L, 1);
+    }
+}
+
+/*
+** kvmfetch per key step, stack: conn, keys, results, errs, key.
+*/
+static void batch_fetch_one(lua_State *L, conn_data *conn)
 {
+    size_t iLen;
+    const char *key, *errmsg;
     int res;
-    const char *errmsg, *zVar;
-	unqlite_value *uValue;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-	size_t iLen;
-	/* get var name to be extracted */
-	zVar = luaL_checklstring(L,2,&iLen);
-  
-    /* init a cursor for this connection */
-    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
-	
-	res =  unqlite_value_to_bool(uValue);
-	lua_pushboolean(L,res);
-    return 1;
+    key = key_get(L, lua_gettop(L), conn, KEY_ARG, &iLen, &errmsg);
+    if (key == NULL) {
+        batch_seterror(L, 4, errmsg);
+        return;
+    }
+    res = kv_fetch(conn, key, iLen, &conn->fetch_buf);
+    if (res == UNQLITE_OK) {
+        lua_pushvalue(L, -1);
+        scratch_push(L, &conn->fetch_buf);
+        lua_rawset(L, 3);
+    }
+    else if (res != UNQLITE_NOTFOUND) {
+        scratch_trim(&conn->fetch_buf);
+        batch_seterror(L, 4, kv_errmsg(conn, res));
+    }
 }
 
 /*
-** Extract a variable of int64 type from jx9 vm.
-** It wraps :
-** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
-** int   unqlite_value_to_bool(unqlite_value *uValue);
+** Fetch many records in one call.
+** conn:kvmfetch(keys) where keys is an array of keys (or a table whose keys
+** are the record keys).
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @return integer 2: a table key -> data (missing keys are absent) and
+** nil or a table key -> error message
 */
-static int jx9_ds_vm_extract_int64(lua_State *L)
+static int conn_kv_mfetch(lua_State *L)
 {
-    unqlite_int64 iVal;
-    const char *errmsg, *zVar;
-	unqlite_value *uValue;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-	size_t iLen;
-	/* get var name to be extracted */
-	zVar = luaL_checklstring(L,2,&iLen);
-  
-    /* init a cursor for this connection */
-    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
-	
-	iVal =  unqlite_value_to_int64(uValue);
-	/* FIXME: Check this for lua 5.1 this could be a problem. A macro is needed maybe */
-	lua_pushinteger(L,(int)iVal);
-    return 1;
+    conn_data *conn = getconnection(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_newtable(L);    /* 3: results */
+    lua_pushnil(L);     /* 4: errors */
+    batch_foreach_key(L, conn, batch_fetch_one);
+    return 2;
 }
 
+/*
+** kvmdelete per key step, stack: conn, keys, count, errs, key.
+*/
+static void batch_delete_one(lua_State *L, conn_data *conn)
+{
+    size_t iLen;
+    const char *key, *errmsg;
+    int res;
+    key = key_get(L, lua_gettop(L), conn, KEY_ARG, &iLen, &errmsg);
+    if (key == NULL) {
+        batch_seterror(L, 4, errmsg);
+        return;
+    }
+    res = kv_delete(L, conn, key, iLen);
+    if (res == UNQLITE_OK || res == UNQLITE_NOTFOUND) {
+        lua_pushinteger(L, lua_tointeger(L, 3) + 1);
+        lua_replace(L, 3);
+    }
+    else
+        batch_seterror(L, 4, kv_errmsg(conn, res));
+}
 
 /*
-** Extract a variable of boolean type from jx9 vm.
-** It wraps unqlite_vm_reset.
-** int   unqlite_vm_extract_variable(unqlite_vm *pVm, const cher *zVar);
-** double   unqlite_value_to_double(unqlite_value *uValue);
+** Delete many records in one call, inside one write transaction.
+** conn:kvmdelete(keys [, commit]) where keys is an array of keys (or a table
+** whose keys are the record keys). Missing keys count as deleted.
+** Commit behaves as in conn:kvmstore.
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @return integer 2: number of deleted keys and nil or a table
+** key -> error message, or nil and err if the transaction cannot start
 */
-static int jx9_ds_vm_extract_double(lua_State *L)
+static int conn_kv_mdelete(lua_State *L)
 {
-    double dVal;
-    const char *errmsg, *zVar;
-	unqlite_value *uValue;
-    jx9_doc_data *jx9data = (jx9_doc_data *)luaL_checkudata(L, 1, LUANOSQL_JX9DOCSTORE_UNQLITE);
-    luaL_argcheck(L, jx9data != NULL, 1, LUANOSQL_PREFIX"vm expected");
-	size_t iLen;
-	/* get var name to be extracted */
-	zVar = luaL_checklstring(L,2,&iLen);
-  
-    /* init a cursor for this connection */
-    uValue = unqlite_vm_extract_variable(jx9data->uvm, zVar);
-	
-	dVal =  unqlite_value_to_double(uValue);
-	lua_pushnumber(L,dVal);
-    return 1;
+    int res, docommit;
+    conn_data *conn = getconnection(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    docommit = lua_toboolean(L, 3);
+    lua_settop(L, 2);
+    res = unqlite_begin(conn->unqlite_conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    lua_pushinteger(L, 0);  /* 3: count */
+    lua_pushnil(L);         /* 4: errors */
+    batch_foreach_key(L, conn, batch_delete_one);
+    if (docommit && lua_isnil(L, 4)) {
+        res = commit_now(conn);
+        if (res != UNQLITE_OK)
+            return luanosql_faildirect(L, kv_errmsg(conn, res));
+    }
+    return 2;
 }
 
+/*
+** Store many records in one call, inside one write transaction.
+** conn:kvmstore(records [, commit]) where records is a table key -> data.
+** When commit is true and every record was stored the transaction is
+** committed, otherwise it is left open for conn:commit() / conn:rollback().
+** @param L the lua state
+** @return integer 2: number of stored records and nil or a table
+** key -> error message, or nil and err if the transaction cannot start
+*/
+static int conn_kv_mstore(lua_State *L)
+{
+    int res, docommit;
+    size_t iKeyLen, iDataLen;
+    const char *key, *data, *errmsg;
+    lua_Integer count = 0;
+    conn_data *conn = getconnection(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    docommit = lua_toboolean(L, 3);
+    lua_settop(L, 2);
+    lua_pushnil(L);     /* 3: errors */
 
+    res = unqlite_begin(conn->unqlite_conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        /* stack: conn, records, errs, key, data */
+        lua_pushvalue(L, -2);
+        key = key_get(L, lua_gettop(L), conn, KEY_ARG, &iKeyLen, &errmsg);
+        if (key == NULL || !lua_isstring(L, -2)) {
+            batch_seterror(L, 3, key == NULL ? errmsg : "invalid key or data type");
+        }
+        else {
+            data = lua_tolstring(L, -2, &iDataLen);
+            res = kv_store(L, conn, key, iKeyLen, data, iDataLen);
+            if (res == UNQLITE_OK)
+                count++;
+            else
+                batch_seterror(L, 3, kv_errmsg(conn, res));
+        }
+        lua_pop(L, 2);
+    }
 
-#endif  /* LUANOSQL_OMIT_JX9_DOCSTORE */
-
+    if (docommit && lua_isnil(L, 3)) {
+        res = commit_now(conn);
+        if (res != UNQLITE_OK)
+            return luanosql_faildirect(L, kv_errmsg(conn, res));
+    }
+    lua_pushinteger(L, count);
+    lua_pushvalue(L, 3);
+    return 2;
+}
 
 
+/*
+** Range and prefix scans, served by the ordered key index.
+*/
 
 /*
-** Closes the cursor and reset all structure fields.
+** Push the records of positions [start, end) of the ordered key index.
+** Options table at index opts (0 if none): limit, reverse, keys_only,
+** typed_keys.
 ** @param L the lua state
-** @param cur_data curor to be detroyed
-** @return void
+** @param conn the connection
+** @param start first position
+** @param end position past the last one
+** @param opts stack index of the options table or 0
+** @return integer 2: an array of keys and an array of data (nil for
+** keys_only), or luanosql_faildirect
 */
-static void cur_destroy(lua_State *L, cur_data *cur)
+static int kindex_push_range(lua_State *L, conn_data *conn, size_t start, size_t end, int opts)
 {
-    conn_data *conn;
-
-    /* Nullify structure fields. */
-    cur->closed = 1;
-    cur->cursor = NULL;
-    lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
-    conn = lua_touserdata (L, -1);
-    conn->cur_counter--;
-    luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
-    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_key_cb);
-    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_key_cb_udata);
-    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_data_cb);
-    luaL_unref(L, LUA_REGISTRYINDEX, cur->cur_data_cb_udata);
+    int res, keys_only = 0, reverse = 0, typed_keys = 0, count = 0;
+    lua_Integer limit = 0;
+    size_t i;
+    key_index *idx = conn->kindex;
+    if (opts) {
+        lua_getfield(L, opts, "limit");
+        limit = lua_tointeger(L, -1);
+        lua_getfield(L, opts, "reverse");
+        reverse = lua_toboolean(L, -1);
+        lua_getfield(L, opts, "keys_only");
+        keys_only = lua_toboolean(L, -1);
+        lua_getfield(L, opts, "typed_keys");
+        typed_keys = lua_toboolean(L, -1);
+        lua_pop(L, 4);
+    }
+    if (end < start)
+        end = start;
+    lua_createtable(L, (int)(end - start), 0);
+    if (keys_only)
+        lua_pushnil(L);
+    else
+        lua_createtable(L, (int)(end - start), 0);
+    for (i = 0; i < end - start && (limit <= 0 || count < limit); i++) {
+        ikey *k = &idx->keys[reverse ? end - 1 - i : start + i];
+        if (!keys_only) {
+            res = kv_fetch(conn, k->data, k->len, &conn->fetch_buf);
+            /* keys removed behind our back (another connection) are skipped */
+            if (res == UNQLITE_NOTFOUND)
+                continue;
+            if (res != UNQLITE_OK) {
+                scratch_trim(&conn->fetch_buf);
+                return luanosql_faildirect(L, kv_errmsg(conn, res));
+            }
+            scratch_push(L, &conn->fetch_buf);
+            lua_rawseti(L, -2, count + 1);
+        }
+        if (typed_keys)
+            key_push(L, k->data, k->len);
+        else
+            lua_pushlstring(L, k->data, k->len);
+        lua_rawseti(L, -3, count + 1);
+        count++;
+    }
+    return 2;
 }
 
 /*
-** Create a new Connection object and push it on top of the stack.
+** Read the records whose key is in [lo, hi), in key order.
+** conn:range(lo, hi [, opts]) - lo or hi can be nil for an open bound.
+** opts is a table with: limit (max records), reverse (descending order),
+** keys_only (do not read data), typed_keys (decode integer and tuple keys).
+** lo, hi and the prefix of conn:prefix can be integer or tuple keys.
+** The ordered key index is built on first use by a full scan, later calls
+** only visit the matching keys.
 ** @param L the lua state
-** @param env the integer reference to the env
-** @param unqlite_conn unqlite connection object
-** @return conn_data a valid conn_data structure
+** @return integer 2: an array of keys and an array of data (nil when
+** keys_only is set), or luanosql_faildirect
 */
-static int create_connection(lua_State *L, int env, unqlite *unqlite_conn)
+static int conn_range(lua_State *L)
 {
-    conn_data *conn = (conn_data*)lua_newuserdata(L, sizeof(conn_data));
-    luanosql_setmeta(L, LUANOSQL_CONNECTION_UNQLITE);
-
-    /* Initialize data structure */
-    conn->closed = 0;
-    conn->env = LUA_NOREF;
-    conn->unqlite_conn = unqlite_conn;
-    conn->cur_counter = 0;
-    conn->con_fetch_cb =
-        conn->con_fetch_cb_udata = LUA_NOREF;
-    conn->L = L;
-    lua_pushvalue (L, env);
-    conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
-
-    return 1;
+    int res;
+    size_t lolen = 0, hilen = 0, start, end;
+    conn_data *conn = getconnection(L);
+    const char *lo = lua_isnoneornil(L, 2) ? NULL : key_check(L, 2, conn, KEY_ARG, &lolen);
+    const char *hi = lua_isnoneornil(L, 3) ? NULL : key_check(L, 3, conn, KEY_HI, &hilen);
+    if (!lua_isnoneornil(L, 4))
+        luaL_checktype(L, 4, LUA_TTABLE);
+    res = conn->kindex == NULL ? wb_flush(conn) : UNQLITE_OK;   /* built by a cursor scan */
+    if (res == UNQLITE_OK)
+        res = kindex_ensure(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate key index" : kv_errmsg(conn, res));
+    start = lo ? kindex_lower(conn->kindex, lo, lolen) : 0;
+    end = hi ? kindex_lower(conn->kindex, hi, hilen) : conn->kindex->nkeys;
+    return kindex_push_range(L, conn, start, end, lua_istable(L, 4) ? 4 : 0);
 }
 
-
-/**
-**  These are cursor function
+/*
+** Read the records whose key starts with prefix, in key order.
+** conn:prefix(prefix [, opts]) - opts as in conn:range.
+** @param L the lua state
+** @return integer 2: an array of keys and an array of data (nil when
+** keys_only is set), or luanosql_faildirect
 */
+static int conn_prefix(lua_State *L)
+{
+    int res;
+    size_t plen, start, end;
+    conn_data *conn = getconnection(L);
+    const char *prefix = key_check(L, 2, conn, KEY_ARG, &plen);
+    if (!lua_isnoneornil(L, 3))
+        luaL_checktype(L, 3, LUA_TTABLE);
+    res = conn->kindex == NULL ? wb_flush(conn) : UNQLITE_OK;   /* built by a cursor scan */
+    if (res == UNQLITE_OK)
+        res = kindex_ensure(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate key index" : kv_errmsg(conn, res));
+    start = kindex_lower(conn->kindex, prefix, plen);
+    end = kindex_prefix_end(conn->kindex, start, prefix, plen);
+    return kindex_push_range(L, conn, start, end, lua_istable(L, 3) ? 3 : 0);
+}
 
 /*
-** Create a new Cursor object and push it on top of the stack.
-** It wraps unqlite_kv_cursor_init.
-** int unqlite_kv_cursor_init(unqlite *pDb,unqlite_kv_cursor **ppOut);
+** Drop the ordered key index, it is rebuilt by the next range or prefix
+** scan. Needed when another connection or process changed the keys.
 ** @param L the lua state
-** @return integer 1 or luanosql_faildirect with err msg
+** @return integer 1 (true)
 */
-static int conn_create_cursor(lua_State *L)
+static int conn_reindex(lua_State *L)
 {
     conn_data *conn = getconnection(L);
-    int res;
-    const char *errmsg;
-    unqlite_kv_cursor *ucursor;
-    /* init a cursor for this connection */
-    res = unqlite_kv_cursor_init(conn->unqlite_conn,&ucursor);
-    if (res != UNQLITE_OK) {
-        unqlite_logerror(conn->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
-    }
-    /* Create our own cursor internal structure */
-    cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
-    luanosql_setmeta (L, LUANOSQL_CURSOR_UNQLITE);
-
-    /* increment cursor count this connection */
-    conn->cur_counter++;
-    /* fill in cur structure */
-    cur->cursor = ucursor;
-    cur->closed = 0;
-    cur->conn = LUA_NOREF;
-    cur->cur_key_cb =
-    cur->cur_key_cb_udata =
-    cur->cur_data_cb =
-    cur->cur_data_cb_udata = LUA_NOREF;
-    cur->conn_data = conn;
-    lua_pushvalue(L, 1);
-    cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+    kindex_drop(conn);
+    ix_dir_drop(conn);
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 /*
-** Cursor object collector function
-** @param L the lua state
-** @return integer 1
+** Secondary index methods, see ix_prepare for the maintenance.
 */
-static int cur_gc(lua_State *L)
+
+/*
+** Find a declared index by name.
+** @return sec_index* the index or NULL
+*/
+static sec_index *ix_find(conn_data *conn, const char *name)
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUANOSQL_CURSOR_UNQLITE);
-    if (cur != NULL && !(cur->closed))
-    {
-        res = unqlite_kv_cursor_release(cur->conn_data->unqlite_conn, cur->cursor);
-        if (res != UNQLITE_OK) {
-            unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-            return luanosql_faildirect(L, errmsg);
-        }
-        cur_destroy(L, cur);
-    }
-    return 0;
+    sec_index *ix;
+    for (ix = conn->indexes != NULL ? conn->indexes->list : NULL; ix != NULL; ix = ix->next)
+        if (strcmp(ix->name, name) == 0)
+            return ix;
+    return NULL;
 }
 
 /*
-** Release the cursor on top of the stack.
-** Release a cursor object (deallocation) 
-** It wraps unqlite_kv_cursor_release.
-** int unqlite_kv_cursor_release(unqlite *pDb,unqlite_kv_cursor *pCur);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
-** 
+** Declare a secondary index and build its entries from the records.
+** conn:create_index(name, extractor) - extractor is a field path of
+** MessagePack records such as "user.email", or a function(key, data)
+** returning the value to index. Only string and integer values are
+** indexed. An index of the same name is replaced.
+** The index is kept up to date by the writes of this connection only.
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
 */
-static int cur_release(lua_State *L)
+static int conn_create_index(lua_State *L)
 {
     int res;
-    const char *errmsg;
-    cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUANOSQL_CURSOR_UNQLITE);
-    luaL_argcheck(L, cur != NULL, 1, LUANOSQL_PREFIX"cursor expected");
-    if (cur->closed) {
-        lua_pushboolean(L, 0);
-        return 1;
+    conn_data *conn = getconnection(L);
+    const char *name = luaL_checkstring(L, 2);
+    sec_index *ix, *old, **pp;
+    scratch_buf prefix = {NULL, 0, 0};
+    luaL_argcheck(L, lua_type(L, 3) == LUA_TSTRING || lua_isfunction(L, 3), 3,
+                  LUANOSQL_PREFIX"field path or function expected");
+    if (IS_SHARED(conn))
+        return luanosql_faildirect(L, "a shared connection cannot maintain indexes");
+    if (conn->indexes == NULL && (conn->indexes = (index_set *)calloc(1, sizeof(index_set))) == NULL)
+        return luanosql_faildirect(L, "Cannot allocate index");
+    ix = (sec_index *)calloc(1, sizeof(sec_index));
+    if (ix == NULL)
+        return luanosql_faildirect(L, "Cannot allocate index");
+    ix->fn = LUA_NOREF;
+    ix->name = str_dup(name);
+    if (scratch_consumer(LUANOSQL_INDEX_PREFIX, LUANOSQL_INDEX_PREFIXLEN, &prefix) != UNQLITE_OK ||
+        tkey_put(L, 2, &prefix) != 0)
+        scratch_free(&prefix);
+    ix->prefix = prefix.data;
+    ix->plen = prefix.len;
+    if (lua_isfunction(L, 3)) {
+        lua_pushvalue(L, 3);
+        ix->fn = luaL_ref(L, LUA_REGISTRYINDEX);
     }
-    res = unqlite_kv_cursor_release(cur->conn_data->unqlite_conn, cur->cursor);
+    else
+        ix->path = str_dup(lua_tostring(L, 3));
+    if (ix->name == NULL || ix->prefix == NULL || (ix->fn == LUA_NOREF && ix->path == NULL)) {
+        ix_free(L, ix);
+        return luanosql_faildirect(L, "Cannot allocate index");
+    }
+    for (pp = &conn->indexes->list; *pp != NULL; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0) {
+            old = *pp;
+            *pp = old->next;
+            ix_free(L, old);
+            break;
+        }
+    }
+    ix->next = conn->indexes->list;
+    conn->indexes->list = ix;
+    res = ix_build(L, conn, ix);
     if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+        conn->indexes->list = ix->next;
+        ix_free(L, ix);
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate index" : kv_errmsg(conn, res));
     }
-    cur_destroy(L, cur);
     lua_pushboolean(L, 1);
     return 1;
 }
 
 /*
-** Move a cursor to seek a record
-** It wraps unqlite_kv_cursor_first_entry.
-** int unqlite_kv_cursor_seek(unqlite_kv_cursor *pCursor,const void *pKey,int nKeyLen,int iPos);
-** iPos param can one among: UNQLITE_CURSOR_MATCH_EXACT or 0 (default), UNQLITE_CURSOR_MATCH_LE or
-** UNQLITE_CURSOR_MATCH_GE (see unqlite documentation).
-** @see luanosql_faildirect
-** Seek with the cursor
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Delete the entries of a declared index and forget it.
+** conn:drop_index(name)
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
 */
-static int cur_seek(lua_State *L)
+static int conn_drop_index(lua_State *L)
 {
     int res;
-    const char *errmsg;
-    size_t iLen;
-    cur_data *cur = getcursor(L);
-    const char *key = luaL_checklstring(L, 2, &iLen);
-    // fallback in default
-    if (lua_gettop(L) < 3 || lua_isnil(L, 3) || luaL_checkint(L,3) > 2 /* possible values 0,1,2 */)
-    {
-        res = unqlite_kv_cursor_seek(cur->cursor, key, iLen, UNQLITE_CURSOR_MATCH_EXACT);
+    conn_data *conn = getconnection(L);
+    const char *name = luaL_checkstring(L, 2);
+    sec_index *ix = ix_find(conn, name), **pp;
+    if (ix == NULL)
+        return luanosql_faildirect(L, "no such index");
+    res = wb_flush(conn);
+    if (res == UNQLITE_OK)
+        res = ix_clear(conn, ix);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate index" : kv_errmsg(conn, res));
+    for (pp = &conn->indexes->list; *pp != ix; pp = &(*pp)->next)
+        ;
+    *pp = ix->next;
+    ix_free(L, ix);
+    if (conn->indexes->list == NULL)
+        ix_drop(L, conn);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Append the records of the entries [start, end) of the sorted entry keys
+** of ix to the arrays at tkeys and tdata (0 for keys only). Each record is
+** read and its value extracted again, the entries of records removed or
+** changed without this connection are skipped.
+** @return integer UnQLite result code (IX_EXTRACT_ERROR if the extractor
+** function failed)
+*/
+static int ix_push_entries(lua_State *L, conn_data *conn, sec_index *ix, size_t start, size_t end,
+                           int tkeys, int tdata, int typed_keys, lua_Integer limit, int *count)
+{
+    index_set *set = conn->indexes;
+    const unsigned char *v, *pk, *kend;
+    const char *data;
+    size_t i, n, dlen;
+    int res = UNQLITE_OK;
+    for (i = start; i < end && (limit <= 0 || *count < limit); i++) {
+        if (set->dir == NULL || i >= set->dir->nkeys)
+            break;
+        v = (const unsigned char *)set->dir->keys[i].data + ix->plen;
+        kend = (const unsigned char *)set->dir->keys[i].data + set->dir->keys[i].len;
+        pk = tkey_next(v, kend);
+        if (pk == NULL || pk == kend || *pk != TKEY_STR || tkey_next(pk, kend) != kend)
+            continue;
+        lua_pushlstring(L, (const char *)v, pk - v);
+        tkey_push(L, pk, kend);
+        data = lua_tolstring(L, -1, &n);
+        res = kv_fetch(conn, data, n, &conn->fetch_buf);
+        if (res == UNQLITE_OK) {
+            scratch_push(L, &conn->fetch_buf);
+            data = lua_tolstring(L, -1, &dlen);
+            set->vals.len = 0;
+            res = ix_extract(L, conn, ix, lua_tostring(L, -2), n, data, dlen, &set->vals);
+        }
         if (res == UNQLITE_NOTFOUND) {
-            lua_pushboolean(L, 0); /* not ok, but it means not found -> we manage this case */
-            return 1;
+            lua_pop(L, 2);
+            res = UNQLITE_OK;
+            continue;
         }
         if (res != UNQLITE_OK) {
-            unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-            return luanosql_faildirect(L, errmsg);
+            scratch_trim(&conn->fetch_buf);
+            return res;
         }
-    } else
-    {
-        res = unqlite_kv_cursor_seek(cur->cursor, (const char *)key, iLen, luaL_checkint(L,3));
-        if (res != UNQLITE_OK) {
-            unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-            return luanosql_faildirect(L, errmsg);
+        /* stack: value, primary key, data */
+        data = lua_tolstring(L, -3, &dlen);
+        if (set->vals.len == dlen && memcmp(set->vals.data, data, dlen) == 0) {
+            if (tdata) {
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, tdata, *count + 1);
+            }
+            if (typed_keys)
+                key_push(L, lua_tostring(L, -2), n);
+            else
+                lua_pushvalue(L, -2);
+            lua_rawseti(L, tkeys, *count + 1);
+            (*count)++;
         }
+        lua_pop(L, 3);
     }
-    lua_pushboolean(L, 1);
-    return 1;
+    return res;
 }
 
 /*
-** Move the cursor to the first entry
-** It wraps unqlite_kv_cursor_first_entry.
-** int unqlite_kv_cursor_first_entry(unqlite_kv_cursor *pCursor);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Check the index and value arguments, build the entry key and push the
+** result arrays. Options table at index opts: limit, keys_only, typed_keys.
+** @return sec_index* the index, or NULL if it is not declared
 */
-static int cur_first_entry(lua_State *L)
+static sec_index *ix_query(lua_State *L, conn_data *conn, int opts, lua_Integer *limit, int *typed_keys)
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = getcursor(L);
-	
-    res = unqlite_kv_cursor_first_entry(cur->cursor);
-    /* check result */
-	if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    sec_index *ix = ix_find(conn, luaL_checkstring(L, 2));
+    int keys_only = 0;
+    *limit = 0;
+    *typed_keys = 0;
+    if (!lua_isnoneornil(L, opts)) {
+        luaL_checktype(L, opts, LUA_TTABLE);
+        lua_getfield(L, opts, "limit");
+        *limit = lua_tointeger(L, -1);
+        lua_getfield(L, opts, "keys_only");
+        keys_only = lua_toboolean(L, -1);
+        lua_getfield(L, opts, "typed_keys");
+        *typed_keys = lua_toboolean(L, -1);
+        lua_pop(L, 3);
     }
-    lua_pushboolean(L, 1);
+    lua_settop(L, opts);
+    if (ix == NULL)
+        return NULL;
+    lua_newtable(L);
+    if (keys_only)
+        lua_pushnil(L);
+    else
+        lua_newtable(L);
+    return ix;
+}
+
+/*
+** Read the records whose index value is value, in key order.
+** conn:index_lookup(name, value [, opts]) - opts is a table with: limit
+** (max records), keys_only (do not return data), typed_keys (decode
+** integer and tuple keys). The sorted entry keys are read by a full scan
+** on first use, then it costs one fetch per record found.
+** @param L the lua state
+** @return integer 2: an array of keys and an array of data (nil when
+** keys_only is set), or luanosql_faildirect
+*/
+static int conn_index_lookup(lua_State *L)
+{
+    int res, typed_keys, count = 0;
+    size_t start, end;
+    lua_Integer limit;
+    conn_data *conn = getconnection(L);
+    sec_index *ix = ix_query(L, conn, 4, &limit, &typed_keys);
+    index_set *set = conn->indexes;
+    if (ix == NULL)
+        return luanosql_faildirect(L, "no such index");
+    set->vals.len = 0;
+    if (tkey_put(L, 3, &set->vals) == -1)
+        luaL_argerror(L, 3, "index value must be a string or an integer");
+    res = ix_dir_ensure(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate index" : kv_errmsg(conn, res));
+    if (ix_entry_key(set, ix, set->vals.data, set->vals.len, 0) != 0)
+        return luanosql_faildirect(L, "Cannot allocate buffer");
+    start = kindex_lower(set->dir, set->ekey.data, set->ekey.len);
+    end = kindex_prefix_end(set->dir, start, set->ekey.data, set->ekey.len);
+    res = ix_push_entries(L, conn, ix, start, end, 5, lua_istable(L, 6) ? 6 : 0, typed_keys, limit, &count);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    return 2;
+}
+
+/*
+** Read the records whose index value is in [lo, hi), by value.
+** conn:index_range(name, lo, hi [, opts]) - lo or hi can be nil for an
+** open bound, opts as in conn:index_lookup. The sorted entry keys are
+** read by a full scan on first use, later calls only visit the matching
+** entries.
+** @param L the lua state
+** @return integer 2: an array of keys and an array of data (nil when
+** keys_only is set), or luanosql_faildirect
+*/
+static int conn_index_range(lua_State *L)
+{
+    int res, typed_keys, count = 0;
+    size_t i, start = 0, end = 0;
+    lua_Integer limit;
+    conn_data *conn = getconnection(L);
+    sec_index *ix = ix_query(L, conn, 5, &limit, &typed_keys);
+    index_set *set = conn->indexes;
+    if (ix == NULL)
+        return luanosql_faildirect(L, "no such index");
+    res = ix_dir_ensure(conn);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate index" : kv_errmsg(conn, res));
+    for (i = 0; i < 2; i++) {
+        set->vals.len = 0;
+        if (!lua_isnil(L, 3 + (int)i) && tkey_put(L, 3 + (int)i, &set->vals) == -1)
+            luaL_argerror(L, 3 + (int)i, "index value must be a string or an integer");
+        if (ix_entry_key(set, ix, set->vals.data, set->vals.len, 0) != 0)
+            return luanosql_faildirect(L, "Cannot allocate buffer");
+        if (i == 0)
+            start = kindex_lower(set->dir, set->ekey.data, set->ekey.len);
+        else if (lua_isnil(L, 4))
+            end = kindex_prefix_end(set->dir, start, ix->prefix, ix->plen);
+        else
+            end = kindex_lower(set->dir, set->ekey.data, set->ekey.len);
+    }
+    res = ix_push_entries(L, conn, ix, start, end, 6, lua_istable(L, 7) ? 7 : 0, typed_keys, limit, &count);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    return 2;
+}
+
+/*
+** Get the mode the connection was opened with, as env:connect options.
+** @param L the lua state
+** @return integer 1: a table {readonly, mmap, memory, journal, mutex}
+*/
+static int conn_mode(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    int flags = conn->open_flags;
+    lua_createtable(L, 0, 5);
+    lua_pushboolean(L, (flags & (UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP)) != 0);
+    lua_setfield(L, -2, "readonly");
+    lua_pushboolean(L, (flags & UNQLITE_OPEN_MMAP) != 0);
+    lua_setfield(L, -2, "mmap");
+    lua_pushboolean(L, (flags & UNQLITE_OPEN_IN_MEMORY) != 0);
+    lua_setfield(L, -2, "memory");
+    lua_pushboolean(L, (flags & UNQLITE_OPEN_OMIT_JOURNALING) == 0);
+    lua_setfield(L, -2, "journal");
+    lua_pushboolean(L, (flags & UNQLITE_OPEN_NOMUTEX) == 0);
+    lua_setfield(L, -2, "mutex");
     return 1;
 }
 
+
+/*
+** Engine configuration: page cache, KV engine, key hash and compare
+** functions, auto commit. Set by env:connect options or conn:config.
+*/
+
+typedef unsigned int (*kv_hash_func)(const void *pKey, unsigned int nLen);
+typedef int (*kv_cmp_func)(const void *pKey1, const void *pKey2, unsigned int nLen);
+
+/*
+** Key compare with the C library memcmp.
+** @return integer memcmp result
+*/
+static int kv_cmp_memcmp(const void *pKey1, const void *pKey2, unsigned int nLen)
+{
+    return memcmp(pKey1, pKey2, nLen);
+}
+
+/* Built-in hash functions, "default" keeps the engine one */
+static const char *const kv_hash_names[] = {"default", "fnv1a", "djb2", NULL};
+static const kv_hash_func kv_hash_funcs[] = {NULL, kv_hash_fnv1a, kv_hash_djb2};
+
+/* Built-in compare functions, "default" keeps the engine one */
+static const char *const kv_cmp_names[] = {"default", "memcmp", NULL};
+static const kv_cmp_func kv_cmp_funcs[] = {NULL, kv_cmp_memcmp};
+
+/* Options accepted by conn:config */
+static const char *const config_options[] = {
+    "cache", "auto_commit", NULL
+};
+
 /*
-** Move the cursor to the last entry
-** It wraps unqlite_kv_cursor_last_entry.
-** int unqlite_kv_cursor_last_entry(unqlite_kv_cursor *pCursor);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Get a boolean option from a table.
+** @param L the lua state
+** @param idx stack index of the options table or 0
+** @param name option name
+** @param def default value, for a missing option
+** @return integer 0 or 1
 */
-static int cur_last_entry(lua_State *L)
+static int opt_bool(lua_State *L, int idx, const char *name, int def)
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = getcursor(L);
-    res = unqlite_kv_cursor_last_entry(cur->cursor);
-    if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    int val = def;
+    if (idx) {
+        lua_getfield(L, idx, name);
+        if (!lua_isnil(L, -1))
+            val = lua_toboolean(L, -1);
+        lua_pop(L, 1);
     }
-    lua_pushboolean(L,1);
-    return 1;
+    return val;
 }
 
 /*
-** Check cursor validity
-** It wraps unqlite_kv_cursor_valid_entry.
-** int unqlite_kv_cursor_valid_entry(unqlite_kv_cursor *pCursor);
-** @param L the lua state 
-** @return integer 1 (true or false pushed on lua stack)
+** Raise an error if an options table holds a name not in the list.
+** @param L the lua state
+** @param idx stack index of the options table
+** @param names NULL terminated list of valid names
+** @param what kind of options, for the error message
+** @return void
 */
-static int cur_is_valid_entry(lua_State *L)
+static void check_options(lua_State *L, int idx, const char *const names[], const char *what)
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = getcursor(L);
-    res = unqlite_kv_cursor_valid_entry(cur->cursor);
-    lua_pushboolean(L, res);
-    return 1;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        const char *name = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : NULL;
+        int i;
+        for (i = 0; name != NULL && names[i] != NULL; i++)
+            if (strcmp(name, names[i]) == 0)
+                break;
+        if (name == NULL || names[i] == NULL)
+            luaL_error(L, LUANOSQL_PREFIX"unknown %s option '%s'", what, name ? name : "?");
+        lua_pop(L, 1);
+    }
 }
 
 /*
-** Set cursor pointing to previous entry
-** It wraps unqlite_kv_cursor_prev_entry.
-** int unqlite_kv_cursor_prev_entry(unqlite_kv_cursor *pCursor);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Get the index of a name in a built-in function list.
+** @param L the lua state
+** @param idx stack index of the options table
+** @param field option name
+** @param names NULL terminated list of names
+** @return integer index in the list, -1 if the option is missing
 */
-static int cur_prev_entry(lua_State *L)
+static int config_choice(lua_State *L, int idx, const char *field, const char *const names[])
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = getcursor(L);
-    res = unqlite_kv_cursor_prev_entry(cur->cursor);
-	if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    const char *name;
+    int i;
+    lua_getfield(L, idx, field);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return -1;
     }
-    lua_pushboolean(L, 1);
-    return 1;
+    name = lua_tostring(L, -1);
+    for (i = 0; name != NULL && names[i] != NULL; i++)
+        if (strcmp(name, names[i]) == 0)
+            break;
+    if (name == NULL || names[i] == NULL)
+        luaL_error(L, LUANOSQL_PREFIX"unknown %s function '%s'", field, name ? name : "?");
+    lua_pop(L, 1);
+    return i;
 }
 
 /*
-** Set cursor pointing to next entry
-** It wraps unqlite_kv_cursor_next_entry.
-** int unqlite_kv_cursor_next_entry(unqlite_kv_cursor *pCursor);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Read the engine settings of an options table over cfg. The KV engine,
+** hash and compare functions can only be chosen before the first access.
+** @param L the lua state
+** @param idx stack index of the options table
+** @param cfg settings, updated
+** @param engine receives the KV engine name or NULL (NULL: not allowed)
+** @return void
 */
-static int cur_next_entry(lua_State *L)
+static void config_read(lua_State *L, int idx, conn_config *cfg, const char **engine)
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = getcursor(L);
-    res = unqlite_kv_cursor_next_entry(cur->cursor);
-	if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    lua_getfield(L, idx, "cache");
+    if (!lua_isnil(L, -1)) {
+        lua_Integer cache = lua_tointeger(L, -1);
+        if (!lua_isnumber(L, -1) || cache < 1)
+            luaL_error(L, LUANOSQL_PREFIX"cache must be a positive number of pages");
+        cfg->cache = (int)cache;
+    }
+    lua_pop(L, 1);
+    if (!opt_bool(L, idx, "auto_commit", 1))
+        cfg->auto_commit = 0;
+    else if (!cfg->auto_commit)
+        luaL_error(L, LUANOSQL_PREFIX"auto_commit cannot be enabled again");
+    if (engine != NULL) {
+        int i;
+        lua_getfield(L, idx, "engine");
+        if (!lua_isnil(L, -1) && lua_type(L, -1) != LUA_TSTRING)
+            luaL_error(L, LUANOSQL_PREFIX"engine must be a string");
+        *engine = lua_tostring(L, -1);
+        lua_pop(L, 1);  /* the string stays referenced by the options table */
+        if ((i = config_choice(L, idx, "hash", kv_hash_names)) >= 0)
+            cfg->hash = i;
+        if ((i = config_choice(L, idx, "cmp", kv_cmp_names)) >= 0)
+            cfg->cmp = i;
     }
-    lua_pushboolean(L, 1);
-    return 1;
 }
 
 /*
-** Delete an entry using cursor
-** It wraps unqlite_kv_cursor_delete_entry.
-** int unqlite_kv_cursor_delete_entry(unqlite_kv_cursor *pCursor);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Apply the settings that differ from old to an UnQLite handle.
+** @param db the UnQLite handle
+** @param cfg new settings
+** @param old current settings
+** @param engine KV engine name or NULL
+** @return integer UnQLite result code
 */
-static int cur_delete_entry(lua_State *L)
+static int config_apply(unqlite *db, const conn_config *cfg, const conn_config *old,
+                        const char *engine)
 {
-    int res;
-    const char *errmsg;
-    cur_data *cur = getcursor(L);
-    res = unqlite_kv_cursor_delete_entry(cur->cursor);
-    if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
-    }
-	lua_pushboolean(L, 1);
-    return 1;
+    int res = UNQLITE_OK;
+    if (engine != NULL)
+        res = unqlite_config(db, UNQLITE_CONFIG_KV_ENGINE, engine);
+    if (res == UNQLITE_OK && cfg->cache != old->cache)
+        res = unqlite_config(db, UNQLITE_CONFIG_MAX_PAGE_CACHE, cfg->cache);
+    if (res == UNQLITE_OK && !cfg->auto_commit && old->auto_commit)
+        res = unqlite_config(db, UNQLITE_CONFIG_DISABLE_AUTO_COMMIT);
+    if (res == UNQLITE_OK && cfg->hash != old->hash)
+        res = unqlite_kv_config(db, UNQLITE_KV_CONFIG_HASH_FUNC, kv_hash_funcs[cfg->hash]);
+    if (res == UNQLITE_OK && cfg->cmp != old->cmp)
+        res = unqlite_kv_config(db, UNQLITE_KV_CONFIG_CMP_FUNC, kv_cmp_funcs[cfg->cmp]);
+    return res;
 }
 
 /*
-** Use a cusor to get a key
-** It wraps unqlite_kv_cursor_key.
-** int unqlite_kv_cursor_key(unqlite_kv_cursor *pCursor,void *pBuf,int *pnByte);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Get or change the engine settings.
+** conn:config() returns {cache, engine, auto_commit, hash, cmp}, cache is
+** nil while the engine default is in use.
+** conn:config{cache = n, auto_commit = false} changes them.
+** @param L the lua state
+** @return integer 1: the settings table or true, or luanosql_faildirect
 */
-static int cur_get_key(lua_State *L)
+static int conn_config_method(lua_State *L)
 {
     int res;
-    const char *errmsg;
-    char *buf;
-    int bufLen = 0;
-    cur_data *cur = getcursor(L);
-
-    /* Get length first */
-    res = unqlite_kv_cursor_key(cur->cursor, NULL, &bufLen);
-    if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    const char *engine = NULL;
+    conn_data *conn = getconnection(L);
+    conn_config cfg = conn->config;
+    if (lua_isnoneornil(L, 2)) {
+        lua_createtable(L, 0, 5);
+        if (cfg.cache > 0) {
+            lua_pushinteger(L, cfg.cache);
+            lua_setfield(L, -2, "cache");
+        }
+        unqlite_config(conn->unqlite_conn, UNQLITE_CONFIG_GET_KV_NAME, &engine);
+        lua_pushstring(L, engine != NULL ? engine : "unknown");
+        lua_setfield(L, -2, "engine");
+        lua_pushboolean(L, cfg.auto_commit);
+        lua_setfield(L, -2, "auto_commit");
+        lua_pushstring(L, kv_hash_names[cfg.hash]);
+        lua_setfield(L, -2, "hash");
+        lua_pushstring(L, kv_cmp_names[cfg.cmp]);
+        lua_setfield(L, -2, "cmp");
+        return 1;
     }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    check_options(L, 2, config_options, "config");
+    config_read(L, 2, &cfg, NULL);
+    res = config_apply(conn->unqlite_conn, &cfg, &conn->config, NULL);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    conn->config = cfg;
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    /* Allocating buffer */
-    buf = (char *)malloc(bufLen);
 
-    if( buf == NULL ) {
-        luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
-    }
+/*
+** Parallel export. Every part opens a read-only handle of its own on the
+** database file, walks the whole key space with a cursor and writes the
+** records whose key hash falls in its share to a file of its own. The
+** hash engine has no ordered or page level access, so the key space is
+** split by key hash: every part reads the keys, only the owner reads and
+** writes the data. A part file starts with "LNX1" and holds records of a
+** key length (4 bytes, little endian), a data length (8), the key and the
+** data. Reserved keys (bloom sidecar) are not exported.
+*/
 
-    /* It's data time! */
-    res = unqlite_kv_cursor_key(cur->cursor, buf, &bufLen);
-    if (res != UNQLITE_OK) {
-        free(buf);
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
-    }
-    lua_pushlstring(L, buf, (size_t)bufLen);
-    free(buf);
-    return 1;
+/* Parts of conn:parallel_export when the count is not given */
+#ifndef LUANOSQL_EXPORT_THREADS
+#define LUANOSQL_EXPORT_THREADS 4
+#endif
+#define EXPORT_MAX_THREADS 64
+#define EXPORT_MAGIC "LNX1"
+
+typedef struct
+{
+    const char    *path;               /**< database path */
+    const char    *engine;             /**< KV engine name or NULL */
+    conn_config   config;              /**< engine settings of the connection */
+    int           part;                /**< index of this part */
+    int           nparts;              /**< number of parts */
+    char          *file;               /**< output file (malloc'd) */
+    unsigned long records;             /**< records written */
+    double        bytes;               /**< key and data bytes written */
+    double        ms;                  /**< time spent */
+    int           res;                 /**< UnQLite result code */
+    char          errmsg[256];         /**< error message when res is not UNQLITE_OK */
+#ifdef LUANOSQL_PTHREADS
+    pthread_t     thread;
+    int           started;             /**< thread created */
+#endif
+} export_part;
+
+/*
+** UnQLite data consumer writing each chunk to the part file.
+** @return integer UNQLITE_OK or UNQLITE_ABORT on a write error
+*/
+static int export_consumer(const void *pData, unsigned int iDataLen, void *pUserData)
+{
+    return fwrite(pData, 1, iDataLen, (FILE *)pUserData) == iDataLen ? UNQLITE_OK : UNQLITE_ABORT;
 }
 
 /*
-** Use a cursor to get a data. Data length is firstly retrieved, then another call 
-** to get real data.This could not seem efficient but it is helpful for large data.
-** It wraps unqlite_kv_cursor_data.
-** int unqlite_kv_cursor_data(unqlite_kv_cursor *pCursor,void *pBuf,unqlite_int64 *pnData);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Write the share of one part. Errors are left in part->res and errmsg.
+** @param part the part
+** @return void
 */
-static int cur_get_data(lua_State *L)
+static void export_run(export_part *part)
 {
-    int res;
-    const char *errmsg;
-    char *buf;
-    unqlite_int64 bufLen;
-    cur_data *cur = getcursor(L);
-    /* Get length first */
-    res = unqlite_kv_cursor_data(cur->cursor, NULL, &bufLen);
-    if (res != UNQLITE_OK) {
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    conn_config defaults = {0, 1, 0, 0};
+    unqlite *db = NULL;
+    unqlite_kv_cursor *cur = NULL;
+    scratch_buf key = {NULL, 0, 0};
+    unsigned char head[12];
+    unqlite_int64 dlen;
+    double t0 = now_ms();
+    int res, rc, werr = 0;
+    FILE *out = fopen(part->file, "wb");
+    if (out == NULL) {
+        part->res = UNQLITE_IOERR;
+        snprintf(part->errmsg, sizeof(part->errmsg), "Cannot create %s", part->file);
+        return;
     }
-
-    /* Allocating buffer */
-    buf = (char *)malloc(bufLen);
-
-    if( buf == NULL ) {
-        luaL_error(L, LUANOSQL_PREFIX"Cannot allocate buffer");
+    res = unqlite_open(&db, part->path, UNQLITE_OPEN_READONLY);
+    if (res == UNQLITE_OK)
+        res = config_apply(db, &part->config, &defaults, part->engine);
+    if (res == UNQLITE_OK)
+        res = unqlite_kv_cursor_init(db, &cur);
+    if (res == UNQLITE_OK && fwrite(EXPORT_MAGIC, 1, 4, out) != 4)
+        werr = 1;
+    rc = res == UNQLITE_OK ? unqlite_kv_cursor_first_entry(cur) : UNQLITE_DONE;
+    while (!werr && rc == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cur)) {
+        key.len = 0;
+        res = unqlite_kv_cursor_key_callback(cur, scratch_consumer, &key);
+        if (res != UNQLITE_OK)
+            break;
+        if (!IS_LOCAL_KEY(key.data, key.len) &&
+            kv_hash_fnv1a(key.data, (unsigned int)key.len) % (unsigned int)part->nparts ==
+                (unsigned int)part->part) {
+            res = unqlite_kv_cursor_data(cur, NULL, &dlen);
+            if (res != UNQLITE_OK)
+                break;
+            put_le(head, key.len, 4);
+            put_le(head + 4, (size_t)dlen, 8);
+            if (fwrite(head, 1, 12, out) != 12 || fwrite(key.data, 1, key.len, out) != key.len) {
+                werr = 1;
+                break;
+            }
+            res = unqlite_kv_cursor_data_callback(cur, export_consumer, out);
+            if (res != UNQLITE_OK) {
+                werr = res == UNQLITE_ABORT;
+                break;
+            }
+            part->records++;
+            part->bytes += (double)key.len + (double)dlen;
+        }
+        rc = unqlite_kv_cursor_next_entry(cur);
     }
-
-    /* It's data time! */
-    res = unqlite_kv_cursor_data(cur->cursor, buf, &bufLen);
-    if (res != UNQLITE_OK) {
-        free(buf);
-        unqlite_logerror(cur->conn_data->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    if (fclose(out) != 0)
+        werr = 1;
+    if (werr) {
+        res = UNQLITE_IOERR;
+        snprintf(part->errmsg, sizeof(part->errmsg), "Cannot write %s", part->file);
     }
-    /* FIXME: works in major cases (up to u32, here unqlite_int64),
-    size_t here could truncate. Check size_t doc */
-    lua_pushlstring(L, buf, (size_t)bufLen);
-    free(buf);
-    return 1;
+    else if (res != UNQLITE_OK)
+        snprintf(part->errmsg, sizeof(part->errmsg), "%s", db != NULL ? engine_errmsg(db, res) :
+                 "Cannot open database");
+    part->res = res;
+    scratch_free(&key);
+    if (cur != NULL)
+        unqlite_kv_cursor_release(db, cur);
+    if (db != NULL)
+        unqlite_close(db);
+    part->ms = now_ms() - t0;
 }
 
-/**
-**  These are connection function
-*/
-
+#ifdef LUANOSQL_PTHREADS
 /*
-** Connection object collector function
-** This is garbarge collection function  for data related to  a
-** connection object.
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Thread body of a part.
+** @param arg the export_part
+** @return NULL
 */
-static int conn_gc(lua_State *L)
+static void *export_main(void *arg)
 {
-    conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUANOSQL_CONNECTION_UNQLITE);
-    if (conn != NULL && !(conn->closed))
-    {
-        if (conn->cur_counter > 0)
-            return luaL_error (L, LUANOSQL_PREFIX"there are open cursors");
-
-        /* Nullify structure fields. */
-        conn->closed = 1;
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
-        unqlite_close(conn->unqlite_conn);
-        
-    }
-    return 0;
+    export_run((export_part *)arg);
+    return NULL;
 }
-
+#endif
 
 /*
-** Close a Connection object.
-** @param L the lua state 
-** @return integer 1
+** Export the database to part files in a directory, the parts being
+** written in parallel by worker threads.
+** conn:parallel_export(dir [, nthreads]) - dir must exist, the files are
+** dir/part-000.lnx and so on. Pending writes are committed first, so that
+** the read-only handles of the parts see them. With an UnQLite built
+** without thread support the parts are written one after the other.
+** @param L the lua state
+** @return integer 1: {records, bytes, seconds, threads, parts = {{file,
+** records, bytes, seconds}, ...}}, or luanosql_faildirect
 */
-static int conn_close(lua_State *L)
+static int conn_parallel_export(lua_State *L)
 {
-    conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUANOSQL_CONNECTION_UNQLITE);
-    luaL_argcheck (L, conn != NULL, 1, LUANOSQL_PREFIX"connection expected");
-    if (conn->closed)
-    {
-        lua_pushboolean(L, 0);
-        return 1;
+    conn_data *conn = getconnection(L);
+    const char *dir = luaL_checkstring(L, 2);
+    int n = luaL_optint(L, 3, LUANOSQL_EXPORT_THREADS);
+    export_part *parts;
+    double t0, records = 0, bytes = 0;
+    size_t dlen = strlen(dir);
+    int i, res, failed = -1;
+    int threaded = 0;   /* the engine globals are only safe with its mutexes */
+    luaL_argcheck(L, n >= 1 && n <= EXPORT_MAX_THREADS, 3, "thread count out of range");
+    if (conn->path == NULL || (conn->open_flags & UNQLITE_OPEN_IN_MEMORY) || strcmp(conn->path, ":mem:") == 0)
+        return luanosql_faildirect(L, "an in-memory database cannot be exported in parallel");
+    if (!(conn->open_flags & UNQLITE_OPEN_READONLY) && (res = commit_now(conn)) != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    parts = (export_part *)calloc((size_t)n, sizeof(export_part));
+    if (parts == NULL)
+        return luanosql_faildirect(L, "Cannot allocate export parts");
+    for (i = 0; i < n; i++) {
+        parts[i].path = conn->path;
+        parts[i].engine = conn->engine;
+        parts[i].config = conn->config;
+        parts[i].part = i;
+        parts[i].nparts = n;
+        parts[i].file = (char *)malloc(dlen + 16);
+        if (parts[i].file == NULL) {
+            parts[i].res = UNQLITE_NOMEM;
+            strcpy(parts[i].errmsg, "Cannot allocate export parts");
+        }
+        else
+            sprintf(parts[i].file, "%s/part-%03d.lnx", dir, i);
     }
-    /* Clean up */
-    conn_gc(L);
-    lua_pushboolean(L, 1);
+#ifdef LUANOSQL_PTHREADS
+    threaded = n > 1 && unqlite_lib_is_threadsafe();
+#endif
+    t0 = now_ms();
+    for (i = 0; i < n; i++) {
+        if (parts[i].res != UNQLITE_OK)
+            continue;
+#ifdef LUANOSQL_PTHREADS
+        parts[i].started = threaded && pthread_create(&parts[i].thread, NULL, export_main, &parts[i]) == 0;
+        if (!parts[i].started)
+#endif
+            export_run(&parts[i]);
+    }
+#ifdef LUANOSQL_PTHREADS
+    for (i = 0; i < n; i++) {
+        if (parts[i].started)
+            pthread_join(parts[i].thread, NULL);
+    }
+#endif
+    t0 = now_ms() - t0;
+
+    lua_createtable(L, 0, 5);
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        if (parts[i].res != UNQLITE_OK && failed < 0)
+            failed = i;
+        records += parts[i].records;
+        bytes += parts[i].bytes;
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, parts[i].file != NULL ? parts[i].file : "");
+        lua_setfield(L, -2, "file");
+        lua_pushnumber(L, (lua_Number)parts[i].records);
+        lua_setfield(L, -2, "records");
+        lua_pushnumber(L, parts[i].bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, parts[i].ms / 1000.0);
+        lua_setfield(L, -2, "seconds");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "parts");
+    lua_pushnumber(L, records);
+    lua_setfield(L, -2, "records");
+    lua_pushnumber(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, t0 / 1000.0);
+    lua_setfield(L, -2, "seconds");
+    lua_pushinteger(L, threaded ? n : 1);
+    lua_setfield(L, -2, "threads");
+    if (failed >= 0)
+        lua_pushfstring(L, "part %d: %s", failed + 1, parts[failed].errmsg);
+    for (i = 0; i < n; i++)
+        free(parts[i].file);
+    free(parts);
+    if (failed >= 0)
+        return luanosql_faildirect(L, lua_tostring(L, -1));
     return 1;
 }
 
-
-
 /*
-** Commit the current transaction.
-** This is normally not needed as closing connection allows unqlite
-** automatically commit all operations such as kvfetch,kvdelete, kvappend.
-** It wraps unqlite_commit.
-** int unqlite_commit(unqlite *pDb);
-** @param L the lua state 
-** @return integer 1 or luanosql_faildirect
+** Bulk load. The input file is read through a large buffer and parsed in
+** C, the records are stored with kv_store and committed every batch
+** records. Formats:
+** tsv: key, a tab, data, one record per line; \\, \t, \n, \r and \0 are
+** unescaped in both fields.
+** jsonl: one object per line with a string "key" and a "value", a string
+** value is stored decoded, any other JSON value as its text.
+** binary: the part files of conn:parallel_export.
 */
-static int conn_commit(lua_State *L)
-{
-    conn_data *conn = getconnection(L);
-    int res;
 
-    res = unqlite_commit(conn->unqlite_conn);
+/* Records stored between two commits of conn:bulk_load by default */
+#ifndef LUANOSQL_BULK_BATCH
+#define LUANOSQL_BULK_BATCH 100000
+#endif
 
-    if (res != UNQLITE_OK)
-    {
-        lua_pushnil(L);
-        lua_pushliteral(L, LUANOSQL_PREFIX);
-        lua_concat(L, 2);
-        return 2;
-    }
-    lua_pushboolean(L, 1);
-    return 1;
-}
+/* Read buffer of conn:bulk_load */
+#ifndef LUANOSQL_BULK_READ
+#define LUANOSQL_BULK_READ (1024*1024)
+#endif
+
+#define BULK_TSV    0
+#define BULK_JSONL  1
+#define BULK_BINARY 2
+
+static const char *const bulk_formats[] = {"tsv", "jsonl", "binary", NULL};
+
+/* Options accepted by conn:bulk_load */
+static const char *const bulk_options[] = {"format", "batch", "progress", NULL};
 
+/* Buffered input of a bulk load */
+typedef struct
+{
+    FILE          *f;
+    char          *buf;                /**< read buffer (malloc'd) */
+    size_t        pos;                 /**< next unread byte of buf */
+    size_t        len;                 /**< bytes in buf */
+    double        bytes;               /**< bytes consumed */
+    unsigned long line;                /**< current line (text formats) */
+    scratch_buf   spill;               /**< line crossing the end of buf */
+    scratch_buf   key;                 /**< decoded key */
+    scratch_buf   data;                /**< decoded data */
+} bulk_reader;
 
 /*
-** Rollback the current transaction.
-** It wraps unqlite_commit.
-** int unqlite_commit(unqlite *pDb);
-** @param L the lua state 
-** @return integer 1
+** Refill the read buffer.
+** @return integer bytes read, 0 at the end of the file or on a read error
 */
-static int conn_rollback(lua_State *L)
+static size_t bulk_fill(bulk_reader *r)
 {
-    conn_data *conn = getconnection(L);
-    int res;
+    r->pos = 0;
+    r->len = fread(r->buf, 1, LUANOSQL_BULK_READ, r->f);
+    return r->len;
+}
 
-    res = unqlite_rollback(conn->unqlite_conn);
-    if( res!= UNQLITE_OK)
-    {
-        lua_pushnil(L);
-        lua_pushliteral(L, LUANOSQL_PREFIX);
-        lua_concat(L, 2);
-        return 2;
+/*
+** Read the next line, without its end of line.
+** @param r the reader
+** @param line set to the line, valid until the next read
+** @param len set to the line length
+** @return integer 1 for a line, 0 at the end of the file, -1 if out of memory
+*/
+static int bulk_line(bulk_reader *r, const char **line, size_t *len)
+{
+    const char *nl;
+    size_t n;
+    r->spill.len = 0;
+    for (;;) {
+        if (r->pos == r->len && bulk_fill(r) == 0) {
+            if (r->spill.len == 0)
+                return 0;
+            *line = r->spill.data;
+            *len = r->spill.len;
+            break;
+        }
+        nl = (const char *)memchr(r->buf + r->pos, '\n', r->len - r->pos);
+        n = nl != NULL ? (size_t)(nl - (r->buf + r->pos)) : r->len - r->pos;
+        if (nl != NULL && r->spill.len == 0) {
+            *line = r->buf + r->pos;
+            *len = n;
+            r->pos += n + 1;
+            break;
+        }
+        if (scratch_consumer(r->buf + r->pos, (unsigned int)n, &r->spill) != UNQLITE_OK)
+            return -1;
+        r->pos += n;
+        if (nl != NULL) {
+            r->pos++;
+            *line = r->spill.data;
+            *len = r->spill.len;
+            break;
+        }
     }
-    lua_pushboolean(L, 1);
+    r->line++;
+    r->bytes += (double)*len + 1;
+    if (*len > 0 && (*line)[*len - 1] == '\r')
+        (*len)--;
     return 1;
 }
 
-
 /*
-** unqlite_kv_fetch_callback callback:
-** Params: database, callback function, userdata
-**
-*** fetch_callback:
-** Params: pData,iDataLen, pUserData 
-** @param pData void* output provided 
-** @param iDataLen output length integer  
-** @param pUserData passed is a conn_data
-** @return integer 0
+** Read exactly n bytes, appended to buf.
+** @return integer 1 if ok, 0 if the file ends first, -1 if out of memory
 */
-static int fetch_callback(const void *pData, unsigned int iDataLen, void *pUserData /* conn_data for us */) {
-    conn_data *conn = (conn_data*)pUserData;
-    int res = 0;
-    lua_State *L = conn->L;
-    int top = lua_gettop(L);
-    /* setup lua callback */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);    /* get the callback function */
-    /* pData push  param */
-    lua_pushlstring(L, pData, (size_t)iDataLen);
-    /* iDataLen push  param */
-    lua_pushinteger(L, iDataLen);
-    /* get callback user data */
-    lua_rawgeti(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
-    /* call lua function */
-    res = lua_pcall(L, 3, 1, 0);
-    lua_settop(L, top);
-    return 0;
+static int bulk_read(bulk_reader *r, size_t n, scratch_buf *buf)
+{
+    size_t chunk;
+    while (n > 0) {
+        if (r->pos == r->len && bulk_fill(r) == 0)
+            return 0;
+        chunk = r->len - r->pos < n ? r->len - r->pos : n;
+        if (scratch_consumer(r->buf + r->pos, (unsigned int)chunk, buf) != UNQLITE_OK)
+            return -1;
+        r->pos += chunk;
+        r->bytes += (double)chunk;
+        n -= chunk;
+    }
+    return 1;
 }
 
-
-/**
-** Expecting a Lua function looking like this:
-** kvfetch_callback(key, mycallback, udata or nil)
-** mycallback(pout, udata)
-** (pUserData passed is a conn_data struct)
-** It unqlite_kv_fetch_callback.
-** int unqlite_kv_fetch_callback(unqlite *pDb, const void *pKey,int nKeyLen,
-**    int (*xConsumer)(const void *pData,unsigned int iDataLen,void *pUserData),
-**    void *pUserData);
-** @param L the lua state 
-** @return integer 0
+/*
+** Unescape a TSV field into buf.
+** @return integer 0 if ok, -1 if out of memory
 */
-static int conn_kv_fetch_callback(lua_State *L) {
-    size_t iLen;
-    conn_data *conn = getconnection(L);
-    const char *key = luaL_checklstring(L, 2, &iLen);
+static int bulk_tsv_field(const char *s, size_t n, scratch_buf *buf)
+{
+    size_t i;
+    char c;
+    buf->len = 0;
+    if (scratch_reserve(buf, n + 1) != 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        c = s[i];
+        if (c == '\\' && i + 1 < n) {
+            switch (s[++i]) {
+                case 't': c = '\t'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = '\0'; break;
+                default: c = s[i]; break;
+            }
+        }
+        buf->data[buf->len++] = c;
+    }
+    return 0;
+}
 
-    if (lua_gettop(L) < 3 || lua_isnil(L, 3)) {
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
+/* Skip JSON white space */
+static const char *json_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
 
-        conn->con_fetch_cb = LUA_NOREF;
-        conn->con_fetch_cb_udata = LUA_NOREF;
+/*
+** Read four hex digits.
+** @return integer the value or -1
+*/
+static long json_hex4(const char *p, const char *end)
+{
+    long v = 0;
+    int i, d;
+    if (end - p < 4)
+        return -1;
+    for (i = 0; i < 4; i++) {
+        d = p[i];
+        if (d >= '0' && d <= '9') d -= '0';
+        else if (d >= 'a' && d <= 'f') d -= 'a' - 10;
+        else if (d >= 'A' && d <= 'F') d -= 'A' - 10;
+        else return -1;
+        v = v * 16 + d;
+    }
+    return v;
+}
 
-        /* clear con_fetch_cb handler */
-        unqlite_kv_fetch_callback(conn->unqlite_conn, key, iLen, NULL,NULL);
+/*
+** Decode a JSON string starting at its opening quote into buf (if not NULL).
+** @return pointer past the closing quote, or NULL if invalid or out of memory
+*/
+static const char *json_string(const char *p, const char *end, scratch_buf *buf)
+{
+    unsigned char u[4];
+    long c, lo;
+    int n;
+    if (buf != NULL)
+        buf->len = 0;
+    if (p >= end || *p++ != '"')
+        return NULL;
+    while (p < end && *p != '"') {
+        const char *run = p;
+        while (p < end && *p != '"' && *p != '\\')
+            p++;
+        if (buf != NULL && p > run && scratch_consumer(run, (unsigned int)(p - run), buf) != UNQLITE_OK)
+            return NULL;
+        if (p >= end || *p == '"')
+            break;
+        if (++p >= end)
+            return NULL;
+        n = 1;
+        switch (*p++) {
+            case '"': u[0] = '"'; break;
+            case '\\': u[0] = '\\'; break;
+            case '/': u[0] = '/'; break;
+            case 'b': u[0] = '\b'; break;
+            case 'f': u[0] = '\f'; break;
+            case 'n': u[0] = '\n'; break;
+            case 'r': u[0] = '\r'; break;
+            case 't': u[0] = '\t'; break;
+            case 'u':
+                if ((c = json_hex4(p, end)) < 0)
+                    return NULL;
+                p += 4;
+                if (c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                    (lo = json_hex4(p + 2, end)) >= 0xdc00 && lo < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                    p += 6;
+                }
+                if (c < 0x80)
+                    u[0] = (unsigned char)c;
+                else if (c < 0x800) {
+                    u[0] = (unsigned char)(0xc0 | (c >> 6));
+                    u[1] = (unsigned char)(0x80 | (c & 0x3f));
+                    n = 2;
+                }
+                else if (c < 0x10000) {
+                    u[0] = (unsigned char)(0xe0 | (c >> 12));
+                    u[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+                    u[2] = (unsigned char)(0x80 | (c & 0x3f));
+                    n = 3;
+                }
+                else {
+                    u[0] = (unsigned char)(0xf0 | (c >> 18));
+                    u[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3f));
+                    u[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+                    u[3] = (unsigned char)(0x80 | (c & 0x3f));
+                    n = 4;
+                }
+                break;
+            default:
+                return NULL;
+        }
+        if (buf != NULL && scratch_consumer(u, (unsigned int)n, buf) != UNQLITE_OK)
+            return NULL;
     }
-    else {
-        luaL_checktype(L, 3, LUA_TFUNCTION);
-        /* always userdata field (even if nil) */
-        lua_settop(L, 4);
+    return p < end ? p + 1 : NULL;
+}
 
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb);
-        luaL_unref(L, LUA_REGISTRYINDEX, conn->con_fetch_cb_udata);
-        conn->con_fetch_cb_udata = luaL_ref(L, LUA_REGISTRYINDEX);
-        conn->con_fetch_cb = luaL_ref(L, LUA_REGISTRYINDEX);
+/*
+** Skip a JSON value.
+** @return pointer past the value or NULL if invalid
+*/
+static const char *json_skip(const char *p, const char *end, int depth)
+{
+    char close;
+    if (p >= end || depth > 200)
+        return NULL;
+    if (*p == '"')
+        return json_string(p, end, NULL);
+    if (*p == '{' || *p == '[') {
+        close = *p == '{' ? '}' : ']';
+        p = json_ws(p + 1, end);
+        if (p < end && *p == close)
+            return p + 1;
+        for (;;) {
+            if (close == '}') {
+                if ((p = json_string(p, end, NULL)) == NULL)
+                    return NULL;
+                p = json_ws(p, end);
+                if (p >= end || *p++ != ':')
+                    return NULL;
+                p = json_ws(p, end);
+            }
+            if ((p = json_skip(p, end, depth + 1)) == NULL)
+                return NULL;
+            p = json_ws(p, end);
+            if (p < end && *p == ',')
+                p = json_ws(p + 1, end);
+            else if (p < end && *p == close)
+                return p + 1;
+            else
+                return NULL;
+        }
+    }
+    /* number, true, false, null */
+    if (!(*p == '-' || isalnum((unsigned char)*p)))
+        return NULL;
+    while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.'))
+        p++;
+    return p;
+}
 
-        /* set kv_fetch_callback handler */
-        unqlite_kv_fetch_callback(conn->unqlite_conn, key, iLen, fetch_callback, conn);
+/*
+** Parse a JSONL record {"key": string, "value": any} into r->key / r->data.
+** @return integer 0 if ok, -1 if invalid or out of memory
+*/
+static int bulk_json_record(bulk_reader *r, const char *p, const char *end)
+{
+    const char *name, *v;
+    int havekey = 0, havevalue = 0;
+    p = json_ws(p, end);
+    if (p >= end || *p++ != '{')
+        return -1;
+    p = json_ws(p, end);
+    while (p < end && *p != '}') {
+        name = p;
+        if ((p = json_string(p, end, NULL)) == NULL)
+            return -1;
+        v = json_ws(p, end);
+        if (v >= end || *v++ != ':')
+            return -1;
+        v = json_ws(v, end);
+        if (p - name == 5 && memcmp(name, "\"key\"", 5) == 0) {
+            if ((p = json_string(v, end, &r->key)) == NULL)
+                return -1;
+            havekey = 1;
+        }
+        else if (p - name == 7 && memcmp(name, "\"value\"", 7) == 0) {
+            if (v < end && *v == '"')
+                p = json_string(v, end, &r->data);
+            else if ((p = json_skip(v, end, 0)) != NULL) {
+                r->data.len = 0;
+                if (scratch_consumer(v, (unsigned int)(p - v), &r->data) != UNQLITE_OK)
+                    return -1;
+            }
+            if (p == NULL)
+                return -1;
+            havevalue = 1;
+        }
+        else if ((p = json_skip(v, end, 0)) == NULL)
+            return -1;
+        p = json_ws(p, end);
+        if (p < end && *p == ',')
+            p = json_ws(p + 1, end);
+        else if (p >= end || *p != '}')
+            return -1;
     }
+    if (p >= end || json_ws(p + 1, end) != end || !havekey || !havevalue)
+        return -1;
     return 0;
 }
 
-
 /*
-** Store key and data
-** wraps unqlite_kv_store to a data source.
-** int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
-** @param L the lua state 
-** @return integer 0 or 2 with luanosql_faildirect
+** Read the next record into r->key and r->data.
+** @param r the reader
+** @param format BULK_*
+** @param errmsg set to the error message when -1 is returned
+** @return integer 1 for a record, 0 at the end of the file, -1 on error
 */
-static int conn_kv_store(lua_State *L)
+static int bulk_next(bulk_reader *r, int format, const char **errmsg)
 {
-    const char *errmsg;
+    const char *line, *tab;
+    unsigned char head[12];
+    scratch_buf hb;
+    size_t len;
     int res;
-    size_t iKeyLen, iDataLen;
-    conn_data *conn = getconnection(L);
-    const char *key = luaL_checklstring(L, 2, &iKeyLen);
-    const char *data = luaL_checklstring(L, 3, &iDataLen);
-    /* assuming */
-    res = unqlite_kv_store(conn->unqlite_conn, key, iKeyLen, data, iDataLen);
-
-    if (res != UNQLITE_OK)
-    {
-        unqlite_logerror(conn->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    if (format == BULK_BINARY) {
+        hb.data = (char *)head;
+        hb.len = 0;
+        hb.size = sizeof(head);
+        res = bulk_read(r, 12, &hb);
+        if (res == 0 && hb.len == 0 && !ferror(r->f))
+            return 0;
+        r->key.len = r->data.len = 0;
+        if (res == 1)
+            res = bulk_read(r, get_le(head, 4), &r->key);
+        if (res == 1)
+            res = bulk_read(r, get_le(head + 4, 8), &r->data);
+        if (res != 1)
+            *errmsg = res == 0 ? "truncated record" : "Cannot allocate buffer";
+        return res == 1 ? 1 : -1;
+    }
+    do {
+        res = bulk_line(r, &line, &len);
+        if (res < 0)
+            *errmsg = "Cannot allocate buffer";
+        else if (res == 0 && ferror(r->f)) {
+            *errmsg = "read error";
+            res = -1;
+        }
+        if (res <= 0)
+            return res;
+    } while (len == 0 || json_ws(line, line + len) == line + len);
+    if (format == BULK_JSONL) {
+        if (bulk_json_record(r, line, line + len) == 0)
+            return 1;
+        *errmsg = "invalid JSON record";
+        return -1;
+    }
+    tab = (const char *)memchr(line, '\t', len);
+    if (tab == NULL) {
+        *errmsg = "missing tab";
+        return -1;
+    }
+    if (bulk_tsv_field(line, (size_t)(tab - line), &r->key) != 0 ||
+        bulk_tsv_field(tab + 1, len - (size_t)(tab - line) - 1, &r->data) != 0) {
+        *errmsg = "Cannot allocate buffer";
+        return -1;
     }
-    lua_pushboolean(L, 1);
     return 1;
 }
 
+/*
+** Close the input and free the buffers of a reader.
+** @return void
+*/
+static void bulk_close(bulk_reader *r)
+{
+    if (r->f != NULL)
+        fclose(r->f);
+    free(r->buf);
+    scratch_free(&r->spill);
+    scratch_free(&r->key);
+    scratch_free(&r->data);
+}
 
 /*
-** Append key / data to an existing record. If record does not exist it is created.
-** wraps unqlite_kv_append to a data source.
-** int unqlite_kv_append(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
-** @param L the lua state 
-** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
+** Push the bulk load statistics.
+** @return void
 */
-static int conn_kv_append(lua_State *L)
+static void bulk_push_stats(lua_State *L, double records, double bytes, double ms, unsigned long batches)
 {
-    const char *errmsg;
-    int res;
-    size_t iKeyLen,iDataLen;
-    conn_data *conn = getconnection(L);
-    const char *key = luaL_checklstring(L, 2, &iKeyLen);
-    const char *data = luaL_checklstring(L,3, &iDataLen);
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, records);
+    lua_setfield(L, -2, "records");
+    lua_pushnumber(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, ms / 1000.0);
+    lua_setfield(L, -2, "seconds");
+    lua_pushnumber(L, (lua_Number)batches);
+    lua_setfield(L, -2, "batches");
+    lua_pushnumber(L, ms > 0 ? records * 1000.0 / ms : 0);
+    lua_setfield(L, -2, "records_per_sec");
+    lua_pushnumber(L, ms > 0 ? bytes * 1000.0 / ms : 0);
+    lua_setfield(L, -2, "bytes_per_sec");
+}
 
-    res = unqlite_kv_append(conn->unqlite_conn, key, iKeyLen, data, iDataLen);
+/*
+** Load the records of a file.
+** conn:bulk_load(path [, opts]) - opts: format ("tsv", "jsonl" or
+** "binary"), batch (records per transaction) and progress, a function
+** called with the statistics table after every commit; when it returns
+** false the load stops. Batches committed before an error are kept, the
+** records of the failed batch are left in the open transaction.
+** @param L the lua state
+** @return integer 1: {records, bytes, seconds, batches, records_per_sec,
+** bytes_per_sec}, or luanosql_faildirect
+*/
+static int conn_bulk_load(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    const char *path = luaL_checkstring(L, 2);
+    const char *errmsg = NULL, *name;
+    char magic[4];
+    lua_Integer batch = LUANOSQL_BULK_BATCH;
+    bulk_reader r;
+    double t0, records = 0, bytes = 0;
+    unsigned long batches = 0, pending = 0;
+    int format = BULK_TSV, progress = 0, res = UNQLITE_OK, more = 1, next, ok;
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        check_options(L, 3, bulk_options, "bulk_load");
+        lua_getfield(L, 3, "format");
+        if (!lua_isnil(L, -1)) {
+            name = lua_tostring(L, -1);
+            for (format = 0; name != NULL && bulk_formats[format] != NULL; format++)
+                if (strcmp(name, bulk_formats[format]) == 0)
+                    break;
+            if (name == NULL || bulk_formats[format] == NULL)
+                luaL_error(L, LUANOSQL_PREFIX"unknown bulk_load format '%s'", name ? name : "?");
+        }
+        lua_getfield(L, 3, "batch");
+        if (!lua_isnil(L, -1)) {
+            batch = lua_tointeger(L, -1);
+            if (batch < 1)
+                luaL_error(L, LUANOSQL_PREFIX"bulk_load batch must be positive");
+        }
+        lua_getfield(L, 3, "progress");
+        if (!lua_isnil(L, -1)) {
+            luaL_checktype(L, -1, LUA_TFUNCTION);
+            progress = lua_gettop(L);
+        }
+    }
+    if (conn->open_flags & UNQLITE_OPEN_READONLY)
+        return luanosql_faildirect(L, "Database is read-only");
+
+    memset(&r, 0, sizeof(r));
+    r.f = fopen(path, "rb");
+    if (r.f == NULL)
+        return luanosql_faildirect(L, "Cannot open bulk load file");
+    r.buf = (char *)malloc(LUANOSQL_BULK_READ);
+    if (r.buf == NULL) {
+        bulk_close(&r);
+        return luanosql_faildirect(L, "Cannot allocate buffer");
+    }
+    if (format == BULK_BINARY && (fread(magic, 1, 4, r.f) != 4 || memcmp(magic, EXPORT_MAGIC, 4) != 0)) {
+        bulk_close(&r);
+        return luanosql_faildirect(L, "not a parallel_export part file");
+    }
+    /* the key index would log every key, it is rebuilt on demand instead */
+    kindex_drop(conn);
 
-    if (res != UNQLITE_OK)
-    {
-        unqlite_logerror(conn->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    t0 = now_ms();
+    while (more) {
+        next = bulk_next(&r, format, &errmsg);
+        if (next < 0)
+            break;
+        if (next > 0) {
+            /* part files hold the stored bytes, the codec is not applied again */
+            res = (format == BULK_BINARY ? kv_store_raw : kv_store)(L, conn, r.key.data ? r.key.data : "",
+                           r.key.len, r.data.data ? r.data.data : "", r.data.len);
+            if (res != UNQLITE_OK) {
+                errmsg = kv_errmsg(conn, res);
+                break;
+            }
+            records++;
+            bytes += (double)r.key.len + (double)r.data.len;
+            pending++;
+        }
+        if (pending > 0 && (next == 0 || pending >= (unsigned long)batch)) {
+            res = commit_now(conn);
+            if (res != UNQLITE_OK) {
+                errmsg = kv_errmsg(conn, res);
+                break;
+            }
+            batches++;
+            pending = 0;
+            if (progress) {
+                lua_pushvalue(L, progress);
+                bulk_push_stats(L, records, bytes, now_ms() - t0, batches);
+                if (lua_pcall(L, 1, 1, 0) != 0) {
+                    bulk_close(&r);
+                    lua_error(L);
+                }
+                ok = lua_isnil(L, -1) || lua_toboolean(L, -1);
+                lua_pop(L, 1);
+                if (!ok)
+                    break;
+            }
+        }
+        more = next > 0;
     }
-    lua_pushboolean(L, 1);
+    /* part files bypass ix_prepare, the indexes are built again */
+    if (errmsg == NULL && format == BULK_BINARY && conn->indexes != NULL && records > 0 &&
+        ((res = ix_rebuild(L, conn)) != UNQLITE_OK || (res = commit_now(conn)) != UNQLITE_OK))
+        errmsg = kv_errmsg(conn, res);
+    if (errmsg != NULL && r.line > 0)
+        lua_pushfstring(L, "%s: line %d: %s", path, (int)r.line, errmsg);
+    else if (errmsg != NULL)
+        lua_pushfstring(L, "%s: %s", path, errmsg);
+    bulk_close(&r);
+    if (errmsg != NULL)
+        return luanosql_faildirect(L, lua_tostring(L, -1));
+    bulk_push_stats(L, records, bytes, now_ms() - t0, batches);
     return 1;
 }
 
+/*
+** Dump and restore. A dump starts with "LNSD" and a version (4 bytes,
+** little endian), then blocks of a header (payload length on 8 bytes,
+** record count and CRC32 of the payload on 4) and a payload of records, framed
+** as in the export part files: key length (4), data length (8), key, data.
+** A block with a zero length and count ends the dump, followed by the
+** total record count (8). Blocks are about LUANOSQL_DUMP_BLOCK bytes, a
+** bigger record gets a block of its own; nothing is compressed, so a dump
+** can be read sequentially or mapped in memory.
+*/
+
+/* Target payload size of a dump block */
+#ifndef LUANOSQL_DUMP_BLOCK
+#define LUANOSQL_DUMP_BLOCK (1024*1024)
+#endif
 
+/* Bytes restored between two commits */
+#ifndef LUANOSQL_RESTORE_TXN
+#define LUANOSQL_RESTORE_TXN (64*1024*1024)
+#endif
 
+#define DUMP_MAGIC "LNSD"
+#define DUMP_VERSION 1
+#define DUMP_BLOCK_HEADER 16
+
+/* CRC32 (IEEE 802.3, reflected) of every byte value */
+static const unsigned long crc32_table[256] = {
+    0x00000000UL, 0x77073096UL, 0xee0e612cUL, 0x990951baUL, 0x076dc419UL, 0x706af48fUL,
+    0xe963a535UL, 0x9e6495a3UL, 0x0edb8832UL, 0x79dcb8a4UL, 0xe0d5e91eUL, 0x97d2d988UL,
+    0x09b64c2bUL, 0x7eb17cbdUL, 0xe7b82d07UL, 0x90bf1d91UL, 0x1db71064UL, 0x6ab020f2UL,
+    0xf3b97148UL, 0x84be41deUL, 0x1adad47dUL, 0x6ddde4ebUL, 0xf4d4b551UL, 0x83d385c7UL,
+    0x136c9856UL, 0x646ba8c0UL, 0xfd62f97aUL, 0x8a65c9ecUL, 0x14015c4fUL, 0x63066cd9UL,
+    0xfa0f3d63UL, 0x8d080df5UL, 0x3b6e20c8UL, 0x4c69105eUL, 0xd56041e4UL, 0xa2677172UL,
+    0x3c03e4d1UL, 0x4b04d447UL, 0xd20d85fdUL, 0xa50ab56bUL, 0x35b5a8faUL, 0x42b2986cUL,
+    0xdbbbc9d6UL, 0xacbcf940UL, 0x32d86ce3UL, 0x45df5c75UL, 0xdcd60dcfUL, 0xabd13d59UL,
+    0x26d930acUL, 0x51de003aUL, 0xc8d75180UL, 0xbfd06116UL, 0x21b4f4b5UL, 0x56b3c423UL,
+    0xcfba9599UL, 0xb8bda50fUL, 0x2802b89eUL, 0x5f058808UL, 0xc60cd9b2UL, 0xb10be924UL,
+    0x2f6f7c87UL, 0x58684c11UL, 0xc1611dabUL, 0xb6662d3dUL, 0x76dc4190UL, 0x01db7106UL,
+    0x98d220bcUL, 0xefd5102aUL, 0x71b18589UL, 0x06b6b51fUL, 0x9fbfe4a5UL, 0xe8b8d433UL,
+    0x7807c9a2UL, 0x0f00f934UL, 0x9609a88eUL, 0xe10e9818UL, 0x7f6a0dbbUL, 0x086d3d2dUL,
+    0x91646c97UL, 0xe6635c01UL, 0x6b6b51f4UL, 0x1c6c6162UL, 0x856530d8UL, 0xf262004eUL,
+    0x6c0695edUL, 0x1b01a57bUL, 0x8208f4c1UL, 0xf50fc457UL, 0x65b0d9c6UL, 0x12b7e950UL,
+    0x8bbeb8eaUL, 0xfcb9887cUL, 0x62dd1ddfUL, 0x15da2d49UL, 0x8cd37cf3UL, 0xfbd44c65UL,
+    0x4db26158UL, 0x3ab551ceUL, 0xa3bc0074UL, 0xd4bb30e2UL, 0x4adfa541UL, 0x3dd895d7UL,
+    0xa4d1c46dUL, 0xd3d6f4fbUL, 0x4369e96aUL, 0x346ed9fcUL, 0xad678846UL, 0xda60b8d0UL,
+    0x44042d73UL, 0x33031de5UL, 0xaa0a4c5fUL, 0xdd0d7cc9UL, 0x5005713cUL, 0x270241aaUL,
+    0xbe0b1010UL, 0xc90c2086UL, 0x5768b525UL, 0x206f85b3UL, 0xb966d409UL, 0xce61e49fUL,
+    0x5edef90eUL, 0x29d9c998UL, 0xb0d09822UL, 0xc7d7a8b4UL, 0x59b33d17UL, 0x2eb40d81UL,
+    0xb7bd5c3bUL, 0xc0ba6cadUL, 0xedb88320UL, 0x9abfb3b6UL, 0x03b6e20cUL, 0x74b1d29aUL,
+    0xead54739UL, 0x9dd277afUL, 0x04db2615UL, 0x73dc1683UL, 0xe3630b12UL, 0x94643b84UL,
+    0x0d6d6a3eUL, 0x7a6a5aa8UL, 0xe40ecf0bUL, 0x9309ff9dUL, 0x0a00ae27UL, 0x7d079eb1UL,
+    0xf00f9344UL, 0x8708a3d2UL, 0x1e01f268UL, 0x6906c2feUL, 0xf762575dUL, 0x806567cbUL,
+    0x196c3671UL, 0x6e6b06e7UL, 0xfed41b76UL, 0x89d32be0UL, 0x10da7a5aUL, 0x67dd4accUL,
+    0xf9b9df6fUL, 0x8ebeeff9UL, 0x17b7be43UL, 0x60b08ed5UL, 0xd6d6a3e8UL, 0xa1d1937eUL,
+    0x38d8c2c4UL, 0x4fdff252UL, 0xd1bb67f1UL, 0xa6bc5767UL, 0x3fb506ddUL, 0x48b2364bUL,
+    0xd80d2bdaUL, 0xaf0a1b4cUL, 0x36034af6UL, 0x41047a60UL, 0xdf60efc3UL, 0xa867df55UL,
+    0x316e8eefUL, 0x4669be79UL, 0xcb61b38cUL, 0xbc66831aUL, 0x256fd2a0UL, 0x5268e236UL,
+    0xcc0c7795UL, 0xbb0b4703UL, 0x220216b9UL, 0x5505262fUL, 0xc5ba3bbeUL, 0xb2bd0b28UL,
+    0x2bb45a92UL, 0x5cb36a04UL, 0xc2d7ffa7UL, 0xb5d0cf31UL, 0x2cd99e8bUL, 0x5bdeae1dUL,
+    0x9b64c2b0UL, 0xec63f226UL, 0x756aa39cUL, 0x026d930aUL, 0x9c0906a9UL, 0xeb0e363fUL,
+    0x72076785UL, 0x05005713UL, 0x95bf4a82UL, 0xe2b87a14UL, 0x7bb12baeUL, 0x0cb61b38UL,
+    0x92d28e9bUL, 0xe5d5be0dUL, 0x7cdcefb7UL, 0x0bdbdf21UL, 0x86d3d2d4UL, 0xf1d4e242UL,
+    0x68ddb3f8UL, 0x1fda836eUL, 0x81be16cdUL, 0xf6b9265bUL, 0x6fb077e1UL, 0x18b74777UL,
+    0x88085ae6UL, 0xff0f6a70UL, 0x66063bcaUL, 0x11010b5cUL, 0x8f659effUL, 0xf862ae69UL,
+    0x616bffd3UL, 0x166ccf45UL, 0xa00ae278UL, 0xd70dd2eeUL, 0x4e048354UL, 0x3903b3c2UL,
+    0xa7672661UL, 0xd06016f7UL, 0x4969474dUL, 0x3e6e77dbUL, 0xaed16a4aUL, 0xd9d65adcUL,
+    0x40df0b66UL, 0x37d83bf0UL, 0xa9bcae53UL, 0xdebb9ec5UL, 0x47b2cf7fUL, 0x30b5ffe9UL,
+    0xbdbdf21cUL, 0xcabac28aUL, 0x53b39330UL, 0x24b4a3a6UL, 0xbad03605UL, 0xcdd70693UL,
+    0x54de5729UL, 0x23d967bfUL, 0xb3667a2eUL, 0xc4614ab8UL, 0x5d681b02UL, 0x2a6f2b94UL,
+    0xb40bbe37UL, 0xc30c8ea1UL, 0x5a05df1bUL, 0x2d02ef8dUL
+};
 
 /*
-** Fetch data for a given key
-** wraps unqlite_kv_fetch to a data source.
-** int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlite_int64 pBufLen);
-** @param L the lua state 
-** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
+** Continue a CRC32 over n more bytes.
+** @param crc CRC of the previous bytes (0 to start)
+** @return unsigned long the CRC
 */
-static int conn_kv_fetch(lua_State *L)
+static unsigned long crc32_update(unsigned long crc, const unsigned char *p, size_t n)
 {
-    const char *errmsg;
-    int res;
-    size_t iLen;
-    unqlite_int64 nBytes = 0;  //Data length
-    conn_data *conn = getconnection(L);
-    const char *key = luaL_checklstring(L, 2, &iLen);
-    char *zBuf;     //Dynamically allocated buffer
-
-    // Get the length first, later get data. Can we do it in one-shot?
-    res = unqlite_kv_fetch(conn->unqlite_conn, key, iLen, NULL, &nBytes);
-	
-	if (res == UNQLITE_NOTFOUND) {
-        lua_pushboolean(L, 1);
-        lua_pushnil(L);
-        return 2;
-    }
-    if (res != UNQLITE_OK) {
-        unqlite_logerror(conn->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
-    }
+    crc = ~crc & 0xffffffffUL;
+    while (n-- > 0)
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc & 0xffffffffUL;
+}
 
-    //Allocate a buffer big enough to hold the record content
-    zBuf = (char *)malloc(nBytes);
-    // TODO: why cannot we use an assert here?
-    if( zBuf == NULL ) {
-        return;
-    } 
+/*
+** Write a dump block: header then payload. The payload sits in buf after
+** DUMP_BLOCK_HEADER bytes kept free for the header.
+** @return integer 0 if ok, -1 on a write error
+*/
+static int dump_block(FILE *out, scratch_buf *buf, unsigned long count)
+{
+    size_t n = buf->len - DUMP_BLOCK_HEADER;
+    unsigned char *p = (unsigned char *)buf->data;
+    put_le(p, n, 8);
+    put_le(p + 8, count, 4);
+    put_le(p + 12, crc32_update(0, p + DUMP_BLOCK_HEADER, n), 4);
+    if (fwrite(p, 1, buf->len, out) != buf->len)
+        return -1;
+    buf->len = DUMP_BLOCK_HEADER;
+    return 0;
+}
 
-    //Copy record content in our buffer now
-    res = unqlite_kv_fetch(conn->unqlite_conn, key, iLen,zBuf, &nBytes);
+/*
+** Push the dump / restore statistics.
+** @return void
+*/
+static void dump_push_stats(lua_State *L, double records, double bytes, unsigned long blocks, double ms)
+{
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, records);
+    lua_setfield(L, -2, "records");
+    lua_pushnumber(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, (lua_Number)blocks);
+    lua_setfield(L, -2, "blocks");
+    lua_pushnumber(L, ms / 1000.0);
+    lua_setfield(L, -2, "seconds");
+}
 
-    // TODO: refactor, this check is done 1000 times.
+/*
+** Write every record of the database, as seen by the connection, to a
+** dump file. Buffered writes are flushed first. Reserved records (bloom
+** sidecar, index entries) describe this database only and are skipped.
+** conn:dump(path)
+** @param L the lua state
+** @return integer 1: {records, bytes, blocks, seconds}, or luanosql_faildirect
+*/
+static int conn_dump(lua_State *L)
+{
+    conn_data *conn = getconnection(L);
+    const char *path = luaL_checkstring(L, 2);
+    unqlite_kv_cursor *cur = NULL;
+    scratch_buf buf = {NULL, 0, 0};
+    unsigned char head[DUMP_BLOCK_HEADER];
+    unsigned long count = 0, blocks = 0;
+    unqlite_int64 dlen;
+    double t0 = now_ms(), records = 0, bytes = 0;
+    const char *errmsg = NULL;
+    int res, klen;
+    size_t mark;
+    FILE *out;
+
+    res = wb_flush(conn);
     if (res != UNQLITE_OK)
-    {
-        unqlite_logerror(conn->unqlite_conn, errmsg);
-		free(zBuf);
-        return luanosql_faildirect(L, errmsg);
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    res = unqlite_kv_cursor_init(conn->unqlite_conn, &cur);
+    if (res != UNQLITE_OK)
+        return luanosql_faildirect(L, kv_errmsg(conn, res));
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        unqlite_kv_cursor_release(conn->unqlite_conn, cur);
+        return luanosql_faildirect(L, "Cannot create dump file");
     }
-    lua_pushboolean(L, 1);
-    lua_pushlstring(L, zBuf, nBytes);
-    free(zBuf);
-    return 2;
+    memcpy(head, DUMP_MAGIC, 4);
+    put_le(head + 4, DUMP_VERSION, 4);
+    if (fwrite(head, 1, 8, out) != 8 || scratch_reserve(&buf, LUANOSQL_DUMP_BLOCK + DUMP_BLOCK_HEADER) != 0)
+        errmsg = "Cannot write dump file";
+    buf.len = DUMP_BLOCK_HEADER;
+    res = unqlite_kv_cursor_first_entry(cur);
+    while (errmsg == NULL && res == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cur)) {
+        res = unqlite_kv_cursor_key(cur, NULL, &klen);
+        if (res == UNQLITE_OK)
+            res = unqlite_kv_cursor_data(cur, NULL, &dlen);
+        if (res != UNQLITE_OK)
+            break;
+        if (count > 0 && buf.len + 12 + (size_t)klen + (size_t)dlen > LUANOSQL_DUMP_BLOCK + DUMP_BLOCK_HEADER) {
+            if (dump_block(out, &buf, count) != 0) {
+                errmsg = "Cannot write dump file";
+                break;
+            }
+            count = 0;
+            blocks++;
+        }
+        mark = buf.len;
+        put_le(head, (size_t)klen, 4);
+        put_le(head + 4, (size_t)dlen, 8);
+        if (scratch_consumer(head, 12, &buf) != UNQLITE_OK)
+            res = UNQLITE_ABORT;
+        if (res == UNQLITE_OK)
+            res = unqlite_kv_cursor_key_callback(cur, scratch_consumer, &buf);
+        if (res == UNQLITE_OK && IS_LOCAL_KEY(buf.data + mark + 12, (size_t)klen)) {
+            buf.len = mark;
+            res = unqlite_kv_cursor_next_entry(cur);
+            continue;
+        }
+        if (res == UNQLITE_OK)
+            res = unqlite_kv_cursor_data_callback(cur, scratch_consumer, &buf);
+        if (res != UNQLITE_OK)
+            break;
+        count++;
+        records++;
+        bytes += (double)klen + (double)dlen;
+        res = unqlite_kv_cursor_next_entry(cur);
+    }
+    if (errmsg == NULL && res != UNQLITE_OK && res != UNQLITE_DONE)
+        errmsg = kv_errmsg(conn, res);
+    unqlite_kv_cursor_release(conn->unqlite_conn, cur);
+    if (errmsg == NULL && count > 0) {
+        if (dump_block(out, &buf, count) != 0)
+            errmsg = "Cannot write dump file";
+        blocks++;
+    }
+    if (errmsg == NULL) {
+        memset(head, 0, sizeof(head));
+        if (fwrite(head, 1, DUMP_BLOCK_HEADER, out) != DUMP_BLOCK_HEADER)
+            errmsg = "Cannot write dump file";
+        put_le(head, (size_t)records, 8);
+        if (errmsg == NULL && fwrite(head, 1, 8, out) != 8)
+            errmsg = "Cannot write dump file";
+    }
+    if (fclose(out) != 0 && errmsg == NULL)
+        errmsg = "Cannot write dump file";
+    if (errmsg != NULL)
+        lua_pushstring(L, errmsg);
+    scratch_free(&buf);
+    if (errmsg != NULL)
+        return luanosql_faildirect(L, lua_tostring(L, -1));
+    dump_push_stats(L, records, bytes, blocks, now_ms() - t0);
+    return 1;
 }
 
-
 /*
-** Delete a record passing the key. if the record is not found it returns
-** true anyway as deleting a non existent record does not have any side-effect.
-** wraps unqlite_kv_delete to a data source.
-** int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen);
-** @param L the lua state 
-** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
+** Store the records of a dump file, committing about every
+** LUANOSQL_RESTORE_TXN bytes. Records are stored over the existing ones.
+** Every block is checked before any of its records is stored; on an
+** error the blocks committed before are kept, the others are left in the
+** open transaction.
+** conn:restore(path)
+** @param L the lua state
+** @return integer 1: {records, bytes, blocks, seconds}, or luanosql_faildirect
 */
-static int conn_kv_delete(lua_State *L)
+static int conn_restore(lua_State *L)
 {
-    const char *errmsg;
-    int res;
-    size_t iLen;
     conn_data *conn = getconnection(L);
-    const char *key = luaL_checklstring(L, 2, &iLen);
-
-    res = unqlite_kv_delete(conn->unqlite_conn, key, iLen);
-
-    if (res != UNQLITE_OK && res != UNQLITE_NOTFOUND)
-    {
-        unqlite_logerror(conn->unqlite_conn, errmsg);
-        return luanosql_faildirect(L, errmsg);
+    const char *path = luaL_checkstring(L, 2);
+    scratch_buf block = {NULL, 0, 0}, hb;
+    unsigned char head[DUMP_BLOCK_HEADER];
+    const unsigned char *p, *end;
+    unsigned long blocks = 0, count;
+    double t0 = now_ms(), records = 0, bytes = 0, pending = 0;
+    size_t klen, dlen, n;
+    const char *errmsg = NULL;
+    bulk_reader r;
+    int res = UNQLITE_OK;
+
+    if (conn->open_flags & UNQLITE_OPEN_READONLY)
+        return luanosql_faildirect(L, "Database is read-only");
+    memset(&r, 0, sizeof(r));
+    r.f = fopen(path, "rb");
+    if (r.f == NULL)
+        return luanosql_faildirect(L, "Cannot open dump file");
+    r.buf = (char *)malloc(LUANOSQL_BULK_READ);
+    hb.data = (char *)head;
+    hb.size = sizeof(head);
+    hb.len = 0;
+    if (r.buf == NULL)
+        errmsg = "Cannot allocate buffer";
+    else if (bulk_read(&r, 8, &hb) != 1 || memcmp(head, DUMP_MAGIC, 4) != 0)
+        errmsg = "not a dump file";
+    else if (get_le(head + 4, 4) != DUMP_VERSION)
+        errmsg = "unsupported dump version";
+    else
+        kindex_drop(conn);
+    while (errmsg == NULL) {
+        hb.len = 0;
+        if (bulk_read(&r, DUMP_BLOCK_HEADER, &hb) != 1) {
+            errmsg = "truncated dump";
+            break;
+        }
+        n = get_le(head, 8);
+        count = (unsigned long)get_le(head + 8, 4);
+        if (n == 0 && count == 0) {
+            hb.len = 0;
+            if (bulk_read(&r, 8, &hb) != 1)
+                errmsg = "truncated dump";
+            else if ((double)get_le(head, 8) != records)
+                errmsg = "record count mismatch";
+            break;
+        }
+        block.len = 0;
+        if (bulk_read(&r, n, &block) != 1) {
+            errmsg = "truncated dump";
+            break;
+        }
+        if (crc32_update(0, (const unsigned char *)block.data, n) != (unsigned long)get_le(head + 12, 4)) {
+            errmsg = "checksum mismatch";
+            break;
+        }
+        p = (const unsigned char *)block.data;
+        end = p + n;
+        for (; count > 0; count--) {
+            if (end - p < 12 || (klen = get_le(p, 4), dlen = get_le(p + 4, 8),
+                                 (size_t)(end - p - 12) < klen || (size_t)(end - p - 12) - klen < dlen)) {
+                errmsg = "corrupt block";
+                break;
+            }
+            res = kv_store_raw(L, conn, (const char *)p + 12, klen, (const char *)p + 12 + klen, dlen);
+            if (res != UNQLITE_OK) {
+                errmsg = kv_errmsg(conn, res);
+                break;
+            }
+            p += 12 + klen + dlen;
+            records++;
+            bytes += (double)(klen + dlen);
+            pending += (double)(klen + dlen);
+        }
+        if (errmsg == NULL && p != end)
+            errmsg = "corrupt block";
+        if (errmsg != NULL)
+            break;
+        blocks++;
+        if (pending >= LUANOSQL_RESTORE_TXN) {
+            if ((res = commit_now(conn)) != UNQLITE_OK)
+                errmsg = kv_errmsg(conn, res);
+            pending = 0;
+        }
     }
-    lua_pushboolean(L, 1);
+    /* the restored entries may not match the indexes declared here */
+    if (errmsg == NULL && (res = ix_rebuild(L, conn)) != UNQLITE_OK)
+        errmsg = kv_errmsg(conn, res);
+    if (errmsg == NULL && (res = commit_now(conn)) != UNQLITE_OK)
+        errmsg = kv_errmsg(conn, res);
+    if (errmsg != NULL)
+        lua_pushfstring(L, "%s: %s", path, errmsg);
+    bulk_close(&r);
+    scratch_free(&block);
+    if (errmsg != NULL)
+        return luanosql_faildirect(L, lua_tostring(L, -1));
+    dump_push_stats(L, records, bytes, blocks, now_ms() - t0);
     return 1;
 }
 
-
 /*
 ** This section is for environment object functions.
 */
@@ -1367,8 +8868,15 @@ static int conn_kv_delete(lua_State *L)
 static int env_gc (lua_State *L)
 {
     env_data *env = (env_data *)luaL_checkudata(L, 1, LUANOSQL_ENVIRONMENT_UNQLITE);
-    if (env != NULL && !(env->closed))
+    if (env != NULL && !(env->closed)) {
         env->closed = 1;
+#ifdef LUANOSQL_ASYNC
+        async_pool_stop(env);   /* runs the queued operations first */
+#endif
+        pool_trim(env, 0);
+        free(env->pool);
+        env->pool = NULL;
+    }
     return 0;
 }
 
@@ -1393,8 +8901,168 @@ static int env_close (lua_State *L)
 
 
 /*
-** Open a connection with DB (it is always created in UNQLITE_OPEN_READWRITE, UNQLITE_OPEN_CREATE)
-** Connects to a data source.
+** Configure the connection pool.
+** env:pool{size = n, idle = seconds} - size is the max number of idle
+** handles kept (0 disables pooling), idle the seconds an idle handle is
+** kept (0: until evicted by size).
+** @param L the lua state
+** @return integer 1 (true) or luanosql_faildirect
+*/
+static int env_pool(lua_State *L)
+{
+    env_data *env = getenvironment(L);
+    int size = env->pool_size;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "size");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(L, lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0, 2,
+                      LUANOSQL_PREFIX"pool size must be a non negative number");
+        size = (int)lua_tointeger(L, -1);
+    }
+    lua_getfield(L, 2, "idle");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(L, lua_isnumber(L, -1) && lua_tointeger(L, -1) >= 0, 2,
+                      LUANOSQL_PREFIX"pool idle must be a non negative number");
+        env->pool_idle = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 2);
+    pool_trim(env, size);
+    if (size != env->pool_size && env->pool != NULL) {
+        pool_entry *pool = (pool_entry *)realloc(env->pool, sizeof(pool_entry) * (size > 0 ? size : 1));
+        if (pool == NULL)
+            return luanosql_faildirect(L, "Cannot allocate pool");
+        env->pool = pool;
+    }
+    env->pool_size = size;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Get the connection pool counters.
+** @param L the lua state
+** @return integer 1: a table {hits, misses, evictions, idle, size}
+*/
+static int env_pool_stats(lua_State *L)
+{
+    env_data *env = getenvironment(L);
+    pool_trim(env, env->pool_size);
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, (lua_Number)env->pool_hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, (lua_Number)env->pool_misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, (lua_Number)env->pool_evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, env->pool_count);
+    lua_setfield(L, -2, "idle");
+    lua_pushinteger(L, env->pool_size);
+    lua_setfield(L, -2, "size");
+    return 1;
+}
+
+
+/*
+** Open a connection on a shared handle (env:connect with shared = true).
+** The engine settings are applied by the connection opening the handle,
+** the later ones use it as it is.
+** @param L the lua state
+** @param sourcename database path
+** @param flags UNQLITE_OPEN_* flags
+** @param cfg engine settings
+** @param engine KV engine name or NULL
+** @param typed_keys encode integer and tuple keys
+** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
+*/
+static int connect_shared(lua_State *L, const char *sourcename, int flags,
+                          const conn_config *cfg, const char *engine, int typed_keys)
+{
+#ifndef LUANOSQL_OMIT_THREADS
+    conn_config defaults = {0, 1, 0, 0};
+    const char *errmsg;
+    shared_handle *sh;
+    int res, fresh;
+    if (!unqlite_lib_is_threadsafe())
+        return luanosql_faildirect(L, "UnQLite was built without thread support");
+    if (flags & UNQLITE_OPEN_NOMUTEX)
+        luaL_error(L, LUANOSQL_PREFIX"a shared connection needs the engine mutex");
+    if ((flags & UNQLITE_OPEN_IN_MEMORY) || strcmp(sourcename, ":mem:") == 0)
+        luaL_error(L, LUANOSQL_PREFIX"an in-memory database cannot be shared");
+    registry_lock();
+    sh = shared_attach(sourcename, flags, &fresh, &res);
+    if (sh == NULL) {
+        registry_unlock();
+        return luanosql_faildirect(L, res == UNQLITE_NOMEM ? "Cannot allocate shared handle" :
+                                   "Cannot open shared database");
+    }
+    if (fresh && (res = config_apply(sh->db, cfg, &defaults, engine)) != UNQLITE_OK) {
+        shared_list = sh->next;     /* still at the head, nobody else has it */
+        registry_unlock();
+        unqlite_logerror(sh->db, &errmsg);
+        lua_pushstring(L, errmsg);
+        shared_free(sh);
+        return luanosql_faildirect(L, lua_tostring(L, -1));
+    }
+    registry_unlock();
+    return create_connection(L, 1, sh->db, flags, cfg, sourcename, engine, sh, typed_keys);
+#else
+    (void)sourcename; (void)flags; (void)cfg; (void)engine; (void)typed_keys;
+    return luanosql_faildirect(L, "shared connections are not compiled in");
+#endif
+}
+
+
+/* Options accepted by env:connect */
+static const char *const connect_options[] = {
+    "readonly", "mmap", "memory", "journal", "mutex",
+    "cache", "engine", "auto_commit", "hash", "cmp", "shared", "typed_keys", NULL
+};
+
+/*
+** Check the env:connect options and translate them into UNQLITE_OPEN_*
+** flags. Unknown options and incompatible modes raise an error.
+** @param L the lua state
+** @param idx stack index of the options table or 0
+** @param sourcename database path, ":mem:" is an in-memory database
+** @return integer the open flags
+*/
+static int connect_flags(lua_State *L, int idx, const char *sourcename)
+{
+    int readonly, mmap, memory, flags;
+    if (idx)
+        check_options(L, idx, connect_options, "connect");
+    mmap = opt_bool(L, idx, "mmap", 0);
+    readonly = opt_bool(L, idx, "readonly", mmap);
+    memory = opt_bool(L, idx, "memory", strcmp(sourcename, ":mem:") == 0);
+    if (mmap && !readonly)
+        luaL_error(L, LUANOSQL_PREFIX"mmap mode is read-only");
+    if (memory && readonly)
+        luaL_error(L, LUANOSQL_PREFIX"an in-memory database cannot be read-only");
+
+    if (mmap)
+        flags = UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP;
+    else if (readonly)
+        flags = UNQLITE_OPEN_READONLY;
+    else
+        flags = UNQLITE_OPEN_READWRITE | UNQLITE_OPEN_CREATE;
+    if (memory)
+        flags |= UNQLITE_OPEN_IN_MEMORY;
+    if (!opt_bool(L, idx, "journal", 1))
+        flags |= UNQLITE_OPEN_OMIT_JOURNALING;
+    if (!opt_bool(L, idx, "mutex", 1))
+        flags |= UNQLITE_OPEN_NOMUTEX;
+    return flags;
+}
+
+/*
+** Open a connection with DB, or reuse an idle handle of the pool.
+** env:connect(sourcename [, opts]) - by default the database is opened
+** read-write and created if missing; opts selects other modes:
+** readonly, mmap (read-only, memory mapped), memory, journal, mutex,
+** and the engine settings: cache, engine, auto_commit, hash, cmp.
+** shared = true attaches to the handle other lua_States of the process
+** opened on the same path with the same flags (see shared_attach).
+** typed_keys = true encodes integer and tuple keys (see key_get).
 ** @param L the lua state 
 ** @return integer 1 if ok, 2 for luanosql_faildirect(L, errmsg);
 */
@@ -1403,19 +9071,38 @@ static int env_connect(lua_State *L)
     const char *sourcename;
     unqlite *conn;
     const char *errmsg;
-    int res;
-    getenvironment(L);  /* validate environment */
+    const char *engine = NULL;
+    int res, flags, typed_keys;
+    conn_config defaults = {0, 1, 0, 0};
+    conn_config cfg = defaults, old;
+    env_data *env = getenvironment(L);  /* validate environment */
 
     sourcename = luaL_checkstring(L, 2);
-    res = unqlite_open(&conn, sourcename, UNQLITE_OPEN_READWRITE | UNQLITE_OPEN_CREATE);
+    if (!lua_isnoneornil(L, 3))
+        luaL_checktype(L, 3, LUA_TTABLE);
+    flags = connect_flags(L, lua_istable(L, 3) ? 3 : 0, sourcename);
+    if (lua_istable(L, 3))
+        config_read(L, 3, &cfg, &engine);
+    typed_keys = opt_bool(L, lua_istable(L, 3) ? 3 : 0, "typed_keys", 0);
+    if (opt_bool(L, lua_istable(L, 3) ? 3 : 0, "shared", 0))
+        return connect_shared(L, sourcename, flags, &cfg, engine, typed_keys);
+    conn = env->pool_size > 0 ? pool_take(env, sourcename, engine, flags, &cfg, &old) : NULL;
+    if (conn != NULL)
+        res = config_apply(conn, &cfg, &old, NULL);  /* only the cache size can differ */
+    else {
+        res = unqlite_open(&conn, sourcename, flags);
+        if (res == UNQLITE_OK)
+            res = config_apply(conn, &cfg, &defaults, engine);
+    }
 
     if (res != UNQLITE_OK)
     {
-        unqlite_logerror(conn, errmsg);
+        unqlite_logerror(conn, &errmsg);
+        lua_pushstring(L, errmsg);      /* the log is freed with the handle */
 		unqlite_close(conn);
-        return luanosql_faildirect(L, errmsg);
+        return luanosql_faildirect(L, lua_tostring(L, -1));
     }
-    return create_connection(L, 1, conn);
+    return create_connection(L, 1, conn, flags, &cfg, sourcename, engine, NULL, typed_keys);
 }
 
 /*
@@ -1429,6 +9116,12 @@ static void create_metatables (lua_State *L)
         {"__gc", env_gc},
         {"close", env_close},
         {"connect", env_connect},
+        {"pool", env_pool},
+        {"pool_stats", env_pool_stats},
+#ifdef LUANOSQL_ASYNC
+        {"async_fd", env_async_fd},
+        {"async_poll", env_async_poll},
+#endif
         {NULL, NULL},
     };
     struct luaL_Reg connection_methods[] = {
@@ -1436,11 +9129,53 @@ static void create_metatables (lua_State *L)
         {"close", conn_close},
         {"commit", conn_commit},
         {"rollback", conn_rollback},
+        {"commit_policy", conn_commit_policy},
+        {"commit_stats", conn_commit_stats},
+        {"write_buffer", conn_write_buffer},
+        {"write_buffer_stats", conn_write_buffer_stats},
+        {"flush", conn_flush},
+        {"value_cache", conn_value_cache},
+        {"value_cache_stats", conn_value_cache_stats},
+        {"bloom", conn_bloom},
+        {"bloom_stats", conn_bloom_stats},
+        {"compression", conn_compression},
+        {"compression_stats", conn_compression_stats},
+        {"exists", conn_exists},
+#ifndef LUANOSQL_OMIT_STATS
+        {"stats", conn_stats},
+        {"reset_stats", conn_reset_stats},
+#endif
         {"kvstore", conn_kv_store},
         {"kvappend", conn_kv_append},
         {"kvfetch", conn_kv_fetch},
         {"kvdelete", conn_kv_delete},
+#ifdef LUANOSQL_ASYNC
+        {"kvfetch_async", conn_kv_fetch_async},
+        {"kvstore_async", conn_kv_store_async},
+        {"kvappend_async", conn_kv_append_async},
+        {"kvdelete_async", conn_kv_delete_async},
+        {"commit_async", conn_commit_async},
+#endif
         {"kvfetch_callback", conn_kv_fetch_callback},
+        {"kvfetch_stream", conn_kv_fetch_stream},
+        {"put_table", conn_put_table},
+        {"get_table", conn_get_table},
+        {"kvmstore", conn_kv_mstore},
+        {"kvmfetch", conn_kv_mfetch},
+        {"kvmdelete", conn_kv_mdelete},
+        {"range", conn_range},
+        {"prefix", conn_prefix},
+        {"reindex", conn_reindex},
+        {"create_index", conn_create_index},
+        {"drop_index", conn_drop_index},
+        {"index_lookup", conn_index_lookup},
+        {"index_range", conn_index_range},
+        {"mode", conn_mode},
+        {"config", conn_config_method},
+        {"parallel_export", conn_parallel_export},
+        {"bulk_load", conn_bulk_load},
+        {"dump", conn_dump},
+        {"restore", conn_restore},
         {"create_cursor", conn_create_cursor},
 #ifndef LUANOSQL_OMIT_JX9_DOCSTORE
         {"compile", jx9_ds_compile},
@@ -1458,12 +9193,37 @@ static void create_metatables (lua_State *L)
         {"prev_entry", cur_prev_entry},
         {"next_entry", cur_next_entry},
         {"cursor_key", cur_get_key},
+        {"cursor_typed_key", cur_get_typed_key},
         {"cursor_data", cur_get_data},
+        {"cursor_data_stream", cur_data_stream},
+        {"cursor_table", cur_get_table},
         {"delete_entry", cur_delete_entry},
+        {"scan", cur_scan},
+        {"records", cur_records},
         //{"key_callback", cur_key_callback},   /** to be implemented */
         //{"data_callback", cur_data_callback}, /** to be implemented */
         {NULL, NULL},
     };
+#ifdef LUANOSQL_ASYNC
+    struct luaL_Reg async_methods[] = {
+        {"__gc", async_gc},
+        {"ready", async_ready},
+        {"wait", async_wait},
+        {"result", async_result},
+        {NULL, NULL},
+    };
+#endif
+    struct luaL_Reg blob_methods[] = {
+        {"__gc", blob_gc},
+        {"__len", blob_len},
+        {"len", blob_len},
+        {"sub", blob_sub},
+        {"byte", blob_byte},
+        {"tostring", blob_tostring},
+        {"write", blob_write},
+        {"free", blob_free},
+        {NULL, NULL},
+    };
 #ifndef LUANOSQL_OMIT_JX9_DOCSTORE
 	struct luaL_Reg jx9_ds_methods[] = {
         {"__gc", jx9_ds_gc},
@@ -1483,11 +9243,21 @@ static void create_metatables (lua_State *L)
     luanosql_createmeta(L, LUANOSQL_ENVIRONMENT_UNQLITE, environment_methods);
     luanosql_createmeta(L, LUANOSQL_CONNECTION_UNQLITE, connection_methods);
     luanosql_createmeta(L, LUANOSQL_CURSOR_UNQLITE, cursor_methods);
+#ifndef LUANOSQL_OMIT_THREADS
+    shared_createmeta(L, LUANOSQL_SHARED_CONNECTION_UNQLITE, connection_methods, shared_conn_call);
+    shared_createmeta(L, LUANOSQL_SHARED_CURSOR_UNQLITE, cursor_methods, shared_cur_call);
+    lua_pop(L, 2);
+#endif
+#ifdef LUANOSQL_ASYNC
+    luanosql_createmeta(L, LUANOSQL_ASYNC_UNQLITE, async_methods);
+    lua_pop(L, 1);
+#endif
+    luanosql_createmeta(L, LUANOSQL_BLOB_UNQLITE, blob_methods);
 #ifndef LUANOSQL_OMIT_JX9_DOCSTORE
     luanosql_createmeta(L, LUANOSQL_JX9DOCSTORE_UNQLITE, jx9_ds_methods);
-	lua_pop(L, 4);
+	lua_pop(L, 5);
 #else
-	lua_pop(L,3);
+	lua_pop(L,4);
 #endif
 }
 
@@ -1504,6 +9274,12 @@ static int create_environment (lua_State *L)
 
     /* fill in structure */
     env->closed = 0;
+    env->pool = NULL;
+    env->pool_count = 0;
+    env->pool_size = LUANOSQL_POOL_SIZE;
+    env->pool_idle = LUANOSQL_POOL_IDLE;
+    env->pool_hits = env->pool_misses = env->pool_evictions = 0;
+    env->async = NULL;
     return 1;
 }
 
@@ -128,6 +128,88 @@ context("User should be able to create/close a connection", function()
 			assert_equal(data2, "value-10-appended")
 		end)
 		
+		test("Should be able to store and fetch large and empty values", function ()
+			-- large values are handed over by the engine in several chunks
+			local big = string.rep("0123456789abcdef", 65536)
+			assert_true(conn:kvstore("big", big))
+			local res, data = conn:kvfetch("big")
+			assert_true(res)
+			assert_equal(#data, #big)
+			assert_equal(data, big)
+			-- small read after a big one reuses the connection buffer
+			local r1, d1 = conn:kvfetch("key1")
+			assert_equal(d1, "value-1")
+			assert_true(conn:kvstore("empty", ""))
+			local r2, d2 = conn:kvfetch("empty")
+			assert_true(r2)
+			assert_equal(d2, "")
+			assert_true(conn:kvdelete("big"))
+			assert_true(conn:kvdelete("empty"))
+		end)
+		
+		test("Should be able to fetch a value as a blob", function ()
+			local big = string.rep("0123456789abcdef", 16384)
+			assert_true(conn:kvstore("blob", big))
+			local res, blob = conn:kvfetch("blob", true)
+			assert_true(res)
+			assert_equal(blob:len(), #big)
+			assert_equal(#blob, #big)
+			assert_equal(blob:sub(1, 4), "0123")
+			assert_equal(blob:sub(-3), "def")
+			assert_equal(blob:sub(5, 4), "")
+			assert_equal(blob:byte(1), 48)
+			assert_equal(select("#", blob:byte(1, 3)), 3)
+			assert_equal(blob:tostring(), big)
+			local f = io.tmpfile()
+			assert_true(blob:write(f))
+			f:seek("set")
+			assert_equal(f:read("*a"), big)
+			f:close()
+			assert_true(blob:free())
+			assert_false(blob:free())
+			assert_error(function() blob:len() end)
+			-- missing keys give true and nil
+			local r2, b2 = conn:kvfetch("no-such-key", true)
+			assert_true(r2)
+			assert_nil(b2)
+			assert_true(conn:kvdelete("blob"))
+		end)
+		
+		test("Should be able to stream a value to a function in chunks", function ()
+			local big = string.rep("0123456789", 10000)
+			assert_true(conn:kvstore("stream", big))
+			local chunks = {}
+			local res, n = conn:kvfetch_stream("stream", function (chunk)
+				assert_true(#chunk <= 4096)
+				chunks[#chunks + 1] = chunk
+			end, 4096)
+			assert_true(res)
+			assert_equal(n, #big)
+			assert_gt(#chunks, 1)
+			assert_equal(table.concat(chunks), big)
+			-- missing keys give true and nil, as kvfetch
+			local r2, n2 = conn:kvfetch_stream("no-such-key", function () end)
+			assert_true(r2)
+			assert_nil(n2)
+		end)
+		
+		test("Should be able to stream a value to a file", function ()
+			local f = io.tmpfile()
+			local res, n = conn:kvfetch_stream("stream", f)
+			assert_true(res)
+			assert_equal(n, 100000)
+			f:seek("set")
+			assert_equal(f:read("*a"), string.rep("0123456789", 10000))
+			f:close()
+		end)
+		
+		test("Should get an error when the stream sink fails", function ()
+			local res, err = conn:kvfetch_stream("stream", function () error("sink full") end, 1024)
+			assert_nil(res)
+			assert_match("sink full", err)
+			assert_true(conn:kvdelete("stream"))
+		end)
+		
 		test("Should be able to register a consumer callback to redirect data retrieval", function()
 			--  Try to pass userdata which can be used by callback itself
 			--print("Check Callback on fetch")
@@ -187,6 +269,1286 @@ end)
 
 
 
+-- In this context we cover batch operations (kvmstore, kvmfetch, kvmdelete)
+context("User should be able to manage data in batches", function()
+	
+	local conn, env
+	
+	test("Should be able to create a connection", function ()
+		os.remove("lns-unqlite-batch.testdb")
+		env = assert(driver.unqlite())
+		conn = assert(env:connect("lns-unqlite-batch.testdb"))
+	end)
+	
+	test("Should be able to store a table of records in one call", function ()
+		local n, errs = conn:kvmstore(mlist, true)
+		assert_equal(n, 10)
+		assert_nil(errs)
+		local r, d = conn:kvfetch("key3")
+		assert_equal(d, "value-3")
+	end)
+	
+	test("Should be able to fetch an array of keys in one call", function ()
+		local res, errs = conn:kvmfetch({"key1", "key2", "missing"})
+		assert_nil(errs)
+		assert_equal(res["key1"], "value-1")
+		assert_equal(res["key2"], "value-2")
+		assert_nil(res["missing"])
+	end)
+	
+	test("Should be able to fetch using the keys of a map", function ()
+		local res = conn:kvmfetch(mlist)
+		for k, v in pairs(mlist) do
+			assert_equal(res[k], v)
+		end
+	end)
+	
+	test("Should get per key errors for invalid records", function ()
+		local n, errs = conn:kvmstore({good = "yes", bad = {}})
+		assert_equal(n, 1)
+		assert_not_nil(errs)
+		assert_not_nil(errs["bad"])
+		assert_nil(errs["good"])
+		assert_true(conn:rollback())
+	end)
+	
+	test("Should be able to delete an array of keys in one call", function ()
+		local n, errs = conn:kvmdelete({"key1", "key2", "missing"}, true)
+		assert_equal(n, 3)
+		assert_nil(errs)
+		local res = conn:kvmfetch({"key1", "key2", "key3"})
+		assert_nil(res["key1"])
+		assert_nil(res["key2"])
+		assert_equal(res["key3"], "value-3")
+	end)
+	
+	test("Should be able to close the connection", function ()
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-batch.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover the connection open modes
+context("User should be able to open connections in different modes", function()
+	
+	local env
+	
+	test("Should be able to open a read-only connection", function ()
+		os.remove("lns-unqlite-mode.testdb")
+		env = assert(driver.unqlite())
+		local rw = assert(env:connect("lns-unqlite-mode.testdb"))
+		local mode = rw:mode()
+		assert_false(mode.readonly)
+		assert_true(mode.journal)
+		assert_true(mode.mutex)
+		assert_true(rw:kvstore("key1", "value-1"))
+		assert_true(rw:close())
+		local ro = assert(env:connect("lns-unqlite-mode.testdb", {readonly = true}))
+		assert_true(ro:mode().readonly)
+		local res, data = ro:kvfetch("key1")
+		assert_equal(data, "value-1")
+		local r2, err = ro:kvstore("key2", "value-2")
+		assert_nil(r2)
+		assert_not_nil(err)
+		assert_true(ro:close())
+	end)
+	
+	test("Should be able to open a memory mapped connection", function ()
+		local mm = assert(env:connect("lns-unqlite-mode.testdb", {mmap = true}))
+		local mode = mm:mode()
+		assert_true(mode.mmap)
+		assert_true(mode.readonly)
+		local res, data = mm:kvfetch("key1")
+		assert_equal(data, "value-1")
+		assert_true(mm:close())
+		os.remove("lns-unqlite-mode.testdb")
+	end)
+	
+	test("Should be able to open in-memory and unjournaled connections", function ()
+		local mem = assert(env:connect(":mem:", {journal = false, mutex = false}))
+		local mode = mem:mode()
+		assert_true(mode.memory)
+		assert_false(mode.journal)
+		assert_false(mode.mutex)
+		assert_true(mem:kvstore("key1", "value-1"))
+		assert_true(mem:close())
+	end)
+	
+	test("Should be able to configure the engine", function ()
+		local conn = assert(env:connect("lns-unqlite-mode.testdb", {cache = 4096, hash = "fnv1a", cmp = "memcmp"}))
+		local cfg = conn:config()
+		assert_equal(cfg.cache, 4096)
+		assert_equal(cfg.hash, "fnv1a")
+		assert_equal(cfg.cmp, "memcmp")
+		assert_true(cfg.auto_commit)
+		assert_not_nil(cfg.engine)
+		assert_true(conn:kvstore("key1", "value-1"))
+		assert_true(conn:config{cache = 256})
+		assert_equal(conn:config().cache, 256)
+		local res, data = conn:kvfetch("key1")
+		assert_equal(data, "value-1")
+		-- engine, hash and cmp only at connect, auto_commit cannot come back
+		assert_error(function() conn:config{hash = "djb2"} end)
+		assert_error(function() conn:config{cache = 0} end)
+		assert_true(conn:config{auto_commit = false})
+		assert_false(conn:config().auto_commit)
+		assert_error(function() conn:config{auto_commit = true} end)
+		assert_true(conn:close())
+		os.remove("lns-unqlite-mode.testdb")
+		assert_error(function() env:connect("lns-unqlite-mode.testdb", {hash = "no-such-hash"}) end)
+		local r2, err = env:connect("lns-unqlite-mode.testdb", {engine = "no-such-engine"})
+		assert_nil(r2)
+		assert_not_nil(err)
+		os.remove("lns-unqlite-mode.testdb")
+	end)
+	
+	test("Should NOT be able to open incompatible modes", function ()
+		assert_error(function() env:connect("lns-unqlite-mode.testdb", {mmap = true, readonly = false}) end)
+		assert_error(function() env:connect(":mem:", {readonly = true}) end)
+		assert_error(function() env:connect("lns-unqlite-mode.testdb", {no_such_option = true}) end)
+		assert_true(env:close())
+	end)
+	
+end)
+
+
+-- In this context we cover the group commit policy
+context("User should be able to group commits", function()
+	
+	test("Should be able to commit every N operations or bytes", function ()
+		os.remove("lns-unqlite-commit.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-commit.testdb"))
+		assert_true(conn:commit_policy{ops = 10})
+		for i = 1, 25 do
+			assert_true(conn:kvstore("key" .. i, "value-" .. i))
+		end
+		local st = conn:commit_stats()
+		assert_equal(st.auto_commits, 2)
+		assert_equal(st.pending_ops, 5)
+		-- committed writes survive a rollback
+		assert_true(conn:rollback())
+		local res, data = conn:kvfetch("key20")
+		assert_equal(data, "value-20")
+		local r2, d2 = conn:kvfetch("key25")
+		assert_nil(d2)
+		assert_equal(conn:commit_stats().pending_ops, 0)
+		-- bytes limit, deletes are counted too
+		assert_true(conn:commit_policy{bytes = 100})
+		assert_true(conn:kvstore("big", string.rep("x", 200)))
+		assert_equal(conn:commit_stats().auto_commits, 3)
+		assert_true(conn:kvdelete("big"))
+		assert_equal(conn:commit_stats().pending_ops, 1)
+		assert_true(conn:commit())
+		st = conn:commit_stats()
+		assert_equal(st.commits, 4)
+		assert_equal(st.pending_ops, 0)
+		assert_not_nil(st.avg_ms)
+		-- turn it off
+		assert_true(conn:commit_policy{})
+		assert_true(conn:kvstore("key1", "value-1"))
+		assert_equal(conn:commit_stats().pending_ops, 0)
+		assert_error(function() conn:commit_policy{ops = -1} end)
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-commit.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover the write-behind buffer
+context("User should be able to buffer writes", function()
+	
+	local conn, env
+	
+	test("Should be able to coalesce buffered writes", function ()
+		os.remove("lns-unqlite-wbuf.testdb")
+		env = assert(driver.unqlite())
+		conn = assert(env:connect("lns-unqlite-wbuf.testdb"))
+		assert_nil(conn:write_buffer_stats())
+		assert_true(conn:kvstore("base", "abc"))
+		assert_true(conn:write_buffer{bytes = 1024 * 1024})
+		for i = 1, 100 do
+			assert_true(conn:kvstore("counter", tostring(i)))
+		end
+		local st = conn:write_buffer_stats()
+		assert_equal(st.writes, 100)
+		assert_equal(st.coalesced, 99)
+		assert_equal(st.pending, 1)
+		-- reads see the buffered state
+		local res, data = conn:kvfetch("counter")
+		assert_equal(data, "100")
+		assert_true(conn:kvappend("base", "def"))
+		assert_true(conn:kvappend("base", "ghi"))
+		local r2, d2 = conn:kvfetch("base")
+		assert_equal(d2, "abcdefghi")
+		assert_true(conn:kvdelete("counter"))
+		local r3, d3 = conn:kvfetch("counter")
+		assert_true(r3)
+		assert_nil(d3)
+		assert_true(conn:kvappend("counter", "x"))
+		local r4, d4 = conn:kvfetch("counter")
+		assert_equal(d4, "x")
+	end)
+	
+	test("Should be able to flush buffered writes", function ()
+		-- cursors see the buffered writes
+		local cur = assert(conn:create_cursor())
+		assert_equal(conn:write_buffer_stats().pending, 0)
+		assert_true(cur:seek("base"))
+		assert_equal(cur:cursor_data(), "abcdefghi")
+		assert_true(cur:release())
+		-- the size limit flushes
+		assert_true(conn:write_buffer{bytes = 64})
+		assert_true(conn:kvstore("big", string.rep("x", 100)))
+		assert_equal(conn:write_buffer_stats().pending, 0)
+		-- rollback discards them
+		assert_true(conn:commit())
+		assert_true(conn:write_buffer{bytes = 1024})
+		assert_true(conn:kvstore("base", "changed"))
+		assert_true(conn:rollback())
+		local res, data = conn:kvfetch("base")
+		assert_equal(data, "abcdefghi")
+		-- commit and close flush them
+		assert_true(conn:kvstore("key1", "value-1"))
+		assert_true(conn:commit())
+		assert_equal(conn:write_buffer_stats().pending, 0)
+		assert_true(conn:kvstore("key2", "value-2"))
+		assert_true(conn:write_buffer(false))
+		assert_nil(conn:write_buffer_stats())
+		assert_true(conn:write_buffer{})
+		assert_true(conn:kvstore("key3", "value-3"))
+		assert_true(conn:close())
+		conn = assert(env:connect("lns-unqlite-wbuf.testdb"))
+		local r2, d2 = conn:kvfetch("key2")
+		assert_equal(d2, "value-2")
+		local r3, d3 = conn:kvfetch("key3")
+		assert_equal(d3, "value-3")
+		assert_error(function() conn:write_buffer{bytes = 0} end)
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-wbuf.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover the kvfetch value cache
+context("User should be able to cache values", function()
+	
+	test("Should be able to serve hot keys from the cache", function ()
+		os.remove("lns-unqlite-vcache.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-vcache.testdb"))
+		assert_nil(conn:value_cache_stats())
+		assert_true(conn:value_cache{bytes = 64 * 1024})
+		for i = 1, 10 do
+			assert_true(conn:kvstore("key" .. i, "value-" .. i))
+		end
+		for n = 1, 3 do
+			local res, data = conn:kvfetch("key1")
+			assert_equal(data, "value-1")
+		end
+		local st = conn:value_cache_stats()
+		assert_equal(st.misses, 1)
+		assert_equal(st.hits, 2)
+		assert_equal(st.entries, 1)
+		-- writes invalidate
+		assert_true(conn:kvappend("key1", "-more"))
+		local r1, d1 = conn:kvfetch("key1")
+		assert_equal(d1, "value-1-more")
+		assert_true(conn:kvdelete("key1"))
+		local r2, d2 = conn:kvfetch("key1")
+		assert_nil(d2)
+		assert_equal(conn:value_cache_stats().invalidations, 2)
+		-- cursor deletes too
+		local r3, d3 = conn:kvfetch("key2")
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek("key2"))
+		assert_true(cur:delete_entry())
+		assert_true(cur:release())
+		local r4, d4 = conn:kvfetch("key2")
+		assert_nil(d4)
+		-- rollback drops everything
+		local r5, d5 = conn:kvfetch("key3")
+		assert_true(conn:rollback())
+		assert_equal(conn:value_cache_stats().entries, 0)
+		local r6, d6 = conn:kvfetch("key3")
+		assert_nil(d6)
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-vcache.testdb")
+	end)
+	
+	test("Should be able to evict values over the budget", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		assert_true(conn:value_cache{bytes = 4096})
+		local value = string.rep("v", 500)
+		for i = 1, 20 do
+			assert_true(conn:kvstore("key" .. i, value))
+			local res, data = conn:kvfetch("key" .. i)
+			assert_equal(data, value)
+		end
+		local st = conn:value_cache_stats()
+		assert_gt(st.evictions, 0)
+		assert_true(st.bytes <= 4096)
+		assert_true(conn:value_cache(false))
+		assert_nil(conn:value_cache_stats())
+		assert_error(function() conn:value_cache{bytes = 0} end)
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+end)
+
+
+-- In this context we cover the key bloom filter
+context("User should be able to filter missing keys", function()
+	
+	test("Should be able to answer missing keys without the engine", function ()
+		os.remove("lns-unqlite-bloom.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		for i = 1, 100 do
+			assert_true(conn:kvstore("key" .. i, "value-" .. i))
+		end
+		assert_nil(conn:bloom_stats())
+		assert_true(conn:bloom{fpr = 0.01})
+		local st = conn:bloom_stats()
+		assert_equal(st.keys, 100)
+		assert_equal(st.hashes, 7)
+		for i = 1, 100 do
+			local res, data = conn:kvfetch("key" .. i)
+			assert_equal(data, "value-" .. i)
+			assert_true(conn:exists("key" .. i))
+		end
+		for i = 1, 1000 do
+			local res, data = conn:kvfetch("missing" .. i)
+			assert_nil(data)
+			assert_false(conn:exists("missing" .. i))
+		end
+		st = conn:bloom_stats()
+		assert_gt(st.negatives, 1900)
+		assert_equal(st.positives - st.false_positives, 200)
+		-- new keys are added
+		assert_true(conn:kvstore("later", "x"))
+		assert_true(conn:exists("later"))
+		-- the sidecar does not show up in scans
+		local keys = conn:prefix("", {keys_only = true})
+		assert_equal(#keys, 101)
+		assert_true(conn:close())
+		-- the filter is loaded back from the sidecar
+		conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(conn:bloom{})
+		assert_equal(conn:bloom_stats().keys, 101)
+		assert_true(conn:exists("later"))
+		assert_true(conn:bloom(false))
+		assert_nil(conn:bloom_stats())
+		assert_error(function() conn:bloom{fpr = 2} end)
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-bloom.testdb")
+	end)
+	
+	test("Should be able to drop a stale sidecar on write", function ()
+		os.remove("lns-unqlite-bloom.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(conn:kvstore("a", "1"))
+		assert_true(conn:bloom{})
+		assert_true(conn:close())
+		-- written without the filter: the sidecar goes away
+		conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(conn:kvstore("b", "2"))
+		assert_true(conn:close())
+		conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(conn:bloom{})
+		assert_equal(conn:bloom_stats().keys, 2)
+		local res, data = conn:kvfetch("b")
+		assert_equal(data, "2")
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-bloom.testdb")
+	end)
+
+	test("Should be able to drop the sidecar again after a commit", function ()
+		os.remove("lns-unqlite-bloom.testdb")
+		local env = assert(driver.unqlite())
+		local writer = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(writer:kvstore("x", "1"))
+		assert_true(writer:commit())
+		-- another connection saves a sidecar without y
+		local conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(conn:bloom{})
+		assert_true(conn:close())
+		-- the writer's next transaction deletes it again
+		assert_true(writer:kvstore("y", "2"))
+		assert_true(writer:commit())
+		conn = assert(env:connect("lns-unqlite-bloom.testdb"))
+		assert_true(conn:bloom{})
+		local res, data = conn:kvfetch("y")
+		assert_equal(data, "2")
+		assert_true(conn:exists("y"))
+		assert_true(conn:close())
+		assert_true(writer:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-bloom.testdb")
+	end)
+
+end)
+
+
+-- In this context we cover the operation statistics
+context("User should be able to read operation statistics", function()
+	
+	test("Should be able to count and time operations", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		for i = 0, 9 do
+			assert_true(conn:kvstore("key" .. i, "0123456789"))
+		end
+		assert_true(conn:kvappend("key1", "abc"))
+		local res, data = conn:kvfetch("key1")
+		res, data = conn:kvfetch("missing")
+		assert_true(conn:kvdelete("key2"))
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:first_entry())
+		assert_true(cur:next_entry())
+		assert_true(cur:release())
+		assert_true(conn:commit())
+		local st = conn:stats()
+		assert_equal(st.kvstore.count, 10)
+		assert_equal(st.kvstore.bytes, 10 * 14)
+		assert_equal(st.kvappend.count, 1)
+		assert_equal(st.kvfetch.count, 2)
+		assert_equal(st.kvfetch.misses, 1)
+		assert_equal(st.kvdelete.count, 1)
+		assert_equal(st.cursor.count, 2)
+		assert_equal(st.commit.count, 1)
+		assert_equal(st.bytes_read, 4 + 13 + 7)
+		assert_equal(st.bytes_written, 10 * 14 + 7 + 4)
+		local n = 0
+		for i, c in ipairs(st.kvstore.histogram) do
+			n = n + c
+		end
+		assert_equal(n, st.kvstore.timed)
+		assert_gt(st.kvstore.timed, 0)
+		assert_equal(st.commit.timed, 1)
+		assert_true(st.kvstore.p50_ms <= st.kvstore.p99_ms)
+		assert_true(st.kvstore.p99_ms <= st.kvstore.max_ms)
+		assert_true(conn:reset_stats())
+		assert_equal(conn:stats().kvstore.count, 0)
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+end)
+
+
+-- In this context we cover connections sharing one handle
+context("User should be able to share a database handle", function()
+	
+	test("Should be able to share one handle between connections", function ()
+		os.remove("lns-unqlite-shared.testdb")
+		local env = assert(driver.unqlite())
+		local a = assert(env:connect("lns-unqlite-shared.testdb", {shared = true}))
+		local b = assert(env:connect("lns-unqlite-shared.testdb", {shared = true}))
+		assert_match("^UnQLite shared connection", tostring(a))
+		-- writes of one connection are seen by the other
+		assert_true(a:kvstore("k1", "v1"))
+		local res, data = b:kvfetch("k1")
+		assert_equal(data, "v1")
+		-- the key index of b is rebuilt after the writes of a
+		assert_equal(#b:prefix("k", {keys_only = true}), 1)
+		assert_true(a:kvstore("k2", "v2"))
+		assert_equal(#b:prefix("k", {keys_only = true}), 2)
+		local cur = assert(b:create_cursor())
+		assert_match("^UnQLite shared cursor", tostring(cur))
+		assert_true(cur:first_entry())
+		assert_equal(cur:cursor_key(), "k1")
+		-- the records iterator refills its batches holding the lock
+		local seen = {}
+		for k, v in cur:records(1) do seen[k] = v end
+		assert_equal(seen.k1, "v1")
+		assert_equal(seen.k2, "v2")
+		assert_true(cur:release())
+		-- per connection caches would miss the writes of the others
+		assert_nil(a:bloom{})
+		assert_nil(a:value_cache{})
+		assert_nil(a:write_buffer{})
+		assert_error(function() env:connect("lns-unqlite-shared.testdb", {shared = true, mutex = false}) end)
+		-- the handle stays open until its last connection is closed
+		assert_true(a:close())
+		assert_error(function() a:kvfetch("k1") end)
+		res, data = b:kvfetch("k2")
+		assert_equal(data, "v2")
+		assert_true(b:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-shared.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover asynchronous operations
+context("User should be able to run operations asynchronously", function()
+	
+	test("Should be able to queue operations on a shared connection", function ()
+		os.remove("lns-unqlite-async.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-async.testdb", {shared = true}))
+		assert_equal(type(env:async_fd()), "number")
+		local stores = {}
+		for i = 1, 100 do
+			stores[i] = assert(conn:kvstore_async("key" .. i, "value-" .. i))
+		end
+		-- operations of a handle run in the order they were queued
+		local res, data = conn:kvfetch_async("key100"):wait()
+		assert_true(res)
+		assert_equal(data, "value-100")
+		for i = 1, 100 do
+			assert_true(stores[i]:ready())
+			assert_true(stores[i]:result())
+		end
+		res, data = conn:kvfetch_async("missing"):wait()
+		assert_true(res)
+		assert_nil(data)
+		assert_true(conn:kvappend_async("key1", "+"):wait())
+		assert_true(conn:kvdelete_async("key2"):wait())
+		assert_true(conn:commit_async():wait())
+		assert_gt(env:async_poll(), 100)
+		assert_equal(env:async_poll(), 0)
+		res, data = conn:kvfetch("key1")
+		assert_equal(data, "value-1+")
+		assert_equal(#conn:prefix("key", {keys_only = true}), 99)
+		-- a raw value starting with the compression tag reads back as stored
+		assert_true(conn:kvstore_async("tagged", "\245\1 raw"):wait())
+		res, data = conn:kvfetch_async("tagged"):wait()
+		assert_equal(data, "\245\1 raw")
+		res, data = conn:kvfetch("tagged")
+		assert_equal(data, "\245\1 raw")
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-async.testdb")
+	end)
+	
+	test("Should not be able to queue operations on a plain connection", function ()
+		os.remove("lns-unqlite-async.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-async.testdb"))
+		assert_nil(conn:kvfetch_async("key"))
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-async.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover the parallel export
+context("User should be able to export a database in parallel", function()
+	
+	-- read back the records of a part file
+	local function read_part(name)
+		local f = assert(io.open(name, "rb"))
+		local s = f:read("*a")
+		f:close()
+		assert_equal(s:sub(1, 4), "LNX1")
+		local records, pos = {}, 5
+		local function le(i, n)
+			local v = 0
+			for j = i + n - 1, i, -1 do v = v * 256 + s:byte(j) end
+			return v
+		end
+		while pos <= #s do
+			local klen, dlen = le(pos, 4), le(pos + 4, 8)
+			local key = s:sub(pos + 12, pos + 11 + klen)
+			records[key] = s:sub(pos + 12 + klen, pos + 11 + klen + dlen)
+			pos = pos + 12 + klen + dlen
+		end
+		return records
+	end
+	
+	test("Should be able to split the records between part files", function ()
+		os.remove("lns-unqlite-export.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-export.testdb"))
+		for i = 1, 200 do
+			assert_true(conn:kvstore("key" .. i, string.rep("v", i)))
+		end
+		-- pending writes are committed before the parts run
+		local st = assert(conn:parallel_export(".", 3))
+		assert_equal(st.threads, 3)
+		assert_equal(st.records, 200)
+		assert_equal(#st.parts, 3)
+		local seen, count = {}, 0
+		for i, part in ipairs(st.parts) do
+			assert_equal(part.file, string.format("./part-%03d.lnx", i - 1))
+			local n = 0
+			for key, data in pairs(read_part(part.file)) do
+				assert_nil(seen[key])
+				seen[key] = data
+				n = n + 1
+			end
+			assert_equal(part.records, n)
+			count = count + n
+			os.remove(part.file)
+		end
+		assert_equal(count, 200)
+		assert_equal(seen.key17, string.rep("v", 17))
+		assert_error(function() conn:parallel_export(".", 0) end)
+		assert_nil(conn:parallel_export("lns-unqlite-no-such-dir"))
+		assert_true(conn:close())
+		conn = assert(env:connect(":mem:"))
+		assert_nil(conn:parallel_export("."))
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-export.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover the bulk loader
+context("User should be able to bulk load records", function()
+	
+	local function write_file(name, text)
+		local f = assert(io.open(name, "wb"))
+		f:write(text)
+		f:close()
+	end
+	
+	test("Should be able to load tsv, jsonl and binary files", function ()
+		os.remove("lns-unqlite-bulk.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-bulk.testdb"))
+		local lines = {}
+		for i = 1, 250 do lines[i] = "key" .. i .. "\tvalue-" .. i end
+		lines[#lines + 1] = "tab\\tkey\tline\\nbreak\r"
+		write_file("lns-unqlite-bulk.tsv", table.concat(lines, "\n"))
+		local calls = 0
+		local st = assert(conn:bulk_load("lns-unqlite-bulk.tsv", {batch = 100, progress = function(p)
+			calls = calls + 1
+			assert_equal(p.batches, calls)
+		end}))
+		assert_equal(st.records, 251)
+		assert_equal(st.batches, 3)
+		assert_equal(calls, 3)
+		local res, data = conn:kvfetch("key250")
+		assert_equal(data, "value-250")
+		res, data = conn:kvfetch("tab\tkey")
+		assert_equal(data, "line\nbreak")
+		write_file("lns-unqlite-bulk.jsonl",
+			'{"key": "j1", "value": "caf\\u00e9 \\"quoted\\""}\n' ..
+			'\n' ..
+			'{"value": {"a": [1, 2.5, null]}, "other": true, "key": "j2"}\n')
+		st = assert(conn:bulk_load("lns-unqlite-bulk.jsonl", {format = "jsonl"}))
+		assert_equal(st.records, 2)
+		res, data = conn:kvfetch("j1")
+		assert_equal(data, "caf\195\169 \"quoted\"")
+		res, data = conn:kvfetch("j2")
+		assert_equal(data, '{"a": [1, 2.5, null]}')
+		write_file("lns-unqlite-bulk.jsonl", '{"key": "j3", "value": 1}\n{"key": 4, "value": 1}\n')
+		res, data = conn:bulk_load("lns-unqlite-bulk.jsonl", {format = "jsonl"})
+		assert_nil(res)
+		assert_match("line 2", data)
+		assert_true(conn:rollback())
+		assert_error(function() conn:bulk_load("lns-unqlite-bulk.tsv", {format = "csv"}) end)
+		-- binary: the part files of parallel_export
+		st = assert(conn:parallel_export(".", 2))
+		local copy = assert(env:connect(":mem:"))
+		local total = 0
+		for _, part in ipairs(st.parts) do
+			total = total + assert(copy:bulk_load(part.file, {format = "binary"})).records
+			os.remove(part.file)
+		end
+		assert_equal(total, 253)
+		res, data = copy:kvfetch("j2")
+		assert_equal(data, '{"a": [1, 2.5, null]}')
+		assert_nil(copy:bulk_load("lns-unqlite-bulk.tsv", {format = "binary"}))
+		assert_true(copy:close())
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-bulk.tsv")
+		os.remove("lns-unqlite-bulk.jsonl")
+		os.remove("lns-unqlite-bulk.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover dumps and restores
+context("User should be able to dump and restore a database", function()
+	
+	test("Should be able to restore a dump into another database", function ()
+		os.remove("lns-unqlite-dump.testdb")
+		os.remove("lns-unqlite-dump.bin")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-dump.testdb"))
+		for i = 1, 300 do
+			assert_true(conn:kvstore("key" .. i, string.rep("v", i * 10)))
+		end
+		assert_true(conn:kvstore("empty", ""))
+		-- reserved records (here index entries) are not dumped
+		assert_true(conn:create_index("size", function(key, data) return #data end))
+		local st = assert(conn:dump("lns-unqlite-dump.bin"))
+		assert_equal(st.records, 301)
+		assert_gt(st.blocks, 0)
+		local copy = assert(env:connect(":mem:"))
+		st = assert(copy:restore("lns-unqlite-dump.bin"))
+		assert_equal(st.records, 301)
+		local res, data = copy:kvfetch("key300")
+		assert_equal(data, string.rep("v", 3000))
+		res, data = copy:kvfetch("empty")
+		assert_equal(data, "")
+		local cur = assert(copy:create_cursor())
+		local n = 0
+		for k in cur:records(64, true) do n = n + 1 end
+		assert_equal(n, 301)
+		assert_true(cur:release())
+		assert_true(copy:close())
+		-- a damaged block is detected before its records are stored
+		local f = assert(io.open("lns-unqlite-dump.bin", "rb"))
+		local s = f:read("*a")
+		f:close()
+		f = assert(io.open("lns-unqlite-dump.bin", "wb"))
+		f:write(s:sub(1, 40), s:sub(41, 41) == "x" and "y" or "x", s:sub(42))
+		f:close()
+		copy = assert(env:connect(":mem:"))
+		res, data = copy:restore("lns-unqlite-dump.bin")
+		assert_nil(res)
+		assert_match("checksum mismatch", data)
+		f = assert(io.open("lns-unqlite-dump.bin", "wb"))
+		f:write(s:sub(1, #s - 10))
+		f:close()
+		res, data = copy:restore("lns-unqlite-dump.bin")
+		assert_nil(res)
+		assert_match("truncated", data)
+		assert_true(copy:close())
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-dump.bin")
+		os.remove("lns-unqlite-dump.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover value compression
+context("User should be able to compress values", function()
+	
+	test("Should be able to read compressed and raw values", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		assert_true(conn:kvstore("old", "stored before"))
+		assert_nil(conn:compression_stats())
+		assert_true(conn:compression{threshold = 32})
+		local doc = string.rep('{"name": "luanosql", "tags": ["kv", "lua"]}', 50)
+		assert_true(conn:kvstore("doc", doc))
+		assert_true(conn:kvstore("small", "tiny"))
+		assert_true(conn:kvstore("tagged", "\245\1 looks encoded"))
+		local res, data = conn:kvfetch("doc")
+		assert_equal(data, doc)
+		res, data = conn:kvfetch("tagged")
+		assert_equal(data, "\245\1 looks encoded")
+		res, data = conn:kvfetch("old")
+		assert_equal(data, "stored before")
+		assert_true(conn:kvappend("doc", "!"))
+		res, data = conn:kvfetch("doc")
+		assert_equal(data, doc .. "!")
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek("doc"))
+		assert_equal(cur:cursor_data(), doc .. "!")
+		assert_true(cur:release())
+		local st = conn:compression_stats()
+		assert_equal(st.threshold, 32)
+		assert_equal(st.compressed, 2)
+		assert_gt(st.ratio, 4)
+		-- disabled, values are stored raw and still decoded
+		assert_true(conn:compression(false))
+		assert_nil(conn:compression_stats())
+		res, data = conn:kvfetch("doc")
+		assert_equal(data, doc .. "!")
+		assert_true(conn:kvappend("doc", "?"))
+		res, data = conn:kvfetch("doc")
+		assert_equal(data, doc .. "!?")
+		assert_true(conn:kvstore("tagged", "\245\0 raw"))
+		res, data = conn:kvfetch("tagged")
+		assert_equal(data, "\245\0 raw")
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+
+	test("Should be able to read compressed values on any connection", function ()
+		os.remove("lns-unqlite-codec.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-codec.testdb"))
+		assert_true(conn:compression{})
+		local doc = string.rep("compressible ", 100)
+		assert_true(conn:kvstore("doc", doc))
+		assert_true(conn:put_table("t", {text = doc}))
+		assert_true(conn:close())
+		-- a fresh connection never enabled compression
+		conn = assert(env:connect("lns-unqlite-codec.testdb"))
+		local res, data = conn:kvfetch("doc")
+		assert_equal(data, doc)
+		local ok, t = conn:get_table("t")
+		assert_equal(t.text, doc)
+		local keys, values = conn:range("doc", "doc\0")
+		assert_equal(values[1], doc)
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek("doc"))
+		assert_equal(cur:cursor_data(), doc)
+		assert_true(cur:release())
+		-- data appended raw follows the compressed bytes
+		assert_true(conn:kvappend("doc", "tail"))
+		res, data = conn:kvfetch("doc")
+		assert_equal(data, doc .. "tail")
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-codec.testdb")
+	end)
+
+	test("Should keep tagged values as they are without compression", function ()
+		os.remove("lns-unqlite-plain.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-plain.testdb"))
+		assert_true(conn:kvstore("lz", "\245\1 not compressed"))
+		assert_true(conn:kvstore("raw", "\245\0 not escaped"))
+		assert_true(conn:kvappend("raw", "!"))
+		local res, data = conn:kvfetch("lz")
+		assert_equal(data, "\245\1 not compressed")
+		res, data = conn:kvfetch("raw")
+		assert_equal(data, "\245\0 not escaped!")
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek("lz"))
+		assert_equal(cur:cursor_data(), "\245\1 not compressed")
+		assert_true(cur:release())
+		assert_true(conn:close())
+		-- a new connection reads them unchanged, the database has no codec marker
+		conn = assert(env:connect("lns-unqlite-plain.testdb"))
+		res, data = conn:kvfetch("raw")
+		assert_equal(data, "\245\0 not escaped!")
+		local st = assert(conn:dump("lns-unqlite-plain.bin"))
+		assert_equal(st.records, 2)
+		assert_true(conn:close())
+		-- the dump holds each key followed by its stored bytes, not escaped ones
+		local f = assert(io.open("lns-unqlite-plain.bin", "rb"))
+		local bytes = f:read("*a")
+		f:close()
+		assert_not_nil(bytes:find("lz\245\1 not compressed", 1, true))
+		assert_not_nil(bytes:find("raw\245\0 not escaped!", 1, true))
+		-- restored as they are, they read back unchanged
+		conn = assert(env:connect(":mem:"))
+		assert(conn:restore("lns-unqlite-plain.bin"))
+		res, data = conn:kvfetch("lz")
+		assert_equal(data, "\245\1 not compressed")
+		res, data = conn:kvfetch("raw")
+		assert_equal(data, "\245\0 not escaped!")
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-plain.testdb")
+		os.remove("lns-unqlite-plain.bin")
+	end)
+
+end)
+
+
+-- In this context we cover table serialization
+context("User should be able to store Lua tables", function()
+	
+	test("Should be able to put and get nested tables", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		local t = {name = "luanosql", tags = {"kv", "lua"}, version = 1.5, big = 2^40, neg = -70000,
+			ok = true, nested = {deep = {[10] = "sparse"}}}
+		assert_true(conn:put_table("t", t))
+		local res, v = conn:get_table("t")
+		assert_true(res)
+		assert_equal(v.name, "luanosql")
+		assert_equal(#v.tags, 2)
+		assert_equal(v.tags[2], "lua")
+		assert_equal(v.version, 1.5)
+		assert_equal(v.big, 2^40)
+		assert_equal(v.neg, -70000)
+		assert_true(v.ok)
+		assert_equal(v.nested.deep[10], "sparse")
+		-- the record is plain MessagePack: a fixmap of 7 entries
+		res, v = conn:kvfetch("t")
+		assert_equal(v:byte(1), 0x87)
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek("t"))
+		assert_equal(cur:cursor_table().tags[1], "kv")
+		assert_true(cur:release())
+		res, v = conn:get_table("missing")
+		assert_true(res)
+		assert_nil(v)
+		assert_true(conn:kvstore("raw", "not msgpack"))
+		assert_nil(conn:get_table("raw"))
+		assert_error(function() conn:put_table("f", {print}) end)
+		local cycle = {}
+		cycle.self = cycle
+		assert_error(function() conn:put_table("c", cycle) end)
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+end)
+
+
+-- In this context we cover integer and tuple keys
+context("User should be able to use integer and tuple keys", function()
+	
+	test("Should be able to store, scan and decode typed keys", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:", {typed_keys = true}))
+		for _, n in ipairs({9, 10, -1, 2^40}) do
+			assert_true(conn:kvstore(n, "int" .. n))
+		end
+		local res, data = conn:kvfetch(10)
+		assert_equal(data, "int10")
+		res, data = conn:kvfetch("10")
+		assert_nil(data)
+		assert_true(conn:kvstore({"acme", 20, "b\0c"}, "t1"))
+		assert_true(conn:kvstore({"acme", 3, "x"}, "t2"))
+		assert_true(conn:kvstore({"acme", 3}, "t3"))
+		assert_true(conn:kvstore({"zeta", 1}, "t4"))
+		res, data = conn:kvfetch({"acme", 20, "b\0c"})
+		assert_equal(data, "t1")
+		-- integers sort numerically, tuples element by element
+		local keys, values = conn:range(nil, nil, {typed_keys = true})
+		assert_equal(table.concat(values, ","), "t3,t2,t1,t4,int-1,int9,int10,int" .. 2^40)
+		assert_equal(keys[3][3], "b\0c")
+		assert_equal(keys[8], 2^40)
+		keys, values = conn:prefix({"acme"})
+		assert_equal(#values, 3)
+		keys, values = conn:range({"acme", 3}, {"acme", 4})
+		assert_equal(table.concat(values, ","), "t3,t2")
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek({"zeta", 1}))
+		assert_equal(cur:cursor_typed_key()[1], "zeta")
+		assert_true(cur:seek(-1))
+		assert_equal(cur:cursor_typed_key(), -1)
+		assert_true(cur:release())
+		assert_true(conn:kvstore("plain", "p"))
+		assert_true(conn:kvdelete({"zeta", 1}))
+		res, data = conn:kvfetch({"zeta", 1})
+		assert_nil(data)
+		assert_error(function() conn:kvstore(1.5, "x") end)
+		assert_error(function() conn:kvstore({}, "x") end)
+		assert_error(function() conn:kvstore({"a", true}, "x") end)
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+	test("Should keep number keys as strings without typed_keys", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		assert_true(conn:kvstore(42, "answer"))
+		assert_true(conn:kvstore(1.5, "half"))
+		local res, data = conn:kvfetch(42)
+		assert_equal(data, "answer")
+		res, data = conn:kvfetch("42")
+		assert_equal(data, "answer")
+		res, data = conn:kvfetch("1.5")
+		assert_equal(data, "half")
+		local fetched = conn:kvmfetch({42})
+		assert_equal(fetched["42"], "answer")
+		local keys = conn:range(nil, nil, {keys_only = true})
+		assert_equal(table.concat(keys, ","), "1.5,42")
+		assert_error(function() conn:kvstore({"acme", 1}, "x") end)
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+end)
+
+
+-- In this context we cover secondary indexes
+context("User should be able to query records by secondary indexes", function()
+	
+	test("Should be able to look up records by a field path", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		assert_true(conn:put_table("u1", {name = "ann", city = "rome", age = 30}))
+		assert_true(conn:put_table("u2", {name = "bob", city = "oslo", age = 25}))
+		assert_true(conn:kvstore("note", "not a table"))
+		assert_true(conn:create_index("by_city", "city"))
+		assert_true(conn:create_index("by_age", "age"))
+		assert_true(conn:put_table("u3", {name = "cat", city = "rome", age = 41}))
+		local keys, values = conn:index_lookup("by_city", "rome")
+		assert_equal(table.concat(keys, ","), "u1,u3")
+		assert_equal(#values, 2)
+		-- the entries follow updates and deletes
+		assert_true(conn:put_table("u1", {name = "ann", city = "oslo", age = 31}))
+		assert_true(conn:kvdelete("u2"))
+		keys = conn:index_lookup("by_city", "rome", {keys_only = true})
+		assert_equal(table.concat(keys, ","), "u3")
+		keys = conn:index_lookup("by_city", "oslo", {keys_only = true})
+		assert_equal(table.concat(keys, ","), "u1")
+		keys = conn:index_range("by_age", 30, nil, {keys_only = true})
+		assert_equal(table.concat(keys, ","), "u1,u3")
+		keys = conn:index_range("by_age", nil, 40, {keys_only = true})
+		assert_equal(table.concat(keys, ","), "u1")
+		-- the entries are reserved keys, range scans do not see them
+		keys = conn:range(nil, nil, {keys_only = true})
+		assert_equal(#keys, 3)
+		local cur = assert(conn:create_cursor())
+		assert_true(cur:seek("u3"))
+		assert_true(cur:delete_entry())
+		assert_true(cur:release())
+		keys = conn:index_lookup("by_city", "rome")
+		assert_equal(#keys, 0)
+		assert_true(conn:drop_index("by_city"))
+		assert_nil(conn:index_lookup("by_city", "oslo"))
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+	test("Should be able to index with a function", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:", {typed_keys = true}))
+		assert_true(conn:create_index("by_tenant", function(key, data)
+			if data == "boom" then error("bad record") end
+			return type(key) == "table" and key[1] or nil
+		end))
+		assert_true(conn:kvstore({"acme", 1}, "a"))
+		assert_true(conn:kvstore({"acme", 2}, "b"))
+		assert_true(conn:kvstore({"zeta", 1}, "c"))
+		assert_true(conn:kvstore("plain", "d"))
+		local keys, values = conn:index_lookup("by_tenant", "acme", {typed_keys = true})
+		assert_equal(keys[2][2], 2)
+		assert_equal(table.concat(values, ","), "a,b")
+		-- an extractor error fails the write before anything is stored
+		local res, err = conn:kvstore({"acme", 3}, "boom")
+		assert_nil(res)
+		assert_match("bad record", err)
+		res, err = conn:kvfetch({"acme", 3})
+		assert_nil(err)
+		assert_true(conn:kvappend({"zeta", 1}, "c"))
+		keys, values = conn:index_lookup("by_tenant", "zeta")
+		assert_equal(values[1], "cc")
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+	test("Should be able to index many records with one value", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		assert_true(conn:create_index("by_tag", function(key, data) return data end))
+		for i = 1, 500 do
+			assert_true(conn:kvstore(string.format("k%03d", i), i % 2 == 0 and "ab" or "ab\0c"))
+		end
+		assert_true(conn:kvstore("k\0", "ab"))
+		assert_true(conn:kvstore("k\255", "ab"))
+		local keys = conn:index_lookup("by_tag", "ab", {keys_only = true})
+		assert_equal(#keys, 252)
+		assert_equal(keys[1], "k\0")
+		assert_equal(keys[2], "k002")
+		assert_equal(keys[252], "k\255")
+		keys = conn:index_lookup("by_tag", "ab\0c", {keys_only = true, limit = 3})
+		assert_equal(table.concat(keys, ","), "k001,k003,k005")
+		keys = conn:index_range("by_tag", "ab", "ab\0c", {keys_only = true})
+		assert_equal(#keys, 252)
+		-- an update moves only the entry of its record
+		assert_true(conn:kvstore("k002", "ab\0c"))
+		assert_true(conn:kvdelete("k\0"))
+		keys = conn:index_lookup("by_tag", "ab", {keys_only = true})
+		assert_equal(#keys, 250)
+		assert_equal(keys[1], "k004")
+		keys = conn:index_lookup("by_tag", "ab\0c", {keys_only = true})
+		assert_equal(#keys, 251)
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+	test("Should skip the entries of records changed by another connection", function ()
+		os.remove("lns-unqlite-index.testdb")
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect("lns-unqlite-index.testdb"))
+		assert_true(conn:put_table("u1", {city = "rome"}))
+		assert_true(conn:put_table("u2", {city = "rome"}))
+		assert_true(conn:put_table("u3", {city = "rome"}))
+		assert_true(conn:create_index("by_city", "city"))
+		assert_true(conn:commit())
+		local other = assert(env:connect("lns-unqlite-index.testdb"))
+		assert_true(other:put_table("u1", {city = "oslo"}))
+		assert_true(other:kvdelete("u2"))
+		assert_true(other:commit())
+		assert_true(other:close())
+		local keys, values = conn:index_lookup("by_city", "rome")
+		assert_equal(table.concat(keys, ","), "u3")
+		assert_equal(#values, 1)
+		keys = conn:index_range("by_city", nil, nil, {keys_only = true})
+		assert_equal(table.concat(keys, ","), "u3")
+		-- building the index again picks up the new values
+		assert_true(conn:create_index("by_city", "city"))
+		keys = conn:index_lookup("by_city", "oslo", {keys_only = true})
+		assert_equal(table.concat(keys, ","), "u1")
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-index.testdb")
+	end)
+	
+	test("Should not be able to use the connection from an extractor", function ()
+		local env = assert(driver.unqlite())
+		local conn = assert(env:connect(":mem:"))
+		assert_true(conn:kvstore("other", string.rep("o", 1000)))
+		assert_true(conn:create_index("by_fetch", function(key, data)
+			if data == "fetch" then conn:kvfetch("other") end
+			return data
+		end))
+		local res, err = conn:kvstore("k1", "fetch")
+		assert_nil(res)
+		assert_match("in use by an index extractor", err)
+		res, err = conn:kvfetch("k1")
+		assert_nil(err)
+		assert_true(conn:drop_index("by_fetch"))
+		assert_true(conn:create_index("by_store", function(key, data)
+			if data == "store" then conn:kvstore("k2", "nested") end
+			return data
+		end))
+		res, err = conn:kvstore("k1", "store")
+		assert_nil(res)
+		assert_match("in use by an index extractor", err)
+		res, err = conn:kvfetch("k2")
+		assert_nil(err)
+		-- the connection works again once the extractor returned
+		assert_true(conn:kvstore("k1", "plain"))
+		local keys = conn:index_lookup("by_store", "plain", {keys_only = true})
+		assert_equal(table.concat(keys, ","), "k1")
+		res, err = conn:kvfetch("other")
+		assert_equal(err, string.rep("o", 1000))
+		assert_true(conn:close())
+		assert_true(env:close())
+	end)
+	
+end)
+
+
+-- In this context we cover the environment connection pool
+context("User should be able to pool connections", function()
+	
+	local env
+	
+	test("Should be able to reuse pooled connections", function ()
+		os.remove("lns-unqlite-pool.testdb")
+		env = assert(driver.unqlite())
+		assert_true(env:pool{size = 2, idle = 0})
+		local c1 = assert(env:connect("lns-unqlite-pool.testdb"))
+		assert_true(c1:kvstore("key1", "value-1"))
+		assert_true(c1:close())
+		local st = env:pool_stats()
+		assert_equal(st.misses, 1)
+		assert_equal(st.idle, 1)
+		-- same path and options: the handle is reused
+		local c2 = assert(env:connect("lns-unqlite-pool.testdb"))
+		local res, data = c2:kvfetch("key1")
+		assert_equal(data, "value-1")
+		st = env:pool_stats()
+		assert_equal(st.hits, 1)
+		assert_equal(st.idle, 0)
+		-- other options: a new handle
+		local c3 = assert(env:connect("lns-unqlite-pool.testdb", {readonly = true}))
+		assert_equal(env:pool_stats().misses, 2)
+		assert_true(c2:close())
+		assert_true(c3:close())
+		assert_equal(env:pool_stats().idle, 2)
+	end)
+	
+	test("Should be able to evict idle connections", function ()
+		-- only the cache size differs: the handle is reused
+		local c4 = assert(env:connect("lns-unqlite-pool.testdb", {cache = 1024}))
+		assert_equal(c4:config().cache, 1024)
+		assert_equal(env:pool_stats().hits, 2)
+		assert_true(c4:close())
+		local c5 = assert(env:connect("lns-unqlite-pool.testdb", {mutex = false}))
+		assert_true(c5:close())
+		-- the pool holds 2 handles at most
+		local st = env:pool_stats()
+		assert_equal(st.idle, 2)
+		assert_equal(st.evictions, 1)
+		assert_true(env:pool{size = 0})
+		st = env:pool_stats()
+		assert_equal(st.idle, 0)
+		assert_equal(st.evictions, 3)
+		-- pooling disabled
+		local c6 = assert(env:connect("lns-unqlite-pool.testdb"))
+		assert_true(c6:close())
+		assert_equal(env:pool_stats().idle, 0)
+		assert_error(function() env:pool{size = -1} end)
+		assert_true(env:close())
+		os.remove("lns-unqlite-pool.testdb")
+	end)
+	
+end)
+
+
+-- In this context we cover ordered range and prefix scans
+context("User should be able to read ordered ranges of keys", function()
+	
+	local conn, env
+	
+	test("Should be able to create a connection", function ()
+		os.remove("lns-unqlite-range.testdb")
+		env = assert(driver.unqlite())
+		conn = assert(env:connect("lns-unqlite-range.testdb"))
+		for i = 10, 29 do
+			assert_true(conn:kvstore("ts:" .. i, "v" .. i))
+		end
+		assert_true(conn:kvstore("other", "x"))
+		assert_true(conn:commit())
+	end)
+	
+	test("Should be able to read a range of keys in order", function ()
+		local keys, values = conn:range("ts:12", "ts:15")
+		assert_equal(#keys, 3)
+		assert_equal(keys[1], "ts:12")
+		assert_equal(keys[3], "ts:14")
+		assert_equal(values[2], "v13")
+	end)
+	
+	test("Should be able to use limit, reverse and keys_only", function ()
+		local keys, values = conn:range("ts:20", nil, {limit = 2, reverse = true, keys_only = true})
+		assert_nil(values)
+		assert_equal(#keys, 2)
+		-- open upper bound: the last key is "ts:29"
+		assert_equal(keys[1], "ts:29")
+		assert_equal(keys[2], "ts:28")
+	end)
+	
+	test("Should be able to read keys by prefix", function ()
+		local keys = conn:prefix("ts:2", {keys_only = true})
+		assert_equal(#keys, 10)
+		local none = conn:prefix("zz")
+		assert_equal(#none, 0)
+	end)
+	
+	test("Should see keys stored and deleted after the index is built", function ()
+		assert_true(conn:kvstore("ts:125", "v125"))
+		assert_true(conn:kvdelete("ts:13"))
+		local keys = conn:range("ts:12", "ts:15", {keys_only = true})
+		assert_equal(table.concat(keys, ","), "ts:12,ts:125,ts:14")
+		-- rolled back keys disappear from the index too
+		assert_true(conn:rollback())
+		keys = conn:range("ts:12", "ts:15", {keys_only = true})
+		assert_equal(table.concat(keys, ","), "ts:12,ts:13,ts:14")
+	end)
+	
+	test("Should be able to close the connection", function ()
+		assert_true(conn:close())
+		assert_true(env:close())
+		os.remove("lns-unqlite-range.testdb")
+	end)
+	
+end)
+
+
 -- In this context we cover commit and rollback
 context("User should be able to manually manage transactions", function()
 	
@@ -336,6 +1698,13 @@ context("User should be able to manage data using cursor", function()
 			assert_equal(cur:cursor_key(), "key1")				
 		end)
 		
+		test("Should be able to get cursor data as a blob", function ()
+			local res, err = cur:first_entry()
+			local blob = cur:cursor_data(true)
+			assert_equal(blob:tostring(), mlist["key1"])
+			assert_equal(#blob, #mlist["key1"])
+		end)
+		
 		test("Should be able to seek for an entry using cursor EXACT_MATCH", function ()
 			-- search for a record
 			local res, err = cur:seek("key5", 0)
@@ -414,6 +1783,57 @@ context("User should be able to manage data using cursor", function()
 			assert_true(res2 and data==nil)
 		end)
 		
+		test("Should be able to stream data using cursor", function ()
+			assert_true(cur:seek("key5"))
+			local parts = {}
+			local res, n = cur:cursor_data_stream(function (chunk) parts[#parts + 1] = chunk end, 2)
+			assert_true(res)
+			assert_equal(n, #mlist["key5"])
+			assert_equal(table.concat(parts), mlist["key5"])
+		end)
+		
+		test("Should be able to scan records in batches", function ()
+			assert_true(cur:first_entry())
+			local seen, total = {}, 0
+			repeat
+				local keys, values = cur:scan(4)
+				for i = 1, #keys do
+					seen[keys[i]] = values[i]
+				end
+				total = total + #keys
+			until #keys == 0
+			-- key7 has been deleted
+			assert_equal(total, 9)
+			for k, v in pairs(mlist) do
+				if k ~= "key7" then assert_equal(seen[k], v) end
+			end
+		end)
+		
+		test("Should be able to scan keys only", function ()
+			assert_true(cur:first_entry())
+			local keys, values = cur:scan(100, true)
+			assert_equal(#keys, 9)
+			assert_nil(values)
+		end)
+		
+		test("Should be able to iterate over records with a for loop", function ()
+			local total = 0
+			assert_true(cur:first_entry())
+			for k, v in cur:records(3) do
+				assert_equal(mlist[k], v)
+				total = total + 1
+			end
+			assert_equal(total, 9)
+			-- the cursor is exhausted, a new iterator restarts from the first entry
+			total = 0
+			for k, v in cur:records(2, true) do
+				assert_nil(v)
+				assert_not_nil(mlist[k])
+				total = total + 1
+			end
+			assert_equal(total, 9)
+		end)
+		
 		test("Should be able to release a cursor", function ()
 			-- release cursor
 			local res, err = cur:release()